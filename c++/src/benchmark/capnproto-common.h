@@ -79,6 +79,37 @@ struct Uncompressed {
   }
 };
 
+struct Trusted {
+  // Uncompressed, but each received message is checked once with validateAll() and then read
+  // without per-access bounds checks.
+
+  typedef kj::FdInputStream& BufferedInput;
+
+  class MessageReader: public InputStreamMessageReader {
+  public:
+    MessageReader(kj::InputStream& inputStream,
+                  ReaderOptions options = ReaderOptions(),
+                  kj::ArrayPtr<word> scratchSpace = nullptr)
+      : InputStreamMessageReader(inputStream, options, scratchSpace) {
+      validateAll();
+    }
+  };
+
+  class ArrayMessageReader: public Uncompressed::ArrayMessageReader {
+  public:
+    ArrayMessageReader(kj::ArrayPtr<const byte> array,
+                       ReaderOptions options = ReaderOptions(),
+                       kj::ArrayPtr<word> scratchSpace = nullptr)
+      : Uncompressed::ArrayMessageReader(array, options, scratchSpace) {
+      validateAll();
+    }
+  };
+
+  static inline void write(kj::OutputStream& output, MessageBuilder& builder) {
+    writeMessage(output, builder);
+  }
+};
+
 struct Packed {
   typedef kj::BufferedInputStreamWrapper BufferedInput;
   typedef PackedMessageReader MessageReader;
@@ -404,6 +435,7 @@ struct BenchmarkMethods {
 
 struct BenchmarkTypes {
   typedef capnp::Uncompressed Uncompressed;
+  typedef capnp::Trusted Trusted;
   typedef capnp::Packed Packed;
 #if HAVE_SNAPPY
   typedef capnp::SnappyCompressed SnappyCompressed;
@@ -0,0 +1,133 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+// Measures packing and unpacking speed with the scalar code and, if the CPU supports it, the
+// vectorized kernels.  Each pass packs and then unpacks a 1MiB buffer of mixed zero, sparse and
+// dense words ITERATION_COUNT times.
+
+#include <capnp/serialize-packed.h>
+#include <kj/debug.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+namespace capnp {
+namespace benchmark {
+namespace capnp {
+
+kj::Array<word> makeData(uint wordCount) {
+  // Pseudo-random runs of words, each run with its own density of non-zero bytes.
+
+  auto result = kj::heapArray<word>(wordCount);
+  byte* bytes = reinterpret_cast<byte*>(result.begin());
+  uint32_t state = 12345;
+  auto next = [&]() { state = state * 1103515245 + 12345; return state >> 16; };
+
+  uint i = 0;
+  while (i < wordCount) {
+    uint runLength = kj::min<uint>(next() % 300 + 1, wordCount - i);
+    uint density = next() % 10;  // 0 = all zero, 9 = all non-zero
+    for (uint j = 0; j < runLength * sizeof(word); j++) {
+      byte value = next() % 255 + 1;
+      bytes[i * sizeof(word) + j] = next() % 9 < density ? value : 0;
+    }
+    i += runLength;
+  }
+
+  return result;
+}
+
+double now() {
+  timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec / 1e9;
+}
+
+void run(const char* name, kj::ArrayPtr<const byte> bytes, uint iterations) {
+  // The packed form is never larger than 10/8 of the input, plus a little.
+  auto packed = kj::heapArray<byte>(bytes.size() * 10 / 8 + 64);
+  auto roundTrip = kj::heapArray<byte>(bytes.size());
+  size_t packedSize = 0;
+
+  double start = now();
+  for (uint i = 0; i < iterations; i++) {
+    kj::ArrayOutputStream arrayOut(packed);
+    {
+      _::PackedOutputStream packedOut(arrayOut);
+      packedOut.write(bytes.begin(), bytes.size());
+    }
+    packedSize = arrayOut.getArray().size();
+  }
+  double packSeconds = now() - start;
+
+  start = now();
+  for (uint i = 0; i < iterations; i++) {
+    kj::ArrayInputStream arrayIn(packed.slice(0, packedSize));
+    _::PackedInputStream packedIn(arrayIn);
+    packedIn.InputStream::read(roundTrip.begin(), roundTrip.size());
+  }
+  double unpackSeconds = now() - start;
+
+  KJ_ASSERT(memcmp(roundTrip.begin(), bytes.begin(), bytes.size()) == 0, "round trip failed");
+
+  double mib = (double)bytes.size() * iterations / (1 << 20);
+  fprintf(stdout, "%-8s pack %8.1f MiB/s  unpack %8.1f MiB/s  (of unpacked data)\n",
+          name, mib / packSeconds, mib / unpackSeconds);
+}
+
+int main(int argc, char* argv[]) {
+  if (argc != 2) {
+    fprintf(stderr, "USAGE:  %s ITERATION_COUNT\n", argv[0]);
+    return 1;
+  }
+
+  uint iterations = strtoul(argv[1], nullptr, 0);
+  if (iterations == 0) {
+    fprintf(stderr, "ITERATION_COUNT must be positive.\n");
+    return 1;
+  }
+
+  auto data = makeData(1 << 17);  // 1MiB
+  auto bytes = kj::arrayPtr(reinterpret_cast<const byte*>(data.begin()),
+                            data.size() * sizeof(word));
+
+  bool previous = _::setPackedSimdEnabled(false);
+  run("scalar", bytes, iterations);
+  _::setPackedSimdEnabled(true);
+  if (_::isPackedSimdActive()) {
+    run("simd", bytes, iterations);
+  } else {
+    fprintf(stdout, "simd     not available on this CPU\n");
+  }
+  _::setPackedSimdEnabled(previous);
+
+  return 0;
+}
+
+}  // namespace capnp
+}  // namespace benchmark
+}  // namespace capnp
+
+int main(int argc, char* argv[]) {
+  return capnp::benchmark::capnp::main(argc, argv);
+}
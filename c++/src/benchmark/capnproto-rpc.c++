@@ -0,0 +1,183 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+
+// Measures how many writes and reads the two-party RPC transport makes per call under pipelined
+// load, with and without write batching.  Each configuration makes ITERATION_COUNT calls, keeping
+// WINDOW of them in flight at once, and reports system calls per call on each side along with the
+// call rate.
+
+#include "rpc.capnp.h"
+#include <capnp/rpc-twoparty.h>
+#include <kj/async-io.h>
+#include <kj/debug.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+namespace capnp {
+namespace benchmark {
+namespace capnp {
+
+class AdderImpl final: public Adder::Server {
+protected:
+  kj::Promise<void> add(AddContext context) override {
+    auto params = context.getParams();
+    context.getResults().setValue(params.getLeft() + params.getRight());
+    return kj::READY_NOW;
+  }
+};
+
+struct Result {
+  uint64_t clientWrites = 0;
+  uint64_t clientReads = 0;
+  uint64_t serverWrites = 0;
+  uint64_t serverReads = 0;
+  double seconds = 0;
+};
+
+Result run(kj::AsyncIoContext& ioContext, uint64_t callCount, uint window,
+           kj::Maybe<WriteBatchOptions> writeOptions) {
+  Result result;
+
+  {
+    auto serverThread = ioContext.provider->newPipeThread(
+        [&result,writeOptions](kj::AsyncIoProvider& ioProvider, kj::AsyncIoStream& stream,
+                               kj::WaitScope& waitScope) {
+      kj::Own<TwoPartyVatNetwork> network;
+      KJ_IF_MAYBE(options, writeOptions) {
+        network = kj::heap<TwoPartyVatNetwork>(stream, rpc::twoparty::Side::SERVER,
+                                               ioProvider.getTimer(), *options);
+      } else {
+        network = kj::heap<TwoPartyVatNetwork>(stream, rpc::twoparty::Side::SERVER);
+      }
+      auto server = makeRpcServer(*network, kj::heap<AdderImpl>());
+      network->onDisconnect().wait(waitScope);
+      result.serverWrites = network->getWriteCount();
+      result.serverReads = network->getReadCount();
+    });
+
+    kj::Own<TwoPartyVatNetwork> network;
+    KJ_IF_MAYBE(options, writeOptions) {
+      network = kj::heap<TwoPartyVatNetwork>(*serverThread.pipe, rpc::twoparty::Side::CLIENT,
+                                             ioContext.provider->getTimer(), *options);
+    } else {
+      network = kj::heap<TwoPartyVatNetwork>(*serverThread.pipe, rpc::twoparty::Side::CLIENT);
+    }
+
+    {
+      auto client = makeRpcClient(*network);
+
+      MallocMessageBuilder vatIdMessage(8);
+      auto vatId = vatIdMessage.initRoot<rpc::twoparty::VatId>();
+      vatId.setSide(rpc::twoparty::Side::SERVER);
+      auto adder = client.bootstrap(vatId).castAs<Adder>();
+
+      // Make sure the bootstrap exchange isn't counted.
+      {
+        auto request = adder.addRequest();
+        request.send().wait(ioContext.waitScope);
+      }
+      uint64_t writesBefore = network->getWriteCount();
+      uint64_t readsBefore = network->getReadCount();
+
+      timespec start, end;
+      clock_gettime(CLOCK_MONOTONIC, &start);
+
+      // Keep `window` calls outstanding, sending a new one whenever one returns.
+      int64_t sum = 0;
+      uint64_t sent = 0;
+      kj::Function<kj::Promise<void>()> next = [&]() -> kj::Promise<void> {
+        if (sent == callCount) return kj::READY_NOW;
+        auto request = adder.addRequest();
+        request.setLeft(++sent);
+        request.setRight(0);
+        return request.send().then([&](Response<Adder::AddResults>&& response) {
+          sum += response.getValue();
+          return next();
+        });
+      };
+
+      kj::Vector<kj::Promise<void>> promises;
+      for (uint i = 0; i < window; i++) {
+        promises.add(next());
+      }
+      kj::joinPromises(promises.releaseAsArray()).wait(ioContext.waitScope);
+
+      clock_gettime(CLOCK_MONOTONIC, &end);
+      result.seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+      result.clientWrites = network->getWriteCount() - writesBefore;
+      result.clientReads = network->getReadCount() - readsBefore;
+
+      KJ_ASSERT(sum == (int64_t)(callCount * (callCount + 1) / 2), "wrong results", sum);
+    }
+  }
+
+  // The server thread has been joined, so its counts are in, but they include the bootstrap
+  // exchange and the final Finish/Release traffic, which is negligible at realistic counts.
+  return result;
+}
+
+void report(const char* name, uint64_t callCount, const Result& result) {
+  fprintf(stdout, "%-28s client %6.3f writes %6.3f reads  server %6.3f writes %6.3f reads  "
+          "(per call)  %8.0f calls/s\n", name,
+          (double)result.clientWrites / callCount, (double)result.clientReads / callCount,
+          (double)result.serverWrites / callCount, (double)result.serverReads / callCount,
+          callCount / result.seconds);
+}
+
+int main(int argc, char* argv[]) {
+  if (argc != 3) {
+    fprintf(stderr, "USAGE:  %s ITERATION_COUNT WINDOW\n", argv[0]);
+    return 1;
+  }
+
+  uint64_t callCount = strtoull(argv[1], nullptr, 0);
+  uint window = strtoul(argv[2], nullptr, 0);
+  if (callCount == 0 || window == 0) {
+    fprintf(stderr, "ITERATION_COUNT and WINDOW must be positive.\n");
+    return 1;
+  }
+
+  auto ioContext = kj::setupAsyncIo();
+
+  report("end of turn (default)", callCount, run(ioContext, callCount, window, nullptr));
+
+  WriteBatchOptions options;
+  options.maxDelay = 100 * kj::MICROSECONDS;
+  report("100us delay", callCount, run(ioContext, callCount, window, options));
+
+  options.maxDelay = 1 * kj::MILLISECONDS;
+  report("1ms delay", callCount, run(ioContext, callCount, window, options));
+
+  options.maxBatchBytes = 4096;
+  report("1ms delay, 4KiB max batch", callCount, run(ioContext, callCount, window, options));
+
+  return 0;
+}
+
+}  // namespace capnp
+}  // namespace benchmark
+}  // namespace capnp
+
+int main(int argc, char* argv[]) {
+  return capnp::benchmark::capnp::main(argc, argv);
+}
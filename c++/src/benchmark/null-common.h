@@ -157,6 +157,7 @@ struct BenchmarkMethods {
 
 struct BenchmarkTypes {
   typedef void Uncompressed;
+  typedef void Trusted;
   typedef void Packed;
 #if HAVE_SNAPPY
   typedef void SnappyCompressed;
@@ -341,6 +341,7 @@ struct BenchmarkMethods {
 
 struct BenchmarkTypes {
   typedef protobuf::Uncompressed Uncompressed;
+  typedef protobuf::Uncompressed Trusted;
   typedef protobuf::Uncompressed Packed;
 #if HAVE_SNAPPY
   typedef protobuf::SnappyCompressed SnappyCompressed;
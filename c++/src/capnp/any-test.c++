@@ -316,6 +316,81 @@ TEST(Any, Equals) {
   EXPECT_EQ(Equality::EQUAL, anyA.equals(anyB));
 }
 
+TEST(Any, EqualsIgnoresTrailingNulls) {
+  MallocMessageBuilder builderA;
+  auto oldVersion = builderA.initRoot<test::TestOldVersion>();
+  oldVersion.setOld1(123);
+  oldVersion.setOld2("foo");
+
+  // TestNewVersion has a longer data section and more pointers, but they're all default.
+  MallocMessageBuilder builderB;
+  auto newVersion = builderB.initRoot<test::TestNewVersion>();
+  newVersion.setOld1(123);
+  newVersion.setOld2("foo");
+
+  auto anyA = builderA.getRoot<AnyPointer>();
+  auto anyB = builderB.getRoot<AnyPointer>();
+  EXPECT_EQ(Equality::EQUAL, anyA.equals(anyB));
+  EXPECT_EQ(Equality::EQUAL, anyB.equals(anyA));
+  EXPECT_EQ(anyA.canonicalHash(), anyB.canonicalHash());
+
+  // A non-null pointer beyond the end of the shorter pointer section makes them differ.
+  newVersion.setNew2("qux");
+  EXPECT_EQ(Equality::NOT_EQUAL, anyA.equals(anyB));
+  EXPECT_EQ(Equality::NOT_EQUAL, anyB.equals(anyA));
+  EXPECT_NE(anyA.canonicalHash(), anyB.canonicalHash());
+}
+
+TEST(Any, CanonicalHash) {
+  MallocMessageBuilder builderA;
+  initTestMessage(builderA.initRoot<test::TestAllTypes>());
+
+  // Tiny segments put nearly every object behind a far pointer, so the layout is very different.
+  MallocMessageBuilder builderB(1, AllocationStrategy::FIXED_SIZE);
+  initTestMessage(builderB.initRoot<test::TestAllTypes>());
+  ASSERT_GT(builderB.getSegmentsForOutput().size(), 1u);
+
+  auto anyA = builderA.getRoot<AnyPointer>();
+  auto anyB = builderB.getRoot<AnyPointer>();
+  uint64_t hash = anyA.canonicalHash();
+  EXPECT_EQ(hash, anyB.canonicalHash());
+  EXPECT_EQ(hash, canonicalHash(builderA.getRoot<test::TestAllTypes>().asReader()));
+  EXPECT_EQ(hash, builderA.getRoot<AnyStruct>().canonicalHash());
+
+  // Same hash for the canonicalized message.
+  auto canonical = canonicalize(builderA.getRoot<test::TestAllTypes>().asReader());
+  kj::ArrayPtr<const word> segments[1] = { canonical };
+  SegmentArrayMessageReader canonicalReader(segments);
+  EXPECT_EQ(hash, canonicalReader.getRoot<AnyPointer>().canonicalHash());
+
+  // The key matters.
+  EXPECT_NE(hash, anyA.canonicalHash(1, 2));
+  EXPECT_EQ(anyA.canonicalHash(1, 2), anyB.canonicalHash(1, 2));
+
+  // Any change matters: data, text, and list content.
+  auto rootB = builderB.getRoot<test::TestAllTypes>();
+  rootB.setInt16Field(-1);
+  EXPECT_NE(hash, anyB.canonicalHash());
+  rootB.setInt16Field(-12345);
+  EXPECT_EQ(hash, anyB.canonicalHash());
+
+  rootB.getStructList()[2].setTextField("x");
+  EXPECT_NE(hash, anyB.canonicalHash());
+  rootB.getStructList()[2].setTextField("structlist 3");
+  EXPECT_EQ(hash, anyB.canonicalHash());
+
+  rootB.getBoolList().set(0, false);
+  EXPECT_NE(hash, anyB.canonicalHash());
+
+  // Lists with the same bytes but different element sizes differ.
+  MallocMessageBuilder builderC;
+  builderC.getRoot<AnyPointer>().setAs<List<uint16_t>>({1, 2, 3, 4});
+  MallocMessageBuilder builderD;
+  builderD.getRoot<AnyPointer>().setAs<List<uint32_t>>({0x00020001, 0x00040003});
+  EXPECT_NE(builderC.getRoot<AnyPointer>().canonicalHash(),
+            builderD.getRoot<AnyPointer>().canonicalHash());
+}
+
 }  // namespace
 }  // namespace _ (private)
 }  // namespace capnp
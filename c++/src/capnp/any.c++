@@ -122,9 +122,194 @@ Equality AnyStruct::Reader::equals(AnyStruct::Reader right) {
     }
   }
 
+  // Canonically, trailing null pointers don't exist, so the longer pointer section may only have
+  // nulls past the end of the shorter one.
+  for (; i < ptrsL.size(); i++) {
+    if (!ptrsL[i].isNull()) return Equality::NOT_EQUAL;
+  }
+  for (; i < ptrsR.size(); i++) {
+    if (!ptrsR[i].isNull()) return Equality::NOT_EQUAL;
+  }
+
   return eqResult;
 }
 
+// -------------------------------------------------------------------
+
+namespace {
+
+class SipHasher {
+  // Incremental SipHash-2-4.
+
+public:
+  SipHasher(uint64_t k0, uint64_t k1)
+      : v0(k0 ^ 0x736f6d6570736575ull), v1(k1 ^ 0x646f72616e646f6dull),
+        v2(k0 ^ 0x6c7967656e657261ull), v3(k1 ^ 0x7465646279746573ull) {}
+
+  void add(uint64_t value) {
+    _::WireValue<uint64_t> wire;
+    wire.set(value);
+    add(&wire, sizeof(wire));
+  }
+
+  void add(const void* data, size_t size) {
+    const byte* pos = reinterpret_cast<const byte*>(data);
+    const byte* end = pos + size;
+    totalSize += size;
+
+    if (tailSize > 0) {
+      while (tailSize < sizeof(uint64_t) && pos < end) {
+        tail |= uint64_t(*pos++) << (tailSize++ * 8);
+      }
+      if (tailSize < sizeof(uint64_t)) return;
+      compress(tail);
+      tail = 0;
+      tailSize = 0;
+    }
+
+    while (end - pos >= 8) {
+      _::WireValue<uint64_t> wire;
+      memcpy(&wire, pos, sizeof(wire));
+      compress(wire.get());
+      pos += 8;
+    }
+
+    while (pos < end) {
+      tail |= uint64_t(*pos++) << (tailSize++ * 8);
+    }
+  }
+
+  uint64_t finish() {
+    compress(tail | (totalSize << 56));
+    v2 ^= 0xff;
+    round();
+    round();
+    round();
+    round();
+    return v0 ^ v1 ^ v2 ^ v3;
+  }
+
+private:
+  uint64_t v0, v1, v2, v3;
+  uint64_t tail = 0;
+  uint tailSize = 0;
+  uint64_t totalSize = 0;
+
+  static inline uint64_t rotl(uint64_t x, uint b) { return (x << b) | (x >> (64 - b)); }
+
+  inline void round() {
+    v0 += v1; v1 = rotl(v1, 13); v1 ^= v0; v0 = rotl(v0, 32);
+    v2 += v3; v3 = rotl(v3, 16); v3 ^= v2;
+    v0 += v3; v3 = rotl(v3, 21); v3 ^= v0;
+    v2 += v1; v1 = rotl(v1, 17); v1 ^= v2; v2 = rotl(v2, 32);
+  }
+
+  inline void compress(uint64_t m) {
+    v3 ^= m;
+    round();
+    round();
+    v0 ^= m;
+  }
+};
+
+// The hash covers exactly what equals() compares: struct data sections and pointer sections with
+// trailing zeros and nulls removed, list element sizes and contents, and the shape of the pointer
+// tree.  Each object is prefixed with its kind and lengths so that distinct trees can't produce
+// the same stream.
+
+enum class HashTag: uint64_t { NULL_, STRUCT, LIST, CAPABILITY };
+
+void hashPointer(SipHasher& hasher, AnyPointer::Reader pointer);
+
+void hashStruct(SipHasher& hasher, AnyStruct::Reader value) {
+  auto data = value.getDataSection();
+  size_t dataSize = data.size();
+  while (dataSize > 0 && data[dataSize - 1] == 0) {
+    --dataSize;
+  }
+  hasher.add(dataSize);
+  hasher.add(data.begin(), dataSize);
+
+  auto pointers = value.getPointerSection();
+  uint pointerCount = pointers.size();
+  while (pointerCount > 0 && pointers[pointerCount - 1].isNull()) {
+    --pointerCount;
+  }
+  hasher.add(pointerCount);
+  for (uint i = 0; i < pointerCount; i++) {
+    hashPointer(hasher, pointers[i]);
+  }
+}
+
+void hashList(SipHasher& hasher, AnyList::Reader list) {
+  hasher.add(static_cast<uint64_t>(list.getElementSize()));
+  hasher.add(list.size());
+
+  switch (list.getElementSize()) {
+    case ElementSize::VOID:
+    case ElementSize::BIT:
+    case ElementSize::BYTE:
+    case ElementSize::TWO_BYTES:
+    case ElementSize::FOUR_BYTES:
+    case ElementSize::EIGHT_BYTES: {
+      auto bytes = list.getRawBytes();
+      hasher.add(bytes.begin(), bytes.size());
+      break;
+    }
+    case ElementSize::POINTER:
+      for (auto element: list.as<List<AnyPointer>>()) {
+        hashPointer(hasher, element);
+      }
+      break;
+    case ElementSize::INLINE_COMPOSITE:
+      for (auto element: list.as<List<AnyStruct>>()) {
+        hashStruct(hasher, element);
+      }
+      break;
+  }
+}
+
+void hashPointer(SipHasher& hasher, AnyPointer::Reader pointer) {
+  switch (pointer.getPointerType()) {
+    case PointerType::NULL_:
+      hasher.add(static_cast<uint64_t>(HashTag::NULL_));
+      break;
+    case PointerType::STRUCT:
+      hasher.add(static_cast<uint64_t>(HashTag::STRUCT));
+      hashStruct(hasher, pointer.getAs<AnyStruct>());
+      break;
+    case PointerType::LIST:
+      hasher.add(static_cast<uint64_t>(HashTag::LIST));
+      hashList(hasher, pointer.getAs<AnyList>());
+      break;
+    case PointerType::CAPABILITY:
+      hasher.add(static_cast<uint64_t>(HashTag::CAPABILITY));
+      break;
+  }
+}
+
+}  // namespace
+
+uint64_t AnyPointer::Reader::canonicalHash(uint64_t k0, uint64_t k1) {
+  SipHasher hasher(k0, k1);
+  hashPointer(hasher, *this);
+  return hasher.finish();
+}
+
+uint64_t AnyStruct::Reader::canonicalHash(uint64_t k0, uint64_t k1) {
+  SipHasher hasher(k0, k1);
+  hasher.add(static_cast<uint64_t>(HashTag::STRUCT));
+  hashStruct(hasher, *this);
+  return hasher.finish();
+}
+
+uint64_t AnyList::Reader::canonicalHash(uint64_t k0, uint64_t k1) {
+  SipHasher hasher(k0, k1);
+  hasher.add(static_cast<uint64_t>(HashTag::LIST));
+  hashList(hasher, *this);
+  return hasher.finish();
+}
+
 kj::StringPtr KJ_STRINGIFY(Equality res) {
   switch(res) {
     case Equality::NOT_EQUAL:
@@ -158,8 +343,31 @@ Equality AnyList::Reader::equals(AnyList::Reader right) {
       } else {
         return Equality::NOT_EQUAL;
       }
-    case ElementSize::POINTER:
+    case ElementSize::POINTER: {
+      if (right.getElementSize() != ElementSize::POINTER) {
+        return Equality::NOT_EQUAL;
+      }
+      auto llist = as<List<AnyPointer>>();
+      auto rlist = right.as<List<AnyPointer>>();
+      for(size_t i = 0; i < size(); i++) {
+        switch(llist[i].equals(rlist[i])) {
+          case Equality::EQUAL:
+            break;
+          case Equality::NOT_EQUAL:
+            return Equality::NOT_EQUAL;
+          case Equality::UNKNOWN_CONTAINS_CAPS:
+            eqResult = Equality::UNKNOWN_CONTAINS_CAPS;
+            break;
+          default:
+            KJ_UNREACHABLE;
+        }
+      }
+      return eqResult;
+    }
     case ElementSize::INLINE_COMPOSITE: {
+      if (right.getElementSize() != ElementSize::INLINE_COMPOSITE) {
+        return Equality::NOT_EQUAL;
+      }
       auto llist = as<List<AnyStruct>>();
       auto rlist = right.as<List<AnyStruct>>();
       for(size_t i = 0; i < size(); i++) {
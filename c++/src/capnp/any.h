@@ -95,8 +95,13 @@ struct AnyPointer {
     Reader() = default;
     inline Reader(_::PointerReader reader): reader(reader) {}
 
-    inline MessageSize targetSize() const;
-    // Get the total size of the target object and all its children.
+    inline MessageSize targetSize(uint threadCount = 1) const;
+    // Get the total size of the target object and all its children.  With `threadCount` > 1, large
+    // lists are measured by that many threads at once, which helps for very big messages.
+    //
+    // Note that in per-thread traversal limit mode (ReaderOptions::traversalLimitPerThread), each
+    // helper thread counts against its own budget, so the only bound on the total is
+    // ReaderOptions::sharedTraversalLimitInWords.
 
     inline PointerType getPointerType() const;
 
@@ -111,6 +116,17 @@ struct AnyPointer {
       return !(*this == right);
     }
 
+    uint64_t canonicalHash(uint64_t k0 = 0, uint64_t k1 = 0);
+    // Compute a 64-bit hash of the target's canonical form, without constructing it.  Objects for
+    // which equals() returns EQUAL always have the same hash, regardless of how they are laid out
+    // in their messages.  The message is traversed once and nothing is allocated.
+    //
+    // The hash is SipHash-2-4 keyed with (k0, k1); pass a secret key if the content is untrusted
+    // and collisions could be exploited.  Note that this is a hash of the object's structure, not
+    // of the bytes canonicalize() would produce, so it won't match a hash of those bytes.
+    //
+    // Capabilities contribute only the fact that they are present.
+
     template <typename T>
     inline ReaderFor<T> getAs() const;
     // Valid for T = any generated struct type, interface type, List<U>, Text, or Data.
@@ -169,6 +185,10 @@ struct AnyPointer {
       return !(*this == right);
     }
 
+    inline uint64_t canonicalHash(uint64_t k0 = 0, uint64_t k1 = 0) {
+      return asReader().canonicalHash(k0, k1);
+    }
+
     inline void clear();
     // Set to null.
 
@@ -478,6 +498,9 @@ public:
     return !(*this == right);
   }
 
+  uint64_t canonicalHash(uint64_t k0 = 0, uint64_t k1 = 0);
+  // See AnyPointer::Reader::canonicalHash().
+
   template <typename T>
   ReaderFor<T> as() const {
     // T must be a struct type.
@@ -521,6 +544,10 @@ public:
     return !(*this == right);
   }
 
+  inline uint64_t canonicalHash(uint64_t k0 = 0, uint64_t k1 = 0) {
+    return asReader().canonicalHash(k0, k1);
+  }
+
   inline operator Reader() const { return Reader(_builder.asReader()); }
   inline Reader asReader() const { return Reader(_builder.asReader()); }
 
@@ -638,6 +665,9 @@ public:
     return !(*this == right);
   }
 
+  uint64_t canonicalHash(uint64_t k0 = 0, uint64_t k1 = 0);
+  // See AnyPointer::Reader::canonicalHash().
+
   template <typename T> ReaderFor<T> as() {
     // T must be List<U>.
     return ReaderFor<T>(_reader);
@@ -739,8 +769,8 @@ private:
 // =======================================================================================
 // Inline implementation details
 
-inline MessageSize AnyPointer::Reader::targetSize() const {
-  return reader.targetSize().asPublic();
+inline MessageSize AnyPointer::Reader::targetSize(uint threadCount) const {
+  return reader.targetSize(threadCount).asPublic();
 }
 
 inline PointerType AnyPointer::Reader::getPointerType() const {
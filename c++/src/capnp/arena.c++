@@ -24,6 +24,7 @@
 #include "message.h"
 #include <kj/debug.h>
 #include <kj/refcount.h>
+#include <kj/threadlocal.h>
 #include <vector>
 #include <string.h>
 #include <stdio.h>
@@ -37,14 +38,126 @@ namespace _ {  // private
 
 Arena::~Arena() noexcept(false) {}
 
+namespace {
+
+static constexpr uint READ_LIMITER_SLOT_COUNT = 64;
+// Number of separate budgets kept by a per-thread ReadLimiter.
+
+static constexpr uint64_t SHARED_LIMIT_CHUNK_WORDS = 8192;
+// Per-thread ReadLimiters with a shared limit draw from it in chunks of this size.
+
+uint nextThreadSlot = 0;
+KJ_THREADLOCAL_PTR(void) threadSlot = nullptr;
+// Only a small integer is needed, but KJ_THREADLOCAL_PTR can only hold pointers, so the slot
+// number is stored plus one, so that null means "not yet assigned".
+
+uint getThreadSlot() {
+  // Threads are assigned slots round-robin when they first use a per-thread ReadLimiter, and
+  // never give them back, so only the first READ_LIMITER_SLOT_COUNT such threads in the process
+  // are guaranteed distinct slots.  A long-lived thread pool of up to that size started early
+  // gets them; threads started later may share.
+  void* slot = threadSlot;
+  if (slot == nullptr) {
+    uintptr_t index = __atomic_fetch_add(&nextThreadSlot, 1, __ATOMIC_RELAXED) %
+        READ_LIMITER_SLOT_COUNT;
+    slot = reinterpret_cast<void*>(index + 1);
+    threadSlot = slot;
+  }
+  return reinterpret_cast<uintptr_t>(slot) - 1;
+}
+
+inline void addWithoutOverflow(volatile uint64_t& value, uint64_t amount) {
+  uint64_t oldValue = value;
+  uint64_t newValue = oldValue + amount;
+  if (newValue > oldValue) {
+    value = newValue;
+  }
+}
+
+}  // namespace
+
+struct ReadLimiter::PerThread {
+  struct Slot {
+    volatile uint64_t limit;
+    // Remaining budget of the thread(s) using this slot.
+
+    volatile uint64_t credit;
+    // Words drawn from `shared` and not yet read.  Only used if there is a shared limit.
+
+    byte padding[112];
+    // Keeps the counters of different slots at least a cache line apart regardless of alignment.
+  };
+
+  Slot slots[READ_LIMITER_SLOT_COUNT];
+
+  uint64_t shared;
+  // Remaining shared budget.  Modified atomically.
+
+  bool hasSharedLimit;
+};
+
+ReadLimiter::~ReadLimiter() noexcept(false) {
+  delete perThread;
+}
+
+void ReadLimiter::setPerThread(WordCount64 sharedLimit) {
+  KJ_REQUIRE(perThread == nullptr, "ReadLimiter is already in per-thread mode.");
+  perThread = new PerThread;
+  for (auto& slot: perThread->slots) {
+    slot.limit = limit;
+    slot.credit = 0;
+  }
+  perThread->shared = sharedLimit / WORDS;
+  perThread->hasSharedLimit = perThread->shared != uint64_t(kj::maxValue);
+}
+
+bool ReadLimiter::canReadPerThread(WordCount amount, Arena* arena) {
+  uint64_t words = amount / WORDS;
+  PerThread::Slot& slot = perThread->slots[getThreadSlot()];
+
+  // As in canRead(), be careful not to store an underflowed value, in case multiple threads share
+  // the slot.
+  uint64_t current = slot.limit;
+  if (KJ_UNLIKELY(words > current)) {
+    arena->reportReadLimitReached();
+    return false;
+  }
+
+  if (perThread->hasSharedLimit) {
+    uint64_t credit = slot.credit;
+    if (words > credit) {
+      uint64_t needed = words - credit;
+      uint64_t shared = __atomic_load_n(&perThread->shared, __ATOMIC_RELAXED);
+      uint64_t draw;
+      do {
+        if (KJ_UNLIKELY(needed > shared)) {
+          arena->reportReadLimitReached();
+          return false;
+        }
+        draw = kj::max(needed, kj::min(SHARED_LIMIT_CHUNK_WORDS, shared));
+      } while (!__atomic_compare_exchange_n(&perThread->shared, &shared, shared - draw, true,
+                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+      credit += draw;
+    }
+    slot.credit = credit - words;
+  }
+
+  slot.limit = current - words;
+  return true;
+}
+
 void ReadLimiter::unread(WordCount64 amount) {
   // Be careful not to overflow here.  Since ReadLimiter has no thread-safety, it's possible that
   // the limit value was not updated correctly for one or more reads, and therefore unread() could
   // overflow it even if it is only unreading bytes that were actually read.
-  uint64_t oldValue = limit;
-  uint64_t newValue = oldValue + amount / WORDS;
-  if (newValue > oldValue) {
-    limit = newValue;
+  if (perThread != nullptr) {
+    PerThread::Slot& slot = perThread->slots[getThreadSlot()];
+    addWithoutOverflow(slot.limit, amount / WORDS);
+    if (perThread->hasSharedLimit) {
+      addWithoutOverflow(slot.credit, amount / WORDS);
+    }
+  } else {
+    addWithoutOverflow(limit, amount / WORDS);
   }
 }
 
@@ -57,10 +170,27 @@ void SegmentBuilder::throwNotWritable() {
 
 // =======================================================================================
 
+struct ReaderArena::SegmentTable {
+  kj::Array<SegmentReader*> segments;
+  // Indexed by segment ID.  Entries are null if not loaded yet.  Slot 0 is unused.
+};
+
+struct ReaderArena::MoreSegments {
+  kj::Vector<kj::Own<SegmentReader>> segments;
+  kj::Vector<kj::Own<SegmentTable>> tables;
+  // All tables ever published.  The last one is current.
+};
+
 ReaderArena::ReaderArena(MessageReader* message)
     : message(message),
       readLimiter(message->getOptions().traversalLimitInWords * WORDS),
-      segment0(this, SegmentId(0), message->getSegment(0), &readLimiter) {}
+      trusted(false),
+      segment0(this, SegmentId(0), message->getSegment(0), &readLimiter),
+      segmentTable(nullptr) {
+  if (message->getOptions().traversalLimitPerThread) {
+    readLimiter.setPerThread(message->getOptions().sharedTraversalLimitInWords * WORDS);
+  }
+}
 
 ReaderArena::~ReaderArena() noexcept(false) {}
 
@@ -73,15 +203,25 @@ SegmentReader* ReaderArena::tryGetSegment(SegmentId id) {
     }
   }
 
+  SegmentTable* table = __atomic_load_n(&segmentTable, __ATOMIC_ACQUIRE);
+  if (table != nullptr && id.value < table->segments.size()) {
+    SegmentReader* result = __atomic_load_n(&table->segments[id.value], __ATOMIC_ACQUIRE);
+    if (result != nullptr) {
+      return result;
+    }
+  }
+
+  return tryGetSegmentSlow(id);
+}
+
+SegmentReader* ReaderArena::tryGetSegmentSlow(SegmentId id) {
   auto lock = moreSegments.lockExclusive();
 
-  SegmentMap* segments = nullptr;
-  KJ_IF_MAYBE(s, *lock) {
-    auto iter = s->get()->find(id.value);
-    if (iter != s->get()->end()) {
-      return iter->second;
-    }
-    segments = *s;
+  // Another thread may have loaded the segment while we waited for the lock.
+  SegmentTable* table = segmentTable;
+  if (table != nullptr && id.value < table->segments.size() &&
+      table->segments[id.value] != nullptr) {
+    return table->segments[id.value];
   }
 
   kj::ArrayPtr<const word> newSegment = message->getSegment(id.value);
@@ -90,18 +230,52 @@ SegmentReader* ReaderArena::tryGetSegment(SegmentId id) {
   }
 
   if (*lock == nullptr) {
-    // OK, the segment exists, so allocate the map.
-    auto s = kj::heap<SegmentMap>();
-    segments = s;
-    *lock = kj::mv(s);
+    // OK, the segment exists, so allocate the storage.
+    *lock = kj::heap<MoreSegments>();
+  }
+  MoreSegments& more = *KJ_ASSERT_NONNULL(*lock);
+
+  if (table == nullptr || id.value >= table->segments.size()) {
+    // Publish a bigger table.  Sizes are powers of two so that growth happens rarely.
+    size_t newSize = table == nullptr ? 16 : table->segments.size() * 2;
+    while (newSize <= id.value) {
+      newSize *= 2;
+    }
+
+    auto newTable = kj::heap<SegmentTable>();
+    newTable->segments = kj::heapArray<SegmentReader*>(newSize);
+    for (size_t i = 0; i < newSize; i++) {
+      newTable->segments[i] = table != nullptr && i < table->segments.size() ?
+          table->segments[i] : nullptr;
+    }
+    table = newTable.get();
+    more.tables.add(kj::mv(newTable));
   }
 
   auto segment = kj::heap<SegmentReader>(this, id, newSegment, &readLimiter);
-  SegmentReader* result = segment;
-  segments->insert(std::make_pair(id.value, mv(segment)));
+  if (trusted) {
+    segment->setTrusted();
+  }
+  SegmentReader* result = segment.get();
+  more.segments.add(kj::mv(segment));
+
+  __atomic_store_n(&table->segments[id.value], result, __ATOMIC_RELEASE);
+  __atomic_store_n(&segmentTable, table, __ATOMIC_RELEASE);
   return result;
 }
 
+void ReaderArena::setTrusted() {
+  trusted = true;
+  segment0.setTrusted();
+
+  auto lock = moreSegments.lockExclusive();
+  KJ_IF_MAYBE(s, *lock) {
+    for (auto& segment: s->get()->segments) {
+      segment->setTrusted();
+    }
+  }
+}
+
 void ReaderArena::reportReadLimitReached() {
   KJ_FAIL_REQUIRE("Exceeded message traversal limit.  See capnp::ReaderOptions.") {
     return;
@@ -139,23 +313,120 @@ BuilderArena::BuilderArena(MessageBuilder* message,
   }
 }
 
-BuilderArena::~BuilderArena() noexcept(false) {}
+struct BuilderLane {
+  BuilderArena* arena;
+
+  SegmentBuilder* segment;
+  // The segment this lane allocates from, or null if it hasn't allocated yet.
+
+  BuilderLane* next;
+  // The lane the same thread entered before this one, if any.
+};
+
+namespace {
+
+KJ_THREADLOCAL_PTR(BuilderLane) threadLanes = nullptr;
+// The calling thread's lanes, most recently entered first.
+
+}  // namespace
+
+struct BuilderArena::ConcurrentState {
+  struct SealedSegment {
+    SegmentBuilder* segment;
+    const word* end;
+  };
+
+  struct SegmentTable {
+    kj::Array<SegmentBuilder*> segments;
+    // Indexed by segment ID.  Entries are null if not added yet.  Slot 0 is unused.
+  };
+
+  struct Locked {
+    uint laneCount = 0;
+
+    kj::Vector<SealedSegment> sealed;
+    // Segments to unseal when leaving concurrent mode.
+
+    kj::Vector<kj::Own<SegmentTable>> tables;
+    // All tables ever published.  The last one is current.
+  };
+
+  kj::MutexGuarded<Locked> locked;
+
+  SegmentTable* segmentTable = nullptr;
+  // All segments but segment 0, for looking up segments without the lock, as in ReaderArena:
+  // tables are published with release stores and never modified afterwards, except that empty
+  // slots may be filled in.  When a segment ID beyond the end is added, a bigger copy is published
+  // and the old table is retired but kept alive until concurrent mode ends, as other threads may
+  // still be using it.  Only written with the lock held.
+
+  SegmentBuilder* tryGetSegment(SegmentId id) {
+    SegmentTable* table = __atomic_load_n(&segmentTable, __ATOMIC_ACQUIRE);
+    if (table != nullptr && id.value < table->segments.size()) {
+      return __atomic_load_n(&table->segments[id.value], __ATOMIC_ACQUIRE);
+    }
+    return nullptr;
+  }
+
+  void publish(Locked& lock, SegmentBuilder* segment) {
+    uint id = segment->getSegmentId().value;
+    SegmentTable* table = segmentTable;
+    if (table == nullptr || id >= table->segments.size()) {
+      // Sizes are powers of two so that growth happens rarely.
+      size_t newSize = table == nullptr ? 16 : table->segments.size() * 2;
+      while (newSize <= id) {
+        newSize *= 2;
+      }
+
+      auto newTable = kj::heap<SegmentTable>();
+      newTable->segments = kj::heapArray<SegmentBuilder*>(newSize);
+      for (size_t i = 0; i < newSize; i++) {
+        newTable->segments[i] = table != nullptr && i < table->segments.size() ?
+            table->segments[i] : nullptr;
+      }
+      table = newTable.get();
+      lock.tables.add(kj::mv(newTable));
+    }
+
+    __atomic_store_n(&table->segments[id], segment, __ATOMIC_RELEASE);
+    __atomic_store_n(&segmentTable, table, __ATOMIC_RELEASE);
+  }
+};
+
+BuilderArena::~BuilderArena() noexcept(false) {
+  delete concurrent;
+}
 
 SegmentBuilder* BuilderArena::getSegment(SegmentId id) {
   // This method is allowed to fail if the segment ID is not valid.
   if (id == SegmentId(0)) {
     return &segment0;
   } else {
-    KJ_IF_MAYBE(s, moreSegments) {
-      KJ_REQUIRE(id.value - 1 < s->get()->builders.size(), "invalid segment id", id.value);
+    SegmentBuilder* result = tryGetMoreSegment(id);
+    KJ_REQUIRE(result != nullptr, "invalid segment id", id.value);
+    return result;
+  }
+}
+
+SegmentBuilder* BuilderArena::tryGetMoreSegment(SegmentId id) {
+  if (KJ_UNLIKELY(concurrent != nullptr)) {
+    // Other threads may be adding segments, so `moreSegments` may be changing under us.
+    return concurrent->tryGetSegment(id);
+  }
+
+  KJ_IF_MAYBE(s, moreSegments) {
+    if (id.value - 1 < s->get()->builders.size()) {
       return const_cast<SegmentBuilder*>(s->get()->builders[id.value - 1].get());
-    } else {
-      KJ_FAIL_REQUIRE("invalid segment id", id.value);
     }
   }
+  return nullptr;
 }
 
 BuilderArena::AllocateResult BuilderArena::allocate(WordCount amount) {
+  if (KJ_UNLIKELY(concurrent != nullptr)) {
+    return allocateConcurrent(amount);
+  }
+
   if (segment0.getArena() == nullptr) {
     // We're allocating the first segment.
     kj::ArrayPtr<word> ptr = message->allocateSegment(amount / WORDS);
@@ -193,8 +464,113 @@ BuilderArena::AllocateResult BuilderArena::allocate(WordCount amount) {
   }
 }
 
+BuilderArena::AllocateResult BuilderArena::allocateConcurrent(WordCount amount) {
+  BuilderLane* lane = threadLanes;
+  while (lane != nullptr && lane->arena != this) {
+    lane = lane->next;
+  }
+  KJ_REQUIRE(lane != nullptr,
+      "While a ConcurrentBuilder exists, every thread which builds the message needs a "
+      "ConcurrentBuilder::Lane.");
+
+  if (lane->segment != nullptr) {
+    word* attempt = lane->segment->allocate(amount);
+    if (attempt != nullptr) {
+      return AllocateResult { lane->segment, attempt };
+    }
+  }
+
+  // Move the lane to a new segment.  The old one is sealed so that nobody allocates in it again
+  // until concurrent mode ends.
+  auto lock = concurrent->locked.lockExclusive();
+  if (lane->segment != nullptr) {
+    lock->sealed.add(ConcurrentState::SealedSegment { lane->segment, lane->segment->seal() });
+  }
+  SegmentBuilder* result = addSegmentInternal(message->allocateSegment(amount / WORDS));
+  lane->segment = result;
+  return AllocateResult { result, result->allocate(amount) };
+}
+
+void BuilderArena::beginConcurrent() {
+  KJ_REQUIRE(concurrent == nullptr, "Message is already being built concurrently.");
+  KJ_REQUIRE(segment0.getArena() != nullptr, "Root segment must be allocated first.");
+
+  auto state = new ConcurrentState;
+  {
+    auto lock = state->locked.lockExclusive();
+    lock->sealed.add(ConcurrentState::SealedSegment { &segment0, segment0.seal() });
+    KJ_IF_MAYBE(s, moreSegments) {
+      for (auto& builder: s->get()->builders) {
+        lock->sealed.add(ConcurrentState::SealedSegment { builder.get(), builder->seal() });
+        state->publish(*lock, builder.get());
+      }
+    }
+  }
+  concurrent = state;
+}
+
+void BuilderArena::endConcurrent() {
+  KJ_REQUIRE(concurrent != nullptr, "Message is not being built concurrently.");
+  {
+    auto lock = concurrent->locked.lockExclusive();
+    KJ_REQUIRE(lock->laneCount == 0, "All lanes must be destroyed before the ConcurrentBuilder.");
+    for (auto& sealed: lock->sealed) {
+      sealed.segment->unseal(sealed.end);
+    }
+  }
+  delete concurrent;
+  concurrent = nullptr;
+}
+
+BuilderLane* BuilderArena::enterLane() {
+  KJ_REQUIRE(concurrent != nullptr, "Message is not being built concurrently.");
+  concurrent->locked.lockExclusive()->laneCount++;
+  BuilderLane* lane = new BuilderLane { this, nullptr, threadLanes };
+  threadLanes = lane;
+  return lane;
+}
+
+void BuilderArena::leaveLane(BuilderLane* lane) {
+  if (threadLanes == lane) {
+    threadLanes = lane->next;
+  } else {
+    KJ_FAIL_REQUIRE(
+        "Lanes must be destroyed by the thread which created them, in reverse order.") {
+      break;
+    }
+
+    // Recover as best we can.  If the lane is further down this thread's list, unlink it and
+    // proceed as usual.  If it belongs to another thread, we can't touch it, but it still
+    // mustn't keep endConcurrent() from succeeding.
+    BuilderLane* prev = threadLanes;
+    while (prev != nullptr && prev->next != lane) {
+      prev = prev->next;
+    }
+    if (prev == nullptr) {
+      concurrent->locked.lockExclusive()->laneCount--;
+      return;
+    }
+    prev->next = lane->next;
+  }
+
+  {
+    auto lock = concurrent->locked.lockExclusive();
+    if (lane->segment != nullptr) {
+      // Other threads may now use objects this lane allocated, so nobody may allocate here.
+      lock->sealed.add(ConcurrentState::SealedSegment { lane->segment, lane->segment->seal() });
+    }
+    lock->laneCount--;
+  }
+  delete lane;
+}
+
 SegmentBuilder* BuilderArena::addExternalSegment(kj::ArrayPtr<const word> content) {
-  return addSegmentInternal(content);
+  if (KJ_UNLIKELY(concurrent != nullptr)) {
+    auto lock = concurrent->locked.lockExclusive();
+    return addSegmentInternal(content);
+  } else {
+    return addSegmentInternal(content);
+  }
 }
 
 template <typename T>
@@ -222,6 +598,11 @@ SegmentBuilder* BuilderArena::addSegmentInternal(kj::ArrayPtr<T> content) {
   // getSegmentsForOutput(), which callers might reasonably expect is a thread-safe method.
   segmentState->forOutput.resize(segmentState->builders.size() + 1);
 
+  if (KJ_UNLIKELY(concurrent != nullptr)) {
+    // The caller holds the lock.
+    concurrent->publish(concurrent->locked.getAlreadyLockedExclusive(), result);
+  }
+
   return result;
 }
 
@@ -265,15 +646,7 @@ SegmentReader* BuilderArena::tryGetSegment(SegmentId id) {
       return &segment0;
     }
   } else {
-    KJ_IF_MAYBE(segmentState, moreSegments) {
-      if (id.value <= segmentState->get()->builders.size()) {
-        // TODO(cleanup):  Return a const SegmentReader and tediously constify all SegmentBuilder
-        //   pointers throughout the codebase.
-        return const_cast<SegmentReader*>(kj::implicitCast<const SegmentReader*>(
-            segmentState->get()->builders[id.value - 1].get()));
-      }
-    }
-    return nullptr;
+    return tryGetMoreSegment(id);
   }
 }
 
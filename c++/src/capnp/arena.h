@@ -37,7 +37,6 @@
 #include "common.h"
 #include "message.h"
 #include "layout.h"
-#include <unordered_map>
 
 #if !CAPNP_LITE
 #include "capability.h"
@@ -56,6 +55,7 @@ class SegmentBuilder;
 class Arena;
 class BuilderArena;
 class ReadLimiter;
+struct BuilderLane;
 
 class Segment;
 typedef kj::Id<uint32_t, Segment> SegmentId;
@@ -78,13 +78,22 @@ class ReadLimiter {
   // This class is "safe" to use from multiple threads for its intended use case.  Threads may
   // overwrite each others' changes to the counter, but this is OK because it only means that the
   // limit is enforced a bit less strictly -- it will still kick in eventually.
+  //
+  // In per-thread mode (see setPerThread()), each thread counts against its own copy of the
+  // limit instead, so that threads reading the same message don't all write to one cache line.
 
 public:
   inline explicit ReadLimiter();                     // No limit.
   inline explicit ReadLimiter(WordCount64 limit);    // Limit to the given number of words.
+  ~ReadLimiter() noexcept(false);
 
   inline void reset(WordCount64 limit);
 
+  void setPerThread(WordCount64 sharedLimit);
+  // Switch to per-thread mode:  every thread gets a budget equal to the current limit, and
+  // additionally all threads together may not read more than `sharedLimit` (kj::maxValue for no
+  // shared limit).  Must be called before any reads.  See ReaderOptions::traversalLimitPerThread.
+
   KJ_ALWAYS_INLINE(bool canRead(WordCount amount, Arena* arena));
 
   void unread(WordCount64 amount);
@@ -95,7 +104,13 @@ private:
   volatile uint64_t limit;
   // Current limit, decremented each time catRead() is called.  Volatile because multiple threads
   // could be trying to modify it at once.  (This is not real thread-safety, but good enough for
-  // the purpose of this class.  See class comment.)
+  // the purpose of this class.  See class comment.)  Unused in per-thread mode.
+
+  struct PerThread;
+  PerThread* perThread;
+  // Non-null in per-thread mode.  Owned.  (Not kj::Own because the type is incomplete here.)
+
+  bool canReadPerThread(WordCount amount, Arena* arena);
 
   KJ_DISALLOW_COPY(ReadLimiter);
 };
@@ -137,9 +152,15 @@ public:
   inline void unread(WordCount64 amount);
   // Add back some words to the ReadLimiter.
 
+  inline void setTrusted();
+  // From now on, containsInterval() checks nothing and amplifiedRead() always succeeds, without
+  // consulting the ReadLimiter.  Only for segments of messages which have been fully validated;
+  // see MessageReader::validateAll().
+
 private:
   Arena* arena;
   SegmentId id;
+  bool trusted;
   kj::ArrayPtr<const word> ptr;
   ReadLimiter* readLimiter;
 
@@ -183,6 +204,14 @@ public:
   // boundaries, then move the end up to `to` and return true. Otherwise, do nothing and return
   // false.
 
+  inline const word* seal();
+  // Shrink the segment to the space allocated so far, so that allocate() and tryExtend() fail
+  // from now on, and return the old end.  Used while building concurrently, when only the thread
+  // which owns a segment may allocate in it.
+
+  inline void unseal(const word* end);
+  // Undo seal(), given the end it returned.
+
 private:
   word* pos;
   // Pointer to a pointer to the current end point of the segment, i.e. the location where the
@@ -214,6 +243,9 @@ public:
   ~ReaderArena() noexcept(false);
   KJ_DISALLOW_COPY(ReaderArena);
 
+  void setTrusted();
+  // Mark all segments, including those loaded later, trusted.  See SegmentReader::setTrusted().
+
   // implements Arena ------------------------------------------------
   SegmentReader* tryGetSegment(SegmentId id) override;
   void reportReadLimitReached() override;
@@ -221,19 +253,27 @@ public:
 private:
   MessageReader* message;
   ReadLimiter readLimiter;
+  bool trusted;
 
   // Optimize for single-segment messages so that small messages are handled quickly.
   SegmentReader segment0;
 
-  typedef std::unordered_map<uint, kj::Own<SegmentReader>> SegmentMap;
-  kj::MutexGuarded<kj::Maybe<kj::Own<SegmentMap>>> moreSegments;
-  // We need to mutex-guard the segment map because we lazily initialize segments when they are
-  // first requested, but a Reader is allowed to be used concurrently in multiple threads.  Luckily
-  // this only applies to large messages.
-  //
-  // TODO(perf):  Thread-local thing instead?  Some kind of lockless map?  Or do sharing of data
-  //   in a different way, where you have to construct a new MessageReader in each thread (but
-  //   possibly backed by the same data)?
+  struct SegmentTable;
+  struct MoreSegments;
+
+  SegmentTable* segmentTable;
+  // Flat table of the other segments loaded so far, indexed by segment ID, or null if none have
+  // been loaded.  Read without locking:  a table and the SegmentReaders in it are published with
+  // release stores and never modified or freed afterwards until the arena is destroyed, except
+  // that empty slots may be filled in.  When an ID beyond the end is loaded, a bigger copy is
+  // published and the old table is retired (but kept alive, as other threads may be using it).
+
+  kj::MutexGuarded<kj::Maybe<kj::Own<MoreSegments>>> moreSegments;
+  // Owns the segments and tables.  We need a lock when loading a segment because we lazily
+  // initialize segments when they are first requested, but a Reader is allowed to be used
+  // concurrently in multiple threads.  Lookups of already-loaded segments only use segmentTable.
+
+  SegmentReader* tryGetSegmentSlow(SegmentId id);
 };
 
 class BuilderArena final: public Arena {
@@ -283,6 +323,18 @@ public:
   // the arena is guaranteed to succeed.  Therefore callers should try to allocate from a specific
   // segment first if there is one, then fall back to the arena.
 
+  void beginConcurrent();
+  void endConcurrent();
+  // Enter and leave concurrent mode, in which any number of threads may build the message at
+  // once, each through its own BuilderLane.  Segments which exist at the start are sealed, so that
+  // new objects always go to the allocating thread's own segment.  See ConcurrentBuilder in
+  // message.h.
+
+  BuilderLane* enterLane();
+  void leaveLane(BuilderLane* lane);
+  // Register the calling thread as an allocator in concurrent mode, or undo that.  Lanes must be
+  // left by the thread which entered them, and in reverse order.
+
   SegmentBuilder* addExternalSegment(kj::ArrayPtr<const word> content);
   // Add a new segment to the arena which points to some existing memory region.  The segment is
   // assumed to be completley full; the arena will never allocate from it.  In fact, the segment
@@ -330,20 +382,33 @@ private:
   // segment.  This is not necessarily the last segment because addExternalSegment() may add a
   // segment that is already-full, in which case we don't update this pointer.
 
+  struct ConcurrentState;
+  ConcurrentState* concurrent = nullptr;
+  // Non-null in concurrent mode.  Owned.  (Not kj::Own because the type is incomplete here, and
+  // because arenaSpace in MessageBuilder has no room for a disposer.)  Segment lookups use its
+  // lock-free segment table in this mode, since other threads may be adding segments.
+
   template <typename T>  // Can be `word` or `const word`.
   SegmentBuilder* addSegmentInternal(kj::ArrayPtr<T> content);
+
+  SegmentBuilder* tryGetMoreSegment(SegmentId id);
+  AllocateResult allocateConcurrent(WordCount amount);
 };
 
 // =======================================================================================
 
 inline ReadLimiter::ReadLimiter()
-    : limit(kj::maxValue) {}
+    : limit(kj::maxValue), perThread(nullptr) {}
 
-inline ReadLimiter::ReadLimiter(WordCount64 limit): limit(limit / WORDS) {}
+inline ReadLimiter::ReadLimiter(WordCount64 limit): limit(limit / WORDS), perThread(nullptr) {}
 
 inline void ReadLimiter::reset(WordCount64 limit) { this->limit = limit / WORDS; }
 
 inline bool ReadLimiter::canRead(WordCount amount, Arena* arena) {
+  if (KJ_UNLIKELY(perThread != nullptr)) {
+    return canReadPerThread(amount, arena);
+  }
+
   // Be careful not to store an underflowed value into `limit`, even if multiple threads are
   // decrementing it.
   uint64_t current = limit;
@@ -360,18 +425,18 @@ inline bool ReadLimiter::canRead(WordCount amount, Arena* arena) {
 
 inline SegmentReader::SegmentReader(Arena* arena, SegmentId id, kj::ArrayPtr<const word> ptr,
                                     ReadLimiter* readLimiter)
-    : arena(arena), id(id), ptr(ptr), readLimiter(readLimiter) {}
+    : arena(arena), id(id), trusted(false), ptr(ptr), readLimiter(readLimiter) {}
 
 inline bool SegmentReader::containsInterval(const void* from, const void* to) {
-  return from >= this->ptr.begin() && to <= this->ptr.end() && from <= to &&
+  return trusted || (from >= this->ptr.begin() && to <= this->ptr.end() && from <= to &&
       readLimiter->canRead(
           intervalLength(reinterpret_cast<const byte*>(from),
                          reinterpret_cast<const byte*>(to)) / BYTES_PER_WORD,
-          arena);
+          arena));
 }
 
 inline bool SegmentReader::amplifiedRead(WordCount virtualAmount) {
-  return readLimiter->canRead(virtualAmount, arena);
+  return trusted || readLimiter->canRead(virtualAmount, arena);
 }
 
 inline Arena* SegmentReader::getArena() { return arena; }
@@ -383,6 +448,7 @@ inline WordCount SegmentReader::getOffsetTo(const word* ptr) {
 inline WordCount SegmentReader::getSize() { return ptr.size() * WORDS; }
 inline kj::ArrayPtr<const word> SegmentReader::getArray() { return ptr; }
 inline void SegmentReader::unread(WordCount64 amount) { readLimiter->unread(amount); }
+inline void SegmentReader::setTrusted() { trusted = true; }
 
 // -------------------------------------------------------------------
 
@@ -451,6 +517,16 @@ inline bool SegmentBuilder::tryExtend(word* from, word* to) {
   }
 }
 
+inline const word* SegmentBuilder::seal() {
+  const word* end = ptr.end();
+  ptr = kj::arrayPtr(ptr.begin(), kj::implicitCast<const word*>(pos));
+  return end;
+}
+
+inline void SegmentBuilder::unseal(const word* end) {
+  ptr = kj::arrayPtr(ptr.begin(), end);
+}
+
 }  // namespace _ (private)
 }  // namespace capnp
 
@@ -64,5 +64,64 @@ const ::capnp::_::RawSchema s_f264a779fef191ce = {
   0, 0, nullptr, nullptr, nullptr, { &s_f264a779fef191ce, nullptr, nullptr, 0, 0, nullptr }
 };
 #endif  // !CAPNP_LITE
+static const ::capnp::_::AlignedData<21> b_faf075b2f0a7192f = {
+  {   0,   0,   0,   0,   5,   0,   6,   0,
+     47,  25, 167, 240, 178, 117, 240, 250,
+     16,   0,   0,   0,   5,   0,  17,   0,
+    129,  78,  48, 184, 123, 125, 248, 189,
+      0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+     21,   0,   0,   0, 218,   0,   0,   0,
+     33,   0,   0,   0,   7,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+     28,   0,   0,   0,   3,   0,   1,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+     99,  97, 112, 110, 112,  47,  99,  43,
+     43,  46,  99,  97, 112, 110, 112,  58,
+    115, 112, 101,  99, 105,  97, 108, 105,
+    122, 101,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   1,   0,   1,   0,
+      1,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0, }
+};
+::capnp::word const* const bp_faf075b2f0a7192f = b_faf075b2f0a7192f.words;
+#if !CAPNP_LITE
+const ::capnp::_::RawSchema s_faf075b2f0a7192f = {
+  0xfaf075b2f0a7192f, b_faf075b2f0a7192f.words, 21, nullptr, nullptr,
+  0, 0, nullptr, nullptr, nullptr, { &s_faf075b2f0a7192f, nullptr, nullptr, 0, 0, nullptr }
+};
+#endif  // !CAPNP_LITE
+static const ::capnp::_::AlignedData<20> b_d8c8fa6a8b4a60ac = {
+  {   0,   0,   0,   0,   5,   0,   6,   0,
+    172,  96,  74, 139, 106, 250, 200, 216,
+     16,   0,   0,   0,   5,   0,  17,   0,
+    129,  78,  48, 184, 123, 125, 248, 189,
+      0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+     21,   0,   0,   0, 186,   0,   0,   0,
+     29,   0,   0,   0,   7,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+     24,   0,   0,   0,   3,   0,   1,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+     99,  97, 112, 110, 112,  47,  99,  43,
+     43,  46,  99,  97, 112, 110, 112,  58,
+    110,  97, 116, 105, 118, 101,   0,   0,
+      0,   0,   0,   0,   1,   0,   1,   0,
+      1,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0,
+      0,   0,   0,   0,   0,   0,   0,   0, }
+};
+::capnp::word const* const bp_d8c8fa6a8b4a60ac = b_d8c8fa6a8b4a60ac.words;
+#if !CAPNP_LITE
+const ::capnp::_::RawSchema s_d8c8fa6a8b4a60ac = {
+  0xd8c8fa6a8b4a60ac, b_d8c8fa6a8b4a60ac.words, 20, nullptr, nullptr,
+  0, 0, nullptr, nullptr, nullptr, { &s_d8c8fa6a8b4a60ac, nullptr, nullptr, 0, 0, nullptr }
+};
+#endif  // !CAPNP_LITE
 }  // namespace schemas
 }  // namespace capnp
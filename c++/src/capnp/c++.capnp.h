@@ -16,6 +16,8 @@ namespace schemas {
 
 CAPNP_DECLARE_SCHEMA(b9c6f99ebf805f2c);
 CAPNP_DECLARE_SCHEMA(f264a779fef191ce);
+CAPNP_DECLARE_SCHEMA(faf075b2f0a7192f);
+CAPNP_DECLARE_SCHEMA(d8c8fa6a8b4a60ac);
 
 }  // namespace schemas
 }  // namespace capnp
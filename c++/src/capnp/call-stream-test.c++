@@ -0,0 +1,173 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "call-stream.h"
+#include "test-util.h"
+#include <kj/debug.h>
+#include <kj/compat/gtest.h>
+
+namespace capnp {
+namespace _ {
+namespace {
+
+class HeldCallsImpl final: public test::TestInterface::Server {
+  // Holds each foo() call until the test releases it.
+
+public:
+  kj::Vector<kj::Own<kj::PromiseFulfiller<void>>> held;
+
+  void releaseAll() {
+    for (auto& fulfiller: held) {
+      fulfiller->fulfill();
+    }
+    held.resize(0);
+  }
+
+protected:
+  kj::Promise<void> foo(FooContext context) override {
+    auto paf = kj::newPromiseAndFulfiller<void>();
+    held.add(kj::mv(paf.fulfiller));
+    return kj::mv(paf.promise);
+  }
+};
+
+void settle(kj::WaitScope& waitScope) {
+  for (uint i = 0; i < 20; i++) {
+    kj::evalLater([]() {}).wait(waitScope);
+  }
+}
+
+TEST(Capability, CallStreamFixedWindow) {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+  kj::TimerImpl timer(kj::origin<kj::TimePoint>());
+
+  auto server = kj::heap<HeldCallsImpl>();
+  auto& calls = *server;
+  test::TestInterface::Client client(kj::mv(server));
+
+  size_t callBytes = client.fooRequest().totalSize().wordCount * sizeof(word);
+  CallStreamOptions options;
+  options.adaptive = false;
+  options.minWindowBytes = 1;
+  options.initialWindowBytes = callBytes * 3;
+  CallStream stream(timer, options);
+
+  // The first two calls leave room; the third fills the window.
+  stream.send(client.fooRequest()).wait(waitScope);
+  stream.send(client.fooRequest()).wait(waitScope);
+  bool room = false;
+  auto promise = stream.send(client.fooRequest()).then([&]() { room = true; })
+      .eagerlyEvaluate(nullptr);
+  settle(waitScope);
+  EXPECT_EQ(3u, calls.held.size());
+  EXPECT_EQ(callBytes * 3, stream.getBytesInFlight());
+  EXPECT_FALSE(room);
+
+  // One returning makes room.
+  calls.held[0]->fulfill();
+  settle(waitScope);
+  EXPECT_TRUE(room);
+  promise.wait(waitScope);
+
+  bool finished = false;
+  auto finishPromise = stream.finish().then([&]() { finished = true; }).eagerlyEvaluate(nullptr);
+  settle(waitScope);
+  EXPECT_FALSE(finished);
+  calls.releaseAll();
+  finishPromise.wait(waitScope);
+  EXPECT_EQ(0u, stream.getBytesInFlight());
+  EXPECT_EQ(callBytes * 3, stream.getWindowBytes());
+}
+
+TEST(Capability, CallStreamAdaptiveWindow) {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+  kj::TimerImpl timer(kj::origin<kj::TimePoint>());
+
+  auto server = kj::heap<HeldCallsImpl>();
+  auto& calls = *server;
+  test::TestInterface::Client client(kj::mv(server));
+
+  CallStreamOptions options;
+  options.initialWindowBytes = 1024;
+  options.minWindowBytes = 1024;
+  options.maxWindowBytes = 65536;
+  CallStream stream(timer, options);
+
+  // Each round trip takes 1ms however much is in flight, so the window should keep growing until
+  // it hits the maximum.
+  size_t previousWindow = stream.getWindowBytes();
+  for (uint round = 0; round < 10; round++) {
+    for (;;) {
+      bool room = false;
+      auto promise = stream.send(client.fooRequest()).then([&]() { room = true; })
+          .eagerlyEvaluate(nullptr);
+      settle(waitScope);
+      if (!room) {
+        timer.advanceTo(timer.now() + 1 * kj::MILLISECONDS);
+        calls.releaseAll();
+        promise.wait(waitScope);
+        break;
+      }
+    }
+
+    settle(waitScope);
+    EXPECT_GE(stream.getWindowBytes(), previousWindow);
+    previousWindow = stream.getWindowBytes();
+  }
+
+  EXPECT_EQ(65536u, stream.getWindowBytes());
+  KJ_IF_MAYBE(rtt, stream.getMinRtt()) {
+    EXPECT_TRUE(*rtt == 1 * kj::MILLISECONDS);
+  } else {
+    ADD_FAILURE() << "Expected an RTT measurement.";
+  }
+
+  timer.advanceTo(timer.now() + 1 * kj::MILLISECONDS);
+  calls.releaseAll();
+  stream.finish().wait(waitScope);
+}
+
+TEST(Capability, CallStreamFailure) {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+  kj::TimerImpl timer(kj::origin<kj::TimePoint>());
+
+  auto server = kj::heap<HeldCallsImpl>();
+  auto& calls = *server;
+  test::TestInterface::Client client(kj::mv(server));
+  CallStream stream(timer);
+
+  stream.send(client.fooRequest()).wait(waitScope);
+  stream.send(client.fooRequest()).wait(waitScope);
+  settle(waitScope);
+  ASSERT_EQ(2u, calls.held.size());
+  calls.held[0]->reject(KJ_EXCEPTION(FAILED, "upload failed"));
+  settle(waitScope);
+
+  EXPECT_ANY_THROW(stream.send(client.fooRequest()).wait(waitScope));
+  EXPECT_ANY_THROW(stream.finish().wait(waitScope));
+}
+
+}  // namespace
+}  // namespace _
+}  // namespace capnp
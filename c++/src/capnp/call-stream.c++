@@ -0,0 +1,144 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "call-stream.h"
+#include <kj/debug.h>
+
+namespace capnp {
+
+CallStream::CallStream(kj::Timer& timer, CallStreamOptions options)
+    : timer(timer), options(options),
+      windowBytes(kj::max(options.minWindowBytes,
+                          kj::min(options.initialWindowBytes, options.maxWindowBytes))),
+      tasks(*this) {}
+
+CallStream::~CallStream() noexcept(false) {}
+
+kj::Promise<void> CallStream::sent(size_t bytes, kj::Promise<void>&& returnPromise) {
+  KJ_REQUIRE(roomFulfiller == nullptr,
+             "CallStream::send() called again before the previous send's promise resolved.");
+
+  bytesInFlight += bytes;
+  ++callsInFlight;
+  auto sendTime = timer.now();
+  uint64_t deliveredAtSend = deliveredBytes;
+  tasks.add(returnPromise.then([this,bytes,sendTime,deliveredAtSend]() {
+    returned(bytes, sendTime, deliveredAtSend);
+  }, [this](kj::Exception&& exception) {
+    fail(kj::mv(exception));
+  }));
+
+  // There's always room for one call, however big.
+  if (bytesInFlight < windowBytes || callsInFlight == 1) {
+    return kj::READY_NOW;
+  }
+
+  auto paf = kj::newPromiseAndFulfiller<void>();
+  roomFulfiller = kj::mv(paf.fulfiller);
+  return kj::mv(paf.promise);
+}
+
+kj::Promise<void> CallStream::finish() {
+  KJ_IF_MAYBE(e, error) {
+    return kj::cp(*e);
+  }
+  if (callsInFlight == 0) {
+    return kj::READY_NOW;
+  }
+
+  auto paf = kj::newPromiseAndFulfiller<void>();
+  finishFulfiller = kj::mv(paf.fulfiller);
+  return kj::mv(paf.promise);
+}
+
+void CallStream::returned(size_t bytes, kj::TimePoint sendTime, uint64_t deliveredAtSend) {
+  bytesInFlight -= bytes;
+  --callsInFlight;
+  deliveredBytes += bytes;
+
+  if (options.adaptive) {
+    updateWindow(timer.now() - sendTime, deliveredAtSend);
+  }
+
+  if (bytesInFlight < windowBytes || callsInFlight == 0) {
+    KJ_IF_MAYBE(f, roomFulfiller) {
+      f->get()->fulfill();
+      roomFulfiller = nullptr;
+    }
+  }
+  if (callsInFlight == 0) {
+    KJ_IF_MAYBE(f, finishFulfiller) {
+      f->get()->fulfill();
+      finishFulfiller = nullptr;
+    }
+  }
+}
+
+void CallStream::updateWindow(kj::Duration rtt, uint64_t deliveredAtSend) {
+  if (deliveredAtSend >= roundStart) {
+    // This call was sent after the current round began, so a full round trip has passed.
+    previousRoundMaxRate = roundMaxRate;
+    roundMaxRate = 0;
+    roundStart = deliveredBytes;
+  }
+
+  // A zero RTT means the call returned within the same turn as it was sent, i.e. faster than we
+  // can measure; it tells us nothing.
+  if (rtt <= 0 * kj::NANOSECONDS) {
+    return;
+  }
+
+  KJ_IF_MAYBE(m, minRtt) {
+    if (rtt < *m) *m = rtt;
+  } else {
+    minRtt = rtt;
+  }
+
+  double rate = double(deliveredBytes - deliveredAtSend) / (rtt / kj::NANOSECONDS);
+  roundMaxRate = kj::max(roundMaxRate, rate);
+
+  // Rates from before the previous round are forgotten, so the window shrinks again if the
+  // receiver slows down.
+  double target = 2 * kj::max(roundMaxRate, previousRoundMaxRate) *
+                  (KJ_ASSERT_NONNULL(minRtt) / kj::NANOSECONDS);
+  windowBytes = target >= options.maxWindowBytes ? options.maxWindowBytes
+              : kj::max(options.minWindowBytes, size_t(target));
+}
+
+void CallStream::fail(kj::Exception&& exception) {
+  if (error == nullptr) {
+    KJ_IF_MAYBE(f, roomFulfiller) {
+      f->get()->reject(kj::cp(exception));
+      roomFulfiller = nullptr;
+    }
+    KJ_IF_MAYBE(f, finishFulfiller) {
+      f->get()->reject(kj::cp(exception));
+      finishFulfiller = nullptr;
+    }
+    error = kj::mv(exception);
+  }
+}
+
+void CallStream::taskFailed(kj::Exception&& exception) {
+  fail(kj::mv(exception));
+}
+
+}  // namespace capnp
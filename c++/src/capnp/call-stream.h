@@ -0,0 +1,147 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef CAPNP_CALL_STREAM_H_
+#define CAPNP_CALL_STREAM_H_
+
+#if defined(__GNUC__) && !defined(CAPNP_HEADER_WARNINGS)
+#pragma GCC system_header
+#endif
+
+#include "capability.h"
+#include <kj/time.h>
+
+namespace capnp {
+
+struct CallStreamOptions {
+  size_t initialWindowBytes = 65536;
+  // Bytes of call parameters allowed in flight before anything has been measured.
+
+  size_t minWindowBytes = 4096;
+  size_t maxWindowBytes = 16u << 20;
+  // Bounds on the window.  At least one call is always allowed in flight, however big.
+
+  bool adaptive = true;
+  // Whether to resize the window as calls return.  If false, the window stays at
+  // `initialWindowBytes`.
+};
+
+class CallStream: private kj::TaskSet::ErrorHandler {
+  // Sends a sequence of calls, typically to one capability, keeping a bounded number of bytes of
+  // them in flight.  This lets a client upload bulk data as a series of calls without waiting for
+  // each to return, while not queueing up more than the receiver and the network can absorb.
+  //
+  // Send each call with send() and wait for the returned promise before sending the next; then
+  // wait for finish().  Calls are delivered in the order sent, as usual for calls on one
+  // capability.  The results of streamed calls are dropped, so they are best suited to methods
+  // that return nothing.
+  //
+  // When adaptive, the window follows the measured bandwidth-delay product:  twice the best rate
+  // at which calls have returned over the last two round trips, multiplied by the shortest round
+  // trip time seen.  A window that is too small caps the rate at window / RTT, so it doubles each
+  // round trip until the rate stops improving.  The timer is only used to read the time, which
+  // the event loop updates once per turn, so round trips shorter than that are not measured.
+  //
+  // This is flow control applied by the caller, per stream.  RpcSystem::setFlowLimit() is
+  // different:  it limits the calls a connection will accept, across all capabilities.
+
+public:
+  explicit CallStream(kj::Timer& timer, CallStreamOptions options = CallStreamOptions());
+  KJ_DISALLOW_COPY(CallStream);
+  ~CallStream() noexcept(false);
+
+  template <typename Params, typename Results>
+  kj::Promise<void> send(Request<Params, Results>&& request) KJ_WARN_UNUSED_RESULT;
+  // Send the call now.  The returned promise resolves once the window has room for another call.
+  //
+  // If any call fails, the stream is broken:  further send()s fail with the same exception
+  // without sending anything, and so does finish().
+
+  kj::Promise<void> finish() KJ_WARN_UNUSED_RESULT;
+  // Resolves when every call sent so far has returned.
+
+  inline size_t getWindowBytes() const { return windowBytes; }
+  inline size_t getBytesInFlight() const { return bytesInFlight; }
+  inline kj::Maybe<kj::Duration> getMinRtt() const { return minRtt; }
+
+private:
+  kj::Timer& timer;
+  CallStreamOptions options;
+
+  size_t windowBytes;
+  size_t bytesInFlight = 0;
+  uint callsInFlight = 0;
+
+  kj::Maybe<kj::Duration> minRtt;
+  // Shortest round trip seen.
+
+  uint64_t deliveredBytes = 0;
+  // Total bytes of calls that have returned.  Each call notes this when sent; the difference when
+  // it returns, divided by its round trip time, is a sample of the rate at which calls return.
+
+  uint64_t roundStart = 0;
+  double roundMaxRate = 0;
+  double previousRoundMaxRate = 0;
+  // Highest rate samples (in bytes per nanosecond) in the current and previous round trips.  A
+  // round ends when a call sent after it began returns.
+
+  kj::Maybe<kj::Exception> error;
+  kj::Maybe<kj::Own<kj::PromiseFulfiller<void>>> roomFulfiller;
+  kj::Maybe<kj::Own<kj::PromiseFulfiller<void>>> finishFulfiller;
+  kj::TaskSet tasks;
+
+  kj::Promise<void> sent(size_t bytes, kj::Promise<void>&& returnPromise);
+  void returned(size_t bytes, kj::TimePoint sendTime, uint64_t deliveredAtSend);
+  void fail(kj::Exception&& exception);
+  void updateWindow(kj::Duration rtt, uint64_t deliveredAtSend);
+
+  void taskFailed(kj::Exception&& exception) override;
+};
+
+// =======================================================================================
+// Inline implementation details
+
+namespace _ {  // private
+
+template <typename Builder>
+inline size_t callStreamBytes(Builder& params) {
+  return params.totalSize().wordCount * sizeof(word);
+}
+inline size_t callStreamBytes(AnyPointer::Builder& params) {
+  return params.targetSize().wordCount * sizeof(word);
+}
+
+}  // namespace _ (private)
+
+template <typename Params, typename Results>
+kj::Promise<void> CallStream::send(Request<Params, Results>&& request) {
+  KJ_IF_MAYBE(e, error) {
+    // Don't send anything more on a broken stream.
+    return kj::cp(*e);
+  }
+
+  size_t bytes = _::callStreamBytes(kj::implicitCast<typename Params::Builder&>(request));
+  return sent(bytes, request.send().then([](Response<Results>&&) {}));
+}
+
+}  // namespace capnp
+
+#endif  // CAPNP_CALL_STREAM_H_
@@ -27,6 +27,7 @@
 #include <kj/refcount.h>
 #include <kj/debug.h>
 #include <kj/vector.h>
+#include <kj/threadlocal.h>
 #include <map>
 #include "generated-header-support.h"
 
@@ -125,7 +126,7 @@ public:
 
 class LocalCallContext final: public CallContextHook, public kj::Refcounted {
 public:
-  LocalCallContext(kj::Own<MallocMessageBuilder>&& request, kj::Own<ClientHook> clientRef,
+  LocalCallContext(kj::Own<MessageBuilder>&& request, kj::Own<ClientHook> clientRef,
                    kj::Own<kj::PromiseFulfiller<void>> cancelAllowedFulfiller)
       : request(kj::mv(request)), clientRef(kj::mv(clientRef)),
         cancelAllowedFulfiller(kj::mv(cancelAllowedFulfiller)) {}
@@ -178,7 +179,7 @@ public:
     return kj::addRef(*this);
   }
 
-  kj::Maybe<kj::Own<MallocMessageBuilder>> request;
+  kj::Maybe<kj::Own<MessageBuilder>> request;
   kj::Maybe<Response<AnyPointer>> response;
   AnyPointer::Builder responseBuilder = nullptr;  // only valid if `response` is non-null
   kj::Own<ClientHook> clientRef;
@@ -189,8 +190,8 @@ public:
 class LocalRequest final: public RequestHook {
 public:
   inline LocalRequest(uint64_t interfaceId, uint16_t methodId,
-                      kj::Maybe<MessageSize> sizeHint, kj::Own<ClientHook> client)
-      : message(kj::heap<MallocMessageBuilder>(firstSegmentSize(sizeHint))),
+                      kj::Own<MessageBuilder> message, kj::Own<ClientHook> client)
+      : message(kj::mv(message)),
         interfaceId(interfaceId), methodId(methodId), client(kj::mv(client)) {}
 
   RemotePromise<AnyPointer> send() override {
@@ -233,7 +234,7 @@ public:
     return nullptr;
   }
 
-  kj::Own<MallocMessageBuilder> message;
+  kj::Own<MessageBuilder> message;
 
 private:
   uint64_t interfaceId;
@@ -302,7 +303,8 @@ public:
   Request<AnyPointer, AnyPointer> newCall(
       uint64_t interfaceId, uint16_t methodId, kj::Maybe<MessageSize> sizeHint) override {
     auto hook = kj::heap<LocalRequest>(
-        interfaceId, methodId, sizeHint, kj::addRef(*this));
+        interfaceId, methodId, kj::heap<MallocMessageBuilder>(firstSegmentSize(sizeHint)),
+        kj::addRef(*this));
     auto root = hook->message->getRoot<AnyPointer>();
     return Request<AnyPointer, AnyPointer>(root, kj::mv(hook));
   }
@@ -444,6 +446,47 @@ private:
   AnyPointer::Reader results;
 };
 
+namespace {
+
+class RequestBuilderPool final: public kj::Refcounted {
+  // A pool of request builders shared by all LocalClients in a thread.  Capabilities are only used
+  // from their event loop's thread, so one pool per thread recycles builders just as well as one
+  // per capability, without each of many capabilities pinning idle segments of its own.
+
+public:
+  RequestBuilderPool(): pool(16, 1u << 16) {}
+  // Local requests are usually small; 16 builders retaining at most 512KiB each keeps the worst
+  // case per thread modest.
+
+  ~RequestBuilderPool() noexcept(false);
+
+  static kj::Own<RequestBuilderPool> forThisThread();
+  // Returns the thread's pool, creating it if no LocalClient in this thread holds one.
+
+  MessageBuilderPool pool;
+};
+
+KJ_THREADLOCAL_PTR(RequestBuilderPool) threadRequestBuilderPool = nullptr;
+
+RequestBuilderPool::~RequestBuilderPool() noexcept(false) {
+  if (threadRequestBuilderPool == this) {
+    threadRequestBuilderPool = nullptr;
+  }
+}
+
+kj::Own<RequestBuilderPool> RequestBuilderPool::forThisThread() {
+  RequestBuilderPool* pool = threadRequestBuilderPool;
+  if (pool == nullptr) {
+    auto result = kj::refcounted<RequestBuilderPool>();
+    threadRequestBuilderPool = result.get();
+    return kj::mv(result);
+  } else {
+    return kj::addRef(*pool);
+  }
+}
+
+}  // namespace
+
 class LocalClient final: public ClientHook, public kj::Refcounted {
 public:
   LocalClient(kj::Own<Capability::Server>&& serverParam)
@@ -462,8 +505,15 @@ public:
 
   Request<AnyPointer, AnyPointer> newCall(
       uint64_t interfaceId, uint16_t methodId, kj::Maybe<MessageSize> sizeHint) override {
-    auto hook = kj::heap<LocalRequest>(
-        interfaceId, methodId, sizeHint, kj::addRef(*this));
+    kj::Own<MessageBuilder> message;
+    KJ_IF_MAYBE(s, sizeHint) {
+      message = requestBuilderPool->pool.get(s->wordCount);
+    } else {
+      message = requestBuilderPool->pool.getAdaptive(
+          MessageSizeHistoryMap::methodKey(interfaceId, methodId));
+    }
+
+    auto hook = kj::heap<LocalRequest>(interfaceId, methodId, kj::mv(message), kj::addRef(*this));
     auto root = hook->message->getRoot<AnyPointer>();
     return Request<AnyPointer, AnyPointer>(root, kj::mv(hook));
   }
@@ -535,6 +585,10 @@ private:
   kj::Own<Capability::Server> server;
   _::CapabilityServerSetBase* capServerSet = nullptr;
   void* ptr = nullptr;
+
+  kj::Own<RequestBuilderPool> requestBuilderPool = RequestBuilderPool::forThisThread();
+  // Local calls are often made repeatedly, so we recycle request builders rather than allocating
+  // fresh segments for each call, and learn each method's typical request size.
 };
 
 kj::Own<ClientHook> Capability::Client::makeLocalClient(kj::Own<Capability::Server>&& server) {
@@ -55,6 +55,8 @@ namespace {
 
 static constexpr uint64_t NAMESPACE_ANNOTATION_ID = 0xb9c6f99ebf805f2cull;
 static constexpr uint64_t NAME_ANNOTATION_ID = 0xf264a779fef191ceull;
+static constexpr uint64_t SPECIALIZE_ANNOTATION_ID = 0xfaf075b2f0a7192full;
+static constexpr uint64_t NATIVE_ANNOTATION_ID = 0xd8c8fa6a8b4a60acull;
 
 bool hasDiscriminantValue(const schema::Field::Reader& reader) {
   return reader.getDiscriminantValue() != schema::Field::NO_DISCRIMINANT;
@@ -1780,11 +1782,12 @@ private:
     kj::StringTree readerBuilderDefs;
     kj::StringTree inlineMethodDefs;
     kj::StringTree sourceDefs;
+    kj::StringTree nativeDefs;
   };
 
   kj::StringTree makeReaderDef(kj::StringPtr fullName, kj::StringPtr unqualifiedParentType,
                                const TemplateContext& templateContext, bool isUnion,
-                               kj::Array<kj::StringTree>&& methodDecls) {
+                               bool specialized, kj::Array<kj::StringTree>&& methodDecls) {
     return kj::strTree(
         templateContext.allDecls(),
         "class ", fullName, "::Reader {\n"
@@ -1793,10 +1796,18 @@ private:
         "\n"
         "  Reader() = default;\n"
         "  inline explicit Reader(::capnp::_::StructReader base): _reader(base) {}\n"
-        "\n"
-        "  inline ::capnp::MessageSize totalSize() const {\n"
-        "    return _reader.totalSize().asPublic();\n"
-        "  }\n"
+        "\n",
+        specialized ? kj::strTree(
+            "  inline ::capnp::MessageSize totalSize() const {\n"
+            "    return ::capnp::_::StructHelpers<", unqualifiedParentType, ">::totalSize(_reader)"
+                ".asPublic();\n"
+            "  }\n"
+            "  inline void validate() const {\n"
+            "    ::capnp::_::StructHelpers<", unqualifiedParentType, ">::validate(_reader);\n"
+            "  }\n") : kj::strTree(
+            "  inline ::capnp::MessageSize totalSize() const {\n"
+            "    return _reader.totalSize().asPublic();\n"
+            "  }\n"),
         "\n"
         "#if !CAPNP_LITE\n"
         "  inline ::kj::StringTree toString() const {\n"
@@ -1922,6 +1933,515 @@ private:
         "};\n");
   }
 
+  bool inheritedFlag(Schema schema, uint64_t annotationId) {
+    // Determines whether a Bool annotation like $Cxx.specialize applies to the given node, which
+    // may inherit it from an enclosing scope.
+
+    for (;;) {
+      auto proto = schema.getProto();
+      KJ_IF_MAYBE(value, annotationValue(proto, annotationId)) {
+        return value->getBool();
+      }
+      if (proto.getScopeId() == 0) {
+        // A file, or an implicit method param/result struct, which has no scope.
+        return false;
+      }
+      schema = schemaLoader.get(proto.getScopeId());
+    }
+  }
+
+  enum class PointerSlotKind {
+    UNKNOWN,      // No field seen yet.
+    STRUCT,       // Only fields of one (non-generic) struct type.
+    STRUCT_LIST,  // Only fields of one List(struct) type.
+    OTHER         // Anything else, including any slot used by a union member.
+  };
+
+  struct PointerSlot {
+    PointerSlotKind kind = PointerSlotKind::UNKNOWN;
+    uint64_t typeId = 0;
+    kj::String typeName;
+  };
+
+  void classifyPointerSlots(StructSchema schema, kj::ArrayPtr<PointerSlot> slots,
+                            bool inUnion = false) {
+    // Works out what each pointer slot of a struct may contain, for the purpose of generating
+    // type-specialized traversal code.  Groups share their parent's slots.
+    //
+    // Slots of union members are never specialized:  a later version of the schema may add a
+    // member of another type in the same slot without changing the struct's layout, and we can't
+    // tell from the layout alone that a message was written that way.
+
+    for (auto field: schema.getFields()) {
+      auto proto = field.getProto();
+      bool fieldInUnion = inUnion || hasDiscriminantValue(proto);
+      if (proto.isGroup()) {
+        classifyPointerSlots(field.getType().asStruct(), slots, fieldInUnion);
+        continue;
+      }
+
+      auto type = field.getType();
+      PointerSlotKind kind;
+      Type structType;
+      switch (type.which()) {
+        case schema::Type::STRUCT:
+          kind = PointerSlotKind::STRUCT;
+          structType = type;
+          break;
+        case schema::Type::LIST:
+          structType = type.asList().getElementType();
+          kind = structType.isStruct() ? PointerSlotKind::STRUCT_LIST : PointerSlotKind::OTHER;
+          break;
+        case schema::Type::TEXT:
+        case schema::Type::DATA:
+        case schema::Type::INTERFACE:
+        case schema::Type::ANY_POINTER:
+          kind = PointerSlotKind::OTHER;
+          break;
+        default:
+          // Not a pointer.
+          continue;
+      }
+
+      if (fieldInUnion) {
+        kind = PointerSlotKind::OTHER;
+      }
+
+      uint64_t typeId = 0;
+      if (kind != PointerSlotKind::OTHER) {
+        auto structSchema = structType.asStruct();
+        if (structSchema.getProto().getIsGeneric()) {
+          kind = PointerSlotKind::OTHER;
+        } else {
+          typeId = structSchema.getProto().getId();
+        }
+      }
+
+      auto& slot = slots[proto.getSlot().getOffset()];
+      if (slot.kind == PointerSlotKind::UNKNOWN) {
+        slot.kind = kind;
+        slot.typeId = typeId;
+        if (kind != PointerSlotKind::OTHER) {
+          slot.typeName = kj::str(typeName(structType, nullptr));
+        }
+      } else if (slot.kind != kind || slot.typeId != typeId) {
+        slot.kind = PointerSlotKind::OTHER;
+      }
+    }
+  }
+
+  kj::StringTree makeSpecializedDefs(kj::StringPtr fullName, StructSchema schema) {
+    // Generates the type-specialized traversal functions used by ::capnp::_::StructHelpers.
+
+    auto slots = kj::heapArray<PointerSlot>(schema.getProto().getStruct().getPointerCount());
+    classifyPointerSlots(schema, slots);
+
+    kj::StringPtr params = slots.size() == 0 ?
+        "::capnp::_::StructBuilder, ::capnp::_::StructReader" :
+        "::capnp::_::StructBuilder dst, ::capnp::_::StructReader src";
+    kj::StringPtr readerParam = slots.size() == 0 ?
+        "::capnp::_::StructReader" : "::capnp::_::StructReader src";
+
+    kj::Vector<kj::StringTree> copies, sizes, validations;
+    for (uint i = 0; i < slots.size(); i++) {
+      auto& slot = slots[i];
+      auto src = kj::str("src.getPointerField(", i, " * ::capnp::POINTERS)");
+      auto dst = kj::str("dst.getPointerField(", i, " * ::capnp::POINTERS)");
+      switch (slot.kind) {
+        case PointerSlotKind::STRUCT:
+        case PointerSlotKind::STRUCT_LIST: {
+          bool isList = slot.kind == PointerSlotKind::STRUCT_LIST;
+          auto helpers = kj::str("  ::capnp::_::StructHelpers<", slot.typeName, ">::");
+          copies.add(kj::strTree(helpers, isList ? "copyList" : "copy", "(\n"
+                                 "      ", dst, ", ", src, ");\n"));
+          sizes.add(kj::strTree("  result +=", helpers.slice(1),
+                                isList ? "listTargetSize" : "targetSize", "(\n"
+                                "      ", src, ");\n"));
+          validations.add(kj::strTree(helpers, isList ? "validateList" : "validate", "(\n"
+                                      "      ", src, ");\n"));
+          break;
+        }
+        case PointerSlotKind::UNKNOWN:
+        case PointerSlotKind::OTHER:
+          copies.add(kj::strTree("  ", dst, ".copyFrom(", src, ");\n"));
+          sizes.add(kj::strTree("  result += ", src, ".targetSize();\n"));
+          validations.add(kj::strTree("  ", src, ".targetSize();\n"));
+          break;
+      }
+    }
+
+    return kj::strTree(
+        "void ", fullName, "::_capnpPrivate::copyPointers(\n"
+        "    ", params, ") {\n",
+        copies.releaseAsArray(),
+        "}\n"
+        "::capnp::_::MessageSizeCounts ", fullName, "::_capnpPrivate::pointerTargetsSize(\n"
+        "    ", readerParam, ") {\n"
+        "  ::capnp::_::MessageSizeCounts result = { 0 * ::capnp::WORDS, 0, 0 * ::capnp::WORDS };\n",
+        sizes.releaseAsArray(),
+        "  return result;\n"
+        "}\n"
+        "void ", fullName, "::_capnpPrivate::validatePointers(\n"
+        "    ", readerParam, ") {\n",
+        validations.releaseAsArray(),
+        "}\n"
+        "\n");
+  }
+
+  bool hasNative(StructSchema schema) {
+    return !schema.getProto().getIsGeneric() && inheritedFlag(schema, NATIVE_ANNOTATION_ID);
+  }
+
+  struct NativeFieldText {
+    kj::StringTree member;     // Declaration in the Native struct.
+    kj::StringTree toNative;   // Copies the field from `reader` to `native`.
+    kj::StringTree fromNative; // Copies the field from `native` to `builder`.
+  };
+
+  kj::Maybe<NativeFieldText> makeNativeFieldText(StructSchema::Field field) {
+    // Returns null if the field has no representation in the Native struct.
+
+    auto proto = field.getProto();
+    auto name = protoName(proto);
+    auto titleCase = toTitleCase(name);
+    bool inUnion = hasDiscriminantValue(proto);
+
+    if (proto.isGroup()) {
+      return NativeFieldText {
+        kj::strTree("  ", titleCase, "::Native ", name, ";\n"),
+        kj::strTree("toNative(reader.get", titleCase, "(), native.", name, ");"),
+        kj::strTree("fromNative(builder.", inUnion ? "init" : "get", titleCase, "(), native.",
+                    name, ");")
+      };
+    }
+
+    auto type = field.getType();
+    auto slot = proto.getSlot();
+    auto defaultValue = slot.getDefaultValue();
+    uint offset = slot.getOffset();
+
+    // Empty pointers are normally left null, but a union member must always be written so that
+    // the discriminant is set.
+    auto ifNotEmpty = inUnion ? kj::str() : kj::str("if (native.", name, ".size() > 0) ");
+
+    auto primitive = [&](kj::StringPtr initializer, kj::StringPtr mask) {
+      auto cppType = typeName(type, nullptr);
+      return NativeFieldText {
+        kj::strTree("  ", cppType, " ", name, initializer, ";\n"),
+        kj::strTree("native.", name, " = _data.getDataFieldUnchecked<", cppType, ">(",
+                    offset, " * ::capnp::ELEMENTS", mask, ");"),
+        kj::strTree("builder.set", titleCase, "(native.", name, ");")
+      };
+    };
+
+    switch (type.which()) {
+      case schema::Type::VOID:
+        return nullptr;
+
+#define HANDLE_PRIMITIVE(discrim, defaultName, suffix) \
+      case schema::Type::discrim: \
+        if (defaultValue.get##defaultName() != 0) { \
+          auto value = kj::str(defaultValue.get##defaultName(), #suffix); \
+          return primitive(kj::str(" = ", value), kj::str(", ", value)); \
+        } \
+        return primitive(" = 0", "");
+
+      HANDLE_PRIMITIVE(INT8 , Int8 , );
+      HANDLE_PRIMITIVE(INT16, Int16, );
+      HANDLE_PRIMITIVE(INT32, Int32, );
+      HANDLE_PRIMITIVE(INT64, Int64, ll);
+      HANDLE_PRIMITIVE(UINT8 , Uint8 , u);
+      HANDLE_PRIMITIVE(UINT16, Uint16, u);
+      HANDLE_PRIMITIVE(UINT32, Uint32, u);
+      HANDLE_PRIMITIVE(UINT64, Uint64, ull);
+#undef HANDLE_PRIMITIVE
+
+      case schema::Type::BOOL:
+        return defaultValue.getBool() ?
+            primitive(" = true", ", true") : primitive(" = false", "");
+
+      case schema::Type::FLOAT32: {
+        uint32_t mask;
+        float value = defaultValue.getFloat32();
+        memcpy(&mask, &value, sizeof(mask));
+        return mask == 0 ? primitive(" = 0", "") : primitive(
+            kj::str(" = ::capnp::_::unmask<float>(0, ", mask, "u)"), kj::str(", ", mask, "u"));
+      }
+
+      case schema::Type::FLOAT64: {
+        uint64_t mask;
+        double value = defaultValue.getFloat64();
+        memcpy(&mask, &value, sizeof(mask));
+        return mask == 0 ? primitive(" = 0", "") : primitive(
+            kj::str(" = ::capnp::_::unmask<double>(0, ", mask, "ull)"),
+            kj::str(", ", mask, "ull"));
+      }
+
+      case schema::Type::ENUM: {
+        uint16_t value = defaultValue.getEnum();
+        return primitive(kj::str(" = static_cast<", typeName(type, nullptr), ">(", value, ")"),
+                         value == 0 ? kj::str() : kj::str(", ", value, "u"));
+      }
+
+      case schema::Type::TEXT:
+        return NativeFieldText {
+          kj::strTree("  ::kj::String ", name, ";\n"),
+          kj::strTree("native.", name, " = ::kj::heapString(reader.get", titleCase, "());"),
+          kj::strTree(ifNotEmpty, "builder.set", titleCase, "(native.", name, ");")
+        };
+
+      case schema::Type::DATA:
+        return NativeFieldText {
+          kj::strTree("  ::kj::Array< ::kj::byte> ", name, ";\n"),
+          kj::strTree("native.", name, " = ::kj::heapArray< ::kj::byte>(reader.get",
+                      titleCase, "());"),
+          kj::strTree(ifNotEmpty, "builder.set", titleCase, "(native.", name, ");")
+        };
+
+      case schema::Type::STRUCT: {
+        auto structType = type.asStruct();
+        if (!hasNative(structType)) return nullptr;
+        auto nativeType = kj::str(typeName(type, nullptr), "::Native");
+        return NativeFieldText {
+          kj::strTree("  ::kj::Maybe< ::kj::Own<", nativeType, ">> ", name, ";\n"),
+          kj::strTree("if (reader.has", titleCase, "()) {\n"
+                      "  auto child = ::kj::heap<", nativeType, ">();\n"
+                      "  toNative(reader.get", titleCase, "(), *child);\n"
+                      "  native.", name, " = ::kj::mv(child);\n"
+                      "}"),
+          kj::strTree("KJ_IF_MAYBE(child, native.", name, ") {\n"
+                      "  fromNative(builder.init", titleCase, "(), **child);\n"
+                      "}",
+                      inUnion ? kj::strTree(" else {\n"
+                                            "  builder.init", titleCase, "();\n"
+                                            "}")
+                              : kj::strTree())
+        };
+      }
+
+      case schema::Type::LIST: {
+        auto elementType = type.asList().getElementType();
+        auto init = kj::str("builder.init", titleCase, "(native.", name, ".size())");
+        switch (elementType.which()) {
+          case schema::Type::VOID:
+          case schema::Type::LIST:
+          case schema::Type::INTERFACE:
+          case schema::Type::ANY_POINTER:
+            return nullptr;
+
+          case schema::Type::BOOL:
+            return NativeFieldText {
+              kj::strTree("  ::kj::Array<bool> ", name, ";\n"),
+              kj::strTree("native.", name, " = KJ_MAP(e, reader.get", titleCase,
+                          "()) { return e; };"),
+              kj::strTree(ifNotEmpty, "{\n"
+                          "  auto list = ", init, ";\n"
+                          "  for (::capnp::uint i = 0; i < list.size(); i++) {\n"
+                          "    list.set(i, native.", name, "[i]);\n"
+                          "  }\n"
+                          "}")
+            };
+
+          case schema::Type::TEXT:
+          case schema::Type::DATA: {
+            bool isText = elementType.isText();
+            kj::StringPtr elementNative = isText ? " ::kj::String" : " ::kj::Array< ::kj::byte>";
+            return NativeFieldText {
+              kj::strTree("  ::kj::Array<", elementNative, "> ", name, ";\n"),
+              kj::strTree("native.", name, " = KJ_MAP(e, reader.get", titleCase, "()) { return ",
+                          isText ? "::kj::heapString(e)" : "::kj::heapArray< ::kj::byte>(e)",
+                          "; };"),
+              kj::strTree(ifNotEmpty, "{\n"
+                          "  auto list = ", init, ";\n"
+                          "  for (::capnp::uint i = 0; i < list.size(); i++) {\n"
+                          "    list.set(i, native.", name, "[i]);\n"
+                          "  }\n"
+                          "}")
+            };
+          }
+
+          case schema::Type::STRUCT: {
+            if (!hasNative(elementType.asStruct())) return nullptr;
+            return NativeFieldText {
+              kj::strTree("  ::kj::Array<", typeName(elementType, nullptr), "::Native> ", name,
+                          ";\n"),
+              kj::strTree("native.", name, " = toNative(reader.get", titleCase, "());"),
+              kj::strTree(ifNotEmpty, "fromNative(", init, ", native.", name, ");")
+            };
+          }
+
+          default: {
+            // Primitive or enum.
+            auto elementCpp = typeName(elementType, nullptr);
+            return NativeFieldText {
+              kj::strTree("  ::kj::Array<", elementCpp, "> ", name, ";\n"),
+              kj::strTree("{\n"
+                          "  auto list = reader.get", titleCase, "();\n"
+                          "  native.", name, " = ::kj::heapArray<", elementCpp, ">(list.size());\n"
+                          "  list.copyTo(native.", name, ");\n"
+                          "}"),
+              kj::strTree(ifNotEmpty, init, ".setAll(native.", name, ".asPtr());")
+            };
+          }
+        }
+      }
+
+      case schema::Type::INTERFACE:
+      case schema::Type::ANY_POINTER:
+        return nullptr;
+    }
+
+    KJ_UNREACHABLE;
+  }
+
+  struct NativeText {
+    kj::StringTree headerDefs;
+    kj::StringTree sourceDefs;
+  };
+
+  NativeText makeNativeText(kj::StringPtr fullName, StructSchema schema) {
+    // Generates the Native mirror of a struct and its conversion functions.
+
+    auto structProto = schema.getProto().getStruct();
+    bool isGroup = structProto.getIsGroup();
+    uint dataWords = structProto.getDataWordCount();
+    bool hasUnion = structProto.getDiscriminantCount() != 0;
+
+    kj::Vector<kj::StringTree> members;
+    kj::Vector<kj::StringTree> toNativeCode;
+    kj::Vector<kj::StringTree> fromNativeCode;
+    bool readsData = false;
+
+    auto indent = [](kj::StringTree&& code, kj::StringPtr prefix) {
+      // Indents every line of `code` by `prefix`.
+      kj::String flat = code.flatten();
+      kj::Vector<kj::StringTree> lines;
+      kj::StringPtr rest = flat;
+      for (;;) {
+        KJ_IF_MAYBE(pos, rest.findFirst('\n')) {
+          lines.add(kj::strTree(prefix, kj::heapString(rest.slice(0, *pos)), "\n"));
+          rest = rest.slice(*pos + 1);
+        } else {
+          lines.add(kj::strTree(prefix, kj::heapString(rest), "\n"));
+          break;
+        }
+      }
+      return kj::StringTree(lines.releaseAsArray(), "");
+    };
+
+    if (hasUnion) {
+      members.add(kj::strTree("  Which which = static_cast<Which>(0);\n"));
+      toNativeCode.add(kj::strTree("  native.which = reader.which();\n"));
+    }
+
+    for (auto field: schema.getFields()) {
+      auto proto = field.getProto();
+      bool inUnion = hasDiscriminantValue(proto);
+      auto condition = kj::str("if (native.which == ", fullName, "::",
+                               toUpperCase(protoName(proto)), ") ");
+
+      KJ_IF_MAYBE(text, makeNativeFieldText(field)) {
+        if (proto.isSlot()) {
+          switch (field.getType().which()) {
+            case schema::Type::VOID:
+            case schema::Type::TEXT:
+            case schema::Type::DATA:
+            case schema::Type::LIST:
+            case schema::Type::STRUCT:
+            case schema::Type::INTERFACE:
+            case schema::Type::ANY_POINTER:
+              break;
+            default:
+              readsData = true;
+              break;
+          }
+        }
+        members.add(kj::mv(text->member));
+        if (inUnion) {
+          toNativeCode.add(indent(kj::strTree(condition, "{\n",
+                                              indent(kj::mv(text->toNative), "  "), "}"), "  "));
+          fromNativeCode.add(indent(kj::strTree(condition, "{\n",
+                                                indent(kj::mv(text->fromNative), "  "), "}"),
+                                    "  "));
+        } else {
+          toNativeCode.add(indent(kj::mv(text->toNative), "  "));
+          fromNativeCode.add(indent(kj::mv(text->fromNative), "  "));
+        }
+      } else if (inUnion) {
+        // Void or unmirrored union member:  only the discriminant can be set.
+        kj::StringPtr method = "init";
+        kj::StringPtr args = "()";
+        switch (field.getType().which()) {
+          case schema::Type::VOID: method = "set"; break;
+          case schema::Type::LIST: args = "(0)"; break;
+          case schema::Type::INTERFACE: method = "set"; args = "(nullptr)"; break;
+          default: break;
+        }
+        fromNativeCode.add(kj::strTree(
+            "  ", condition, "builder.", method, toTitleCase(protoName(proto)), args, ";\n"));
+      }
+    }
+
+    auto readerType = kj::str(fullName, "::Reader");
+    auto builderType = kj::str(fullName, "::Builder");
+    auto nativeType = kj::str(fullName, "::Native");
+
+    kj::StringTree listDecls, listDefs;
+    if (!isGroup) {
+      listDecls = kj::strTree(
+          "::kj::Array<", nativeType, "> toNative(::capnp::List<", fullName, ">::Reader list);\n"
+          "void fromNative(::capnp::List<", fullName, ">::Builder list,\n"
+          "                ::kj::ArrayPtr<const ", nativeType, "> natives);\n");
+      listDefs = kj::strTree(
+          "::kj::Array<", nativeType, "> toNative(::capnp::List<", fullName, ">::Reader list) {\n"
+          "  auto result = ::kj::heapArray<", nativeType, ">(list.size());\n"
+          "  for (::capnp::uint i = 0; i < result.size(); i++) {\n"
+          "    toNative(list[i], result[i]);\n"
+          "  }\n"
+          "  return result;\n"
+          "}\n"
+          "void fromNative(::capnp::List<", fullName, ">::Builder list,\n"
+          "                ::kj::ArrayPtr<const ", nativeType, "> natives) {\n"
+          "  KJ_IREQUIRE(list.size() == natives.size());\n"
+          "  for (::capnp::uint i = 0; i < natives.size(); i++) {\n"
+          "    fromNative(list[i], natives[i]);\n"
+          "  }\n"
+          "}\n");
+    }
+
+    return NativeText {
+      kj::strTree(
+          "struct ", nativeType, " {\n",
+          members.releaseAsArray(),
+          "};\n"
+          "\n"
+          "void toNative(", readerType, " reader, ", nativeType, "& native);\n"
+          "", nativeType, " toNative(", readerType, " reader);\n"
+          "void fromNative(", builderType, " builder, const ", nativeType, "& native);\n",
+          kj::mv(listDecls),
+          "\n"),
+
+      kj::strTree(
+          "void toNative(", readerType, " reader, ", nativeType, "& native) {\n",
+          !readsData ? kj::strTree() : kj::strTree(
+              "  ::capnp::word _scratch[", dataWords, "];\n"
+              "  auto _data = ::capnp::_::PointerHelpers<", fullName, ">::getInternalReader(reader)\n"
+              "      .padDataSection(_scratch);\n"),
+          toNativeCode.releaseAsArray(),
+          "}\n",
+          nativeType, " toNative(", readerType, " reader) {\n"
+          "  ", nativeType, " result;\n"
+          "  toNative(reader, result);\n"
+          "  return result;\n"
+          "}\n"
+          "void fromNative(", builderType, " builder, const ", nativeType, "& native) {\n",
+          fromNativeCode.releaseAsArray(),
+          "}\n",
+          kj::mv(listDefs),
+          "\n")
+    };
+  }
+
   StructText makeStructText(kj::StringPtr scope, kj::StringPtr name, StructSchema schema,
                             kj::Array<kj::StringTree> nestedTypeDecls,
                             const TemplateContext& templateContext) {
@@ -1974,8 +2494,29 @@ private:
           "    #endif  // !CAPNP_LITE\n");
     }
 
+    bool specialized = !templateContext.isGeneric() && !structNode.getIsGroup() &&
+        inheritedFlag(schema, SPECIALIZE_ANNOTATION_ID);
+    if (specialized) {
+      declareText = kj::strTree(kj::mv(declareText),
+          "    static void copyPointers(\n"
+          "        ::capnp::_::StructBuilder dst, ::capnp::_::StructReader src);\n"
+          "    static ::capnp::_::MessageSizeCounts pointerTargetsSize(\n"
+          "        ::capnp::_::StructReader src);\n"
+          "    static void validatePointers(::capnp::_::StructReader src);\n");
+    }
+
     declareText = kj::strTree(kj::mv(declareText), "  };");
     defineText = kj::strTree(kj::mv(defineText), "#endif  // !CAPNP_LITE\n\n");
+    if (specialized) {
+      defineText = kj::strTree(kj::mv(defineText), makeSpecializedDefs(fullName, schema));
+    }
+
+    bool native = !templateContext.isGeneric() && hasNative(schema);
+    NativeText nativeText;
+    if (native) {
+      nativeText = makeNativeText(fullName, schema);
+      defineText = kj::strTree(kj::mv(defineText), kj::mv(nativeText.sourceDefs));
+    }
 
     // Name of the ::Which type, when applicable.
     CppTypeName whichName;
@@ -1998,6 +2539,7 @@ private:
           "  class Reader;\n"
           "  class Builder;\n"
           "  class Pipeline;\n",
+          native ? "  struct Native;\n" : "",
           structNode.getDiscriminantCount() == 0 ? kj::strTree() : kj::strTree(
               "  enum Which: uint16_t {\n",
               KJ_MAP(f, structNode.getFields()) {
@@ -2016,6 +2558,7 @@ private:
 
       kj::strTree(
           makeReaderDef(fullName, name, templateContext, structNode.getDiscriminantCount() != 0,
+                        specialized,
                         KJ_MAP(f, fieldTexts) { return kj::mv(f.readerMethodDecls); }),
           makeBuilderDef(fullName, name, templateContext, structNode.getDiscriminantCount() != 0,
                          KJ_MAP(f, fieldTexts) { return kj::mv(f.builderMethodDecls); }),
@@ -2035,7 +2578,8 @@ private:
               "\n"),
           KJ_MAP(f, fieldTexts) { return kj::mv(f.inlineMethodDefs); }),
 
-      kj::mv(defineText)
+      kj::mv(defineText),
+      kj::mv(nativeText.headerDefs)
     };
   }
 
@@ -2522,6 +3066,9 @@ private:
     kj::StringTree capnpSchemaDecls;
     kj::StringTree capnpSchemaDefs;
     kj::StringTree sourceFileDefs;
+    kj::StringTree nativeDefs;
+    // Native mirror types.  Unlike the other parts, nested types come before their parents here,
+    // since a struct's Native contains its groups' Natives by value.
   };
 
   NodeText makeNodeText(kj::StringPtr namespace_, kj::StringPtr scope,
@@ -2691,6 +3238,10 @@ private:
       kj::strTree(
           kj::mv(top.sourceFileDefs),
           KJ_MAP(n, nestedTexts) { return kj::mv(n.sourceFileDefs); }),
+
+      kj::strTree(
+          KJ_MAP(n, nestedTexts) { return kj::mv(n.nativeDefs); },
+          kj::mv(top.nativeDefs)),
     };
 
     if (templateContext.isGeneric()) {
@@ -2732,6 +3283,7 @@ private:
           kj::strTree(),
 
           kj::mv(structText.sourceDefs),
+          kj::mv(structText.nativeDefs),
         };
       }
 
@@ -2763,6 +3315,7 @@ private:
               "CAPNP_DEFINE_ENUM(", name, "_", hexId, ", ", hexId, ");\n"),
 
           kj::strTree(),
+          kj::strTree(),
         };
       }
 
@@ -2783,6 +3336,7 @@ private:
           kj::strTree(),
 
           kj::mv(interfaceText.sourceDefs),
+          kj::strTree(),
         };
       }
 
@@ -2799,6 +3353,7 @@ private:
           kj::strTree(),
 
           kj::mv(constText.def),
+          kj::strTree(),
         };
       }
 
@@ -2813,6 +3368,7 @@ private:
           kj::strTree(),
 
           kj::strTree(),
+          kj::strTree(),
         };
       }
     }
@@ -2919,6 +3475,7 @@ private:
           KJ_MAP(n, nodeTexts) { return kj::mv(n.outerTypeDef); },
           separator, "\n",
           KJ_MAP(n, nodeTexts) { return kj::mv(n.readerBuilderDefs); },
+          KJ_MAP(n, nodeTexts) { return kj::mv(n.nativeDefs); },
           separator, "\n",
           KJ_MAP(n, nodeTexts) { return kj::mv(n.inlineMethodDefs); },
           KJ_MAP(n, namespaceParts) { return kj::strTree("}  // namespace\n"); }, "\n",
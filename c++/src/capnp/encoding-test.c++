@@ -649,6 +649,63 @@ TEST(Encoding, ListUpgrade) {
   checkList(reader.getAnyPointerField().getAs<List<uint16_t>>(), {12, 34, 56});
 }
 
+TEST(Encoding, ListAsArrayPtr) {
+  MallocMessageBuilder builder;
+  auto root = builder.initRoot<TestAllTypes>();
+
+  uint32_t values[] = {12, 34, 56, 78, 90};
+  auto list = root.initUInt32List(5);
+  list.setAll(values);
+  checkList(list.asReader(), {12u, 34u, 56u, 78u, 90u});
+
+  uint32_t copy[5];
+  list.asReader().copyTo(copy);
+  EXPECT_EQ(0, memcmp(values, copy, sizeof(values)));
+
+  auto floats = root.initFloat64List(3);
+  floats.setAll({1.5, -2.25, 1e100});
+  checkList(floats.asReader(), {1.5, -2.25, 1e100});
+
+#if CAPNP_NATIVE_DATA_ARRAYS
+  KJ_IF_MAYBE(array, list.asArrayPtr()) {
+    ASSERT_EQ(5u, array->size());
+    (*array)[2] = 123;
+  } else {
+    ADD_FAILURE() << "Expected a direct view of the list.";
+  }
+  EXPECT_EQ(123u, list[2]);
+
+  KJ_IF_MAYBE(array, root.asReader().getFloat64List().asArrayPtr()) {
+    ASSERT_EQ(3u, array->size());
+    EXPECT_EQ(-2.25, (*array)[1]);
+  } else {
+    ADD_FAILURE() << "Expected a direct view of the list.";
+  }
+#endif
+
+  // An empty list always has an (empty) array view.
+  EXPECT_TRUE(root.asReader().getInt16List().asArrayPtr() != nullptr);
+
+  // A list of structs read as a primitive list is not contiguous, so we have to copy.
+  MallocMessageBuilder builder2;
+  auto root2 = builder2.initRoot<test::TestAnyPointer>();
+  auto structs = root2.getAnyPointerField().initAs<List<test::TestLists::Struct32>>(3);
+  structs[0].setF(11);
+  structs[1].setF(22);
+  structs[2].setF(33);
+  auto upgraded = root2.asReader().getAnyPointerField().getAs<List<uint32_t>>();
+  EXPECT_TRUE(upgraded.asArrayPtr() == nullptr);
+  upgraded.copyTo(kj::arrayPtr(copy, 3));
+  EXPECT_EQ(11u, copy[0]);
+  EXPECT_EQ(22u, copy[1]);
+  EXPECT_EQ(33u, copy[2]);
+
+  auto upgradedBuilder = root2.getAnyPointerField().getAs<List<uint32_t>>();
+  EXPECT_TRUE(upgradedBuilder.asArrayPtr() == nullptr);
+  upgradedBuilder.setAll({44u, 55u, 66u});
+  EXPECT_EQ(55u, structs[1].getF());
+}
+
 TEST(Encoding, BitListDowngrade) {
   // NO LONGER SUPPORTED -- We check for exceptions thrown.
 
@@ -1901,6 +1958,223 @@ TEST(Encoding, UnionInGenerics) {
   builder.initUg();
 }
 
+void initSpecialized(test::TestSpecialized::Builder builder, uint depth) {
+  builder.setValue(depth);
+  builder.setText(kj::str("depth ", depth));
+  builder.getGroup().setInts({1, 2, 3});
+  if (depth == 0) {
+    builder.setB("leaf");
+    return;
+  }
+
+  initTestMessage(builder.initAllTypes());
+  initSpecialized(builder.initChild(), depth - 1);
+  initSpecialized(builder.initA(), depth - 1);
+  auto children = builder.initChildren(3);
+  for (auto child: children) {
+    initSpecialized(child, depth - 1);
+  }
+}
+
+void expectSameSegments(MessageBuilder& a, MessageBuilder& b) {
+  auto segmentsA = a.getSegmentsForOutput();
+  auto segmentsB = b.getSegmentsForOutput();
+  ASSERT_EQ(segmentsA.size(), segmentsB.size());
+  for (uint i = 0; i < segmentsA.size(); i++) {
+    EXPECT_TRUE(segmentsA[i].asBytes() == segmentsB[i].asBytes());
+  }
+}
+
+TEST(Encoding, Specialized) {
+  MallocMessageBuilder builder;
+  initSpecialized(builder.initRoot<test::TestSpecialized>(), 2);
+  auto reader = builder.getRoot<test::TestSpecialized>().asReader();
+
+  // The generated code must produce exactly the same result as the generic code.
+  MallocMessageBuilder generic;
+  generic.setRoot(builder.getRoot<AnyPointer>().asReader());
+  MallocMessageBuilder specialized;
+  specialized.setRoot(reader);
+  expectSameSegments(generic, specialized);
+
+  MallocMessageBuilder nested;
+  nested.initRoot<test::TestSpecialized>().setChild(reader);
+  EXPECT_EQ(2u, nested.getRoot<test::TestSpecialized>().getChild().getValue());
+  checkTestMessage(nested.getRoot<test::TestSpecialized>().getChild().getAllTypes());
+
+  auto size = reader.totalSize();
+  EXPECT_EQ(builder.getRoot<AnyPointer>().asReader().targetSize().wordCount, size.wordCount);
+  EXPECT_EQ(0u, size.capCount);
+
+  reader.validate();
+}
+
+TEST(Encoding, SpecializedOtherVersion) {
+  // A struct written with a different version of the schema is handled by the generic code.
+  MallocMessageBuilder builder;
+  auto root = builder.initRoot<AnyPointer>().initAsAnyStruct(2, 10);
+  root.getDataSection()[0] = 123;
+  root.getPointerSection()[1].setAs<Text>("foo");
+  root.getPointerSection()[9].setAs<Text>("unknown");
+  auto reader = builder.getRoot<test::TestSpecialized>().asReader();
+
+  MallocMessageBuilder generic;
+  generic.setRoot(builder.getRoot<AnyPointer>().asReader());
+  MallocMessageBuilder specialized;
+  specialized.setRoot(reader);
+  expectSameSegments(generic, specialized);
+
+  EXPECT_EQ(builder.getRoot<AnyPointer>().asReader().targetSize().wordCount,
+            reader.totalSize().wordCount);
+  reader.validate();
+}
+
+TEST(Encoding, SpecializedValidate) {
+  MallocMessageBuilder builder;
+  initSpecialized(builder.initRoot<test::TestSpecialized>(), 1);
+
+  // Put a list where a struct is expected.  Generic code can't tell, but specialized code can.
+  builder.getRoot<AnyStruct>().getPointerSection()[2].initAs<List<uint32_t>>(2);
+  auto reader = builder.getRoot<test::TestSpecialized>().asReader();
+  builder.getRoot<AnyPointer>().asReader().targetSize();
+  EXPECT_ANY_THROW(reader.validate());
+}
+
+TEST(Encoding, SpecializedUnionAddedMember) {
+  // A newer version of the schema put a Text where this version only knows a struct.  The layout
+  // is the same, but the pointer must still be handled generically.
+  MallocMessageBuilder builder;
+  auto root = builder.initRoot<test::TestSpecializedUnionV2>();
+  root.initChild().setText("foo");
+  auto reader = builder.getRoot<test::TestSpecializedUnion>().asReader();
+  ASSERT_TRUE(reader.isChild());
+
+  MallocMessageBuilder copy;
+  copy.setRoot(reader);
+  EXPECT_EQ("foo", copy.getRoot<test::TestSpecializedUnionV2>().getChild().getText());
+
+  EXPECT_EQ(builder.getRoot<AnyPointer>().asReader().targetSize().wordCount,
+            reader.totalSize().wordCount);
+  reader.validate();
+}
+
+void initNative(test::TestNative::Builder builder, uint depth) {
+  builder.setInt32Field(-123);
+  builder.setUint64Field(456);
+  builder.setBoolField(false);
+  builder.setFloat64Field(-0.25);
+  builder.setEnumField(test::TestEnum::GARPLY);
+  builder.setTextField("foo");
+  builder.setDataField(data("bar"));
+  builder.setInt16List({1, -2, 3});
+  builder.setBoolList({true, false, false, true, true});
+  builder.setTextList({"a", "bc", ""});
+  builder.getGroup().setInner(12);
+  builder.getGroup().setLabel("label");
+  if (depth > 0) {
+    builder.setName("name");
+    initNative(builder.initStructField(), depth - 1);
+    auto list = builder.initStructList(2);
+    initNative(list[0], depth - 1);
+    list[1].setCount(9);
+  } else {
+    builder.setCount(3);
+  }
+}
+
+TEST(Encoding, NativeDefaults) {
+  test::TestNative::Native native;
+  EXPECT_EQ(test::TestNative::NONE, native.which);
+  EXPECT_EQ(0, native.int32Field);
+  EXPECT_EQ(12345678901234567ull, native.uint64Field);
+  EXPECT_TRUE(native.boolField);
+  EXPECT_EQ(1.5, native.float64Field);
+  EXPECT_EQ(test::TestEnum::BAR, native.enumField);
+  EXPECT_EQ(7u, native.count);
+  EXPECT_EQ(-3, native.group.inner);
+  EXPECT_TRUE(native.structField == nullptr);
+
+  // A default-valued reader converts to the same thing.
+  MallocMessageBuilder builder;
+  auto fromReader = toNative(builder.initRoot<test::TestNative>().asReader());
+  EXPECT_EQ(test::TestNative::NONE, fromReader.which);
+  EXPECT_EQ(12345678901234567ull, fromReader.uint64Field);
+  EXPECT_TRUE(fromReader.boolField);
+  EXPECT_EQ(1.5, fromReader.float64Field);
+  EXPECT_EQ(test::TestEnum::BAR, fromReader.enumField);
+  EXPECT_EQ(-3, fromReader.group.inner);
+  EXPECT_EQ(0u, fromReader.textField.size());
+  EXPECT_EQ(0u, fromReader.structList.size());
+}
+
+TEST(Encoding, NativeRoundTrip) {
+  MallocMessageBuilder builder;
+  initNative(builder.initRoot<test::TestNative>(), 2);
+  builder.getRoot<test::TestNative>().initAllTypes().setInt32Field(5);  // not mirrored
+  auto reader = builder.getRoot<test::TestNative>().asReader();
+
+  auto native = toNative(reader);
+  EXPECT_EQ(-123, native.int32Field);
+  EXPECT_EQ(456u, native.uint64Field);
+  EXPECT_FALSE(native.boolField);
+  EXPECT_EQ(-0.25, native.float64Field);
+  EXPECT_EQ(test::TestEnum::GARPLY, native.enumField);
+  EXPECT_EQ("foo", native.textField);
+  EXPECT_EQ(data("bar"), Data::Reader(native.dataField));
+  ASSERT_EQ(3u, native.int16List.size());
+  EXPECT_EQ(-2, native.int16List[1]);
+  ASSERT_EQ(5u, native.boolList.size());
+  EXPECT_TRUE(native.boolList[4]);
+  ASSERT_EQ(3u, native.textList.size());
+  EXPECT_EQ("bc", native.textList[1]);
+  EXPECT_EQ(test::TestNative::NAME, native.which);
+  EXPECT_EQ("name", native.name);
+  EXPECT_EQ(12, native.group.inner);
+  EXPECT_EQ("label", native.group.label);
+  auto& child = *KJ_ASSERT_NONNULL(native.structField);
+  EXPECT_EQ(test::TestNative::NAME, child.which);
+  auto& grandchild = *KJ_ASSERT_NONNULL(child.structField);
+  EXPECT_EQ(test::TestNative::COUNT, grandchild.which);
+  EXPECT_EQ(3u, grandchild.count);
+  EXPECT_TRUE(grandchild.structField == nullptr);
+  ASSERT_EQ(2u, native.structList.size());
+  EXPECT_EQ("foo", native.structList[0].textField);
+  EXPECT_EQ(test::TestNative::COUNT, native.structList[1].which);
+  EXPECT_EQ(9u, native.structList[1].count);
+
+  MallocMessageBuilder builder2;
+  fromNative(builder2.initRoot<test::TestNative>(), native);
+  auto reader2 = builder2.getRoot<test::TestNative>().asReader();
+
+  // Everything but the unmirrored field survives.
+  EXPECT_FALSE(reader2.hasAllTypes());
+  builder.getRoot<test::TestNative>().disownAllTypes();
+  EXPECT_EQ(kj::str(reader), kj::str(reader2));
+
+  // Bulk conversion of a whole list.
+  MallocMessageBuilder builder3;
+  auto list = builder3.initRoot<test::TestNative>().initStructList(native.structList.size());
+  fromNative(list, native.structList);
+  for (uint i = 0; i < list.size(); i++) {
+    EXPECT_EQ(kj::str(reader.getStructList()[i]), kj::str(list[i].asReader()));
+  }
+}
+
+TEST(Encoding, NativeShortDataSection) {
+  // A message from an older version with a one-word data section.
+  MallocMessageBuilder builder;
+  auto root = builder.getRoot<AnyPointer>().initAsAnyStruct(1, 0);
+  root.getDataSection()[0] = 5;
+
+  auto native = toNative(builder.getRoot<test::TestNative>().asReader());
+  EXPECT_EQ(5, native.int32Field);
+  EXPECT_EQ(12345678901234567ull, native.uint64Field);
+  EXPECT_TRUE(native.boolField);
+  EXPECT_EQ(test::TestEnum::BAR, native.enumField);
+  EXPECT_EQ(test::TestNative::NONE, native.which);
+  EXPECT_EQ(-3, native.group.inner);
+}
+
 }  // namespace
 }  // namespace _ (private)
 }  // namespace capnp
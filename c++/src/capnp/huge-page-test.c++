@@ -0,0 +1,113 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "huge-page.h"
+#include <kj/compat/gtest.h>
+#include "test-util.h"
+
+namespace capnp {
+namespace _ {  // private
+namespace {
+
+bool isAllZero(kj::ArrayPtr<const word> words) {
+  for (auto& w: words) {
+    if (*reinterpret_cast<const uint64_t*>(&w) != 0) return false;
+  }
+  return true;
+}
+
+TEST(HugePage, Allocate) {
+  HugePageSegmentPool pool;
+
+  auto segment = pool.allocate(1);
+  EXPECT_EQ(HUGE_PAGE_WORDS, segment.size());
+  EXPECT_EQ(0u, reinterpret_cast<uintptr_t>(segment.begin()) % (HUGE_PAGE_WORDS * sizeof(word)));
+  EXPECT_TRUE(isAllZero(segment));
+
+  auto big = pool.allocate(HUGE_PAGE_WORDS + 1);
+  EXPECT_EQ(2 * HUGE_PAGE_WORDS, big.size());
+
+  pool.release(segment, 0);
+  pool.release(big, 0);
+  EXPECT_EQ(3 * HUGE_PAGE_WORDS, pool.getRetainedWords());
+}
+
+TEST(HugePage, Builder) {
+  HugePageSegmentPool pool;
+  const word* firstSegment;
+
+  {
+    HugePageMessageBuilder builder(pool);
+    initTestMessage(builder.initRoot<TestAllTypes>());
+    checkTestMessage(builder.getRoot<TestAllTypes>().asReader());
+
+    auto segments = builder.getSegmentsForOutput();
+    ASSERT_EQ(1u, segments.size());
+    firstSegment = segments[0].begin();
+  }
+
+  EXPECT_EQ(HUGE_PAGE_WORDS, pool.getRetainedWords());
+
+  {
+    // The next message gets the same (re-zeroed) segment.
+    HugePageMessageBuilder builder(pool);
+    auto segment = builder.allocateSegment(1);
+    EXPECT_EQ(firstSegment, segment.begin());
+    EXPECT_TRUE(isAllZero(segment));
+    EXPECT_EQ(0u, pool.getRetainedWords());
+
+    // Grow past one segment.
+    builder.initRoot<TestAllTypes>().initDataField(HUGE_PAGE_WORDS * sizeof(word));
+    EXPECT_EQ(2u, builder.getSegmentsForOutput().size());
+  }
+
+  {
+    HugePageMessageBuilder builder(pool);
+    initTestMessage(builder.initRoot<TestAllTypes>());
+    checkTestMessage(builder.getRoot<TestAllTypes>().asReader());
+  }
+}
+
+TEST(HugePage, RetentionLimit) {
+  HugePageOptions options;
+  options.maxRetainedWords = HUGE_PAGE_WORDS;
+  options.bindToLocalNode = true;
+  HugePageSegmentPool pool(options);
+
+  {
+    HugePageMessageBuilder builder(pool);
+    initTestMessage(builder.initRoot<TestAllTypes>());
+    builder.getRoot<TestAllTypes>().initDataField(HUGE_PAGE_WORDS * sizeof(word));
+  }
+
+  // Only one of the two segments was kept.
+  EXPECT_EQ(HUGE_PAGE_WORDS, pool.getRetainedWords());
+
+  {
+    HugePageMessageBuilder builder(pool);
+    initTestMessage(builder.initRoot<TestAllTypes>());
+    checkTestMessage(builder.getRoot<TestAllTypes>().asReader());
+  }
+}
+
+}  // namespace
+}  // namespace _ (private)
+}  // namespace capnp
@@ -0,0 +1,256 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "huge-page.h"
+#include <kj/debug.h>
+#include <string.h>
+#include <errno.h>
+#include <map>
+
+#if _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+#if __linux__
+#include <sys/syscall.h>
+#endif
+
+namespace capnp {
+
+namespace {
+
+constexpr size_t HUGE_PAGE_BYTES = HUGE_PAGE_WORDS * sizeof(word);
+
+int getCurrentNode() {
+  // Returns the NUMA node of the CPU this thread is running on, or -1 if unknown.
+#if __linux__ && defined(SYS_getcpu)
+  unsigned cpu, node;
+  if (syscall(SYS_getcpu, &cpu, &node, nullptr) == 0) {
+    return node;
+  }
+#endif
+  return -1;
+}
+
+void preferNode(void* memory, size_t bytes, int node) {
+  // Set the NUMA policy of the (not yet faulted-in) range to prefer the given node.  We call
+  // mbind() directly rather than linking libnuma.  Failure (e.g. a kernel without NUMA support) is
+  // harmless, so it's ignored.
+#if __linux__ && defined(SYS_mbind)
+  if (node < 0 || node >= int(sizeof(unsigned long) * 8)) return;
+  constexpr int MPOL_PREFERRED = 1;
+  unsigned long mask = 1ul << node;
+  syscall(SYS_mbind, memory, bytes, MPOL_PREFERRED, &mask, sizeof(mask) * 8 + 1, 0);
+#endif
+}
+
+}  // namespace
+
+struct HugePageSegmentPool::State {
+  struct FreeSegment {
+    kj::ArrayPtr<word> segment;
+    int node;
+    // NUMA node the segment was allocated on, or -1 if unknown or not bound.
+  };
+
+  kj::Vector<FreeSegment> free;
+  size_t retainedWords = 0;
+
+  std::map<const word*, int> nodes;
+  // NUMA node of each segment currently handed out.  Only maintained if bindToLocalNode is set.
+};
+
+HugePageSegmentPool::HugePageSegmentPool(HugePageOptions options)
+    : options(options), state(kj::heap<kj::MutexGuarded<State>>()) {}
+
+HugePageSegmentPool::~HugePageSegmentPool() noexcept(false) {
+  auto lock = state->lockExclusive();
+  for (auto& free: lock->free) {
+    unmapSegment(free.segment);
+  }
+}
+
+kj::ArrayPtr<word> HugePageSegmentPool::allocate(uint minimumWords) {
+  size_t words = kj::max<size_t>(minimumWords, 1);
+  words = (words + HUGE_PAGE_WORDS - 1) / HUGE_PAGE_WORDS * HUGE_PAGE_WORDS;
+  int node = options.bindToLocalNode ? getCurrentNode() : -1;
+
+  {
+    // Reuse the smallest retained segment that is big enough.
+    auto lock = state->lockExclusive();
+    State::FreeSegment* best = nullptr;
+    for (auto& free: lock->free) {
+      if (free.segment.size() >= words && free.node == node &&
+          (best == nullptr || free.segment.size() < best->segment.size())) {
+        best = &free;
+      }
+    }
+
+    if (best != nullptr) {
+      auto result = best->segment;
+      lock->retainedWords -= result.size();
+      *best = lock->free.back();
+      lock->free.removeLast();
+      if (options.bindToLocalNode) lock->nodes[result.begin()] = node;
+      return result;
+    }
+  }
+
+  auto result = mapSegment(words, node);
+  if (options.bindToLocalNode) state->lockExclusive()->nodes[result.begin()] = node;
+  return result;
+}
+
+void HugePageSegmentPool::release(kj::ArrayPtr<word> segment, size_t usedWords) {
+  int node = -1;
+  {
+    // Reserve room first, so that we don't zero the segment only to unmap it.
+    auto lock = state->lockExclusive();
+    if (options.bindToLocalNode) {
+      auto iter = lock->nodes.find(segment.begin());
+      KJ_REQUIRE(iter != lock->nodes.end(), "Segment was not allocated from this pool.");
+      node = iter->second;
+      lock->nodes.erase(iter);
+    }
+    if (lock->retainedWords + segment.size() > options.maxRetainedWords) {
+      lock.release();
+      unmapSegment(segment);
+      return;
+    }
+    lock->retainedWords += segment.size();
+  }
+
+  // Zero outside the lock since this may be a lot of memory.
+  memset(segment.begin(), 0, kj::min(usedWords, segment.size()) * sizeof(word));
+
+  state->lockExclusive()->free.add(State::FreeSegment { segment, node });
+}
+
+size_t HugePageSegmentPool::getRetainedWords() {
+  return state->lockShared()->retainedWords;
+}
+
+kj::ArrayPtr<word> HugePageSegmentPool::mapSegment(size_t words, int node) {
+  size_t bytes = words * sizeof(word);
+
+#if _WIN32
+  // Large pages on Windows require a privilege that processes normally don't have, so we just
+  // allocate ordinary (zeroed) pages.
+  void* memory = VirtualAlloc(nullptr, bytes, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+  if (memory == nullptr) {
+    KJ_FAIL_WIN32("VirtualAlloc", GetLastError(), bytes);
+  }
+  return kj::arrayPtr(reinterpret_cast<word*>(memory), words);
+#else
+#ifdef MAP_HUGETLB
+  if (options.useHugeTlb) {
+    void* memory = mmap(nullptr, bytes, PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (memory != MAP_FAILED) {
+      preferNode(memory, bytes, node);
+      return kj::arrayPtr(reinterpret_cast<word*>(memory), words);
+    }
+    // Probably no huge pages reserved.  Fall back to transparent huge pages.
+  }
+#endif
+
+  // Transparent huge pages are only used for 2MB-aligned ranges, so over-allocate and trim.
+  size_t paddedBytes = bytes + HUGE_PAGE_BYTES;
+  void* mapping = mmap(nullptr, paddedBytes, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapping == MAP_FAILED) {
+    KJ_FAIL_SYSCALL("mmap", errno, bytes);
+  }
+
+  byte* start = reinterpret_cast<byte*>(mapping);
+  byte* aligned = reinterpret_cast<byte*>(
+      (reinterpret_cast<uintptr_t>(start) + HUGE_PAGE_BYTES - 1) & ~(HUGE_PAGE_BYTES - 1));
+  if (aligned > start) {
+    munmap(start, aligned - start);
+  }
+  byte* end = start + paddedBytes;
+  if (end > aligned + bytes) {
+    munmap(aligned + bytes, end - (aligned + bytes));
+  }
+
+#ifdef MADV_HUGEPAGE
+  // Fails if transparent huge pages are disabled, in which case we get ordinary pages.
+  madvise(aligned, bytes, MADV_HUGEPAGE);
+#endif
+  preferNode(aligned, bytes, node);
+
+  return kj::arrayPtr(reinterpret_cast<word*>(aligned), words);
+#endif
+}
+
+void HugePageSegmentPool::unmapSegment(kj::ArrayPtr<word> segment) {
+#if _WIN32
+  KJ_ASSERT(VirtualFree(segment.begin(), 0, MEM_RELEASE));
+#else
+  munmap(segment.begin(), segment.size() * sizeof(word));
+#endif
+}
+
+// -------------------------------------------------------------------
+
+HugePageMessageBuilder::HugePageMessageBuilder(
+    HugePageSegmentPool& pool, uint firstSegmentWords, AllocationStrategy allocationStrategy)
+    : pool(pool), nextSize(firstSegmentWords), allocationStrategy(allocationStrategy) {}
+
+HugePageMessageBuilder::~HugePageMessageBuilder() noexcept(false) {
+  // Figure out how much of each segment was used, so that the pool only needs to zero that much.
+  // Segments that no longer appear in the output were already zeroed by compact().
+  auto output = getSegmentsForOutput();
+  auto used = kj::heapArray<size_t>(segments.size());
+  for (uint i = 0; i < segments.size(); i++) {
+    used[i] = 0;
+    for (auto& segment: output) {
+      if (segment.begin() == segments[i].begin()) {
+        used[i] = segment.size();
+        break;
+      }
+    }
+  }
+
+  // The arena must go away before the memory backing it.
+  discardArena();
+
+  for (uint i = 0; i < segments.size(); i++) {
+    pool.release(segments[i], used[i]);
+  }
+}
+
+kj::ArrayPtr<word> HugePageMessageBuilder::allocateSegment(uint minimumSize) {
+  auto segment = pool.allocate(kj::max(minimumSize, nextSize));
+  segments.add(segment);
+
+  if (allocationStrategy == AllocationStrategy::GROW_HEURISTICALLY) {
+    // As with MallocMessageBuilder, we want nextSize to equal the total size allocated so far.
+    nextSize = segments.size() == 1 ? segment.size() : nextSize + segment.size();
+  }
+
+  return segment;
+}
+
+}  // namespace capnp
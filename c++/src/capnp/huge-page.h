@@ -0,0 +1,123 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef CAPNP_HUGE_PAGE_H_
+#define CAPNP_HUGE_PAGE_H_
+
+#if defined(__GNUC__) && !defined(CAPNP_HEADER_WARNINGS)
+#pragma GCC system_header
+#endif
+
+#include "message.h"
+#include <kj/mutex.h>
+#include <kj/vector.h>
+
+namespace capnp {
+
+constexpr uint HUGE_PAGE_WORDS = (2u << 20) / sizeof(word);
+// Words in a 2MB huge page.  HugePageSegmentPool hands out segments in multiples of this size.
+
+struct HugePageOptions {
+  bool useHugeTlb = false;
+  // Try to allocate from the kernel's reserved huge page pool first (Linux `MAP_HUGETLB`).  This
+  // only works if the administrator has reserved huge pages (see `vm.nr_hugepages`).  Otherwise,
+  // and by default, segments are allocated as ordinary 2MB-aligned memory and the kernel is asked
+  // to back them with transparent huge pages (`MADV_HUGEPAGE`).
+
+  bool bindToLocalNode = false;
+  // Ask the kernel to place each new segment's memory on the NUMA node of the thread allocating
+  // it.  Recycled segments are only handed out again to threads on that same node.  This is a
+  // preference rather than a hard binding:  if the node runs out of memory, the kernel falls back
+  // to other nodes.
+
+  size_t maxRetainedWords = 64 * HUGE_PAGE_WORDS;
+  // Maximum total size of released segments kept around for reuse.  Segments released beyond
+  // this are unmapped.
+};
+
+class HugePageSegmentPool {
+  // Allocates message segments from huge pages and recycles them between messages.  On systems
+  // where huge pages aren't available, this still works, but just hands out ordinary memory.
+  //
+  // Large messages built in ordinary calloc()ed memory use 4K pages, so building or scanning a
+  // multi-gigabyte message takes a TLB miss every 4K.  With 2MB pages, this drops drastically.
+  // Since mapping and faulting in fresh huge pages is expensive, released segments are kept and
+  // handed out again; only the words that were actually used are re-zeroed.
+  //
+  // The pool is thread-safe, so builders in different threads may share one pool.  It must
+  // outlive all builders using it.
+
+public:
+  explicit HugePageSegmentPool(HugePageOptions options = HugePageOptions());
+  KJ_DISALLOW_COPY(HugePageSegmentPool);
+  ~HugePageSegmentPool() noexcept(false);
+
+  kj::ArrayPtr<word> allocate(uint minimumWords);
+  // Get a zeroed segment of at least `minimumWords` words, rounded up to a multiple of
+  // HUGE_PAGE_WORDS.  The segment is aligned to HUGE_PAGE_WORDS.
+
+  void release(kj::ArrayPtr<word> segment, size_t usedWords);
+  // Return a segment obtained from allocate().  Only the first `usedWords` words may be nonzero.
+
+  size_t getRetainedWords();
+  // Total size of released segments currently held for reuse, in words.
+
+private:
+  struct State;
+
+  HugePageOptions options;
+  kj::Own<kj::MutexGuarded<State>> state;
+  // Kept out of line so that this header needn't include the STL.
+
+  kj::ArrayPtr<word> mapSegment(size_t words, int node);
+  static void unmapSegment(kj::ArrayPtr<word> segment);
+};
+
+class HugePageMessageBuilder final: public MessageBuilder {
+  // A MessageBuilder which allocates its segments from a HugePageSegmentPool and returns them to
+  // the pool when destroyed.  Since segments are at least 2MB, this is meant for large messages;
+  // for lots of small ones, use MessageBuilderPool instead.
+
+public:
+  explicit HugePageMessageBuilder(HugePageSegmentPool& pool,
+      uint firstSegmentWords = HUGE_PAGE_WORDS,
+      AllocationStrategy allocationStrategy = SUGGESTED_ALLOCATION_STRATEGY);
+  // `firstSegmentWords` and `allocationStrategy` have the same meaning as for
+  // MallocMessageBuilder, except that every segment is rounded up to a multiple of
+  // HUGE_PAGE_WORDS.
+
+  KJ_DISALLOW_COPY(HugePageMessageBuilder);
+  ~HugePageMessageBuilder() noexcept(false);
+
+  kj::ArrayPtr<word> allocateSegment(uint minimumSize) override;
+
+private:
+  HugePageSegmentPool& pool;
+  uint nextSize;
+  AllocationStrategy allocationStrategy;
+
+  kj::Vector<kj::ArrayPtr<word>> segments;
+  // Segments taken from the pool, in the order they were handed out to the arena.
+};
+
+}  // namespace capnp
+
+#endif  // CAPNP_HUGE_PAGE_H_
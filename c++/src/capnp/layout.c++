@@ -22,6 +22,7 @@
 #define CAPNP_PRIVATE
 #include "layout.h"
 #include <kj/debug.h>
+#include <kj/thread.h>
 #include "arena.h"
 #include <string.h>
 #include <stdlib.h>
@@ -617,11 +618,36 @@ struct WireHelpers {
 
   // -----------------------------------------------------------------
 
+  struct ParallelLists {
+    // Big lists found while computing a size with several threads.  Their elements are sized at
+    // the end, all in one go, by sizeListsInParallel(), so that the helper threads are started
+    // only once however many such lists there are.
+
+    struct List {
+      SegmentReader* segment;
+      const word* elements;
+      WordCount dataSize;
+      WirePointerCount pointerCount;
+      uint count;
+      int nestingLimit;
+      uint firstChunk;
+    };
+
+    uint threadCount;
+    kj::Vector<List> lists;
+    uint chunkCount = 0;
+
+    explicit ParallelLists(uint threadCount): threadCount(threadCount) {}
+  };
+
   static MessageSizeCounts totalSize(
-      SegmentReader* segment, const WirePointer* ref, int nestingLimit) {
-    // Compute the total size of the object pointed to, not counting far pointer overhead.
+      SegmentReader* segment, const WirePointer* ref, int nestingLimit,
+      ParallelLists* parallel = nullptr) {
+    // Compute the total size of the object pointed to, not counting far pointer overhead.  With
+    // `parallel` non-null, the elements of big lists reachable through structs alone are not
+    // counted yet, but left for sizeListsInParallel(); see totalSizeOfElements().
 
-    MessageSizeCounts result = { 0 * WORDS, 0 };
+    MessageSizeCounts result = { 0 * WORDS, 0, 0 * WORDS };
 
     if (ref->isNull()) {
       return result;
@@ -632,6 +658,10 @@ struct WireHelpers {
     }
     --nestingLimit;
 
+    if (ref->kind() == WirePointer::FAR) {
+      result.farPointerWords += (ref->isDoubleFar() ? 2 : 1) * POINTER_SIZE_IN_WORDS;
+    }
+
     const word* ptr = followFars(ref, ref->target(), segment);
 
     switch (ref->kind()) {
@@ -646,7 +676,7 @@ struct WireHelpers {
             reinterpret_cast<const WirePointer*>(ptr + ref->structRef.dataSize.get());
         uint count = ref->structRef.ptrCount.get() / POINTERS;
         for (uint i = 0; i < count; i++) {
-          result += totalSize(segment, pointerSection + i, nestingLimit);
+          result += totalSize(segment, pointerSection + i, nestingLimit, parallel);
         }
         break;
       }
@@ -680,10 +710,8 @@ struct WireHelpers {
 
             result.wordCount += count * WORDS_PER_POINTER;
 
-            for (uint i = 0; i < count / POINTERS; i++) {
-              result += totalSize(segment, reinterpret_cast<const WirePointer*>(ptr) + i,
-                                  nestingLimit);
-            }
+            result += totalSizeOfElements(segment, ptr, 0 * WORDS, 1 * POINTERS,
+                                          count / POINTERS, nestingLimit, parallel);
             break;
           }
           case ElementSize::INLINE_COMPOSITE: {
@@ -715,16 +743,9 @@ struct WireHelpers {
             WirePointerCount pointerCount = elementTag->structRef.ptrCount.get();
 
             if (pointerCount > 0 * POINTERS) {
-              const word* pos = ptr + POINTER_SIZE_IN_WORDS;
-              for (uint i = 0; i < count / ELEMENTS; i++) {
-                pos += dataSize;
-
-                for (uint j = 0; j < pointerCount / POINTERS; j++) {
-                  result += totalSize(segment, reinterpret_cast<const WirePointer*>(pos),
-                                      nestingLimit);
-                  pos += POINTER_SIZE_IN_WORDS;
-                }
-              }
+              result += totalSizeOfElements(segment, ptr + POINTER_SIZE_IN_WORDS, dataSize,
+                                            pointerCount, count / ELEMENTS, nestingLimit,
+                                            parallel);
             }
             break;
           }
@@ -748,6 +769,110 @@ struct WireHelpers {
     return result;
   }
 
+  static MessageSizeCounts totalSizeOfElements(
+      SegmentReader* segment, const word* elements, WordCount dataSize,
+      WirePointerCount pointerCount, uint begin, uint end, int nestingLimit) {
+    // Sum totalSize() over the pointers of elements [begin, end) of a list whose elements each
+    // consist of `dataSize` words of data followed by `pointerCount` pointers.  The list must
+    // already have been bounds-checked.
+
+    MessageSizeCounts result = { 0 * WORDS, 0, 0 * WORDS };
+    WordCount step = dataSize + pointerCount * WORDS_PER_POINTER;
+    const word* pos = elements + begin * step;
+    for (uint i = begin; i < end; i++) {
+      pos += dataSize;
+      for (uint j = 0; j < pointerCount / POINTERS; j++) {
+        result += totalSize(segment, reinterpret_cast<const WirePointer*>(pos), nestingLimit);
+        pos += POINTER_SIZE_IN_WORDS;
+      }
+    }
+    return result;
+  }
+
+  static constexpr uint PARALLEL_CHUNK_ELEMENTS = 1024;
+  // Elements handed to a thread at a time when sizing lists in parallel.  Threads take chunks
+  // from a shared counter, so that elements with large subtrees don't leave other threads idle.
+
+  static MessageSizeCounts totalSizeOfElements(
+      SegmentReader* segment, const word* elements, WordCount dataSize,
+      WirePointerCount pointerCount, uint count, int nestingLimit, ParallelLists* parallel) {
+    // Sum totalSize() over the pointers of all elements, or, if `parallel` is non-null and the
+    // list is big enough to be worth splitting, set the list aside for sizeListsInParallel() and
+    // return zero for now.  Elements' own lists are always sized sequentially.
+
+    if (parallel == nullptr || count < 2 * PARALLEL_CHUNK_ELEMENTS) {
+      return totalSizeOfElements(segment, elements, dataSize, pointerCount, 0, count,
+                                 nestingLimit);
+    }
+
+    parallel->lists.add(ParallelLists::List {
+        segment, elements, dataSize, pointerCount, count, nestingLimit, parallel->chunkCount });
+    parallel->chunkCount += (count + PARALLEL_CHUNK_ELEMENTS - 1) / PARALLEL_CHUNK_ELEMENTS;
+    return MessageSizeCounts { 0 * WORDS, 0, 0 * WORDS };
+  }
+
+  static MessageSizeCounts sizeListsInParallel(ParallelLists& parallel) {
+    // Size the elements of every list set aside by totalSizeOfElements(), using up to
+    // `parallel.threadCount` threads, including the calling one.
+
+    uint chunkCount = parallel.chunkCount;
+    if (chunkCount == 0) {
+      return MessageSizeCounts { 0 * WORDS, 0, 0 * WORDS };
+    }
+
+    uint threadCount = kj::min(parallel.threadCount, chunkCount);
+    uint nextChunk = 0;
+    bool failed = false;
+    auto partials = kj::heapArray<MessageSizeCounts>(threadCount);
+    auto errors = kj::heapArray<kj::Maybe<kj::Exception>>(threadCount);
+    auto lists = parallel.lists.asPtr();
+
+    auto work = [&](uint index) {
+      // Runs in each thread, including the calling one.  Exceptions are caught and passed back to
+      // the calling thread so that its ExceptionCallback decides what happens; meanwhile, the
+      // other threads stop early.
+      partials[index] = { 0 * WORDS, 0, 0 * WORDS };
+      errors[index] = kj::runCatchingExceptions([&]() {
+        uint listIndex = 0;
+        while (!__atomic_load_n(&failed, __ATOMIC_RELAXED)) {
+          uint chunk = __atomic_fetch_add(&nextChunk, 1, __ATOMIC_RELAXED);
+          if (chunk >= chunkCount) break;
+
+          // Chunks are taken in increasing order, so the list only ever moves forward.
+          while (listIndex + 1 < lists.size() && lists[listIndex + 1].firstChunk <= chunk) {
+            ++listIndex;
+          }
+          auto& list = lists[listIndex];
+          uint begin = (chunk - list.firstChunk) * PARALLEL_CHUNK_ELEMENTS;
+          uint end = kj::min(begin + PARALLEL_CHUNK_ELEMENTS, list.count);
+          partials[index] += totalSizeOfElements(
+              list.segment, list.elements, list.dataSize, list.pointerCount, begin, end,
+              list.nestingLimit);
+        }
+      });
+      if (errors[index] != nullptr) {
+        __atomic_store_n(&failed, true, __ATOMIC_RELAXED);
+      }
+    };
+
+    {
+      kj::Vector<kj::Own<kj::Thread>> threads(threadCount - 1);
+      for (uint i = 1; i < threadCount; i++) {
+        threads.add(kj::heap<kj::Thread>([&work,i]() { work(i); }));
+      }
+      work(0);
+    }
+
+    MessageSizeCounts result = { 0 * WORDS, 0, 0 * WORDS };
+    for (uint i = 0; i < threadCount; i++) {
+      KJ_IF_MAYBE(exception, errors[i]) {
+        kj::throwRecoverableException(kj::mv(*exception));
+      }
+      result += partials[i];
+    }
+    return result;
+  }
+
   // -----------------------------------------------------------------
   // Copy from an unchecked message.
 
@@ -2532,9 +2657,17 @@ const word* PointerReader::getUnchecked() const {
   return reinterpret_cast<const word*>(pointer);
 }
 
-MessageSizeCounts PointerReader::targetSize() const {
-  return pointer == nullptr ? MessageSizeCounts { 0 * WORDS, 0 }
-                            : WireHelpers::totalSize(segment, pointer, nestingLimit);
+MessageSizeCounts PointerReader::targetSize(uint threadCount) const {
+  if (pointer == nullptr) {
+    return MessageSizeCounts { 0 * WORDS, 0, 0 * WORDS };
+  } else if (threadCount <= 1) {
+    return WireHelpers::totalSize(segment, pointer, nestingLimit);
+  } else {
+    WireHelpers::ParallelLists parallel(threadCount);
+    MessageSizeCounts result = WireHelpers::totalSize(segment, pointer, nestingLimit, &parallel);
+    result += WireHelpers::sizeListsInParallel(parallel);
+    return result;
+  }
 }
 
 PointerType PointerReader::getPointerType() const {
@@ -2723,21 +2856,46 @@ StructBuilder StructBuilder::imbue(CapTableBuilder* capTable) {
 
 MessageSizeCounts StructReader::totalSize() const {
   MessageSizeCounts result = {
-    WireHelpers::roundBitsUpToWords(dataSize) + pointerCount * WORDS_PER_POINTER, 0 };
+    WireHelpers::roundBitsUpToWords(dataSize) + pointerCount * WORDS_PER_POINTER, 0, 0 * WORDS };
 
   for (uint i = 0; i < pointerCount / POINTERS; i++) {
     result += WireHelpers::totalSize(segment, pointers + i, nestingLimit);
   }
 
-  if (segment != nullptr) {
-    // This traversal should not count against the read limit, because it's highly likely that
-    // the caller is going to traverse the object again, e.g. to copy it.
-    segment->unread(result.wordCount);
+  // This traversal should not count against the read limit, because it's highly likely that
+  // the caller is going to traverse the object again, e.g. to copy it.
+  unread(result.wordCount);
+
+  return result;
+}
+
+StructReader StructReader::padDataSection(kj::ArrayPtr<word> scratch) const {
+  if (dataSize >= scratch.size() * WORDS * BITS_PER_WORD) {
+    return *this;
+  }
+
+  memset(scratch.begin(), 0, scratch.asBytes().size());
+  if (dataSize == 1 * BITS) {
+    // A struct list element upgraded from a bool list.
+    if (getDataField<bool>(0 * ELEMENTS)) {
+      *reinterpret_cast<byte*>(scratch.begin()) = 1;
+    }
+  } else {
+    memcpy(scratch.begin(), data, dataSize / BITS_PER_BYTE / BYTES);
   }
 
+  StructReader result = *this;
+  result.data = scratch.begin();
+  result.dataSize = scratch.size() * WORDS * BITS_PER_WORD;
   return result;
 }
 
+void StructReader::unread(WordCount64 amount) const {
+  if (segment != nullptr) {
+    segment->unread(amount);
+  }
+}
+
 kj::Array<word> StructReader::canonicalize() {
   WordCount size = totalSize().wordCount + POINTER_SIZE_IN_WORDS;
   kj::Array<word> backing = kj::heapArray<word>(size / WORDS);
@@ -145,9 +145,14 @@ struct MessageSizeCounts {
   WordCount64 wordCount;
   uint capCount;
 
+  WordCount64 farPointerWords;
+  // Words occupied by far pointer landing pads.  These are not included in `wordCount`, since a
+  // copy of the object wouldn't need them.
+
   MessageSizeCounts& operator+=(const MessageSizeCounts& other) {
     wordCount += other.wordCount;
     capCount += other.capCount;
+    farPointerWords += other.farPointerWords;
     return *this;
   }
 
@@ -402,12 +407,17 @@ public:
   static inline PointerReader getRootUnchecked(const word* location);
   // Get a PointerReader for an unchecked message.
 
-  MessageSizeCounts targetSize() const;
+  MessageSizeCounts targetSize(uint threadCount = 1) const;
   // Return the total size of the target object and everything to which it points.  Does not count
   // far pointer overhead.  This is useful for deciding how much space is needed to copy the object
   // into a flat array.  However, the caller is advised NOT to treat this value as secure.  Instead,
   // use the result as a hint for allocating the first segment, do the copy, and then throw an
   // exception if it overruns.
+  //
+  // If `threadCount` is greater than 1, large lists are divided among up to that many threads
+  // (including the calling one).  The result is the same either way.  The helper threads are
+  // started at most once per call:  large lists are set aside during the traversal and their
+  // elements are all sized together at the end.
 
   inline bool isNull() const { return getPointerType() == PointerType::NULL_; }
   PointerType getPointerType() const;
@@ -589,6 +599,19 @@ public:
   // Like getDataField(offset), but applies the given XOR mask to the result.  Used for reading
   // fields with non-zero default values.
 
+  template <typename T>
+  KJ_ALWAYS_INLINE(T getDataFieldUnchecked(ElementCount offset) const);
+  template <typename T>
+  KJ_ALWAYS_INLINE(T getDataFieldUnchecked(ElementCount offset, Mask<T> mask) const);
+  // Like getDataField(), but skips the bounds check.  Only valid for offsets which fit in a data
+  // section made big enough by padDataSection().
+
+  StructReader padDataSection(kj::ArrayPtr<word> scratch) const;
+  // Returns a reader whose data section is at least as large as `scratch`, so that fields within
+  // that size can be read with getDataFieldUnchecked().  If the data section is already big
+  // enough (the usual case) this returns a copy of *this; otherwise, the data section is copied
+  // into `scratch` and zero-padded.  This lets code which reads many fields check the size once.
+
   KJ_ALWAYS_INLINE(PointerReader getPointerField(WirePointerCount ptrIndex) const);
   // Get a reader for a pointer field given the index within the pointer section.  If the index
   // is out-of-bounds, returns a null pointer.
@@ -600,6 +623,11 @@ public:
   // use the result as a hint for allocating the first segment, do the copy, and then throw an
   // exception if it overruns.
 
+  void unread(WordCount64 amount) const;
+  // Return `amount` words to the message's traversal limit.  totalSize() does this with the
+  // words it traversed, since the caller is likely to traverse them again; type-specialized
+  // implementations of totalSize() (see StructHelpers in pointer-helpers.h) must do the same.
+
   CapTableReader* getCapTable();
   // Gets the capability context in which this object is operating.
 
@@ -688,6 +716,16 @@ public:
       ElementCount index, kj::NoInfer<T> value));
   // Set the element at the given index.
 
+  template <typename T>
+  kj::Maybe<kj::ArrayPtr<T>> tryGetDataArray();
+  // If the list content is laid out exactly like a native array of T, return that array.  This is
+  // the case when the CPU's byte order matches the wire and the list wasn't upgraded to a struct
+  // list.  Returns null otherwise.
+
+  template <typename T>
+  void setDataElements(kj::ArrayPtr<const T> values);
+  // Set elements [0, values.size()) from the given array, with a single memcpy() where possible.
+
   KJ_ALWAYS_INLINE(PointerBuilder getPointerElement(ElementCount index));
 
   StructBuilder getStructElement(ElementCount index);
@@ -759,6 +797,14 @@ public:
   KJ_ALWAYS_INLINE(T getDataElement(ElementCount index) const);
   // Get the element of the given type at the given index.
 
+  template <typename T>
+  kj::Maybe<kj::ArrayPtr<const T>> tryGetDataArray() const;
+  // Like ListBuilder::tryGetDataArray().
+
+  template <typename T>
+  void getDataElements(kj::ArrayPtr<T> output) const;
+  // Copy elements [0, output.size()) into the given array, with a single memcpy() where possible.
+
   KJ_ALWAYS_INLINE(PointerReader getPointerElement(ElementCount index) const);
 
   StructReader getStructElement(ElementCount index) const;
@@ -1088,6 +1134,23 @@ T StructReader::getDataField(ElementCount offset, Mask<T> mask) const {
   return unmask<T>(getDataField<Mask<T> >(offset), mask);
 }
 
+template <typename T>
+inline T StructReader::getDataFieldUnchecked(ElementCount offset) const {
+  return reinterpret_cast<const WireValue<T>*>(data)[offset / ELEMENTS].get();
+}
+
+template <>
+inline bool StructReader::getDataFieldUnchecked<bool>(ElementCount offset) const {
+  BitCount boffset = offset * (1 * BITS / ELEMENTS);
+  const byte* b = reinterpret_cast<const byte*>(data) + boffset / BITS_PER_BYTE;
+  return (*reinterpret_cast<const uint8_t*>(b) & (1 << (boffset % BITS_PER_BYTE / BITS))) != 0;
+}
+
+template <typename T>
+inline T StructReader::getDataFieldUnchecked(ElementCount offset, Mask<T> mask) const {
+  return unmask<T>(getDataFieldUnchecked<Mask<T> >(offset), mask);
+}
+
 inline PointerReader StructReader::getPointerField(WirePointerCount ptrIndex) const {
   if (ptrIndex < pointerCount) {
     // Hacky because WirePointer is defined in the .c++ file (so is incomplete here).
@@ -1184,6 +1247,82 @@ inline Void ListReader::getDataElement<Void>(ElementCount index) const {
   return VOID;
 }
 
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == CAPNP_WIRE_BYTE_ORDER && \
+    !CAPNP_DISABLE_ENDIAN_DETECTION
+#define CAPNP_NATIVE_DATA_ARRAYS 1
+// Primitive list content can be accessed in place as T[] when its step matches sizeof(T).
+#else
+#define CAPNP_NATIVE_DATA_ARRAYS 0
+#endif
+
+template <typename T>
+inline kj::Maybe<kj::ArrayPtr<T>> ListBuilder::tryGetDataArray() {
+  if (elementCount == 0 * ELEMENTS) {
+    return kj::ArrayPtr<T>();
+  }
+#if CAPNP_NATIVE_DATA_ARRAYS
+  if (step == bitsPerElement<T>()) {
+    return kj::arrayPtr(reinterpret_cast<T*>(ptr), elementCount / ELEMENTS);
+  }
+#endif
+  return nullptr;
+}
+
+template <typename T>
+void ListBuilder::setDataElements(kj::ArrayPtr<const T> values) {
+  KJ_IREQUIRE(values.size() * ELEMENTS <= elementCount);
+  KJ_IF_MAYBE(array, tryGetDataArray<T>()) {
+    memcpy(array->begin(), values.begin(), values.size() * sizeof(T));
+  } else {
+    for (uint i = 0; i < values.size(); i++) {
+      setDataElement<T>(i * ELEMENTS, values[i]);
+    }
+  }
+}
+
+#if CAPNP_CANONICALIZE_NAN
+// Floats must go through setDataElement() so that NaNs are canonicalized.
+template <>
+inline void ListBuilder::setDataElements<float>(kj::ArrayPtr<const float> values) {
+  KJ_IREQUIRE(values.size() * ELEMENTS <= elementCount);
+  for (uint i = 0; i < values.size(); i++) {
+    setDataElement<float>(i * ELEMENTS, values[i]);
+  }
+}
+template <>
+inline void ListBuilder::setDataElements<double>(kj::ArrayPtr<const double> values) {
+  KJ_IREQUIRE(values.size() * ELEMENTS <= elementCount);
+  for (uint i = 0; i < values.size(); i++) {
+    setDataElement<double>(i * ELEMENTS, values[i]);
+  }
+}
+#endif
+
+template <typename T>
+inline kj::Maybe<kj::ArrayPtr<const T>> ListReader::tryGetDataArray() const {
+  if (elementCount == 0 * ELEMENTS) {
+    return kj::ArrayPtr<const T>();
+  }
+#if CAPNP_NATIVE_DATA_ARRAYS
+  if (step == bitsPerElement<T>()) {
+    return kj::arrayPtr(reinterpret_cast<const T*>(ptr), elementCount / ELEMENTS);
+  }
+#endif
+  return nullptr;
+}
+
+template <typename T>
+void ListReader::getDataElements(kj::ArrayPtr<T> output) const {
+  KJ_IREQUIRE(output.size() * ELEMENTS <= elementCount);
+  KJ_IF_MAYBE(array, tryGetDataArray<T>()) {
+    memcpy(output.begin(), array->begin(), output.size() * sizeof(T));
+  } else {
+    for (uint i = 0; i < output.size(); i++) {
+      output[i] = getDataElement<T>(i * ELEMENTS);
+    }
+  }
+}
+
 inline PointerReader ListReader::getPointerElement(ElementCount index) const {
   return PointerReader(segment, capTable,
       reinterpret_cast<const WirePointer*>(ptr + index * step / BITS_PER_BYTE), nestingLimit);
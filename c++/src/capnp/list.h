@@ -124,6 +124,24 @@ struct List<T, Kind::PRIMITIVE> {
     inline Iterator begin() const { return Iterator(this, 0); }
     inline Iterator end() const { return Iterator(this, size()); }
 
+    inline kj::Maybe<kj::ArrayPtr<const T>> asArrayPtr() const {
+      static_assert(_::elementSizeForType<T>() != ElementSize::BIT &&
+                    _::elementSizeForType<T>() != ElementSize::VOID,
+                    "Lists of bools and Voids have no array representation.");
+      return reader.template tryGetDataArray<T>();
+    }
+    // Returns the list content as an array pointing directly into the message, without copying.
+    // This requires that the host be little-endian and that the list actually be encoded as a
+    // list of T; if the sender upgraded it to a struct list, the elements aren't contiguous.  In
+    // either case, returns null, and you'll need copyTo() instead.
+
+    inline void copyTo(kj::ArrayPtr<T> output) const {
+      KJ_IREQUIRE(output.size() == size());
+      reader.template getDataElements<T>(output);
+    }
+    // Copy the whole list into `output`, which must have the same size.  This is a single memcpy()
+    // whenever asArrayPtr() would have succeeded.
+
   private:
     _::ListReader reader;
     template <typename U, Kind K>
@@ -165,6 +183,22 @@ struct List<T, Kind::PRIMITIVE> {
     inline Iterator begin() { return Iterator(this, 0); }
     inline Iterator end() { return Iterator(this, size()); }
 
+    inline kj::Maybe<kj::ArrayPtr<T>> asArrayPtr() {
+      static_assert(_::elementSizeForType<T>() != ElementSize::BIT &&
+                    _::elementSizeForType<T>() != ElementSize::VOID,
+                    "Lists of bools and Voids have no array representation.");
+      return builder.template tryGetDataArray<T>();
+    }
+    // Like Reader::asArrayPtr(), but writable.  Note that floats written through the array are
+    // not subject to NaN canonicalization on platforms which require it.
+
+    inline void setAll(kj::ArrayPtr<const T> values) {
+      KJ_IREQUIRE(values.size() == size());
+      builder.template setDataElements<T>(values);
+    }
+    // Set every element from `values`, which must have the same size as the list.  This is a
+    // single memcpy() whenever asArrayPtr() would succeed.
+
   private:
     _::ListBuilder builder;
     template <typename U, Kind K>
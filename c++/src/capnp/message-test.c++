@@ -24,6 +24,7 @@
 #include <kj/array.h>
 #include <kj/vector.h>
 #include <kj/debug.h>
+#include <kj/thread.h>
 #include <kj/compat/gtest.h>
 
 namespace capnp {
@@ -168,6 +169,616 @@ TEST(Message, ReadWriteDataStruct) {
   checkTestMessageAllZero(defaultValue<TestAllTypes>());
 }
 
+bool isAllZero(kj::ArrayPtr<const word> words) {
+  for (auto& w: words.asBytes()) {
+    if (w != 0) return false;
+  }
+  return true;
+}
+
+TEST(Message, ReusableBuilder) {
+  ReusableMessageBuilder builder(2048);
+
+  initTestMessage(builder.initRoot<TestAllTypes>());
+  auto segs = builder.getSegmentsForOutput();
+  ASSERT_EQ(1, segs.size());
+  const word* firstStart = segs[0].begin();
+  size_t firstSize = segs[0].size();
+  EXPECT_EQ(2048, builder.getRetainedWords());
+
+  builder.reset();
+  EXPECT_EQ(0, builder.getSegmentsForOutput().size());
+
+  // The used portion of the segment was zeroed.
+  EXPECT_TRUE(isAllZero(kj::arrayPtr(firstStart, firstSize)));
+
+  // The next message reuses the same memory.
+  checkTestMessageAllZero(builder.getRoot<TestAllTypes>());
+  builder.getRoot<TestAllTypes>().setInt32Field(123);
+  segs = builder.getSegmentsForOutput();
+  ASSERT_EQ(1, segs.size());
+  EXPECT_EQ(firstStart, segs[0].begin());
+  EXPECT_EQ(123, builder.getRoot<TestAllTypes>().getInt32Field());
+  EXPECT_EQ(2048, builder.getRetainedWords());
+}
+
+TEST(Message, ReusableBuilderCoalescesSegments) {
+  ReusableMessageBuilder builder(16);
+
+  initTestMessage(builder.initRoot<TestAllTypes>());
+  auto segs = builder.getSegmentsForOutput();
+  ASSERT_GT(segs.size(), 1);
+  size_t total = 0;
+  for (auto& seg: segs) total += seg.size();
+
+  builder.reset();
+
+  // After reset, a message of the same size fits in one segment.
+  initTestMessage(builder.initRoot<TestAllTypes>());
+  segs = builder.getSegmentsForOutput();
+  ASSERT_EQ(1, segs.size());
+  EXPECT_LE(segs[0].size(), total);
+  EXPECT_EQ(total, builder.getRetainedWords());
+  checkTestMessage(builder.getRoot<TestAllTypes>());
+}
+
+TEST(Message, ReusableBuilderRetentionLimit) {
+  ReusableMessageBuilder builder(64, AllocationStrategy::GROW_HEURISTICALLY, 256);
+
+  builder.initRoot<TestAllTypes>().initStructList(100);
+  EXPECT_GT(builder.getRetainedWords(), 256);
+  builder.reset();
+  EXPECT_EQ(0, builder.getRetainedWords());
+
+  builder.initRoot<TestAllTypes>().setInt32Field(1);
+  EXPECT_EQ(64, builder.getRetainedWords());
+  builder.reset();
+  EXPECT_EQ(64, builder.getRetainedWords());
+}
+
+TEST(Message, ReusableBuilderExternalSegment) {
+  // reset() must not try to zero external, read-only data.
+  ReusableMessageBuilder builder;
+
+  const byte external[16] = { 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16 };
+  auto orphan = builder.getOrphanage().referenceExternalData(
+      Data::Reader(external, sizeof(external)));
+  builder.initRoot<TestAllTypes>().adoptDataField(kj::mv(orphan));
+  EXPECT_EQ(2, builder.getSegmentsForOutput().size());
+
+  builder.reset();
+  builder.initRoot<TestAllTypes>().setTextField("foo");
+  EXPECT_EQ(1, builder.getSegmentsForOutput().size());
+  EXPECT_EQ("foo", builder.getRoot<TestAllTypes>().getTextField());
+}
+
+TEST(Message, MessageBuilderPool) {
+  MessageBuilderPool pool(2);
+  EXPECT_EQ(0, pool.getIdleCount());
+
+  const word* firstStart;
+  {
+    auto builder = pool.get();
+    initTestMessage(builder->initRoot<TestAllTypes>());
+    firstStart = builder->getSegmentsForOutput()[0].begin();
+  }
+  EXPECT_EQ(1, pool.getIdleCount());
+
+  {
+    auto builder = pool.get();
+    EXPECT_EQ(0, pool.getIdleCount());
+    checkTestMessageAllZero(builder->getRoot<TestAllTypes>());
+    EXPECT_EQ(firstStart, builder->getSegmentsForOutput()[0].begin());
+
+    auto builder2 = pool.get();
+    auto builder3 = pool.get();
+    builder2->initRoot<TestAllTypes>();
+    builder3->initRoot<TestAllTypes>();
+  }
+
+  // Pool holds at most two idle builders.
+  EXPECT_EQ(2, pool.getIdleCount());
+}
+
+TEST(Message, MessageBuilderPoolOutlivedByBuilder) {
+  kj::Own<MessageBuilder> builder;
+  {
+    MessageBuilderPool pool;
+    builder = pool.get();
+    initTestMessage(builder->initRoot<TestAllTypes>());
+  }
+  checkTestMessage(builder->getRoot<TestAllTypes>());
+  builder = nullptr;
+}
+
+TEST(Message, MessageSizeHistory) {
+  MessageSizeHistory history(90, 10);
+  EXPECT_EQ(SUGGESTED_FIRST_SEGMENT_WORDS, history.getFirstSegmentWords());
+
+  for (uint i = 1; i <= 10; i++) {
+    history.record(i * 100);
+  }
+  EXPECT_EQ(900u, history.getFirstSegmentWords());
+
+  // Old sizes are forgotten.
+  for (uint i = 0; i < 10; i++) {
+    history.record(50);
+  }
+  EXPECT_EQ(50u, history.getFirstSegmentWords());
+
+  // One outlier doesn't change the 90th percentile of 10.
+  history.record(100000);
+  EXPECT_EQ(50u, history.getFirstSegmentWords());
+
+  // A message bigger than the first segment is learned from, so the next one fits.
+  MessageSizeHistory builderHistory;
+  builderHistory.record(16);
+  for (uint i = 0; i < 2; i++) {
+    MallocMessageBuilder builder(builderHistory);
+    initTestMessage(builder.initRoot<TestAllTypes>());
+    if (i == 0) {
+      EXPECT_GT(builder.getSegmentsForOutput().size(), 1u);
+    } else {
+      EXPECT_EQ(1u, builder.getSegmentsForOutput().size());
+    }
+  }
+}
+
+TEST(Message, MessageBuilderPoolAdaptive) {
+  MessageBuilderPool pool;
+  uint64_t bigKey = MessageSizeHistoryMap::methodKey(0x1234, 0);
+  uint64_t smallKey = MessageSizeHistoryMap::methodKey(0x1234, 1);
+
+  for (uint i = 0; i < 2; i++) {
+    auto builder = pool.getAdaptive(bigKey);
+    builder->initRoot<TestAllTypes>().initDataField(SUGGESTED_FIRST_SEGMENT_WORDS * 8 * 2);
+    EXPECT_EQ(i == 0 ? 2u : 1u, builder->getSegmentsForOutput().size());
+  }
+
+  {
+    auto builder = pool.getAdaptive(smallKey);
+    builder->initRoot<TestAllTypes>().setInt32Field(123);
+    EXPECT_EQ(1u, builder->getSegmentsForOutput().size());
+  }
+}
+
+void expectConsistentUsage(MessageBuilder::SpaceUsage usage) {
+  EXPECT_EQ(usage.usedWords, usage.liveWords + usage.farPointerWords + usage.deadWords);
+  EXPECT_LE(usage.usedWords, usage.allocatedWords);
+}
+
+TEST(Message, SpaceUsage) {
+  {
+    MallocMessageBuilder builder;
+    auto usage = builder.getSpaceUsage();
+    EXPECT_EQ(0u, usage.segmentCount);
+    EXPECT_EQ(0u, usage.usedWords);
+  }
+
+  MallocMessageBuilder builder;
+  auto root = builder.initRoot<TestAllTypes>();
+  root.setTextField("hello");
+
+  auto usage = builder.getSpaceUsage();
+  expectConsistentUsage(usage);
+  EXPECT_EQ(1u, usage.segmentCount);
+  EXPECT_EQ(SUGGESTED_FIRST_SEGMENT_WORDS, usage.allocatedWords);
+  EXPECT_EQ(0u, usage.farPointerWords);
+  EXPECT_EQ(0u, usage.deadWords);
+  EXPECT_EQ(usage.usedWords, usage.liveWords);
+
+  // Replacing the text leaves its old space behind.
+  root.setTextField("a longer piece of text");
+  usage = builder.getSpaceUsage();
+  expectConsistentUsage(usage);
+  EXPECT_EQ(1u, usage.deadWords);
+
+  // So does an orphan.
+  auto orphan = builder.getOrphanage().newOrphan<List<uint64_t>>(10);
+  usage = builder.getSpaceUsage();
+  expectConsistentUsage(usage);
+  EXPECT_EQ(1u + 10u, usage.deadWords);
+}
+
+TEST(Message, SpaceUsageFarPointers) {
+  // One-word segments force nearly every object into its own segment, behind a far pointer.
+  MallocMessageBuilder builder(1, AllocationStrategy::FIXED_SIZE);
+  initTestMessage(builder.initRoot<TestAllTypes>());
+
+  auto usage = builder.getSpaceUsage();
+  expectConsistentUsage(usage);
+  EXPECT_GT(usage.segmentCount, 1u);
+  EXPECT_GT(usage.farPointerWords, 0u);
+  EXPECT_EQ(0u, usage.deadWords);
+}
+
+TEST(Message, Compact) {
+  MallocMessageBuilder builder(1, AllocationStrategy::FIXED_SIZE);
+  auto root = builder.initRoot<TestAllTypes>();
+  initTestMessage(root);
+  for (uint i = 0; i < 10; i++) {
+    root.initStructList(3);
+    initTestMessage(root);
+  }
+
+  auto before = builder.getSpaceUsage();
+  EXPECT_GT(before.deadWords, 0u);
+  EXPECT_GT(before.farPointerWords, 0u);
+
+  builder.compact();
+
+  auto after = builder.getSpaceUsage();
+  expectConsistentUsage(after);
+  EXPECT_EQ(1u, after.segmentCount);
+  EXPECT_EQ(0u, after.deadWords);
+  EXPECT_EQ(0u, after.farPointerWords);
+  EXPECT_EQ(before.liveWords, after.usedWords);
+  EXPECT_EQ(after.usedWords, builder.getSegmentsForOutput()[0].size());
+
+  // The message is intact and can still be modified.
+  checkTestMessage(builder.getRoot<TestAllTypes>());
+  builder.getRoot<TestAllTypes>().setTextField("modified after compaction");
+  EXPECT_EQ("modified after compaction", builder.getRoot<TestAllTypes>().getTextField());
+  EXPECT_EQ(2u, builder.getSegmentsForOutput().size());
+}
+
+TEST(Message, CompactWithScratchSpace) {
+  // The message fits back into the caller's first segment.
+  word scratch[512];
+  memset(scratch, 0, sizeof(scratch));
+  {
+    MallocMessageBuilder builder(kj::arrayPtr(scratch, 512));
+    auto root = builder.initRoot<TestAllTypes>();
+    initTestMessage(root);
+    root.setTextField("replaced, leaving the old text behind as garbage");
+    builder.compact();
+
+    auto segments = builder.getSegmentsForOutput();
+    ASSERT_EQ(1u, segments.size());
+    EXPECT_EQ(scratch, segments[0].begin());
+    EXPECT_TRUE(isAllZero(kj::arrayPtr(scratch + segments[0].size(), scratch + 512)));
+    EXPECT_EQ("replaced, leaving the old text behind as garbage",
+              builder.getRoot<TestAllTypes>().getTextField());
+  }
+  EXPECT_TRUE(isAllZero(kj::arrayPtr(scratch, 512)));
+
+  // The message has outgrown the caller's first segment and must move out of it.
+  {
+    MallocMessageBuilder builder(kj::arrayPtr(scratch, 16));
+    initTestMessage(builder.initRoot<TestAllTypes>());
+    builder.compact();
+
+    auto segments = builder.getSegmentsForOutput();
+    ASSERT_EQ(1u, segments.size());
+    EXPECT_NE(scratch, segments[0].begin());
+    checkTestMessage(builder.getRoot<TestAllTypes>());
+  }
+  EXPECT_TRUE(isAllZero(kj::arrayPtr(scratch, 512)));
+}
+
+TEST(Message, CompactReusableBuilder) {
+  ReusableMessageBuilder builder(1024, AllocationStrategy::FIXED_SIZE);
+
+  // Fill more than one segment, so that the compacted message needs a new one.
+  kj::Vector<kj::ArrayPtr<const word>> touched;
+  auto root = builder.initRoot<TestAllTypes>();
+  initTestMessage(root);
+  root.initInt64List(1500);
+  root.initInt64List(1000).set(999, 123);
+  for (auto segment: builder.getSegmentsForOutput()) touched.add(segment);
+  ASSERT_GT(touched.size(), 1u);
+
+  builder.compact();
+  auto segments = builder.getSegmentsForOutput();
+  ASSERT_EQ(1u, segments.size());
+  EXPECT_EQ(123, builder.getRoot<TestAllTypes>().getInt64List()[999]);
+  touched.add(segments[0]);
+
+  // reset() must zero the compacted segment, wherever it ended up, and compact() the rest.
+  builder.reset();
+  for (auto segment: touched) {
+    EXPECT_TRUE(isAllZero(segment));
+  }
+
+  // A small message is compacted back into the first segment.
+  root = builder.initRoot<TestAllTypes>();
+  initTestMessage(root);
+  root.setTextField("replaced, leaving the old text behind as garbage");
+  const word* first = builder.getSegmentsForOutput()[0].begin();
+  builder.compact();
+  segments = builder.getSegmentsForOutput();
+  ASSERT_EQ(1u, segments.size());
+  EXPECT_EQ(first, segments[0].begin());
+  auto compacted = segments[0];
+
+  builder.reset();
+  EXPECT_TRUE(isAllZero(compacted));
+  checkTestMessageAllZero(builder.getRoot<TestAllTypes>());
+}
+
+TEST(Message, ValidateAll) {
+  MallocMessageBuilder builder(1, AllocationStrategy::FIXED_SIZE);
+  initTestMessage(builder.initRoot<TestAllTypes>());
+  auto segments = builder.getSegmentsForOutput();
+  ASSERT_GT(segments.size(), 1u);
+
+  // Enough for validation plus one full read, but not for repeated reads.
+  ReaderOptions options;
+  options.traversalLimitInWords = builder.getRoot<AnyPointer>().targetSize().wordCount * 2;
+
+  {
+    SegmentArrayMessageReader reader(segments, options);
+    reader.validateAll();
+    for (uint i = 0; i < 5; i++) {
+      checkTestMessage(reader.getRoot<TestAllTypes>());
+    }
+  }
+
+  {
+    SegmentArrayMessageReader reader(segments, options);
+    EXPECT_ANY_THROW({
+      for (uint i = 0; i < 5; i++) {
+        checkTestMessage(reader.getRoot<TestAllTypes>());
+      }
+    });
+  }
+
+  {
+    // Validation itself is still subject to the limit.
+    options.traversalLimitInWords = 16;
+    SegmentArrayMessageReader reader(segments, options);
+    EXPECT_ANY_THROW(reader.validateAll());
+  }
+}
+
+TEST(Message, ValidateAllRejectsInvalid) {
+  MallocMessageBuilder builder;
+  initTestMessage(builder.initRoot<TestAllTypes>());
+  auto segment = builder.getSegmentsForOutput()[0];
+
+  // Cut off the end of the message, so that some pointers point out of bounds.
+  kj::ArrayPtr<const word> truncated[1] = { segment.slice(0, segment.size() - 4) };
+  SegmentArrayMessageReader reader(truncated);
+  EXPECT_ANY_THROW(reader.validateAll());
+
+  // Not having been validated, the reader still catches the problem on access.
+  EXPECT_ANY_THROW(checkTestMessage(reader.getRoot<TestAllTypes>()));
+}
+
+TEST(Message, ValidateAllParallel) {
+  MallocMessageBuilder builder;
+  auto list = builder.initRoot<AnyPointer>().initAs<List<TestAllTypes>>(5000);
+  for (uint i = 0; i < list.size(); i++) {
+    list[i].setUInt32Field(i);
+    list[i].setTextField(kj::str("element ", i));
+    list[i].initStructField().initInt32List(i % 7);
+  }
+  auto segments = builder.getSegmentsForOutput();
+
+  {
+    SegmentArrayMessageReader reader(segments);
+    auto root = reader.getRoot<AnyPointer>();
+    auto expected = root.targetSize();
+    auto actual = root.targetSize(4);
+    EXPECT_EQ(expected.wordCount, actual.wordCount);
+    EXPECT_EQ(expected.capCount, actual.capCount);
+  }
+
+  {
+    SegmentArrayMessageReader reader(segments);
+    reader.validateAll(4);
+    auto copy = reader.getRoot<AnyPointer>().getAs<List<TestAllTypes>>();
+    ASSERT_EQ(5000u, copy.size());
+    EXPECT_EQ(4321u, copy[4321].getUInt32Field());
+    EXPECT_EQ("element 4321", copy[4321].getTextField());
+  }
+
+  {
+    // Several big lists in one message are all split among the same threads.
+    MallocMessageBuilder multi;
+    auto root = multi.initRoot<TestAllTypes>();
+    auto structs = root.initStructList(3000);
+    for (uint i = 0; i < structs.size(); i++) {
+      structs[i].setTextField(kj::str("struct ", i));
+    }
+    auto texts = root.initTextList(2500);
+    for (uint i = 0; i < texts.size(); i++) {
+      texts.set(i, kj::str("text ", i));
+    }
+    root.initStructField().initStructList(4100)[4099].setTextField("last");
+
+    SegmentArrayMessageReader reader(multi.getSegmentsForOutput());
+    auto readRoot = reader.getRoot<AnyPointer>();
+    auto expected = readRoot.targetSize();
+    auto actual = readRoot.targetSize(3);
+    EXPECT_EQ(expected.wordCount, actual.wordCount);
+    reader.validateAll(3);
+  }
+
+  {
+    // Errors found by helper threads are reported to the caller.
+    auto truncated = kj::heapArray(segments);
+    auto& last = truncated[truncated.size() - 1];
+    last = last.slice(0, last.size() / 2);
+    SegmentArrayMessageReader reader(truncated);
+    EXPECT_ANY_THROW(reader.validateAll(4));
+  }
+}
+
+uint countFailedReads(MessageReader& reader, uint threadCount) {
+  // Read the whole message once in each of `threadCount` threads at once.
+  uint failures = 0;
+  kj::Vector<kj::Own<kj::Thread>> threads;
+  for (uint i = 0; i < threadCount; i++) {
+    threads.add(kj::heap<kj::Thread>([&]() {
+      KJ_IF_MAYBE(e, kj::runCatchingExceptions([&]() {
+        checkTestMessage(reader.getRoot<TestAllTypes>());
+      })) {
+        __atomic_add_fetch(&failures, 1, __ATOMIC_RELAXED);
+      }
+    }));
+  }
+  threads.resize(0);
+  return failures;
+}
+
+TEST(Message, PerThreadTraversalLimit) {
+  MallocMessageBuilder builder;
+  initTestMessage(builder.initRoot<TestAllTypes>());
+  auto segments = builder.getSegmentsForOutput();
+
+  // Enough for one full read, but not two.
+  ReaderOptions options;
+  options.traversalLimitInWords = builder.getRoot<AnyPointer>().targetSize().wordCount * 3 / 2;
+  options.traversalLimitPerThread = true;
+
+  {
+    SegmentArrayMessageReader reader(segments, options);
+    EXPECT_EQ(0u, countFailedReads(reader, 4));
+
+    // Each thread is still limited.
+    checkTestMessage(reader.getRoot<TestAllTypes>());
+    EXPECT_ANY_THROW(checkTestMessage(reader.getRoot<TestAllTypes>()));
+  }
+
+  {
+    // The shared limit applies across threads.
+    options.sharedTraversalLimitInWords = options.traversalLimitInWords * 2;
+    SegmentArrayMessageReader reader(segments, options);
+    EXPECT_GT(countFailedReads(reader, 4), 0u);
+  }
+}
+
+TEST(Message, ConcurrentSegmentLookup) {
+  // One word per segment forces every object into its own segment, so reading crosses into
+  // dozens of segments, more than the initial segment table holds.
+  MallocMessageBuilder builder(1, AllocationStrategy::FIXED_SIZE);
+  initTestMessage(builder.initRoot<TestAllTypes>());
+  auto segments = builder.getSegmentsForOutput();
+  ASSERT_GT(segments.size(), 32u);
+
+  SegmentArrayMessageReader reader(segments);
+  EXPECT_EQ(0u, countFailedReads(reader, 4));
+
+  // Segments beyond the end are still rejected.
+  auto truncated = segments.slice(0, segments.size() - 1);
+  SegmentArrayMessageReader truncatedReader(truncated);
+  EXPECT_ANY_THROW(checkTestMessage(truncatedReader.getRoot<TestAllTypes>()));
+}
+
+TEST(Message, ConcurrentBuilder) {
+  static constexpr uint THREADS = 4;
+  static constexpr uint ROWS_PER_THREAD = 500;
+
+  MallocMessageBuilder builder(256);
+  auto rows = builder.initRoot<TestAllTypes>().initStructList(THREADS * ROWS_PER_THREAD);
+  auto orphanage = builder.getOrphanage();
+  kj::Vector<Orphan<List<TestAllTypes>>> extras;
+  extras.resize(THREADS);
+
+  {
+    ConcurrentBuilder concurrent(builder);
+
+    // Without a lane, allocation is refused.
+    EXPECT_ANY_THROW(rows[0].setTextField("foo"));
+
+    kj::Vector<kj::Own<kj::Thread>> threads;
+    for (uint t = 0; t < THREADS; t++) {
+      threads.add(kj::heap<kj::Thread>([&,t]() {
+        ConcurrentBuilder::Lane lane(concurrent);
+        for (uint i = t * ROWS_PER_THREAD; i < (t + 1) * ROWS_PER_THREAD; i++) {
+          rows[i].setUInt32Field(i);
+          rows[i].setTextField(kj::str("row ", i));
+          rows[i].initInt32List(3).set(2, i);
+        }
+
+        auto extra = orphanage.newOrphan<List<TestAllTypes>>(1);
+        initTestMessage(extra.get()[0]);
+        extras[t] = kj::mv(extra);
+      }));
+    }
+  }
+
+  // Back to normal mode:  adopting the orphans links them in with far pointers.
+  for (uint t = 0; t < THREADS; t++) {
+    rows[t].adoptStructList(kj::mv(extras[t]));
+  }
+
+  // Every thread got its own segment.
+  auto segments = builder.getSegmentsForOutput();
+  EXPECT_GT(segments.size(), THREADS);
+
+  SegmentArrayMessageReader reader(segments);
+  auto readRows = reader.getRoot<TestAllTypes>().getStructList();
+  ASSERT_EQ(THREADS * ROWS_PER_THREAD, readRows.size());
+  for (uint i = 0; i < readRows.size(); i++) {
+    EXPECT_EQ(i, readRows[i].getUInt32Field());
+    EXPECT_EQ(kj::str("row ", i), readRows[i].getTextField());
+    EXPECT_EQ(i, readRows[i].getInt32List()[2]);
+  }
+  for (uint t = 0; t < THREADS; t++) {
+    checkTestMessage(readRows[t].getStructList()[0]);
+  }
+}
+
+TEST(Message, ConcurrentBuilderManySegments) {
+  // Tiny segments make every thread add many segments while the others look theirs up.
+  static constexpr uint THREADS = 4;
+  static constexpr uint ROWS_PER_THREAD = 200;
+
+  MallocMessageBuilder builder(8, AllocationStrategy::FIXED_SIZE);
+  auto rows = builder.initRoot<TestAllTypes>().initStructList(THREADS * ROWS_PER_THREAD);
+
+  {
+    ConcurrentBuilder concurrent(builder);
+    kj::Vector<kj::Own<kj::Thread>> threads;
+    for (uint t = 0; t < THREADS; t++) {
+      threads.add(kj::heap<kj::Thread>([&,t]() {
+        ConcurrentBuilder::Lane lane(concurrent);
+        for (uint i = t * ROWS_PER_THREAD; i < (t + 1) * ROWS_PER_THREAD; i++) {
+          rows[i].setTextField(kj::str("a longer row of text, number ", i));
+          KJ_ASSERT(rows[i].asReader().getTextField() == kj::str("a longer row of text, number ", i));
+        }
+      }));
+    }
+  }
+
+  EXPECT_GT(builder.getSegmentsForOutput().size(), THREADS * ROWS_PER_THREAD);
+  for (uint i = 0; i < rows.size(); i++) {
+    EXPECT_EQ(kj::str("a longer row of text, number ", i), rows[i].getTextField());
+  }
+}
+
+class RecoverableExceptionCounter: public kj::ExceptionCallback {
+public:
+  void onRecoverableException(kj::Exception&& exception) override { ++count; }
+  uint count = 0;
+};
+
+TEST(Message, ConcurrentBuilderLanesOutOfOrder) {
+  MallocMessageBuilder builder;
+  builder.initRoot<TestAllTypes>();
+
+  RecoverableExceptionCounter counter;
+  {
+    ConcurrentBuilder concurrent(builder);
+    auto first = kj::heap<ConcurrentBuilder::Lane>(concurrent);
+    auto second = kj::heap<ConcurrentBuilder::Lane>(concurrent);
+    first = nullptr;
+    EXPECT_EQ(1u, counter.count);
+    second = nullptr;
+  }
+  EXPECT_EQ(1u, counter.count);
+
+  // The thread's lanes were left consistent.
+  {
+    ConcurrentBuilder concurrent(builder);
+    ConcurrentBuilder::Lane lane(concurrent);
+    builder.getRoot<TestAllTypes>().setTextField("foo");
+  }
+  EXPECT_EQ("foo", builder.getRoot<TestAllTypes>().getTextField());
+}
+
 // TODO(test):  More tests.
 
 }  // namespace
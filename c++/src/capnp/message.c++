@@ -24,10 +24,13 @@
 #include <kj/debug.h>
 #include "arena.h"
 #include "orphan.h"
+#include <kj/refcount.h>
 #include <stdlib.h>
 #include <exception>
 #include <string>
 #include <vector>
+#include <algorithm>
+#include <unordered_map>
 #include <errno.h>
 
 namespace capnp {
@@ -81,6 +84,12 @@ bool MessageReader::isCanonical() {
 }
 
 
+void MessageReader::validateAll(uint threadCount) {
+  // targetSize() visits every object reachable from the root with all of the usual checks.
+  getRootInternal().targetSize(threadCount);
+  arena()->setTrusted();
+}
+
 AnyPointer::Reader MessageReader::getRootInternal() {
   if (!allocatedArena) {
     static_assert(sizeof(_::ReaderArena) <= sizeof(arenaSpace),
@@ -119,6 +128,13 @@ MessageBuilder::MessageBuilder(kj::ArrayPtr<SegmentInit> segments)
   allocatedArena = true;
 }
 
+void MessageBuilder::discardArena() {
+  if (allocatedArena) {
+    allocatedArena = false;
+    kj::dtor(*arena());
+  }
+}
+
 _::SegmentBuilder* MessageBuilder::getRootSegment() {
   if (allocatedArena) {
     return arena()->getSegment(_::SegmentId(0));
@@ -152,6 +168,71 @@ kj::ArrayPtr<const kj::ArrayPtr<const word>> MessageBuilder::getSegmentsForOutpu
   }
 }
 
+MessageBuilder::SpaceUsage MessageBuilder::getSpaceUsage() {
+  SpaceUsage result = { 0, 0, 0, 0, 0, 0 };
+  if (!allocatedArena) {
+    return result;
+  }
+
+  auto segments = arena()->getSegmentsForOutput();
+  result.segmentCount = segments.size();
+  for (uint i = 0; i < segments.size(); i++) {
+    result.usedWords += segments[i].size();
+    result.allocatedWords += arena()->getSegment(_::SegmentId(i))->getSize() / WORDS;
+  }
+
+  auto size = _::PointerHelpers<AnyPointer>::getInternalBuilder(getRootInternal())
+      .asReader().targetSize();
+  result.liveWords = (size.wordCount + POINTER_SIZE_IN_WORDS) / WORDS;
+  result.farPointerWords = size.farPointerWords / WORDS;
+  result.deadWords = result.usedWords - result.liveWords - result.farPointerWords;
+  return result;
+}
+
+void MessageBuilder::compact() {
+  if (!allocatedArena) {
+    return;
+  }
+
+  auto root = getRootInternal();
+  auto size = root.targetSize();
+  KJ_REQUIRE(size.capCount == 0, "compact() can't be used on messages containing capabilities.");
+
+  // Copy into temporary space first, since the result may end up back in the first segment.
+  uint words = size.wordCount + POINTER_SIZE_IN_WORDS / WORDS;
+  auto temp = kj::heapArray<word>(words);
+  memset(temp.begin(), 0, temp.asBytes().size());
+  size_t used;
+  {
+    FlatMessageBuilder copy(temp);
+    copy.getRoot<AnyPointer>().set(root.asReader());
+    used = copy.getSegmentsForOutput()[0].size();
+  }
+
+  // Zero everything the message used, so that the subclass gets its segments back in the state in
+  // which allocateSegment() handed them out.  External segments aren't ours to touch.
+  _::SegmentBuilder* firstSegment = arena()->getSegment(_::SegmentId(0));
+  kj::ArrayPtr<word> space = kj::arrayPtr(firstSegment->getPtrUnchecked(0 * WORDS),
+                                          firstSegment->getSize() / WORDS);
+  auto segments = arena()->getSegmentsForOutput();
+  for (uint i = 0; i < segments.size(); i++) {
+    if (arena()->getSegment(_::SegmentId(i))->isWritable()) {
+      memset(const_cast<word*>(segments[i].begin()), 0, segments[i].size() * sizeof(word));
+    }
+  }
+
+  discardArena();
+
+  if (space.size() < used) {
+    space = allocateSegment(used);
+  }
+  memcpy(space.begin(), temp.begin(), used * sizeof(word));
+
+  SegmentInit init = { space, used };
+  kj::ctor(*arena(), this, kj::arrayPtr(&init, 1));
+  allocatedArena = true;
+}
+
 Orphanage MessageBuilder::getOrphanage() {
   // We must ensure that the arena and root pointer have been allocated before the Orphanage
   // can be used.
@@ -160,6 +241,23 @@ Orphanage MessageBuilder::getOrphanage() {
   return Orphanage(arena(), arena()->getLocalCapTable());
 }
 
+ConcurrentBuilder::ConcurrentBuilder(MessageBuilder& message) {
+  message.getRootSegment();
+  arena = message.arena();
+  arena->beginConcurrent();
+}
+
+ConcurrentBuilder::~ConcurrentBuilder() noexcept(false) {
+  arena->endConcurrent();
+}
+
+ConcurrentBuilder::Lane::Lane(ConcurrentBuilder& builder)
+    : arena(builder.arena), lane(builder.arena->enterLane()) {}
+
+ConcurrentBuilder::Lane::~Lane() noexcept(false) {
+  arena->leaveLane(lane);
+}
+
 bool MessageBuilder::isCanonical() {
   _::SegmentReader *segment = getRootSegment();
 
@@ -196,6 +294,61 @@ kj::ArrayPtr<const word> SegmentArrayMessageReader::getSegment(uint id) {
 
 // -------------------------------------------------------------------
 
+MessageSizeHistory::MessageSizeHistory(uint percentile, uint historySize)
+    : percentile(percentile), sizes(kj::heapArray<uint>(historySize)),
+      scratch(kj::heapArray<uint>(historySize)) {
+  KJ_REQUIRE(percentile > 0 && percentile <= 100, "percentile must be in (0, 100]", percentile);
+  KJ_REQUIRE(historySize > 0, "historySize must be positive");
+}
+
+void MessageSizeHistory::record(size_t messageWords) {
+  sizes[count++ % sizes.size()] = kj::min(messageWords, uint(kj::maxValue));
+
+  // The history is small, so recomputing the percentile each time is cheap compared to building
+  // the message in the first place.
+  uint n = kj::min<size_t>(count, sizes.size());
+  auto recent = scratch.slice(0, n);
+  memcpy(recent.begin(), sizes.begin(), n * sizeof(uint));
+  uint index = (n * percentile + 99) / 100 - 1;
+  std::nth_element(recent.begin(), recent.begin() + index, recent.end());
+  firstSegmentWords = kj::max(recent[index], 1u);
+}
+
+void MessageSizeHistory::record(MessageBuilder& builder) {
+  size_t total = 0;
+  for (auto& segment: builder.getSegmentsForOutput()) {
+    total += segment.size();
+  }
+  if (total > 0) {
+    // Builders that never allocated anything tell us nothing.
+    record(total);
+  }
+}
+
+struct MessageSizeHistoryMap::Impl {
+  std::unordered_map<uint64_t, kj::Own<MessageSizeHistory>> histories;
+};
+
+MessageSizeHistoryMap::MessageSizeHistoryMap(uint percentile, uint historySize)
+    : percentile(percentile), historySize(historySize), impl(kj::heap<Impl>()) {}
+MessageSizeHistoryMap::~MessageSizeHistoryMap() noexcept(false) {}
+
+MessageSizeHistory& MessageSizeHistoryMap::get(uint64_t key) {
+  auto& slot = impl->histories[key];
+  if (slot.get() == nullptr) {
+    slot = kj::heap<MessageSizeHistory>(percentile, historySize);
+  }
+  return *slot;
+}
+
+uint64_t MessageSizeHistoryMap::methodKey(uint64_t interfaceId, uint16_t methodId) {
+  // Interface IDs are random 64-bit numbers, so mixing in the method ID this way is very unlikely
+  // to collide.  A collision would only make sizing less accurate anyway.
+  return interfaceId ^ (uint64_t(methodId) * 0x9e3779b97f4a7c15ull);
+}
+
+// -------------------------------------------------------------------
+
 struct MallocMessageBuilder::MoreSegments {
   std::vector<void*> segments;
 };
@@ -216,16 +369,24 @@ MallocMessageBuilder::MallocMessageBuilder(
           "First segment must be zeroed.");
 }
 
+MallocMessageBuilder::MallocMessageBuilder(
+    MessageSizeHistory& history, AllocationStrategy allocationStrategy)
+    : MallocMessageBuilder(history.getFirstSegmentWords(), allocationStrategy) {
+  this->history = &history;
+}
+
 MallocMessageBuilder::~MallocMessageBuilder() noexcept(false) {
+  if (history != nullptr) {
+    history->record(*this);
+  }
+
   if (returnedFirstSegment) {
     if (ownFirstSegment) {
       free(firstSegment);
     } else {
-      // Must zero first segment.
+      // Must zero first segment.  If compact() moved the message out of it, compact() already did.
       kj::ArrayPtr<const kj::ArrayPtr<const word>> segments = getSegmentsForOutput();
-      if (segments.size() > 0) {
-        KJ_ASSERT(segments[0].begin() == firstSegment,
-            "First segment in getSegmentsForOutput() is not the first segment allocated?");
+      if (segments.size() > 0 && segments[0].begin() == firstSegment) {
         memset(firstSegment, 0, segments[0].size() * sizeof(word));
       }
     }
@@ -282,6 +443,212 @@ kj::ArrayPtr<word> MallocMessageBuilder::allocateSegment(uint minimumSize) {
 
 // -------------------------------------------------------------------
 
+ReusableMessageBuilder::ReusableMessageBuilder(
+    uint firstSegmentWords, AllocationStrategy allocationStrategy, uint maxRetainedWords)
+    : firstSegmentWords(firstSegmentWords), nextSize(firstSegmentWords),
+      maxRetainedWords(maxRetainedWords), allocationStrategy(allocationStrategy) {}
+
+ReusableMessageBuilder::~ReusableMessageBuilder() noexcept(false) {
+  // The arena must go away before the memory backing it.
+  discardArena();
+  freeSegments();
+}
+
+void ReusableMessageBuilder::freeSegments() {
+  for (auto segment: segments) {
+    free(segment.begin());
+  }
+  segments.clear();
+  segmentsInUse = 0;
+}
+
+void ReusableMessageBuilder::reset() {
+  // Zero out exactly the words that were used.  Note that getSegmentsForOutput() may also contain
+  // external (read-only) segments which we don't own; those are skipped by matching against our
+  // own segments.  Usually ours appear in the same order, but after compact() the message lives in
+  // a single segment which may be any of them.
+  size_t totalUsed = 0;
+  for (auto segment: getSegmentsForOutput()) {
+    for (uint i = 0; i < segmentsInUse; i++) {
+      if (segment.begin() == segments[i].begin()) {
+        memset(segments[i].begin(), 0, segment.size() * sizeof(word));
+        totalUsed += segment.size();
+        break;
+      }
+    }
+  }
+
+  discardArena();
+
+  size_t retained = getRetainedWords();
+  if (retained > maxRetainedWords) {
+    // Don't hold on to an unusually large message's memory.
+    freeSegments();
+    nextSize = firstSegmentWords;
+  } else if (segmentsInUse > 1 && allocationStrategy == AllocationStrategy::GROW_HEURISTICALLY) {
+    // The last message didn't fit in one segment.  Replace the segments with a single one big
+    // enough to hold it, so that similar messages in the future won't need far pointers.
+    freeSegments();
+    nextSize = kj::max<size_t>(firstSegmentWords, totalUsed);
+  } else {
+    nextSize = firstSegmentWords;
+  }
+
+  segmentsInUse = 0;
+}
+
+void ReusableMessageBuilder::setFirstSegmentWords(uint firstSegmentWords) {
+  this->firstSegmentWords = firstSegmentWords;
+  if (segmentsInUse == 0) {
+    nextSize = kj::max(nextSize, firstSegmentWords);
+  }
+}
+
+size_t ReusableMessageBuilder::getRetainedWords() const {
+  size_t result = 0;
+  for (auto& segment: segments) {
+    result += segment.size();
+  }
+  return result;
+}
+
+kj::ArrayPtr<word> ReusableMessageBuilder::allocateSegment(uint minimumSize) {
+  uint size = kj::max(minimumSize, nextSize);
+
+  if (segmentsInUse < segments.size()) {
+    kj::ArrayPtr<word>& retained = segments[segmentsInUse];
+    if (retained.size() >= size ||
+        (segmentsInUse > 0 && retained.size() >= minimumSize)) {
+      // Reuse.  The retained segment was zeroed by reset().  We're lenient about the heuristic
+      // size for later segments since the point is to avoid allocation.
+      ++segmentsInUse;
+      if (allocationStrategy == AllocationStrategy::GROW_HEURISTICALLY) {
+        // Same rule as for fresh segments below.
+        nextSize = segmentsInUse == 1 ? retained.size() : nextSize + retained.size();
+      }
+      return retained;
+    }
+
+    // Too small; replace it.
+    free(retained.begin());
+    retained = nullptr;
+  } else {
+    segments.add(nullptr);
+  }
+
+  void* result = calloc(size, sizeof(word));
+  if (result == nullptr) {
+    KJ_FAIL_SYSCALL("calloc(size, sizeof(word))", ENOMEM, size);
+  }
+
+  auto segment = kj::arrayPtr(reinterpret_cast<word*>(result), size);
+  segments[segmentsInUse++] = segment;
+
+  if (allocationStrategy == AllocationStrategy::GROW_HEURISTICALLY) {
+    // As with MallocMessageBuilder, we want nextSize to equal the total size allocated so far.
+    nextSize = segmentsInUse == 1 ? size : nextSize + size;
+  }
+
+  return segment;
+}
+
+// -------------------------------------------------------------------
+
+struct MessageBuilderPool::State: public kj::Refcounted {
+  uint maxPooledBuilders;
+  uint maxRetainedWords;
+
+  bool poolAlive = true;
+  // False once the MessageBuilderPool has been destroyed.  Outstanding builders then free
+  // themselves when released.
+
+  kj::Vector<PooledBuilder*> idle;
+
+  MessageSizeHistoryMap sizes;
+  // For getAdaptive().
+
+  State(uint maxPooledBuilders, uint maxRetainedWords)
+      : maxPooledBuilders(maxPooledBuilders), maxRetainedWords(maxRetainedWords) {}
+};
+
+class MessageBuilderPool::PooledBuilder final: public kj::Disposer {
+  // Wraps a ReusableMessageBuilder and acts as the kj::Disposer for the Own<MessageBuilder> handed
+  // out by the pool, so that dropping the Own returns the builder to the pool.
+
+public:
+  PooledBuilder(State& state)
+      : builder(SUGGESTED_FIRST_SEGMENT_WORDS, SUGGESTED_ALLOCATION_STRATEGY,
+                state.maxRetainedWords),
+        state(kj::addRef(state)) {}
+
+  ReusableMessageBuilder builder;
+  kj::Own<State> state;
+
+  MessageSizeHistory* history = nullptr;
+  // If non-null, where to record the size of the current message on release.  Points into
+  // `state->sizes`, which our reference keeps alive.
+
+protected:
+  void disposeImpl(void* pointer) const override {
+    auto& self = const_cast<PooledBuilder&>(*this);
+    if (self.history != nullptr) {
+      self.history->record(self.builder);
+      self.history = nullptr;
+    }
+
+    State& state = *self.state;
+    if (state.poolAlive && state.idle.size() < state.maxPooledBuilders) {
+      self.builder.reset();
+      state.idle.add(&self);
+    } else {
+      delete &self;
+    }
+  }
+};
+
+MessageBuilderPool::MessageBuilderPool(uint maxPooledBuilders, uint maxRetainedWords)
+    : state(kj::refcounted<State>(maxPooledBuilders, maxRetainedWords)) {}
+
+MessageBuilderPool::~MessageBuilderPool() noexcept(false) {
+  // Idle builders hold references to the state, so we have to break the cycle by hand.
+  state->poolAlive = false;
+  auto idle = kj::mv(state->idle);
+  for (auto builder: idle) {
+    delete builder;
+  }
+}
+
+MessageBuilderPool::PooledBuilder& MessageBuilderPool::take(uint firstSegmentWords) {
+  PooledBuilder* pooled;
+  if (state->idle.empty()) {
+    pooled = new PooledBuilder(*state);
+  } else {
+    pooled = state->idle.back();
+    state->idle.removeLast();
+  }
+
+  pooled->builder.setFirstSegmentWords(firstSegmentWords);
+  return *pooled;
+}
+
+kj::Own<MessageBuilder> MessageBuilderPool::get(uint firstSegmentWords) {
+  auto& pooled = take(firstSegmentWords);
+  return kj::Own<MessageBuilder>(&pooled.builder, pooled);
+}
+
+kj::Own<MessageBuilder> MessageBuilderPool::getAdaptive(uint64_t sizeKey) {
+  auto& history = state->sizes.get(sizeKey);
+  auto& pooled = take(history.getFirstSegmentWords());
+  pooled.history = &history;
+  return kj::Own<MessageBuilder>(&pooled.builder, pooled);
+}
+
+size_t MessageBuilderPool::getIdleCount() {
+  return state->idle.size();
+}
+
+// -------------------------------------------------------------------
+
 FlatMessageBuilder::FlatMessageBuilder(kj::ArrayPtr<word> array): array(array), allocated(false) {}
 FlatMessageBuilder::~FlatMessageBuilder() noexcept(false) {}
 
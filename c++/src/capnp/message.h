@@ -23,6 +23,7 @@
 #include <kj/memory.h>
 #include <kj/mutex.h>
 #include <kj/debug.h>
+#include <kj/vector.h>
 #include "common.h"
 #include "layout.h"
 #include "any.h"
@@ -39,6 +40,7 @@ namespace capnp {
 namespace _ {  // private
   class ReaderArena;
   class BuilderArena;
+  struct BuilderLane;
 }
 
 class StructSchema;
@@ -81,6 +83,26 @@ struct ReaderOptions {
   // overflow by sending a very-deeply-nested (or even cyclic) message, without the message even
   // being very large.  The default limit of 64 is probably low enough to prevent any chance of
   // stack overflow, yet high enough that it is never a problem in practice.
+
+  bool traversalLimitPerThread = false;
+  // If true, each thread reading the message gets its own budget of traversalLimitInWords.
+  // Normally all threads reading one MessageReader count against a single budget, which they
+  // update without synchronization; when many threads scan the same large message at once (e.g.
+  // a shared mmap()ed file), the cache line holding the counter bounces between their cores and
+  // limits scaling.  In per-thread mode each thread updates its own counter.  This costs about
+  // 8 KiB per MessageReader.
+  //
+  // There are 64 budgets.  Each thread is assigned one, round-robin, the first time it reads any
+  // message in this mode, and keeps it until it exits; assignments are never reclaimed.  So the
+  // first 64 threads in the process to use this mode get budgets of their own, but after that --
+  // e.g. in a program which keeps starting new threads -- two threads may share a budget (and its
+  // cache line) even if few are running at once.  Sharing never lets a thread read more than the
+  // limit; it only makes the threads involved run out sooner.
+
+  uint64_t sharedTraversalLimitInWords = kj::maxValue;
+  // Only applies if traversalLimitPerThread is true:  an additional limit on the total traversed
+  // by all threads together.  Threads draw from it 8192 words at a time, so one thread may hit the
+  // limit while others still hold a little unused budget.
 };
 
 class MessageReader {
@@ -122,6 +144,23 @@ public:
   bool isCanonical();
   // Returns whether the message encoded in the reader is in canonical form.
 
+  void validateAll(uint threadCount = 1);
+  // Check the entire message in one pass, throwing an exception if any pointer reachable from the
+  // root is out-of-bounds or malformed, if nesting is too deep, or if the traversal limit is
+  // exceeded.  If the check passes, the reader is switched to trusted mode:  from then on, getters
+  // skip bounds checks and traversal limit accounting, which are redundant once every object has
+  // been visited.  Checks that decide how to interpret a pointer (e.g. that a struct pointer is
+  // not a list) still apply.
+  //
+  // Use this on input which is read many times after being received once, e.g. a message that is
+  // validated at ingress and then consulted repeatedly.  Since getters no longer count reads,
+  // repeatedly traversing a trusted message is not bounded by the traversal limit.  Call this
+  // before sharing the reader among threads.
+  //
+  // If `threadCount` is greater than 1, large lists are checked by up to that many threads at
+  // once.  This only pays off for messages of many megabytes.  See AnyPointer::Reader::targetSize()
+  // for how this interacts with the traversal limit.
+
 private:
   ReaderOptions options;
 
@@ -227,6 +266,33 @@ public:
   bool isCanonical();
   // Check whether the message builder is in canonical form
 
+  struct SpaceUsage {
+    size_t segmentCount;
+    size_t allocatedWords;   // Total size of all segments, including space not yet used.
+    size_t usedWords;        // Words in use, i.e. the total size of getSegmentsForOutput().
+    size_t liveWords;        // Words reachable from the root, including the root pointer.
+    size_t farPointerWords;  // Words occupied by far pointer landing pads.
+    size_t deadWords;        // Words in use but unreachable: garbage left behind by replaced
+                             // objects, plus any orphans which haven't been adopted.
+  };
+
+  SpaceUsage getSpaceUsage();
+  // Measure how much of the message's space is wasted.  Objects which are replaced, resized, or
+  // upgraded to a larger struct size leave their old space behind, zeroed, and objects allocated
+  // after a segment fills up need far pointers.  This traverses the whole message, so it costs
+  // about as much as computing totalSize().
+
+  void compact();
+  // Rewrite the message into a single segment holding exactly its live content, with no dead
+  // words and no far pointers.  All existing Builders and Orphans pointing into the message become
+  // invalid.  If the content fits in the current first segment, it is copied back there;
+  // otherwise, allocateSegment() is called once for a new first segment, which (as usual) may be
+  // bigger than requested.  The old segments are zeroed but stay with the subclass, which frees
+  // or reuses them as it normally would -- e.g. MallocMessageBuilder only frees them when it is
+  // destroyed.
+  //
+  // The message must not contain capabilities.
+
 private:
   void* arenaSpace[22];
   // Space in which we can construct a BuilderArena.  We don't use BuilderArena directly here
@@ -244,6 +310,59 @@ private:
   _::BuilderArena* arena() { return reinterpret_cast<_::BuilderArena*>(arenaSpace); }
   _::SegmentBuilder* getRootSegment();
   AnyPointer::Builder getRootInternal();
+
+  friend class ConcurrentBuilder;
+
+protected:
+  void discardArena();
+  // Destroys the message content (including any capabilities it holds) so that the next call to
+  // initRoot(), getRoot(), etc. starts a new message, calling allocateSegment() again from
+  // scratch.  The subclass is responsible for zeroing any segment space it intends to hand out
+  // again; call getSegmentsForOutput() *before* this to find out which words were used.
+};
+
+class ConcurrentBuilder {
+  // While a ConcurrentBuilder exists, multiple threads may build the same message at once, e.g.
+  // to fill in the elements of a very large list in parallel.  Each such thread must hold a Lane,
+  // and all new objects the thread allocates go into the Lane's own segments, so the threads
+  // never contend except when one of them needs a new segment.
+  //
+  // Objects which already existed when the ConcurrentBuilder was created, or which were created
+  // by a Lane that has since been destroyed, may be modified by any thread, as long as no two
+  // threads modify the same struct or list element at once.  If a thread sets a pointer in such an
+  // object, the target is allocated in the thread's own segment and linked with a far pointer.
+  // Objects created by a Lane which still exists belong to that Lane's thread.  So, a typical
+  // pattern is for each thread to fill in its own range of a pre-allocated list, or to build
+  // orphans which the main thread adopts after the workers are done.
+  //
+  // Capabilities may not be set while building concurrently, and getSegmentsForOutput() may not
+  // be called.  Adding a segment takes a lock in this mode, but looking segments up does not.
+  //
+  // Once all Lanes and the ConcurrentBuilder are destroyed, the message goes back to normal.  Any
+  // space left over in the segments can then be used again.
+
+public:
+  explicit ConcurrentBuilder(MessageBuilder& message);
+  // Allocates the root pointer if necessary.  Must not be called while other threads are using
+  // the message.
+  KJ_DISALLOW_COPY(ConcurrentBuilder);
+  ~ConcurrentBuilder() noexcept(false);
+  // All Lanes must have been destroyed.
+
+  class Lane {
+  public:
+    explicit Lane(ConcurrentBuilder& builder);
+    // Enables the calling thread to build the message.  Must be destroyed in the same thread.
+    KJ_DISALLOW_COPY(Lane);
+    ~Lane() noexcept(false);
+
+  private:
+    _::BuilderArena* arena;
+    _::BuilderLane* lane;
+  };
+
+private:
+  _::BuilderArena* arena;
 };
 
 template <typename RootType>
@@ -346,6 +465,63 @@ enum class AllocationStrategy: uint8_t {
 constexpr uint SUGGESTED_FIRST_SEGMENT_WORDS = 1024;
 constexpr AllocationStrategy SUGGESTED_ALLOCATION_STRATEGY = AllocationStrategy::GROW_HEURISTICALLY;
 
+class MessageSizeHistory {
+  // Remembers the final sizes of recently-built messages of one kind (e.g. built at one call site,
+  // or the requests of one RPC method) and suggests a first segment size for the next one:  a
+  // percentile of the recent sizes, so that most messages fit in a single segment without
+  // allocating (and zeroing) much more than they need.
+  //
+  // Pass a MessageSizeHistory to MallocMessageBuilder and sizes are recorded automatically when the
+  // builder is destroyed.  MessageBuilderPool::getAdaptive() does the same for pooled builders.
+  //
+  // Not thread-safe.  Use one history per thread.
+
+public:
+  explicit MessageSizeHistory(uint percentile = 90, uint historySize = 32);
+  // `percentile` is the percentage of recent messages that the suggested first segment should be
+  // big enough to hold.  `historySize` is the number of recent messages remembered.
+
+  KJ_DISALLOW_COPY(MessageSizeHistory);
+
+  inline uint getFirstSegmentWords() const { return firstSegmentWords; }
+  // Suggested first segment size.  SUGGESTED_FIRST_SEGMENT_WORDS until some size is recorded.
+
+  void record(size_t messageWords);
+  // Record the total size of a finished message.
+
+  void record(MessageBuilder& builder);
+  // Record the total size of the builder's message, as per getSegmentsForOutput().
+
+private:
+  uint percentile;
+  uint firstSegmentWords = SUGGESTED_FIRST_SEGMENT_WORDS;
+  kj::Array<uint> sizes;
+  kj::Array<uint> scratch;
+  uint count = 0;
+  // Number of sizes recorded so far.  The most recent is `sizes[(count - 1) % sizes.size()]`.
+};
+
+class MessageSizeHistoryMap {
+  // A MessageSizeHistory for each of a set of keys, created on first use.  Not thread-safe.
+
+public:
+  explicit MessageSizeHistoryMap(uint percentile = 90, uint historySize = 32);
+  KJ_DISALLOW_COPY(MessageSizeHistoryMap);
+  ~MessageSizeHistoryMap() noexcept(false);
+
+  MessageSizeHistory& get(uint64_t key);
+
+  static uint64_t methodKey(uint64_t interfaceId, uint16_t methodId);
+  // A key for messages of a particular method, e.g. its requests.
+
+private:
+  uint percentile;
+  uint historySize;
+
+  struct Impl;
+  kj::Own<Impl> impl;
+};
+
 class MallocMessageBuilder: public MessageBuilder {
   // A simple MessageBuilder that uses malloc() (actually, calloc()) to allocate segments.  This
   // implementation should be reasonable for any case that doesn't require writing the message to
@@ -375,6 +551,11 @@ public:
   // firstSegment MUST be zero-initialized.  MallocMessageBuilder's destructor will write new zeros
   // over any space that was used so that it can be reused.
 
+  explicit MallocMessageBuilder(MessageSizeHistory& history,
+      AllocationStrategy allocationStrategy = SUGGESTED_ALLOCATION_STRATEGY);
+  // This version takes the first segment size from `history`, and records the size of the final
+  // message in it on destruction.  `history` must outlive the builder.
+
   KJ_DISALLOW_COPY(MallocMessageBuilder);
   virtual ~MallocMessageBuilder() noexcept(false);
 
@@ -389,10 +570,99 @@ private:
 
   void* firstSegment;
 
+  MessageSizeHistory* history = nullptr;
+
   struct MoreSegments;
   kj::Maybe<kj::Own<MoreSegments>> moreSegments;
 };
 
+class ReusableMessageBuilder final: public MessageBuilder {
+  // A MessageBuilder which, like MallocMessageBuilder, allocates segments with calloc(), but which
+  // can be reset() and used to build another message without freeing them.  This is useful when
+  // building lots of short-lived messages in a loop, e.g. in an RPC server, where allocating and
+  // freeing segments (and page-faulting in fresh memory) for every message would dominate.
+  //
+  // Resetting only re-zeros the words that the previous message actually used, so the cost is
+  // proportional to the message size rather than the segment size.
+  //
+  // If a message needed more than one segment, the segments are coalesced on reset so that the
+  // next message of similar size fits in a single segment.
+
+public:
+  explicit ReusableMessageBuilder(uint firstSegmentWords = SUGGESTED_FIRST_SEGMENT_WORDS,
+      AllocationStrategy allocationStrategy = SUGGESTED_ALLOCATION_STRATEGY,
+      uint maxRetainedWords = 1u << 20);
+  // `firstSegmentWords` and `allocationStrategy` have the same meaning as for
+  // MallocMessageBuilder.  `maxRetainedWords` limits how much memory reset() will hold on to;
+  // if the previous message was larger than this, its segments are freed rather than kept, so
+  // that one huge message doesn't permanently pin a large amount of memory.
+
+  KJ_DISALLOW_COPY(ReusableMessageBuilder);
+  ~ReusableMessageBuilder() noexcept(false);
+
+  void reset();
+  // Discard the current message and prepare to build a new one, keeping the allocated segments.
+  // All Builders, Readers, and Orphans pointing into the old message become invalid.
+
+  void setFirstSegmentWords(uint firstSegmentWords);
+  // Change the minimum size of the first segment for subsequent messages.  A retained first
+  // segment smaller than this will be replaced on next use.
+
+  size_t getRetainedWords() const;
+  // Total size of the segments currently held by this builder, in words.
+
+  kj::ArrayPtr<word> allocateSegment(uint minimumSize) override;
+
+private:
+  uint firstSegmentWords;
+  uint nextSize;
+  uint maxRetainedWords;
+  AllocationStrategy allocationStrategy;
+
+  kj::Vector<kj::ArrayPtr<word>> segments;
+  // All segments we own, in the order they were handed out to the arena.
+
+  uint segmentsInUse = 0;
+  // Number of entries in `segments` handed out for the current message.
+
+  void freeSegments();
+};
+
+class MessageBuilderPool {
+  // Hands out MessageBuilders which return to the pool when their kj::Own is dropped, so that
+  // their segments can be reused for subsequent messages.  See ReusableMessageBuilder.
+  //
+  // The pool is not thread-safe: builders must be obtained and released in the pool's thread.
+  // Builders may safely outlive the pool, in which case they are simply freed when released.
+
+public:
+  explicit MessageBuilderPool(uint maxPooledBuilders = 16, uint maxRetainedWords = 1u << 20);
+  // `maxPooledBuilders` is the maximum number of idle builders that will be kept around; any
+  // builder released while the pool is full is freed.  `maxRetainedWords` is passed to each
+  // ReusableMessageBuilder.
+
+  KJ_DISALLOW_COPY(MessageBuilderPool);
+  ~MessageBuilderPool() noexcept(false);
+
+  kj::Own<MessageBuilder> get(uint firstSegmentWords = SUGGESTED_FIRST_SEGMENT_WORDS);
+  // Get an empty builder whose first segment will be at least `firstSegmentWords` in size.
+
+  kj::Own<MessageBuilder> getAdaptive(uint64_t sizeKey);
+  // Get an empty builder whose first segment size is learned from previous messages built with
+  // the same `sizeKey` (e.g. identifying a call site or message type; see MessageSizeHistoryMap).
+  // The message's size is recorded when the builder is released.
+
+  size_t getIdleCount();
+  // Number of idle builders currently held by the pool.
+
+private:
+  class PooledBuilder;
+  struct State;
+  kj::Own<State> state;
+
+  PooledBuilder& take(uint firstSegmentWords);
+};
+
 class FlatMessageBuilder: public MessageBuilder {
   // THIS IS NOT THE CLASS YOU'RE LOOKING FOR.
   //
@@ -503,6 +773,13 @@ kj::Array<word> canonicalize(T&& reader) {
     return _::PointerHelpers<FromReader<T>>::getInternalReader(reader).canonicalize();
 }
 
+template <typename T>
+uint64_t canonicalHash(T&& reader, uint64_t k0 = 0, uint64_t k1 = 0) {
+  // Hash a struct's canonical form without constructing it.  See
+  // AnyPointer::Reader::canonicalHash().
+  return AnyStruct::Reader(kj::fwd<T>(reader)).canonicalHash(k0, k1);
+}
+
 }  // namespace capnp
 
 #endif  // CAPNP_MESSAGE_H_
@@ -1747,6 +1747,78 @@ TEST(Orphans, ConcatenateStructListsUpgradeFromPrimitive) {
   EXPECT_FALSE(cat[3].hasOld2());
 }
 
+TEST(Orphans, ListAppenderInPlace) {
+  MallocMessageBuilder message;
+  auto root = message.initRoot<TestAllTypes>();
+
+  ListAppender<uint32_t> appender(message.getOrphanage(), 2);
+  for (uint i = 0; i < 100; i++) {
+    appender.add(i * 3);
+  }
+  EXPECT_EQ(100u, appender.size());
+  EXPECT_GE(appender.capacity(), 100u);
+  root.adoptUInt32List(appender.finish());
+
+  // Nothing else was allocated meanwhile, so the list grew in place and the message is exactly as
+  // big as if the list had been allocated at its final size.
+  MallocMessageBuilder expected;
+  expected.initRoot<TestAllTypes>().initUInt32List(100);
+  EXPECT_EQ(expected.getSegmentsForOutput()[0].size(), message.getSegmentsForOutput()[0].size());
+  auto reader = root.asReader().getUInt32List();
+  ASSERT_EQ(100u, reader.size());
+  for (uint i = 0; i < 100; i++) {
+    EXPECT_EQ(i * 3, reader[i]);
+  }
+}
+
+TEST(Orphans, ListAppenderRelocate) {
+  MallocMessageBuilder message;
+  auto root = message.initRoot<TestAllTypes>();
+  auto orphanage = message.getOrphanage();
+
+  ListAppender<TestAllTypes> structs(orphanage, 1);
+  ListAppender<Text> texts(orphanage, 1);
+  for (uint i = 0; i < 40; i++) {
+    // Interleaving the two lists means each one keeps having to move.
+    auto element = structs.add();
+    element.setInt32Field(i);
+    element.setTextField(kj::str("s", i));
+    texts.add(kj::str("t", i));
+  }
+
+  MallocMessageBuilder other;
+  auto otherRoot = other.initRoot<TestAllTypes>();
+  initTestMessage(otherRoot);
+  structs.add(otherRoot.asReader());
+
+  root.adoptStructList(structs.finish());
+  root.adoptTextList(texts.finish());
+
+  auto reader = root.asReader();
+  ASSERT_EQ(41u, reader.getStructList().size());
+  ASSERT_EQ(40u, reader.getTextList().size());
+  for (uint i = 0; i < 40; i++) {
+    EXPECT_EQ(i, reader.getStructList()[i].getInt32Field());
+    EXPECT_EQ(kj::str("s", i), reader.getStructList()[i].getTextField());
+    EXPECT_EQ(kj::str("t", i), reader.getTextList()[i]);
+  }
+  checkTestMessage(reader.getStructList()[40]);
+}
+
+TEST(Orphans, ListAppenderReserve) {
+  MallocMessageBuilder message;
+  ListAppender<TestEnum> appender(message.getOrphanage());
+  appender.reserve(50);
+  EXPECT_EQ(50u, appender.capacity());
+  for (uint i = 0; i < 50; i++) {
+    appender.add(TestEnum::QUX);
+  }
+  EXPECT_EQ(50u, appender.capacity());
+  auto orphan = appender.finish();
+  EXPECT_EQ(50u, orphan.getReader().size());
+  EXPECT_EQ(TestEnum::QUX, orphan.getReader()[49]);
+}
+
 }  // namespace
 }  // namespace _ (private)
 }  // namespace capnp
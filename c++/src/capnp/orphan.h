@@ -193,6 +193,59 @@ private:
   friend struct _::OrphanageInternal;
 };
 
+template <typename T>
+class ListAppender {
+  // Builds a List<T> whose final size isn't known upfront, without collecting the elements
+  // elsewhere first or guessing an upper bound.
+  //
+  // Elements are written directly into an orphaned list which is over-allocated.  When the list
+  // fills up, its capacity is doubled -- in place if the list is still the last object in its
+  // segment and the segment has room, otherwise by allocating a new list and moving the elements
+  // over (shallowly, like Orphan::truncate()).  finish() truncates the list to the number of
+  // elements actually added, which gives the unused space back to the segment when the list is
+  // still at its end.  So, in the common case where nothing else is allocated in the meantime,
+  // building the list involves no copying at all, and the final message is exactly as large as
+  // if the list had been allocated with the right size from the start.
+  //
+  // Relocation leaves a zero'd hole behind, but because the capacity doubles each time, the total
+  // size of the holes stays below the final capacity, i.e. under about twice the final size.
+  //
+  // Builders obtained from add() are invalidated by the next call that grows the list.
+
+public:
+  explicit ListAppender(Orphanage orphanage, uint initialCapacity = 8);
+  KJ_DISALLOW_COPY(ListAppender);
+  ListAppender(ListAppender&&) = default;
+  ListAppender& operator=(ListAppender&&) = default;
+
+  inline uint size() const { return count; }
+  inline uint capacity() const { return builder.size(); }
+
+  void reserve(uint minCapacity);
+  // Make sure there's room for at least `minCapacity` elements in total.
+
+  void add(ReaderFor<T> value);
+  // Append a copy of `value`.  For struct lists, this has the same caveats as
+  // List<T>::Builder::setWithCaveats().
+
+  BuilderFor<T> add();
+  // For struct lists only:  Append a default-valued element and return a builder for it.
+
+  BuilderFor<List<T>> asBuilder() { return builder; }
+  // The underlying list, including unused capacity at the end.  Invalidated by growth.
+
+  Orphan<List<T>> finish();
+  // Truncate the list to size() and return it, ready to be adopted.  The ListAppender must not be
+  // used afterwards.
+
+private:
+  Orphan<List<T>> orphan;
+  BuilderFor<List<T>> builder;
+  uint count = 0;
+
+  void grow(uint minCapacity);
+};
+
 // =======================================================================================
 // Inline implementation details.
 
@@ -208,6 +261,13 @@ struct OrphanGetImpl<T, Kind::PRIMITIVE> {
   }
 };
 
+template <typename T>
+struct OrphanGetImpl<T, Kind::ENUM> {
+  static inline void truncateListOf(_::OrphanBuilder& builder, ElementCount size) {
+    builder.truncate(size, _::elementSizeForType<T>());
+  }
+};
+
 template <typename T>
 struct OrphanGetImpl<T, Kind::STRUCT> {
   static inline typename T::Builder apply(_::OrphanBuilder& builder) {
@@ -435,6 +495,60 @@ inline Orphan<Data> Orphanage::referenceExternalData(Data::Reader data) const {
   return Orphan<Data>(_::OrphanBuilder::referenceExternalData(arena, data));
 }
 
+namespace _ {  // private
+
+template <typename T, Kind = CAPNP_KIND(T)>
+struct ListAppenderImpl {
+  static inline void set(BuilderFor<List<T>>& list, uint index, ReaderFor<T> value) {
+    list.set(index, value);
+  }
+};
+
+template <typename T>
+struct ListAppenderImpl<T, Kind::STRUCT> {
+  static inline void set(BuilderFor<List<T>>& list, uint index, ReaderFor<T> value) {
+    list.setWithCaveats(index, value);
+  }
+};
+
+}  // namespace _ (private)
+
+template <typename T>
+ListAppender<T>::ListAppender(Orphanage orphanage, uint initialCapacity)
+    : orphan(orphanage.newOrphan<List<T>>(kj::max(initialCapacity, 1u))),
+      builder(orphan.get()) {}
+
+template <typename T>
+inline void ListAppender<T>::reserve(uint minCapacity) {
+  if (minCapacity > builder.size()) grow(minCapacity);
+}
+
+template <typename T>
+inline void ListAppender<T>::add(ReaderFor<T> value) {
+  if (count == builder.size()) grow(count + 1);
+  _::ListAppenderImpl<T>::set(builder, count++, value);
+}
+
+template <typename T>
+inline BuilderFor<T> ListAppender<T>::add() {
+  static_assert(CAPNP_KIND(T) == Kind::STRUCT, "add() with no value is only for struct lists.");
+  if (count == builder.size()) grow(count + 1);
+  return builder[count++];
+}
+
+template <typename T>
+void ListAppender<T>::grow(uint minCapacity) {
+  orphan.truncate(kj::max(minCapacity, builder.size() * 2));
+  builder = orphan.get();
+}
+
+template <typename T>
+Orphan<List<T>> ListAppender<T>::finish() {
+  orphan.truncate(count);
+  return kj::mv(orphan);
+}
+
+
 }  // namespace capnp
 
 #endif  // CAPNP_ORPHAN_H_
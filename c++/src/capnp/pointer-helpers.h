@@ -36,6 +36,145 @@ namespace _ {  // private
 // layout.h with the high-level public API and generated types.  This way, the code generator
 // and other templates do not have to specialize on each kind of pointer.
 
+template <typename T>
+struct VoidIfValid_ { typedef void Type; };
+
+template <typename T, typename = void>
+struct StructHelpers {
+  // Deep copy, size computation, and validation of struct type T.  This generic version defers to
+  // the schema-agnostic code in layout.c++.  The specialization below is chosen instead when
+  // capnpc-c++ generated type-specific code for T, which is requested with the $Cxx.specialize
+  // annotation.
+  //
+  // The PointerReader overloads treat a null pointer as "nothing to do".  The *List() variants
+  // operate on pointers to List(T).
+
+  static inline void copy(PointerBuilder dst, StructReader src) { dst.setStruct(src); }
+  static inline void copy(PointerBuilder dst, PointerReader src) { dst.copyFrom(src); }
+  static inline void copyList(PointerBuilder dst, PointerReader src) { dst.copyFrom(src); }
+
+  static inline MessageSizeCounts totalSize(StructReader src) { return src.totalSize(); }
+  static inline MessageSizeCounts targetSize(PointerReader src) { return src.targetSize(); }
+  static inline MessageSizeCounts listTargetSize(PointerReader src) { return src.targetSize(); }
+  // Unlike totalSize(), targetSize() and listTargetSize() count against the traversal limit.
+
+  static inline void validate(StructReader src) { src.totalSize(); }
+  static inline void validate(PointerReader src) { src.targetSize(); }
+  static inline void validateList(PointerReader src) { src.targetSize(); }
+  // Throws if any object reachable from `src` is out-of-bounds.
+};
+
+template <typename T>
+struct StructHelpers<T, typename VoidIfValid_<decltype(&T::_capnpPrivate::copyPointers)>::Type> {
+  // Version for types with generated code.  The generated functions, which are members of
+  // T::_capnpPrivate, handle the struct's pointer section, one pointer field at a time:
+  //
+  //     static void copyPointers(StructBuilder dst, StructReader src);
+  //     static MessageSizeCounts pointerTargetsSize(StructReader src);
+  //     static void validatePointers(StructReader src);
+  //
+  // They may assume that `src` has exactly the layout of T (a source using a different version
+  // of the schema is handed to the generic code instead) and that `dst` was freshly initialized.
+
+  static inline bool hasLayout(StructReader src) {
+    return src.getDataSectionSize() == structSize<T>().data * BITS_PER_WORD &&
+           src.getPointerSectionSize() == structSize<T>().pointers;
+  }
+
+  static inline bool hasLayout(const ListReader& list) {
+    // Whether all elements of the list have T's layout.
+    return list.getElementSize() == ElementSize::INLINE_COMPOSITE &&
+           list.size() > 0 * ELEMENTS && hasLayout(list.getStructElement(0 * ELEMENTS));
+  }
+
+  static void copyContent(StructBuilder dst, StructReader src) {
+    auto data = src.getDataSectionAsBlob();
+    memcpy(dst.getDataSectionAsBlob().begin(), data.begin(), data.size());
+    T::_capnpPrivate::copyPointers(dst, src);
+  }
+
+  static MessageSizeCounts contentSize(StructReader src) {
+    MessageSizeCounts result = { structSize<T>().total(), 0, 0 * WORDS };
+    result += T::_capnpPrivate::pointerTargetsSize(src);
+    return result;
+  }
+
+  static void copy(PointerBuilder dst, StructReader src) {
+    if (hasLayout(src)) {
+      copyContent(dst.initStruct(structSize<T>()), src);
+    } else {
+      dst.setStruct(src);
+    }
+  }
+
+  static void copy(PointerBuilder dst, PointerReader src) {
+    if (!src.isNull()) {
+      copy(dst, src.getStruct(nullptr));
+    }
+  }
+
+  static void copyList(PointerBuilder dst, PointerReader src) {
+    if (src.isNull()) return;
+    ListReader list = src.getList(ElementSize::INLINE_COMPOSITE, nullptr);
+    if (!hasLayout(list)) {
+      dst.setList(list);
+      return;
+    }
+
+    ListBuilder result = dst.initStructList(list.size(), structSize<T>());
+    for (ElementCount i = 0 * ELEMENTS; i < list.size(); i += 1 * ELEMENTS) {
+      copyContent(result.getStructElement(i), list.getStructElement(i));
+    }
+  }
+
+  static MessageSizeCounts totalSize(StructReader src) {
+    if (!hasLayout(src)) return src.totalSize();
+    MessageSizeCounts result = contentSize(src);
+    src.unread(result.wordCount);
+    return result;
+  }
+
+  static MessageSizeCounts targetSize(PointerReader src) {
+    if (src.isNull()) return MessageSizeCounts { 0 * WORDS, 0, 0 * WORDS };
+    StructReader s = src.getStruct(nullptr);
+    return hasLayout(s) ? contentSize(s) : src.targetSize();
+  }
+
+  static MessageSizeCounts listTargetSize(PointerReader src) {
+    if (src.isNull()) return MessageSizeCounts { 0 * WORDS, 0, 0 * WORDS };
+    ListReader list = src.getList(ElementSize::INLINE_COMPOSITE, nullptr);
+    if (!hasLayout(list)) return src.targetSize();
+
+    MessageSizeCounts result = { POINTER_SIZE_IN_WORDS, 0, 0 * WORDS };  // the tag
+    for (ElementCount i = 0 * ELEMENTS; i < list.size(); i += 1 * ELEMENTS) {
+      result += contentSize(list.getStructElement(i));
+    }
+    return result;
+  }
+
+  static void validate(StructReader src) {
+    if (hasLayout(src)) {
+      T::_capnpPrivate::validatePointers(src);
+    } else {
+      src.totalSize();
+    }
+  }
+
+  static void validate(PointerReader src) {
+    if (!src.isNull()) {
+      validate(src.getStruct(nullptr));
+    }
+  }
+
+  static void validateList(PointerReader src) {
+    if (src.isNull()) return;
+    ListReader list = src.getList(ElementSize::INLINE_COMPOSITE, nullptr);
+    for (ElementCount i = 0 * ELEMENTS; i < list.size(); i += 1 * ELEMENTS) {
+      validate(list.getStructElement(i));
+    }
+  }
+};
+
 template <typename T>
 struct PointerHelpers<T, Kind::STRUCT> {
   static inline typename T::Reader get(PointerReader reader, const word* defaultValue = nullptr) {
@@ -46,7 +185,7 @@ struct PointerHelpers<T, Kind::STRUCT> {
     return typename T::Builder(builder.getStruct(structSize<T>(), defaultValue));
   }
   static inline void set(PointerBuilder builder, typename T::Reader value) {
-    builder.setStruct(value._reader);
+    StructHelpers<T>::copy(builder, value._reader);
   }
   static inline void setCanonical(PointerBuilder builder, typename T::Reader value) {
     builder.setStruct(value._reader, true);
@@ -0,0 +1,980 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#if __linux__
+
+#include "rpc-shm.h"
+#include <kj/debug.h>
+#include <map>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+
+#ifndef MFD_CLOEXEC
+#define MFD_CLOEXEC 0x0001U
+#endif
+
+namespace capnp {
+
+namespace {
+
+// The region starts with a RegionHeader, followed by one area per direction holding, in order,
+// the message ring, the free ring, and the segment pool.  Each area and each pool starts on a
+// page boundary.
+//
+// A message is published by writing its segments into the sender's pool and pushing a descriptor
+// onto the message ring:  the segment count, then the byte offset within the pool and size in
+// words of each segment.  When the receiver drops the message, it pushes each segment's offset
+// onto the free ring, and the sender takes the space back.  Each ring has exactly one producer and
+// one consumer, so it needs nothing but a head and a tail.
+
+constexpr uint64_t SHM_MAGIC = 0x4d48535f504e5043ull;  // "CPNP_SHM"
+
+constexpr size_t BLOCK_BYTES = 256;
+// Granularity of pool allocations.  This bounds the number of segments alive at once, which lets
+// us size the rings so they can never overflow.
+
+constexpr uint64_t MAX_SEGMENTS = 512;
+// Maximum number of segments in one incoming message, the same limit the stream reader applies.
+
+struct RingHeader {
+  alignas(64) uint64_t head;   // Advanced by the consumer.
+  alignas(64) uint64_t tail;   // Advanced by the producer.
+};
+
+struct SideHeader {
+  alignas(64) uint32_t waitingForMessages;
+  uint32_t waitingForSpace;
+  // Set by this side before it sleeps on its eventfd.  The other side clears the flag and signals
+  // the eventfd after publishing a message / releasing segments, respectively.
+
+  uint32_t closed;
+  // Set once this side will send no more messages.
+};
+
+struct DirectionHeader {
+  RingHeader messages;  // Message descriptors, from the sending side.
+  RingHeader frees;     // Offsets of released segments, back from the receiving side.
+};
+
+struct RegionHeader {
+  uint64_t magic;
+  uint64_t poolBytes;
+  uint64_t messageRingWords;
+  uint64_t freeRingWords;
+
+  SideHeader sides[2];
+  DirectionHeader directions[2];
+  // Both indexed by rpc::twoparty::Side.  directions[CLIENT] carries messages sent by the client.
+};
+
+inline size_t roundUp(size_t n, size_t unit) {
+  return (n + unit - 1) / unit * unit;
+}
+
+inline size_t roundUpToPowerOfTwo(size_t n) {
+  size_t result = 1;
+  while (result < n) result <<= 1;
+  return result;
+}
+
+inline uint sideIndex(rpc::twoparty::Side side) {
+  return static_cast<uint>(side);
+}
+
+inline size_t spanFor(size_t words) {
+  // Pool bytes taken by a segment of `words` words.  Zero-size segments still take a block so
+  // that they have a distinct offset.
+  return roundUp(kj::max(words, size_t(1)) * sizeof(word), BLOCK_BYTES);
+}
+
+struct Layout {
+  size_t poolBytes;
+  size_t messageRingWords;
+  size_t freeRingWords;
+  size_t areaOffsets[2];
+  size_t poolOffset;    // Within an area.
+  size_t totalBytes;
+
+  explicit Layout(size_t requestedPoolBytes) {
+    size_t pageSize = sysconf(_SC_PAGESIZE);
+    poolBytes = roundUp(requestedPoolBytes, pageSize);
+
+    // A descriptor takes one word plus two per segment, and each segment holds at least one block
+    // of the pool until it is released, so three words per block is enough.  Likewise a free
+    // ring entry is one word per segment.
+    size_t blocks = poolBytes / BLOCK_BYTES;
+    messageRingWords = roundUpToPowerOfTwo(blocks * 3);
+    freeRingWords = roundUpToPowerOfTwo(blocks);
+
+    poolOffset = roundUp((messageRingWords + freeRingWords) * sizeof(uint64_t), pageSize);
+    size_t areaBytes = poolOffset + poolBytes;
+    areaOffsets[0] = roundUp(sizeof(RegionHeader), pageSize);
+    areaOffsets[1] = areaOffsets[0] + areaBytes;
+    totalBytes = areaOffsets[1] + areaBytes;
+  }
+};
+
+class Ring {
+  // View of one single-producer, single-consumer ring of words in the shared region.  `head` and
+  // `tail` count words pushed since the start and are never wrapped; slots are indexed modulo the
+  // capacity, which is a power of two.
+
+public:
+  Ring() = default;
+  Ring(RingHeader& header, uint64_t* slots, size_t capacity)
+      : header(&header), slots(slots), mask(capacity - 1) {}
+
+  // Producer side.
+
+  size_t space() {
+    return mask + 1 - (__atomic_load_n(&header->tail, __ATOMIC_RELAXED) -
+                       __atomic_load_n(&header->head, __ATOMIC_ACQUIRE));
+  }
+
+  void push(kj::ArrayPtr<const uint64_t> words) {
+    // The caller must have checked space().
+    uint64_t tail = __atomic_load_n(&header->tail, __ATOMIC_RELAXED);
+    for (auto w: words) {
+      slots[tail++ & mask] = w;
+    }
+    __atomic_store_n(&header->tail, tail, __ATOMIC_RELEASE);
+  }
+
+  // Consumer side.
+
+  size_t available() {
+    return __atomic_load_n(&header->tail, __ATOMIC_ACQUIRE) -
+           __atomic_load_n(&header->head, __ATOMIC_RELAXED);
+  }
+
+  uint64_t peek(size_t i) {
+    return slots[(__atomic_load_n(&header->head, __ATOMIC_RELAXED) + i) & mask];
+  }
+
+  void pop(size_t n) {
+    __atomic_store_n(&header->head, __atomic_load_n(&header->head, __ATOMIC_RELAXED) + n,
+                     __ATOMIC_RELEASE);
+  }
+
+private:
+  RingHeader* header = nullptr;
+  uint64_t* slots = nullptr;
+  size_t mask = 0;
+};
+
+kj::AutoCloseFd dupFd(int fd) {
+  int result;
+  KJ_SYSCALL(result = fcntl(fd, F_DUPFD_CLOEXEC, 0));
+  return kj::AutoCloseFd(result);
+}
+
+kj::AutoCloseFd newEventFd() {
+  int fd;
+  KJ_SYSCALL(fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK));
+  return kj::AutoCloseFd(fd);
+}
+
+}  // namespace
+
+ShmChannel ShmChannel::clone() const {
+  return { dupFd(memory), dupFd(wakeClient), dupFd(wakeServer),
+           dupFd(livenessClient), dupFd(livenessServer) };
+}
+
+ShmChannel newShmChannel(ShmChannelOptions options) {
+  KJ_REQUIRE(options.poolBytes >= 16 * BLOCK_BYTES, "shared memory pool too small",
+             options.poolBytes);
+  Layout layout(options.poolBytes);
+
+  // We call memfd_create() through syscall() since older glibc versions have no wrapper.
+  int fd;
+  KJ_SYSCALL(fd = syscall(SYS_memfd_create, "capnp-rpc-shm", MFD_CLOEXEC));
+  kj::AutoCloseFd memory(fd);
+  KJ_SYSCALL(ftruncate(memory, layout.totalBytes));
+
+  // A fresh memfd reads as zeros, so the rings start out empty and the pools start out zeroed,
+  // as MessageBuilder requires.  We only need to fill in the header.
+  void* mapping = mmap(nullptr, sizeof(RegionHeader), PROT_READ | PROT_WRITE, MAP_SHARED,
+                       memory, 0);
+  if (mapping == MAP_FAILED) {
+    KJ_FAIL_SYSCALL("mmap", errno);
+  }
+  auto header = reinterpret_cast<RegionHeader*>(mapping);
+  header->poolBytes = layout.poolBytes;
+  header->messageRingWords = layout.messageRingWords;
+  header->freeRingWords = layout.freeRingWords;
+  __atomic_store_n(&header->magic, SHM_MAGIC, __ATOMIC_RELEASE);
+  KJ_SYSCALL(munmap(mapping, sizeof(RegionHeader)));
+
+  int liveness[2];
+  KJ_SYSCALL(socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, liveness));
+
+  return { kj::mv(memory), newEventFd(), newEventFd(),
+           kj::AutoCloseFd(liveness[0]), kj::AutoCloseFd(liveness[1]) };
+}
+
+// =======================================================================================
+
+class ShmVatNetwork::Region final: public kj::Refcounted {
+  // One side's mapping of the region, plus that side's private bookkeeping of its send pool.
+
+public:
+  Region(ShmChannel channelParam, rpc::twoparty::Side side)
+      : channel(kj::mv(channelParam)),
+        selfIndex(sideIndex(side)),
+        peerIndex(side == rpc::twoparty::Side::CLIENT ? sideIndex(rpc::twoparty::Side::SERVER)
+                                                      : sideIndex(rpc::twoparty::Side::CLIENT)) {
+    struct stat stats;
+    KJ_SYSCALL(fstat(channel.memory, &stats));
+    size = stats.st_size;
+    KJ_REQUIRE(size >= sizeof(RegionHeader), "not a shared memory RPC channel");
+
+    void* mapping = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, channel.memory, 0);
+    if (mapping == MAP_FAILED) {
+      KJ_FAIL_SYSCALL("mmap", errno);
+    }
+    header = reinterpret_cast<RegionHeader*>(mapping);
+
+    Layout layout(header->poolBytes);
+    if (__atomic_load_n(&header->magic, __ATOMIC_ACQUIRE) != SHM_MAGIC ||
+        layout.poolBytes != header->poolBytes ||
+        layout.messageRingWords != header->messageRingWords ||
+        layout.freeRingWords != header->freeRingWords ||
+        layout.totalBytes > size) {
+      munmap(mapping, size);
+      KJ_FAIL_REQUIRE("not a shared memory RPC channel, or made by an incompatible version");
+    }
+    base = reinterpret_cast<byte*>(mapping);
+    poolBytes = layout.poolBytes;
+
+    auto ringsOf = [&](uint direction, Ring& messages, Ring& frees, byte*& pool) {
+      byte* area = base + layout.areaOffsets[direction];
+      auto slots = reinterpret_cast<uint64_t*>(area);
+      messages = Ring(header->directions[direction].messages, slots, layout.messageRingWords);
+      frees = Ring(header->directions[direction].frees, slots + layout.messageRingWords,
+                   layout.freeRingWords);
+      pool = area + layout.poolOffset;
+    };
+    ringsOf(selfIndex, outgoing, releasedToUs, sendPool);
+    ringsOf(peerIndex, incoming, releasedByUs, receivePool);
+
+    freeSpans[0] = poolBytes;
+  }
+
+  ~Region() noexcept(false) {
+    if (base != nullptr) {
+      KJ_SYSCALL(munmap(base, size)) { break; }
+    }
+  }
+
+  int wakeFd() {
+    return selfIndex == sideIndex(rpc::twoparty::Side::CLIENT) ? channel.wakeClient
+                                                               : channel.wakeServer;
+  }
+
+  kj::AutoCloseFd takeLiveness() {
+    // Take our end of the liveness socketpair, and close our copy of the peer's end so that ours
+    // hangs up when the peer's copies are gone.
+    if (selfIndex == sideIndex(rpc::twoparty::Side::CLIENT)) {
+      channel.livenessServer = nullptr;
+      return kj::mv(channel.livenessClient);
+    } else {
+      channel.livenessClient = nullptr;
+      return kj::mv(channel.livenessServer);
+    }
+  }
+
+  uint64_t getWakeupCount() { return wakeupCount; }
+  size_t getPoolBytes() { return poolBytes; }
+
+  void drainWakeups() {
+    // Reset our eventfd so that the next signal is a new edge.
+    uint64_t value;
+    ssize_t n;
+    KJ_NONBLOCKING_SYSCALL(n = read(wakeFd(), &value, sizeof(value)));
+  }
+
+  // Sending side -------------------------------------------------------------
+
+  word* sendPointer(size_t offset) {
+    return reinterpret_cast<word*>(sendPool + offset);
+  }
+
+  kj::Maybe<size_t> allocate(size_t bytes) {
+    // Allocate a zeroed span of at least `bytes` bytes from the send pool and return its offset,
+    // or null if there's no room right now.
+
+    size_t span = roundUp(bytes, BLOCK_BYTES);
+    reclaim();
+
+    // First fit.  Since free spans are coalesced and segments are released roughly in the order
+    // they were allocated, the free list stays short.
+    for (auto iter = freeSpans.begin(); iter != freeSpans.end(); ++iter) {
+      if (iter->second >= span) {
+        size_t offset = iter->first;
+        size_t remaining = iter->second - span;
+        freeSpans.erase(iter);
+        if (remaining > 0) {
+          freeSpans[offset + span] = remaining;
+        }
+        return offset;
+      }
+    }
+    return nullptr;
+  }
+
+  void free(size_t offset, size_t span) {
+    // Return a span to the send pool.  It must already be zeroed.
+
+    auto next = freeSpans.lower_bound(offset);
+    if (next != freeSpans.end() && offset + span == next->first) {
+      span += next->second;
+      next = freeSpans.erase(next);
+    }
+    if (next != freeSpans.begin()) {
+      auto prev = next;
+      --prev;
+      if (prev->first + prev->second == offset) {
+        prev->second += span;
+        return;
+      }
+    }
+    freeSpans.insert(next, std::make_pair(offset, span));
+  }
+
+  void reclaim() {
+    // Take back the segments the peer has released.
+
+    size_t n = releasedToUs.available();
+    for (size_t i = 0; i < n; i++) {
+      uint64_t offset = releasedToUs.peek(i);
+      auto iter = inUse.find(offset);
+      KJ_REQUIRE(iter != inUse.end(), "peer released a segment it wasn't sent", offset) {
+        continue;
+      }
+      memset(sendPool + offset, 0, iter->second);
+      free(offset, iter->second);
+      inUse.erase(iter);
+    }
+    releasedToUs.pop(n);
+  }
+
+  void publish(kj::ArrayPtr<const uint64_t> descriptor, kj::ArrayPtr<const size_t> spans) {
+    // Push a message descriptor.  `spans` gives the pool bytes held by each segment, which the
+    // peer now owns until it releases them.
+
+    for (uint i: kj::indices(spans)) {
+      inUse[descriptor[1 + i * 2]] = spans[i];
+    }
+    KJ_ASSERT(outgoing.space() >= descriptor.size(), "shared memory message ring overflowed");
+    outgoing.push(descriptor);
+    wakePeer(header->sides[peerIndex].waitingForMessages);
+  }
+
+  void close() {
+    if (closed) return;
+    closed = true;
+    __atomic_store_n(&header->sides[selfIndex].closed, 1, __ATOMIC_RELEASE);
+    signal();
+  }
+
+  // Receiving side -----------------------------------------------------------
+
+  struct Received {
+    kj::Array<kj::ArrayPtr<const word>> segments;
+    kj::Array<uint64_t> offsets;
+  };
+
+  bool canReceive() {
+    // Returns true if receive() won't block:  there is a message, or the peer has closed.
+    return __atomic_load_n(&header->sides[peerIndex].closed, __ATOMIC_ACQUIRE) ||
+           incoming.available() > 0;
+  }
+
+  kj::Maybe<Received> receive() {
+    size_t available = incoming.available();
+    if (available == 0) {
+      return nullptr;
+    }
+
+    uint64_t count = incoming.peek(0);
+    KJ_REQUIRE(count > 0 && count <= MAX_SEGMENTS && 1 + count * 2 <= available,
+               "shared memory message ring is corrupt", count, available);
+
+    Received result = {
+      kj::heapArray<kj::ArrayPtr<const word>>(count),
+      kj::heapArray<uint64_t>(count)
+    };
+    for (uint i = 0; i < count; i++) {
+      uint64_t offset = incoming.peek(1 + i * 2);
+      uint64_t words = incoming.peek(2 + i * 2);
+      KJ_REQUIRE(offset % sizeof(word) == 0 && words <= poolBytes / sizeof(word) &&
+                 offset <= poolBytes - words * sizeof(word),
+                 "message segment lies outside the shared memory pool", offset, words);
+      result.segments[i] = kj::arrayPtr(
+          reinterpret_cast<const word*>(receivePool + offset), words);
+      result.offsets[i] = offset;
+    }
+    incoming.pop(1 + count * 2);
+    return kj::mv(result);
+  }
+
+  void release(kj::ArrayPtr<const uint64_t> offsets) {
+    // Hand the segments of a received message back to the peer.  Called from destructors, so
+    // doesn't throw.
+
+    if (releasedByUs.space() < offsets.size()) {
+      // Can't happen unless the peer sent us overlapping segments.
+      KJ_LOG(ERROR, "shared memory free ring overflowed; leaking segments");
+      return;
+    }
+    releasedByUs.push(offsets);
+    wakePeer(header->sides[peerIndex].waitingForSpace);
+  }
+
+  // Waiting ------------------------------------------------------------------
+
+  bool sleep(bool wantMessages, bool wantSpace) {
+    // Tell the peer what we want to be woken for.  Returns true if it's already here, in case the
+    // peer published it before seeing our flags, in which case the caller should check again
+    // rather than wait.
+
+    auto& self = header->sides[selfIndex];
+    __atomic_store_n(&self.waitingForMessages, wantMessages, __ATOMIC_SEQ_CST);
+    __atomic_store_n(&self.waitingForSpace, wantSpace, __ATOMIC_SEQ_CST);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    return (wantMessages && canReceive()) || (wantSpace && releasedToUs.available() > 0);
+  }
+
+private:
+  ShmChannel channel;
+  uint selfIndex;
+  uint peerIndex;
+
+  byte* base = nullptr;
+  size_t size = 0;
+  RegionHeader* header = nullptr;
+  size_t poolBytes = 0;
+
+  Ring outgoing;       // Messages we send.
+  Ring releasedToUs;   // Our segments, released by the peer.
+  byte* sendPool = nullptr;
+
+  Ring incoming;       // Messages the peer sends.
+  Ring releasedByUs;   // The peer's segments, released by us.
+  byte* receivePool = nullptr;
+
+  std::map<size_t, size_t> freeSpans;
+  // Free parts of the send pool:  offset -> size in bytes.  Only this side allocates from the
+  // send pool, so this lives in private memory.
+
+  std::map<size_t, size_t> inUse;
+  // Spans of the send pool held by the peer:  offset -> size in bytes.
+
+  uint64_t wakeupCount = 0;
+  bool closed = false;
+
+  void wakePeer(uint32_t& waiting) {
+    // Pairs with the fence in the peer's sleep():  either it sees what we just published, or we
+    // see its flag.
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (__atomic_load_n(&waiting, __ATOMIC_RELAXED) &&
+        __atomic_exchange_n(&waiting, 0, __ATOMIC_SEQ_CST)) {
+      signal();
+    }
+  }
+
+  void signal() {
+    int fd = peerIndex == sideIndex(rpc::twoparty::Side::CLIENT) ? channel.wakeClient
+                                                                 : channel.wakeServer;
+    uint64_t one = 1;
+    ssize_t n;
+    do {
+      n = write(fd, &one, sizeof(one));
+    } while (n < 0 && errno == EINTR);
+    // The only other possible error is EAGAIN if the counter would overflow, in which case the
+    // peer has plenty of wakeups pending already.
+    ++wakeupCount;
+  }
+};
+
+// =======================================================================================
+
+class ShmVatNetwork::SegmentBuilder final: public MessageBuilder {
+  // A MessageBuilder which allocates its segments directly in the send pool, so that sending the
+  // message only takes pushing a descriptor.  If the pool is full, segments come from the heap
+  // instead and are copied into the pool once there's room.
+
+public:
+  SegmentBuilder(kj::Own<Region> region, uint firstSegmentWords, bool usePool)
+      : region(kj::mv(region)), nextSize(firstSegmentWords), usePool(usePool) {}
+  KJ_DISALLOW_COPY(SegmentBuilder);
+
+  ~SegmentBuilder() noexcept(false) {
+    if (published) return;
+
+    // Never sent; the segments are still ours.
+    for (auto& segment: segments) {
+      if (segment.inPool()) {
+        memset(segment.space.begin(), 0, segment.span);
+        region->free(segment.offset, segment.span);
+      }
+    }
+  }
+
+  kj::ArrayPtr<word> allocateSegment(uint minimumSize) override {
+    uint size = kj::max(minimumSize, nextSize);
+    nextSize += size;
+
+    Segment segment;
+    if (usePool) {
+      KJ_IF_MAYBE(offset, region->allocate(size * sizeof(word))) {
+        segment.space = kj::arrayPtr(region->sendPointer(*offset), size);
+        segment.offset = *offset;
+        segment.span = spanFor(size);
+      }
+    }
+    if (segment.space == nullptr) {
+      segment.heap = kj::heapArray<word>(size);
+      memset(segment.heap.begin(), 0, size * sizeof(word));
+      segment.space = segment.heap;
+    }
+
+    segments.add(kj::mv(segment));
+    return segments.back().space;
+  }
+
+  size_t totalSpan() {
+    // Pool bytes the message will take once published.
+    size_t total = 0;
+    for (auto& segment: getSegmentsForOutput()) {
+      total += spanFor(segment.size());
+    }
+    return total;
+  }
+
+  bool tryPublish() {
+    // Push the message to the peer, first copying any segments not already in the pool.  Returns
+    // false if there isn't room for them yet.
+
+    KJ_ASSERT(!published);
+    auto output = getSegmentsForOutput();
+
+    if (order == nullptr) {
+      // Building is done.  Match the arena's segments to ours by address; any we don't know were
+      // added with Orphanage::referenceExternalData(), and must be copied just like heap segments.
+      order = kj::heapArray<uint>(output.size());
+      for (uint i: kj::indices(output)) {
+        uint j = 0;
+        while (j < segments.size() && segments[j].space.begin() != output[i].begin()) ++j;
+        if (j == segments.size()) {
+          Segment segment;
+          segment.space = kj::arrayPtr(const_cast<word*>(output[i].begin()), output[i].size());
+          segment.external = true;
+          segments.add(kj::mv(segment));
+        }
+        order[i] = j;
+      }
+
+      // Give back the unused tails of our pool segments.  Those were never written, so they're
+      // still zero.
+      for (uint i: kj::indices(output)) {
+        auto& segment = segments[order[i]];
+        if (segment.inPool()) {
+          size_t span = spanFor(output[i].size());
+          if (span < segment.span) {
+            region->free(segment.offset + span, segment.span - span);
+            segment.span = span;
+          }
+        }
+      }
+    }
+
+    kj::Vector<uint> copied(output.size());
+    for (uint i: kj::indices(output)) {
+      auto& segment = segments[order[i]];
+      if (!segment.inPool() && !segment.copied) {
+        size_t span = spanFor(output[i].size());
+        KJ_IF_MAYBE(offset, region->allocate(span)) {
+          memcpy(region->sendPointer(*offset), output[i].begin(), output[i].size() * sizeof(word));
+          segment.offset = *offset;
+          segment.span = span;
+          segment.copied = true;
+          copied.add(i);
+        } else {
+          // Undo, so the space isn't stuck with us while we wait.
+          for (uint j: copied) {
+            auto& undo = segments[order[j]];
+            memset(region->sendPointer(undo.offset), 0, output[j].size() * sizeof(word));
+            region->free(undo.offset, undo.span);
+            undo.copied = false;
+          }
+          return false;
+        }
+      }
+    }
+
+    auto descriptor = kj::heapArray<uint64_t>(1 + output.size() * 2);
+    auto spans = kj::heapArray<size_t>(output.size());
+    descriptor[0] = output.size();
+    for (uint i: kj::indices(output)) {
+      auto& segment = segments[order[i]];
+      descriptor[1 + i * 2] = segment.offset;
+      descriptor[2 + i * 2] = output[i].size();
+      spans[i] = segment.span;
+    }
+    region->publish(descriptor, spans);
+    published = true;
+    return true;
+  }
+
+private:
+  struct Segment {
+    kj::ArrayPtr<word> space;
+    // The space handed to the arena, or the external data.
+
+    kj::Array<word> heap;
+    // Non-null if the segment couldn't be placed in the pool.
+
+    bool external = false;
+    // The segment was added with Orphanage::referenceExternalData().  We don't own it.
+
+    size_t offset = 0;
+    size_t span = 0;
+    // Location and size of the segment's space in the pool.  For a heap or external segment, of
+    // its copy.
+
+    bool copied = false;
+    // For a heap or external segment, whether it has been copied into the pool.
+
+    bool inPool() const { return heap == nullptr && !external; }
+  };
+
+  kj::Own<Region> region;
+  uint nextSize;
+  bool usePool;
+  bool published = false;
+  kj::Vector<Segment> segments;
+
+  kj::Array<uint> order;
+  // Index in `segments` of each segment output by the arena, filled in by the first tryPublish().
+};
+
+class ShmVatNetwork::OutgoingMessageImpl final
+    : public OutgoingRpcMessage, public kj::Refcounted {
+public:
+  OutgoingMessageImpl(ShmVatNetwork& network, uint firstSegmentWordSize)
+      : network(network),
+        message(kj::addRef(*network.region),
+                firstSegmentWordSize == 0 ? SUGGESTED_FIRST_SEGMENT_WORDS : firstSegmentWordSize,
+                // While messages are waiting for space, build new ones on the heap, so that they
+                // can't take space the waiting ones need.
+                network.pending.size() == 0) {}
+
+  AnyPointer::Builder getBody() override {
+    return message.getRoot<AnyPointer>();
+  }
+
+  void send() override {
+    size_t size = totalWords();
+    KJ_REQUIRE(size < ReaderOptions().traversalLimitInWords, size,
+               "Trying to send Cap'n Proto message larger than the single-message size limit. The "
+               "other side probably won't accept it and would abort the connection, so I won't "
+               "send it.") {
+      return;
+    }
+
+    size_t span = message.totalSpan();
+    KJ_REQUIRE(span <= network.region->getPoolBytes(), span,
+               "Trying to send Cap'n Proto message larger than the shared memory pool.") {
+      return;
+    }
+
+    KJ_ASSERT(!network.isShutdown, "already shut down");
+
+    network.enqueue(kj::addRef(*this));
+  }
+
+  kj::Maybe<size_t> sizeInWords() override {
+    return totalWords();
+  }
+
+  bool tryPublish() { return message.tryPublish(); }
+
+private:
+  size_t totalWords() {
+    size_t size = 0;
+    for (auto& segment: message.getSegmentsForOutput()) {
+      size += segment.size();
+    }
+    return size;
+  }
+
+  ShmVatNetwork& network;
+  SegmentBuilder message;
+};
+
+class ShmVatNetwork::IncomingMessageImpl final: public IncomingRpcMessage {
+public:
+  IncomingMessageImpl(kj::Own<Region> region, Region::Received received,
+                      ReaderOptions options)
+      : region(kj::mv(region)),
+        offsets(kj::mv(received.offsets)),
+        segments(kj::mv(received.segments)),
+        message(segments, options) {}
+
+  ~IncomingMessageImpl() noexcept(false) {
+    region->release(offsets);
+  }
+
+  AnyPointer::Reader getBody() override {
+    return message.getRoot<AnyPointer>();
+  }
+
+private:
+  kj::Own<Region> region;
+  kj::Array<uint64_t> offsets;
+  kj::Array<kj::ArrayPtr<const word>> segments;
+  SegmentArrayMessageReader message;
+  // Reads the segments in place, in the peer's pool.
+};
+
+// =======================================================================================
+
+ShmVatNetwork::ShmVatNetwork(kj::UnixEventPort& eventPort, ShmChannel channel,
+                             rpc::twoparty::Side side, ReaderOptions receiveOptions)
+    : region(kj::refcounted<Region>(kj::mv(channel), side)),
+      side(side),
+      receiveOptions(receiveOptions),
+      peerVatId(4),
+      observer(eventPort, region->wakeFd(), kj::UnixEventPort::FdObserver::OBSERVE_READ),
+      liveness(region->takeLiveness()),
+      livenessObserver(eventPort, liveness, kj::UnixEventPort::FdObserver::OBSERVE_READ) {
+  peerVatId.initRoot<rpc::twoparty::VatId>().setSide(
+      side == rpc::twoparty::Side::CLIENT ? rpc::twoparty::Side::SERVER
+                                          : rpc::twoparty::Side::CLIENT);
+
+  auto paf = kj::newPromiseAndFulfiller<void>();
+  disconnectPromise = paf.promise.fork();
+  disconnectFulfiller.fulfiller = kj::mv(paf.fulfiller);
+
+  watchTask = watch().eagerlyEvaluate([](kj::Exception&& exception) {
+    KJ_LOG(ERROR, exception);
+  });
+  watchPeerTask = watchPeer().eagerlyEvaluate([](kj::Exception&& exception) {
+    KJ_LOG(ERROR, exception);
+  });
+}
+
+ShmVatNetwork::~ShmVatNetwork() noexcept(false) {
+  // Let the peer see EOF even if we weren't shut down cleanly.
+  region->close();
+}
+
+uint64_t ShmVatNetwork::getWakeupCount() {
+  return region->getWakeupCount();
+}
+
+void ShmVatNetwork::FulfillerDisposer::disposeImpl(void* pointer) const {
+  if (--refcount == 0) {
+    fulfiller->fulfill();
+  }
+}
+
+kj::Own<TwoPartyVatNetworkBase::Connection> ShmVatNetwork::asConnection() {
+  ++disconnectFulfiller.refcount;
+  return kj::Own<TwoPartyVatNetworkBase::Connection>(this, disconnectFulfiller);
+}
+
+kj::Maybe<kj::Own<TwoPartyVatNetworkBase::Connection>> ShmVatNetwork::connect(
+    rpc::twoparty::VatId::Reader ref) {
+  if (ref.getSide() == side) {
+    return nullptr;
+  } else {
+    return asConnection();
+  }
+}
+
+kj::Promise<kj::Own<TwoPartyVatNetworkBase::Connection>> ShmVatNetwork::accept() {
+  if (side == rpc::twoparty::Side::SERVER && !accepted) {
+    accepted = true;
+    return asConnection();
+  } else {
+    // Create a promise that will never be fulfilled.
+    auto paf = kj::newPromiseAndFulfiller<kj::Own<TwoPartyVatNetworkBase::Connection>>();
+    acceptFulfiller = kj::mv(paf.fulfiller);
+    return kj::mv(paf.promise);
+  }
+}
+
+kj::Promise<void> ShmVatNetwork::watch() {
+  return observer.whenBecomesReadable().then([this]() {
+    region->drainWakeups();
+    poll();
+    return watch();
+  });
+}
+
+kj::Promise<void> ShmVatNetwork::watchPeer() {
+  return livenessObserver.whenBecomesReadable().then([this]() -> kj::Promise<void> {
+    byte dummy;
+    ssize_t n;
+    KJ_NONBLOCKING_SYSCALL(n = recv(liveness, &dummy, sizeof(dummy), 0));
+    if (n != 0) {
+      // Spurious wakeup.
+      return watchPeer();
+    }
+
+    // The peer is gone.  Messages it already published are still in the ring and will be
+    // delivered, but nothing we send will ever be read.
+    peerGone = true;
+    pending.clear();
+    KJ_IF_MAYBE(f, drainedFulfiller) {
+      f->get()->fulfill();
+      drainedFulfiller = nullptr;
+    }
+    disconnectFulfiller.fulfiller->fulfill();
+    poll();
+    return kj::READY_NOW;
+  });
+}
+
+bool ShmVatNetwork::canReceive() {
+  return peerGone || region->canReceive();
+}
+
+void ShmVatNetwork::poll() {
+  for (;;) {
+    KJ_IF_MAYBE(f, receiveFulfiller) {
+      if (!f->get()->isWaiting()) {
+        // The receive was canceled.  Leave the message in the ring.
+        receiveFulfiller = nullptr;
+      } else if (canReceive()) {
+        auto fulfiller = kj::mv(*f);
+        receiveFulfiller = nullptr;
+        fulfiller->rejectIfThrows([&]() {
+          fulfiller->fulfill(receive());
+        });
+      }
+    }
+
+    if (pending.size() > 0) {
+      flushPending();
+    }
+
+    if (!region->sleep(receiveFulfiller != nullptr, pending.size() > 0)) {
+      break;
+    }
+  }
+}
+
+kj::Maybe<kj::Own<IncomingRpcMessage>> ShmVatNetwork::receive() {
+  KJ_IF_MAYBE(received, region->receive()) {
+    return kj::Own<IncomingRpcMessage>(kj::heap<IncomingMessageImpl>(
+        kj::addRef(*region), kj::mv(*received), receiveOptions));
+  } else {
+    return nullptr;
+  }
+}
+
+void ShmVatNetwork::enqueue(kj::Own<OutgoingMessageImpl> message) {
+  if (peerGone) {
+    // As with a broken socket, the message is lost.
+    return;
+  }
+
+  if (pending.size() == 0 && message->tryPublish()) {
+    return;
+  }
+
+  // No room yet.  poll() asks the peer to wake us when it releases some.
+  pending.add(kj::mv(message));
+  poll();
+}
+
+void ShmVatNetwork::flushPending() {
+  region->reclaim();
+
+  size_t n = 0;
+  while (n < pending.size() && pending[n]->tryPublish()) {
+    ++n;
+  }
+
+  if (n > 0) {
+    kj::Vector<kj::Own<OutgoingMessageImpl>> rest(pending.size() - n);
+    for (size_t i = n; i < pending.size(); i++) {
+      rest.add(kj::mv(pending[i]));
+    }
+    pending = kj::mv(rest);
+  }
+
+  if (pending.size() == 0) {
+    KJ_IF_MAYBE(f, drainedFulfiller) {
+      region->close();
+      f->get()->fulfill();
+      drainedFulfiller = nullptr;
+    }
+  }
+}
+
+rpc::twoparty::VatId::Reader ShmVatNetwork::getPeerVatId() {
+  return peerVatId.getRoot<rpc::twoparty::VatId>();
+}
+
+kj::Own<OutgoingRpcMessage> ShmVatNetwork::newOutgoingMessage(uint firstSegmentWordSize) {
+  return kj::refcounted<OutgoingMessageImpl>(*this, firstSegmentWordSize);
+}
+
+kj::Promise<kj::Maybe<kj::Own<IncomingRpcMessage>>> ShmVatNetwork::receiveIncomingMessage() {
+  if (canReceive()) {
+    return kj::evalNow([&]() { return receive(); });
+  }
+
+  auto paf = kj::newPromiseAndFulfiller<kj::Maybe<kj::Own<IncomingRpcMessage>>>();
+  receiveFulfiller = kj::mv(paf.fulfiller);
+  poll();
+  return kj::mv(paf.promise);
+}
+
+kj::Promise<void> ShmVatNetwork::shutdown() {
+  KJ_ASSERT(!isShutdown, "already shut down");
+  isShutdown = true;
+
+  if (pending.size() == 0) {
+    region->close();
+    return kj::READY_NOW;
+  }
+
+  auto paf = kj::newPromiseAndFulfiller<void>();
+  drainedFulfiller = kj::mv(paf.fulfiller);
+  return kj::mv(paf.promise);
+}
+
+}  // namespace capnp
+
+#endif  // __linux__
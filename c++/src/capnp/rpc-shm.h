@@ -0,0 +1,199 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef CAPNP_RPC_SHM_H_
+#define CAPNP_RPC_SHM_H_
+
+#if defined(__GNUC__) && !defined(CAPNP_HEADER_WARNINGS)
+#pragma GCC system_header
+#endif
+
+#if !__linux__
+#error "rpc-shm.h is only available on Linux."
+#endif
+
+#include "rpc-twoparty.h"
+#include <kj/async-unix.h>
+#include <kj/io.h>
+#include <kj/vector.h>
+
+namespace capnp {
+
+struct ShmChannelOptions {
+  size_t poolBytes = 4u << 20;
+  // Size of the segment pool in each direction, rounded up to a whole number of pages.  Every
+  // message that has been sent but not yet dropped by the receiver occupies space here.  When the
+  // pool is full, further messages are queued by the sender until the receiver releases some.
+  // A single message may not be larger than the pool.
+};
+
+struct ShmChannel {
+  // The file descriptors shared by the two ends of a shared-memory connection:  a memfd holding
+  // the message rings and segment pools for both directions, an eventfd for each side, used by
+  // the other side to wake it up, and the two ends of a socketpair which tell each side whether
+  // the other is still alive.
+  //
+  // Create one with newShmChannel(), then hand a copy to the peer -- e.g. let a child process
+  // inherit it across fork(), or send the descriptors over a Unix socket with SCM_RIGHTS.  Don't
+  // keep any other copies once both networks exist, or a peer that dies won't be noticed.
+
+  kj::AutoCloseFd memory;
+  kj::AutoCloseFd wakeClient;
+  kj::AutoCloseFd wakeServer;
+
+  kj::AutoCloseFd livenessClient;
+  kj::AutoCloseFd livenessServer;
+  // Each network keeps its own side's end open for as long as it exists and closes the other
+  // side's, so that its end hangs up once the peer's network -- or process -- is gone.
+
+  ShmChannel clone() const;
+  // Duplicate all the descriptors.
+};
+
+ShmChannel newShmChannel(ShmChannelOptions options = ShmChannelOptions());
+// Create and initialize the shared memory and eventfds for one connection.
+
+class ShmVatNetwork: public TwoPartyVatNetworkBase,
+                     private TwoPartyVatNetworkBase::Connection {
+  // A two-party `VatNetwork` for peers on the same host which passes messages through shared
+  // memory instead of a byte stream.  Outgoing messages are built directly in the shared segment
+  // pool, and the receiver reads them in place, so a message is never copied or written through
+  // the kernel.  The only system calls are eventfd writes to wake a peer that is actually
+  // waiting; a peer that is busy picks up new messages when it next checks, so under load most
+  // messages cost no system call at all.
+  //
+  // Both sides map the whole region writable, so the two processes must trust each other not to
+  // scribble on it:  incoming messages are bounds-checked as usual, but a peer that modifies a
+  // message while it is being read can defeat those checks.
+  //
+  // If the peer goes away without shutting down -- say its process crashes -- we notice when its
+  // end of the liveness socketpair closes:  onDisconnect() resolves, receiving returns EOF once
+  // the messages it had already sent are read, and whatever we send from then on is dropped.
+  //
+  // Each network must be used from a single thread, and incoming messages must be dropped in
+  // that thread too.
+
+public:
+  ShmVatNetwork(kj::UnixEventPort& eventPort, ShmChannel channel, rpc::twoparty::Side side,
+                ReaderOptions receiveOptions = ReaderOptions());
+  KJ_DISALLOW_COPY(ShmVatNetwork);
+  ~ShmVatNetwork() noexcept(false);
+
+  kj::Promise<void> onDisconnect() { return disconnectPromise.addBranch(); }
+  // Returns a promise that resolves when the peer disconnects.
+
+  rpc::twoparty::Side getSide() { return side; }
+
+  uint64_t getWakeupCount();
+  // Number of times this side has had to signal the peer's eventfd so far.
+
+  // implements VatNetwork -----------------------------------------------------
+
+  kj::Maybe<kj::Own<TwoPartyVatNetworkBase::Connection>> connect(
+      rpc::twoparty::VatId::Reader ref) override;
+  kj::Promise<kj::Own<TwoPartyVatNetworkBase::Connection>> accept() override;
+
+private:
+  class Region;
+  class SegmentBuilder;
+  class OutgoingMessageImpl;
+  class IncomingMessageImpl;
+
+  kj::Own<Region> region;
+  // The shared mapping.  Reference-counted, since incoming messages point into it and may
+  // outlive the network.
+
+  rpc::twoparty::Side side;
+  ReaderOptions receiveOptions;
+  MallocMessageBuilder peerVatId;
+  bool accepted = false;
+  bool isShutdown = false;
+
+  kj::Vector<kj::Own<OutgoingMessageImpl>> pending;
+  // Sent messages that didn't fit in the pool yet, in order.  Once this is non-empty, every new
+  // message goes here until the receiver has released enough space.
+
+  kj::Maybe<kj::Own<kj::PromiseFulfiller<kj::Maybe<kj::Own<IncomingRpcMessage>>>>>
+      receiveFulfiller;
+  kj::Maybe<kj::Own<kj::PromiseFulfiller<void>>> drainedFulfiller;
+  // Fulfilled by poll() when a message arrives / when `pending` empties after shutdown().
+
+  kj::UnixEventPort::FdObserver observer;
+  kj::Promise<void> watchTask = nullptr;
+
+  kj::AutoCloseFd liveness;
+  kj::UnixEventPort::FdObserver livenessObserver;
+  kj::Promise<void> watchPeerTask = nullptr;
+  bool peerGone = false;
+  // Our end of the liveness socketpair.  The peer never writes to it, so it becomes readable only
+  // when the peer's end is closed.
+
+  kj::Own<kj::PromiseFulfiller<kj::Own<TwoPartyVatNetworkBase::Connection>>> acceptFulfiller;
+  // Fulfiller for the promise returned by acceptConnectionAsRefHost() on the client side, or the
+  // second call on the server side.  Never fulfilled, because there is only one connection.
+
+  kj::ForkedPromise<void> disconnectPromise = nullptr;
+
+  class FulfillerDisposer: public kj::Disposer {
+    // See TwoPartyVatNetwork::FulfillerDisposer.
+
+  public:
+    mutable kj::Own<kj::PromiseFulfiller<void>> fulfiller;
+    mutable uint refcount = 0;
+
+    void disposeImpl(void* pointer) const override;
+  };
+  FulfillerDisposer disconnectFulfiller;
+
+  kj::Own<TwoPartyVatNetworkBase::Connection> asConnection();
+  // Returns a pointer to this with the disposer set to disconnectFulfiller.
+
+  kj::Promise<void> watch();
+  // Loop waiting on our eventfd and calling poll() on each wakeup.
+
+  kj::Promise<void> watchPeer();
+  // Wait for the liveness socket to hang up, then disconnect.
+
+  bool canReceive();
+  // Whether receive() won't block.
+
+  void poll();
+  // Deliver an arrived message to a waiting receive, publish pending messages that now fit, and
+  // tell the peer which of those we still need to be woken for.
+
+  kj::Maybe<kj::Own<IncomingRpcMessage>> receive();
+  // Take the next message from the ring, or return null if the peer has closed its side or gone
+  // away.  Only call once canReceive() returns true.
+
+  void enqueue(kj::Own<OutgoingMessageImpl> message);
+  void flushPending();
+
+  // implements Connection -----------------------------------------------------
+
+  rpc::twoparty::VatId::Reader getPeerVatId() override;
+  kj::Own<OutgoingRpcMessage> newOutgoingMessage(uint firstSegmentWordSize) override;
+  kj::Promise<kj::Maybe<kj::Own<IncomingRpcMessage>>> receiveIncomingMessage() override;
+  kj::Promise<void> shutdown() override;
+};
+
+}  // namespace capnp
+
+#endif  // CAPNP_RPC_SHM_H_
@@ -289,6 +289,14 @@ public:
         })));
       }
 
+      kj::Maybe<size_t> sizeInWords() override {
+        size_t size = 0;
+        for (auto& segment: message.getSegmentsForOutput()) {
+          size += segment.size();
+        }
+        return size;
+      }
+
     private:
       ConnectionImpl& connection;
       MallocMessageBuilder message;
@@ -367,6 +367,68 @@ TEST(TwoPartyNetwork, HugeMessage) {
   }
 }
 
+uint64_t countWritesForCalls(kj::AsyncIoContext& ioContext, uint callCount, uint callsPerTurn,
+                             kj::Maybe<WriteBatchOptions> writeOptions) {
+  // Make `callCount` pipelined calls, `callsPerTurn` at a time, and return how many writes the
+  // client made to send them.
+
+  int serverCallCount = 0;
+  int handleCount = 0;
+  auto serverThread = runServer(*ioContext.provider, serverCallCount, handleCount);
+
+  kj::Own<TwoPartyVatNetwork> network;
+  KJ_IF_MAYBE(options, writeOptions) {
+    network = kj::heap<TwoPartyVatNetwork>(*serverThread.pipe, rpc::twoparty::Side::CLIENT,
+                                           ioContext.provider->getTimer(), *options);
+  } else {
+    network = kj::heap<TwoPartyVatNetwork>(*serverThread.pipe, rpc::twoparty::Side::CLIENT);
+  }
+  auto rpcClient = makeRpcClient(*network);
+
+  auto client = getPersistentCap(rpcClient, rpc::twoparty::Side::SERVER,
+      test::TestSturdyRefObjectId::Tag::TEST_INTERFACE).castAs<test::TestInterface>();
+
+  kj::Vector<kj::Promise<void>> promises;
+  kj::Promise<void> turn = kj::READY_NOW;
+  for (uint i = 0; i < callCount; i += callsPerTurn) {
+    turn = turn.then([&,i]() {
+      for (uint j = i; j < kj::min(i + callsPerTurn, callCount); j++) {
+        auto request = client.fooRequest();
+        request.setI(123);
+        request.setJ(true);
+        promises.add(request.send().ignoreResult());
+      }
+      return kj::evalLater([]() {});
+    });
+  }
+  turn.wait(ioContext.waitScope);
+  kj::joinPromises(promises.releaseAsArray()).wait(ioContext.waitScope);
+
+  EXPECT_EQ(callCount, serverCallCount);
+  return network->getWriteCount();
+}
+
+TEST(TwoPartyNetwork, WriteCoalescing) {
+  auto ioContext = kj::setupAsyncIo();
+
+  // Calls made in the same turn go out together, whatever the options.
+  uint64_t sameTurn = countWritesForCalls(ioContext, 200, 200, nullptr);
+  KJ_LOG(INFO, "writes for 200 calls made in one turn", sameTurn);
+  EXPECT_LT(sameTurn, 20u);
+
+  // With a delay, calls made in separate turns are coalesced too.
+  WriteBatchOptions options;
+  options.maxDelay = 100 * kj::MILLISECONDS;
+  uint64_t separateTurns = countWritesForCalls(ioContext, 200, 1, options);
+  KJ_LOG(INFO, "writes for 200 calls made in separate turns, with delay", separateTurns);
+  EXPECT_LT(separateTurns, 20u);
+
+  // A byte limit overrides the delay.
+  options.maxBatchBytes = 1;
+  uint64_t unbatched = countWritesForCalls(ioContext, 20, 1, options);
+  EXPECT_GE(unbatched, 20u);
+}
+
 class TestAuthenticatedBootstrapImpl final
     : public test::TestAuthenticatedBootstrap<rpc::twoparty::VatId>::Server {
 public:
@@ -28,7 +28,20 @@ namespace capnp {
 TwoPartyVatNetwork::TwoPartyVatNetwork(kj::AsyncIoStream& stream, rpc::twoparty::Side side,
                                        ReaderOptions receiveOptions)
     : stream(stream), side(side), peerVatId(4),
-      receiveOptions(receiveOptions), previousWrite(kj::READY_NOW) {
+      incoming(stream, receiveOptions), writeQueue(stream), writeTasks(*this) {
+  init();
+}
+
+TwoPartyVatNetwork::TwoPartyVatNetwork(kj::AsyncIoStream& stream, rpc::twoparty::Side side,
+                                       kj::Timer& timer, WriteBatchOptions writeOptions,
+                                       ReaderOptions receiveOptions)
+    : stream(stream), side(side), peerVatId(4),
+      incoming(stream, receiveOptions), writeQueue(stream, timer, writeOptions),
+      writeTasks(*this) {
+  init();
+}
+
+void TwoPartyVatNetwork::init() {
   peerVatId.initRoot<rpc::twoparty::VatId>().setSide(
       side == rpc::twoparty::Side::CLIENT ? rpc::twoparty::Side::SERVER
                                           : rpc::twoparty::Side::CLIENT);
@@ -75,17 +88,15 @@ class TwoPartyVatNetwork::OutgoingMessageImpl final
 public:
   OutgoingMessageImpl(TwoPartyVatNetwork& network, uint firstSegmentWordSize)
       : network(network),
-        message(firstSegmentWordSize == 0 ? SUGGESTED_FIRST_SEGMENT_WORDS : firstSegmentWordSize) {}
+        message(network.builderPool.get(
+            firstSegmentWordSize == 0 ? SUGGESTED_FIRST_SEGMENT_WORDS : firstSegmentWordSize)) {}
 
   AnyPointer::Builder getBody() override {
-    return message.getRoot<AnyPointer>();
+    return message->getRoot<AnyPointer>();
   }
 
   void send() override {
-    size_t size = 0;
-    for (auto& segment: message.getSegmentsForOutput()) {
-      size += segment.size();
-    }
+    size_t size = totalWords();
     KJ_REQUIRE(size < ReaderOptions().traversalLimitInWords, size,
                "Trying to send Cap'n Proto message larger than the single-message size limit. The "
                "other side probably won't accept it and would abort the connection, so I won't "
@@ -93,22 +104,29 @@ public:
       return;
     }
 
-    network.previousWrite = KJ_ASSERT_NONNULL(network.previousWrite, "already shut down")
-        .then([&]() {
-      // Note that if the write fails, all further writes will be skipped due to the exception.
-      // We never actually handle this exception because we assume the read end will fail as well
-      // and it's cleaner to handle the failure there.
-      return writeMessage(network.stream, message);
-    }).attach(kj::addRef(*this))
-      // Note that it's important that the eagerlyEvaluate() come *after* the attach() because
-      // otherwise the message (and any capabilities in it) will not be released until a new
-      // message is written! (Kenton once spent all afternoon tracking this down...)
-      .eagerlyEvaluate(nullptr);
+    KJ_ASSERT(!network.isShutdown, "already shut down");
+
+    // The write queue batches this with any other messages sent in the same turn.  We hold on to
+    // the message until it has been written, and release it (and any capabilities in it) right
+    // after.
+    network.writeTasks.add(network.writeQueue.write(*message).attach(kj::addRef(*this)));
+  }
+
+  kj::Maybe<size_t> sizeInWords() override {
+    return totalWords();
   }
 
 private:
+  size_t totalWords() {
+    size_t size = 0;
+    for (auto& segment: message->getSegmentsForOutput()) {
+      size += segment.size();
+    }
+    return size;
+  }
+
   TwoPartyVatNetwork& network;
-  MallocMessageBuilder message;
+  kj::Own<MessageBuilder> message;
 };
 
 class TwoPartyVatNetwork::IncomingMessageImpl final: public IncomingRpcMessage {
@@ -133,9 +151,8 @@ kj::Own<OutgoingRpcMessage> TwoPartyVatNetwork::newOutgoingMessage(uint firstSeg
 
 kj::Promise<kj::Maybe<kj::Own<IncomingRpcMessage>>> TwoPartyVatNetwork::receiveIncomingMessage() {
   return kj::evalLater([&]() {
-    return tryReadMessage(stream, receiveOptions)
-        .then([&](kj::Maybe<kj::Own<MessageReader>>&& message)
-              -> kj::Maybe<kj::Own<IncomingRpcMessage>> {
+    return incoming.tryReadMessage().then([&](kj::Maybe<kj::Own<MessageReader>>&& message)
+                                              -> kj::Maybe<kj::Own<IncomingRpcMessage>> {
       KJ_IF_MAYBE(m, message) {
         return kj::Own<IncomingRpcMessage>(kj::heap<IncomingMessageImpl>(kj::mv(*m)));
       } else {
@@ -146,11 +163,16 @@ kj::Promise<kj::Maybe<kj::Own<IncomingRpcMessage>>> TwoPartyVatNetwork::receiveI
 }
 
 kj::Promise<void> TwoPartyVatNetwork::shutdown() {
-  kj::Promise<void> result = KJ_ASSERT_NONNULL(previousWrite, "already shut down").then([this]() {
+  KJ_ASSERT(!isShutdown, "already shut down");
+  isShutdown = true;
+  return writeQueue.whenDrained().then([this]() {
     stream.shutdownWrite();
   });
-  previousWrite = nullptr;
-  return kj::mv(result);
+}
+
+void TwoPartyVatNetwork::taskFailed(kj::Exception&& exception) {
+  // A write failed.  The queue fails all further writes, and the read end should notice the
+  // problem too; that's where we report it.
 }
 
 // =======================================================================================
@@ -555,6 +555,10 @@ private:
   // There are only four tables.  This definitely isn't a fifth table.  I don't know what you're
   // talking about.
 
+  MessageSizeHistoryMap callSizes;
+  // Sizes of recent outgoing calls of each method, used to size new ones when the caller gives no
+  // hint.
+
   size_t flowLimit;
   size_t callWordsInFlight = 0;
 
@@ -642,7 +646,7 @@ private:
 
       auto request = kj::heap<RpcRequest>(
           *connectionState, *connectionState->connection.get<Connected>(),
-          sizeHint, kj::addRef(*this));
+          interfaceId, methodId, sizeHint, kj::addRef(*this));
       auto callBuilder = request->getCall();
 
       callBuilder.setInterfaceId(interfaceId);
@@ -1381,12 +1385,16 @@ private:
   class RpcRequest final: public RequestHook {
   public:
     RpcRequest(RpcConnectionState& connectionState, VatNetworkBase::Connection& connection,
+               uint64_t interfaceId, uint16_t methodId,
                kj::Maybe<MessageSize> sizeHint, kj::Own<RpcClient>&& target)
         : connectionState(kj::addRef(connectionState)),
           target(kj::mv(target)),
-          message(connection.newOutgoingMessage(
-              firstSegmentSize(sizeHint, messageSizeHint<rpc::Call>() +
-                  sizeInWords<rpc::Payload>() + MESSAGE_TARGET_SIZE_HINT))),
+          sizeHistory(sizeHint == nullptr ? &connectionState.callSizes.get(
+              MessageSizeHistoryMap::methodKey(interfaceId, methodId)) : nullptr),
+          message(connection.newOutgoingMessage(sizeHistory == nullptr
+              ? firstSegmentSize(sizeHint, messageSizeHint<rpc::Call>() +
+                  sizeInWords<rpc::Payload>() + MESSAGE_TARGET_SIZE_HINT)
+              : sizeHistory->getFirstSegmentWords())),
           callBuilder(message->getBody().getAs<rpc::Message>().initCall()),
           paramsBuilder(capTable.imbue(callBuilder.getParams().getContent())) {}
 
@@ -1482,6 +1490,11 @@ private:
     kj::Own<RpcConnectionState> connectionState;
 
     kj::Own<RpcClient> target;
+
+    MessageSizeHistory* sizeHistory;
+    // If the caller gave no size hint, where we learn the size of calls to this method.  Points
+    // into `connectionState`.
+
     kj::Own<OutgoingRpcMessage> message;
     BuilderCapabilityTable capTable;
     rpc::Call::Builder callBuilder;
@@ -1509,6 +1522,11 @@ private:
       if (isTailCall) {
         callBuilder.getSendResultsTo().setYourself();
       }
+      if (sizeHistory != nullptr) {
+        KJ_IF_MAYBE(size, message->sizeInWords()) {
+          sizeHistory->record(*size);
+        }
+      }
       KJ_IF_MAYBE(exception, kj::runCatchingExceptions([&]() {
         KJ_CONTEXT("sending RPC call",
            callBuilder.getInterfaceId(), callBuilder.getMethodId());
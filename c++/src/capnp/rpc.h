@@ -277,6 +277,11 @@ public:
   virtual void send() = 0;
   // Send the message, or at least put it in a queue to be sent later.  Note that the builder
   // returned by `getBody()` remains valid at least until the `OutgoingRpcMessage` is destroyed.
+
+  virtual kj::Maybe<size_t> sizeInWords() { return nullptr; }
+  // Get the total size of the message so far, in words, if the network can tell cheaply.  The RPC
+  // system uses this to learn typical message sizes, so that it can suggest a first segment size
+  // to newOutgoingMessage().  The default returns null, in which case nothing is learned.
 };
 
 class IncomingRpcMessage {
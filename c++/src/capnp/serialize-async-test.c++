@@ -21,8 +21,10 @@
 
 #include "serialize-async.h"
 #include "serialize.h"
+#include "serialize-packed.h"
 #include <kj/debug.h>
 #include <kj/thread.h>
+#include <kj/vector.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
@@ -331,6 +333,351 @@ TEST(SerializeAsyncTest, WriteAsyncEvenSegmentCount) {
   writeMessage(*output, message).wait(ioContext.waitScope);
 }
 
+TEST(SerializeAsyncTest, ParsePackedAsync) {
+  PipeWithSmallBuffer fds;
+  auto ioContext = kj::setupAsyncIo();
+  auto rawInput = ioContext.lowLevelProvider->wrapInputFd(fds[0]);
+  // A tiny read-ahead buffer makes words and runs straddle buffer refills.
+  AsyncPackedInputStream input(*rawInput, 7);
+  SocketOutputStream rawOutput(fds[1]);
+  FragmentingOutputStream output(rawOutput);
+
+  TestMessageBuilder message(7);
+  initTestMessage(message.getRoot<TestAllTypes>());
+  TestMessageBuilder message2(1);
+  message2.getRoot<TestAllTypes>().setTextField("second message");
+
+  kj::Thread thread([&]() {
+    writePackedMessage(output, message);
+    writePackedMessage(output, message2);
+    KJ_SOCKCALL(shutdown(fds[1], SHUT_WR));
+  });
+
+  auto received = readPackedMessage(input).wait(ioContext.waitScope);
+  checkTestMessage(received->getRoot<TestAllTypes>());
+
+  auto received2 = readPackedMessage(input).wait(ioContext.waitScope);
+  EXPECT_EQ("second message", received2->getRoot<TestAllTypes>().getTextField());
+
+  EXPECT_TRUE(tryReadPackedMessage(input).wait(ioContext.waitScope) == nullptr);
+}
+
+TEST(SerializeAsyncTest, WritePackedAsync) {
+  PipeWithSmallBuffer fds;
+  auto ioContext = kj::setupAsyncIo();
+  auto output = ioContext.lowLevelProvider->wrapOutputFd(fds[1]);
+
+  // Make the message big enough that it is packed in several chunks.
+  MallocMessageBuilder message;
+  auto root = message.getRoot<TestAllTypes>();
+  auto list = root.initStructList(256);
+  for (auto element: list) {
+    initTestMessage(element);
+  }
+
+  kj::Thread thread([&]() {
+    SocketInputStream rawInput(fds[0]);
+    kj::BufferedInputStreamWrapper input(rawInput);
+    PackedMessageReader reader(input);
+    auto listReader = reader.getRoot<TestAllTypes>().getStructList();
+    EXPECT_EQ(list.size(), listReader.size());
+    for (auto element: listReader) {
+      checkTestMessage(element);
+    }
+  });
+
+  writePackedMessage(*output, message).wait(ioContext.waitScope);
+}
+
+TEST(SerializeAsyncTest, WriteMessagesAsync) {
+  PipeWithSmallBuffer fds;
+  auto ioContext = kj::setupAsyncIo();
+  auto output = ioContext.lowLevelProvider->wrapOutputFd(fds[1]);
+
+  // Multi-segment messages, with enough pieces in total to exceed IOV_MAX so that the stream
+  // must split the write.
+  kj::Vector<kj::Own<MallocMessageBuilder>> messages;
+  kj::Vector<MessageBuilder*> builders;
+  for (uint i = 0; i < 300; i++) {
+    auto message = kj::heap<MallocMessageBuilder>(1, AllocationStrategy::FIXED_SIZE);
+    auto root = message->getRoot<TestAllTypes>();
+    if (i % 50 == 0) {
+      initTestMessage(root);
+    } else {
+      root.setTextField("small");
+    }
+    root.setUInt32Field(i);
+    builders.add(message.get());
+    messages.add(kj::mv(message));
+  }
+
+  kj::Thread thread([&]() {
+    SocketInputStream input(fds[0]);
+    for (uint i = 0; i < 300; i++) {
+      InputStreamMessageReader reader(input);
+      auto root = reader.getRoot<TestAllTypes>();
+      EXPECT_EQ(i, root.getUInt32Field());
+      if (i % 50 == 0) {
+        EXPECT_EQ(3u, root.getStructList().size());
+      } else {
+        EXPECT_EQ("small", root.getTextField());
+      }
+    }
+  });
+
+  writeMessages(*output, builders.asPtr()).wait(ioContext.waitScope);
+}
+
+class RecordingOutputStream final: public kj::AsyncOutputStream {
+  // Records everything written, and how many write calls were made.  Each write completes on a
+  // later turn, so that writers have a chance to queue up more data in the meantime.
+
+public:
+  kj::Vector<byte> data;
+  uint writeCount = 0;
+
+  kj::Promise<void> write(const void* buffer, size_t size) override {
+    ++writeCount;
+    data.addAll(kj::arrayPtr(reinterpret_cast<const byte*>(buffer), size));
+    return kj::evalLater([]() {});
+  }
+
+  kj::Promise<void> write(kj::ArrayPtr<const kj::ArrayPtr<const byte>> pieces) override {
+    ++writeCount;
+    for (auto& piece: pieces) {
+      data.addAll(piece);
+    }
+    return kj::evalLater([]() {});
+  }
+};
+
+TEST(SerializeAsyncTest, MessageWriteQueue) {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+
+  RecordingOutputStream output;
+  MessageWriteQueue queue(output);
+
+  kj::Vector<kj::Own<MallocMessageBuilder>> messages;
+  for (uint i = 0; i < 30; i++) {
+    auto message = kj::heap<MallocMessageBuilder>();
+    message->getRoot<TestAllTypes>().setUInt32Field(i);
+    messages.add(kj::mv(message));
+  }
+
+  // Messages queued in the same turn go out together.
+  kj::Vector<kj::Promise<void>> promises;
+  for (uint i = 0; i < 10; i++) {
+    promises.add(queue.write(*messages[i]));
+  }
+  EXPECT_EQ(10u, queue.getQueuedCount());
+  promises.add(kj::evalLater([&]() {
+    // The first batch is now being written; these must wait for it.
+    EXPECT_EQ(0u, queue.getQueuedCount());
+    EXPECT_EQ(1u, output.writeCount);
+    kj::Vector<kj::Promise<void>> more;
+    for (uint i = 10; i < 30; i++) {
+      more.add(queue.write(*messages[i]));
+    }
+    EXPECT_EQ(20u, queue.getQueuedCount());
+    return kj::joinPromises(more.releaseAsArray());
+  }));
+  kj::joinPromises(promises.releaseAsArray()).wait(waitScope);
+
+  EXPECT_EQ(2u, output.writeCount);
+  EXPECT_EQ(0u, queue.getQueuedCount());
+
+  // The result is the same as writing each message separately.
+  kj::ArrayPtr<const word> remaining(reinterpret_cast<const word*>(output.data.begin()),
+                                     output.data.size() / sizeof(word));
+  for (uint i = 0; i < 30; i++) {
+    FlatArrayMessageReader reader(remaining);
+    EXPECT_EQ(i, reader.getRoot<TestAllTypes>().getUInt32Field());
+    remaining = kj::arrayPtr(reader.getEnd(), remaining.end());
+  }
+  EXPECT_EQ(0u, remaining.size());
+}
+
+TEST(SerializeAsyncTest, ReadLazily) {
+  PipeWithSmallBuffer fds;
+  auto ioContext = kj::setupAsyncIo();
+  auto input = ioContext.lowLevelProvider->wrapInputFd(fds[0]);
+  SocketOutputStream rawOutput(fds[1]);
+  FragmentingOutputStream output(rawOutput);
+
+  TestMessageBuilder message1(7);
+  initTestMessage(message1.getRoot<TestAllTypes>());
+  TestMessageBuilder message2(10);
+  initTestMessage(message2.getRoot<TestAllTypes>());
+
+  kj::Thread thread([&]() {
+    writeMessage(output, message1);
+    writeMessage(output, message2);
+  });
+
+  word scratch[16];
+  auto received = readMessageLazily(*input, ReaderOptions(), scratch).wait(ioContext.waitScope);
+  EXPECT_EQ(7u, received->getSegmentCount());
+  EXPECT_EQ(1u, received->getLoadedSegmentCount());
+  EXPECT_FALSE(received->isFinished());
+  EXPECT_EQ(computeSerializedSizeInWords(message1) - 4, received->getTotalWords());
+
+  // Later segments are not available until loaded.
+  EXPECT_ANY_THROW(checkTestMessage(received->getRoot<TestAllTypes>()));
+
+  received->loadSegments(3).wait(ioContext.waitScope);
+  EXPECT_EQ(3u, received->getLoadedSegmentCount());
+  received->loadAll().wait(ioContext.waitScope);
+  EXPECT_EQ(7u, received->getLoadedSegmentCount());
+  EXPECT_TRUE(received->isFinished());
+  checkTestMessage(received->getRoot<TestAllTypes>());
+
+  // The stream is positioned at the next message.
+  auto received2 = readMessage(*input).wait(ioContext.waitScope);
+  checkTestMessage(received2->getRoot<TestAllTypes>());
+}
+
+TEST(SerializeAsyncTest, ReadLazilyDiscardAndForward) {
+  PipeWithSmallBuffer fds;
+  auto ioContext = kj::setupAsyncIo();
+  auto input = ioContext.lowLevelProvider->wrapInputFd(fds[0]);
+  SocketOutputStream rawOutput(fds[1]);
+  FragmentingOutputStream output(rawOutput);
+
+  TestMessageBuilder message1(10);
+  initTestMessage(message1.getRoot<TestAllTypes>());
+  TestMessageBuilder message2(7);
+  initTestMessage(message2.getRoot<TestAllTypes>());
+  MallocMessageBuilder message3;
+  message3.getRoot<TestAllTypes>().setUInt32Field(123);
+
+  kj::Thread thread([&]() {
+    writeMessage(output, message1);
+    writeMessage(output, message2);
+    writeMessage(output, message3);
+  });
+
+  auto dropped = readMessageLazily(*input).wait(ioContext.waitScope);
+  dropped->discardRemaining().wait(ioContext.waitScope);
+  EXPECT_TRUE(dropped->isFinished());
+  EXPECT_ANY_THROW(dropped->loadAll().wait(ioContext.waitScope));
+
+  auto forwarded = readMessageLazily(*input).wait(ioContext.waitScope);
+  forwarded->loadSegments(2).wait(ioContext.waitScope);
+  RecordingOutputStream recording;
+  forwarded->forward(recording).wait(ioContext.waitScope);
+  EXPECT_EQ(2u, forwarded->getLoadedSegmentCount());
+  EXPECT_EQ(computeSerializedSizeInWords(message2) * sizeof(word), recording.data.size());
+
+  FlatArrayMessageReader copy(kj::arrayPtr(reinterpret_cast<const word*>(recording.data.begin()),
+                                           recording.data.size() / sizeof(word)));
+  checkTestMessage(copy.getRoot<TestAllTypes>());
+
+  auto last = tryReadMessageLazily(*input).wait(ioContext.waitScope);
+  KJ_IF_MAYBE(l, last) {
+    EXPECT_TRUE(l->get()->isFinished());
+    EXPECT_EQ(123u, l->get()->getRoot<TestAllTypes>().getUInt32Field());
+  } else {
+    ADD_FAILURE() << "Expected a message.";
+  }
+}
+
+class ChunkedInputStream final: public kj::AsyncInputStream {
+  // Serves `data`, returning at most `chunkSize` bytes per read unless more are required, and
+  // counts reads.
+
+public:
+  ChunkedInputStream(kj::ArrayPtr<const byte> data, size_t chunkSize)
+      : data(data), chunkSize(chunkSize) {}
+
+  uint readCount = 0;
+
+  kj::Promise<size_t> tryRead(void* buffer, size_t minBytes, size_t maxBytes) override {
+    ++readCount;
+    size_t n = kj::min(kj::max(minBytes, kj::min(chunkSize, maxBytes)), data.size());
+    memcpy(buffer, data.begin(), n);
+    data = data.slice(n, data.size());
+    return n;
+  }
+
+private:
+  kj::ArrayPtr<const byte> data;
+  size_t chunkSize;
+};
+
+TEST(SerializeAsyncTest, BufferedMessageStream) {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+
+  // Many small messages, a multi-segment one, and one too big for the buffer.
+  kj::Vector<kj::Own<MallocMessageBuilder>> messages;
+  for (uint i = 0; i < 100; i++) {
+    auto message = kj::heap<MallocMessageBuilder>();
+    message->getRoot<TestAllTypes>().setUInt32Field(i);
+    messages.add(kj::mv(message));
+  }
+  auto multi = kj::heap<TestMessageBuilder>(7);
+  initTestMessage(multi->getRoot<TestAllTypes>());
+  messages.add(kj::mv(multi));
+  auto big = kj::heap<MallocMessageBuilder>();
+  big->getRoot<TestAllTypes>().initDataField(10000);
+  messages.add(kj::mv(big));
+  auto last = kj::heap<MallocMessageBuilder>();
+  last->getRoot<TestAllTypes>().setUInt32Field(12345);
+  messages.add(kj::mv(last));
+
+  RecordingOutputStream output;
+  kj::Vector<MessageBuilder*> builders;
+  for (auto& message: messages) {
+    builders.add(message.get());
+  }
+  writeMessages(output, builders.asPtr()).wait(waitScope);
+
+  for (size_t chunkSize: {size_t(1), size_t(100), size_t(1) << 20}) {
+    KJ_CONTEXT(chunkSize);
+    ChunkedInputStream input(output.data.asPtr(), chunkSize);
+    BufferedMessageStream stream(input, ReaderOptions(), 1024);
+
+    kj::Vector<kj::Own<MessageReader>> received;
+    for (uint i = 0; i < 100; i++) {
+      auto reader = stream.readMessage().wait(waitScope);
+      EXPECT_EQ(i, reader->getRoot<TestAllTypes>().getUInt32Field());
+      received.add(kj::mv(reader));
+    }
+    checkTestMessage(stream.readMessage().wait(waitScope)->getRoot<TestAllTypes>());
+    EXPECT_EQ(10000u,
+        stream.readMessage().wait(waitScope)->getRoot<TestAllTypes>().getDataField().size());
+    EXPECT_EQ(12345u,
+        stream.readMessage().wait(waitScope)->getRoot<TestAllTypes>().getUInt32Field());
+    EXPECT_TRUE(stream.tryReadMessage().wait(waitScope) == nullptr);
+
+    // Readers still in use were never overwritten when the stream moved on.
+    for (uint i = 0; i < 100; i++) {
+      EXPECT_EQ(i, received[i]->getRoot<TestAllTypes>().getUInt32Field());
+    }
+
+    EXPECT_EQ(input.readCount, stream.getReadCount());
+    if (chunkSize > 1000000) {
+      // Each read fills the buffer, rather than taking two reads per message.
+      EXPECT_LE(stream.getReadCount(), 10u);
+    }
+  }
+}
+
+TEST(SerializeAsyncTest, BufferedMessageStreamPrematureEof) {
+  kj::EventLoop loop;
+  kj::WaitScope waitScope(loop);
+
+  MallocMessageBuilder message;
+  initTestMessage(message.getRoot<TestAllTypes>());
+  RecordingOutputStream output;
+  writeMessage(output, message).wait(waitScope);
+
+  ChunkedInputStream input(output.data.asPtr().slice(0, output.data.size() - 8), 64);
+  BufferedMessageStream stream(input);
+  EXPECT_ANY_THROW(stream.tryReadMessage().wait(waitScope));
+}
+
 }  // namespace
 }  // namespace _ (private)
 }  // namespace capnp
@@ -21,6 +21,7 @@
 
 #include "serialize-async.h"
 #include <kj/debug.h>
+#include <kj/vector.h>
 
 namespace capnp {
 
@@ -176,6 +177,424 @@ kj::Promise<kj::Maybe<kj::Own<MessageReader>>> tryReadMessage(
 
 namespace {
 
+static constexpr size_t PUMP_BUFFER_BYTES = 65536;
+
+kj::Promise<void> pumpBytes(kj::AsyncInputStream& input, kj::AsyncOutputStream* output,
+                            kj::ArrayPtr<byte> buffer, size_t bytes) {
+  // Copy `bytes` bytes from `input` to `output` through `buffer`, or discard them if `output` is
+  // null.
+
+  if (bytes == 0) {
+    return kj::READY_NOW;
+  }
+
+  return input.tryRead(buffer.begin(), 1, kj::min(bytes, buffer.size()))
+      .then([&input,output,buffer,bytes](size_t n) mutable -> kj::Promise<void> {
+    KJ_REQUIRE(n > 0, "Premature EOF.") {
+      return kj::READY_NOW;
+    }
+
+    if (output == nullptr) {
+      return pumpBytes(input, output, buffer, bytes - n);
+    } else {
+      return output->write(buffer.begin(), n).then([&input,output,buffer,bytes,n]() mutable {
+        return pumpBytes(input, output, buffer, bytes - n);
+      });
+    }
+  });
+}
+
+kj::Promise<void> pumpBytes(kj::AsyncInputStream& input, kj::AsyncOutputStream* output,
+                            size_t bytes) {
+  if (bytes == 0) {
+    return kj::READY_NOW;
+  }
+
+  auto buffer = kj::heapArray<byte>(kj::min(bytes, PUMP_BUFFER_BYTES));
+  auto promise = pumpBytes(input, output, buffer, bytes);
+  return promise.attach(kj::mv(buffer));
+}
+
+}  // namespace
+
+LazyMessageReader::LazyMessageReader(
+    kj::AsyncInputStream& input, ReaderOptions options, kj::ArrayPtr<word> scratchSpace)
+    : MessageReader(options), input(input), scratchSpace(scratchSpace) {
+  memset(firstWord, 0, sizeof(firstWord));
+}
+
+LazyMessageReader::~LazyMessageReader() noexcept(false) {}
+
+size_t LazyMessageReader::sumSegmentSizes(uint begin, uint end) const {
+  size_t result = 0;
+  for (uint i = begin; i < end; i++) {
+    result += getSegmentSize(i);
+  }
+  return result;
+}
+
+size_t LazyMessageReader::getTotalWords() const {
+  return sumSegmentSizes(0, getSegmentCount());
+}
+
+kj::Promise<bool> LazyMessageReader::readHeader() {
+  return input.tryRead(firstWord, sizeof(firstWord), sizeof(firstWord))
+      .then([this](size_t n) -> kj::Promise<bool> {
+    if (n == 0) {
+      return false;
+    } else if (n < sizeof(firstWord)) {
+      // EOF in first word.
+      KJ_FAIL_REQUIRE("Premature EOF.") {
+        return false;
+      }
+    }
+
+    if (getSegmentCount() == 0) {
+      firstWord[1].set(0);
+    }
+
+    // Reject messages with too many segments for security reasons.
+    KJ_REQUIRE(getSegmentCount() < 512, "Message has too many segments.") {
+      return false;
+    }
+
+    kj::Promise<void> promise = kj::READY_NOW;
+    if (getSegmentCount() > 1) {
+      // Read sizes for all segments except the first.  Include padding if necessary.
+      moreSizes = kj::heapArray<_::WireValue<uint32_t>>(getSegmentCount() & ~1);
+      segmentStarts = kj::heapArray<const word*>(getSegmentCount());
+      promise = input.read(moreSizes.begin(), moreSizes.size() * sizeof(moreSizes[0]));
+    }
+
+    return promise.then([this]() {
+      return loadSegments(1);
+    }).then([this]() {
+      finished = loadedCount == getSegmentCount();
+      return true;
+    });
+  });
+}
+
+kj::Promise<void> LazyMessageReader::loadSegments(uint count) {
+  count = kj::min(count, getSegmentCount());
+  if (count <= loadedCount) {
+    return kj::READY_NOW;
+  }
+
+  KJ_REQUIRE(!finished, "Message segments were already discarded or forwarded.") {
+    return kj::READY_NOW;
+  }
+
+  size_t words = sumSegmentSizes(loadedCount, count);
+
+  // Don't load more than the receiver could possibly traverse without hitting the traversal
+  // limit.  Without this check, a malicious client could transmit a very large segment size to
+  // make the receiver allocate excessive space and possibly crash.
+  KJ_REQUIRE(sumSegmentSizes(0, loadedCount) + words <= getOptions().traversalLimitInWords,
+             "Message is too large.  To increase the limit on the receiving end, see "
+             "capnp::ReaderOptions.") {
+    return kj::READY_NOW;  // exception will be propagated
+  }
+
+  // The segments we're about to read are contiguous in the stream, so give them contiguous space
+  // and read them at once.
+  kj::ArrayPtr<word> space;
+  if (words <= scratchSpace.size()) {
+    space = scratchSpace.slice(0, words);
+    scratchSpace = scratchSpace.slice(words, scratchSpace.size());
+  } else {
+    auto owned = kj::heapArray<word>(words);
+    space = owned;
+    ownedSpace.add(kj::mv(owned));
+  }
+
+  return input.read(space.begin(), words * sizeof(word)).then([this,space,count]() mutable {
+    const word* pos = space.begin();
+    for (uint i = loadedCount; i < count; i++) {
+      segmentStart(i) = pos;
+      pos += getSegmentSize(i);
+    }
+    loadedCount = count;
+    finished = loadedCount == getSegmentCount();
+  });
+}
+
+kj::Promise<void> LazyMessageReader::loadAll() {
+  return loadSegments(getSegmentCount());
+}
+
+kj::Promise<void> LazyMessageReader::discardRemaining() {
+  if (finished) {
+    return kj::READY_NOW;
+  }
+
+  size_t bytes = sumSegmentSizes(loadedCount, getSegmentCount()) * sizeof(word);
+  finished = true;
+  return pumpBytes(input, nullptr, bytes);
+}
+
+kj::Promise<void> LazyMessageReader::forward(kj::AsyncOutputStream& output) {
+  KJ_REQUIRE(loadedCount == getSegmentCount() || !finished,
+             "Message segments were already discarded or forwarded.") {
+    return kj::READY_NOW;
+  }
+
+  // The segment table is forwarded verbatim, followed by the loaded segments, in one write.
+  auto pieces = kj::heapArrayBuilder<kj::ArrayPtr<const byte>>(
+      1 + (moreSizes.size() > 0) + loadedCount);
+  pieces.add(kj::arrayPtr(firstWord, 2).asBytes());
+  if (moreSizes.size() > 0) {
+    pieces.add(moreSizes.asBytes());
+  }
+  for (uint i = 0; i < loadedCount; i++) {
+    pieces.add(kj::arrayPtr(segmentStart(i), getSegmentSize(i)).asBytes());
+  }
+
+  size_t remainingBytes = sumSegmentSizes(loadedCount, getSegmentCount()) * sizeof(word);
+  finished = true;
+
+  auto piecesArray = pieces.finish();
+  auto promise = output.write(piecesArray);
+  return promise.attach(kj::mv(piecesArray)).then([this,&output,remainingBytes]() {
+    return pumpBytes(input, &output, remainingBytes);
+  });
+}
+
+kj::ArrayPtr<const word> LazyMessageReader::getSegment(uint id) {
+  if (id >= getSegmentCount()) {
+    return nullptr;
+  }
+
+  KJ_REQUIRE(id < loadedCount,
+             "Message segment was not loaded.  See LazyMessageReader::loadSegments().") {
+    return nullptr;
+  }
+
+  return kj::arrayPtr(segmentStart(id), getSegmentSize(id));
+}
+
+kj::Promise<kj::Own<LazyMessageReader>> readMessageLazily(
+    kj::AsyncInputStream& input, ReaderOptions options, kj::ArrayPtr<word> scratchSpace) {
+  auto reader = kj::heap<LazyMessageReader>(input, options, scratchSpace);
+  auto promise = reader->readHeader();
+  return promise.then(kj::mvCapture(reader,
+        [](kj::Own<LazyMessageReader>&& reader, bool success) {
+    KJ_REQUIRE(success, "Premature EOF.") { break; }
+    return kj::mv(reader);
+  }));
+}
+
+kj::Promise<kj::Maybe<kj::Own<LazyMessageReader>>> tryReadMessageLazily(
+    kj::AsyncInputStream& input, ReaderOptions options, kj::ArrayPtr<word> scratchSpace) {
+  auto reader = kj::heap<LazyMessageReader>(input, options, scratchSpace);
+  auto promise = reader->readHeader();
+  return promise.then(kj::mvCapture(reader,
+        [](kj::Own<LazyMessageReader>&& reader, bool success)
+            -> kj::Maybe<kj::Own<LazyMessageReader>> {
+    if (success) {
+      return kj::mv(reader);
+    } else {
+      return nullptr;
+    }
+  }));
+}
+
+// =======================================================================================
+
+struct BufferedMessageStream::Buffer: public kj::Refcounted {
+  kj::Array<word> space;
+
+  explicit Buffer(size_t words): space(kj::heapArray<word>(words)) {}
+  inline byte* bytes() { return reinterpret_cast<byte*>(space.begin()); }
+};
+
+class BufferedMessageStream::Reader final: public MessageReader {
+public:
+  Reader(ReaderOptions options, const _::WireValue<uint32_t>* table, const word* body,
+         kj::Own<Buffer> buffer, kj::Array<word> ownedSpace)
+      : MessageReader(options), buffer(kj::mv(buffer)), ownedSpace(kj::mv(ownedSpace)) {
+    // `table` need only remain valid for the duration of the constructor.
+    uint segmentCount = table[0].get() + 1;
+    segment0 = kj::arrayPtr(body, table[1].get());
+    body += segment0.size();
+
+    if (segmentCount > 1) {
+      moreSegments = kj::heapArray<kj::ArrayPtr<const word>>(segmentCount - 1);
+      for (uint i = 1; i < segmentCount; i++) {
+        moreSegments[i - 1] = kj::arrayPtr(body, table[i + 1].get());
+        body += moreSegments[i - 1].size();
+      }
+    }
+  }
+
+  kj::ArrayPtr<const word> getSegment(uint id) override {
+    if (id == 0) {
+      return segment0;
+    } else if (id - 1 < moreSegments.size()) {
+      return moreSegments[id - 1];
+    } else {
+      return nullptr;
+    }
+  }
+
+private:
+  kj::Own<Buffer> buffer;
+  kj::Array<word> ownedSpace;
+  // Exactly one of these holds the segments.
+
+  kj::ArrayPtr<const word> segment0;
+  kj::Array<kj::ArrayPtr<const word>> moreSegments;
+  // Only allocated for multi-segment messages.
+};
+
+BufferedMessageStream::BufferedMessageStream(
+    kj::AsyncInputStream& input, ReaderOptions options, size_t bufferWords)
+    : input(input), options(options), bufferWords(bufferWords) {
+  // The largest segment table must fit, so that we can always parse one in place.
+  KJ_REQUIRE(bufferWords >= 256, "BufferedMessageStream buffer is too small.");
+}
+
+BufferedMessageStream::~BufferedMessageStream() noexcept(false) {}
+
+kj::Promise<kj::Own<MessageReader>> BufferedMessageStream::readMessage() {
+  return tryReadMessage().then([](kj::Maybe<kj::Own<MessageReader>>&& maybeReader)
+                                    -> kj::Own<MessageReader> {
+    KJ_IF_MAYBE(reader, maybeReader) {
+      return kj::mv(*reader);
+    }
+    KJ_FAIL_REQUIRE("Premature EOF.") { break; }
+    return kj::Own<MessageReader>();
+  });
+}
+
+kj::Promise<kj::Maybe<kj::Own<MessageReader>>> BufferedMessageStream::tryReadMessage() {
+  typedef kj::Maybe<kj::Own<MessageReader>> Result;
+
+  auto fillAndRetry = [this](size_t minBytes) {
+    return fill(minBytes).then([this](bool eof) -> kj::Promise<Result> {
+      if (eof) {
+        return Result(nullptr);
+      }
+      return tryReadMessage();
+    });
+  };
+
+  size_t available = end - begin;
+  if (available < sizeof(word)) {
+    return fillAndRetry(sizeof(word));
+  }
+
+  auto table = reinterpret_cast<const _::WireValue<uint32_t>*>(buffer->bytes() + begin);
+
+  // Reject messages with too many segments for security reasons.
+  KJ_REQUIRE(table[0].get() < 511, "Message has too many segments.") {
+    return Result(nullptr);  // exception will be propagated
+  }
+
+  uint segmentCount = table[0].get() + 1;
+  size_t tableBytes = ((segmentCount + 2) & ~1u) * sizeof(table[0]);
+  if (available < tableBytes) {
+    return fillAndRetry(tableBytes);
+  }
+
+  size_t totalWords = 0;
+  for (uint i = 0; i < segmentCount; i++) {
+    totalWords += table[i + 1].get();
+  }
+
+  // Don't accept a message which the receiver couldn't possibly traverse without hitting the
+  // traversal limit.  Without this check, a malicious client could transmit a very large segment
+  // size to make the receiver allocate excessive space and possibly crash.
+  KJ_REQUIRE(totalWords <= options.traversalLimitInWords,
+             "Message is too large.  To increase the limit on the receiving end, see "
+             "capnp::ReaderOptions.") {
+    return Result(nullptr);  // exception will be propagated
+  }
+
+  size_t messageBytes = tableBytes + totalWords * sizeof(word);
+  if (available >= messageBytes) {
+    // The whole message is here.  Read it in place.
+    auto body = reinterpret_cast<const word*>(buffer->bytes() + begin + tableBytes);
+    kj::Own<MessageReader> reader = kj::heap<Reader>(
+        options, table, body, kj::addRef(*buffer), nullptr);
+    begin += messageBytes;
+    return Result(kj::mv(reader));
+  } else if (messageBytes <= bufferWords * sizeof(word)) {
+    return fillAndRetry(messageBytes);
+  } else {
+    return readLargeMessage(tableBytes, totalWords).then([](kj::Own<MessageReader>&& reader) {
+      return Result(kj::mv(reader));
+    });
+  }
+}
+
+kj::Promise<bool> BufferedMessageStream::fill(size_t minBytes) {
+  // Read until at least `minBytes` bytes are available from `begin`, asking for as many as will
+  // fit.  Resolves to true on EOF.  We're always at a message boundary here, so EOF is only an
+  // error if part of the next message has already arrived.
+
+  size_t capacity = bufferWords * sizeof(word);
+  size_t available = end - begin;
+  KJ_ASSERT(available < minBytes && minBytes <= capacity);
+
+  if (buffer.get() == nullptr || (buffer->isShared() && begin + minBytes > capacity)) {
+    // Out of room, and readers still point into the current buffer, so we can't reuse it.
+    auto newBuffer = kj::refcounted<Buffer>(bufferWords);
+    if (available > 0) {
+      memcpy(newBuffer->bytes(), buffer->bytes() + begin, available);
+    }
+    buffer = kj::mv(newBuffer);
+    begin = 0;
+    end = available;
+  } else if (!buffer->isShared() && begin > 0) {
+    // Nothing else refers to the buffer, so make as much room as possible.
+    memmove(buffer->bytes(), buffer->bytes() + begin, available);
+    begin = 0;
+    end = available;
+  }
+
+  return input.tryRead(buffer->bytes() + end, minBytes - available, capacity - end)
+      .then([this,minBytes](size_t n) {
+    ++readCount;
+    end += n;
+    if (end - begin < minBytes) {
+      if (end == begin) {
+        return true;
+      }
+      KJ_FAIL_REQUIRE("Premature EOF.") {
+        return true;
+      }
+    }
+    return false;
+  });
+}
+
+kj::Promise<kj::Own<MessageReader>> BufferedMessageStream::readLargeMessage(
+    size_t tableBytes, size_t totalWords) {
+  // The message doesn't fit in the buffer, so it gets space of its own.  Take whatever part of it
+  // has already arrived and read the rest directly into place.
+
+  auto space = kj::heapArray<word>(totalWords);
+  byte* spaceBytes = reinterpret_cast<byte*>(space.begin());
+  size_t haveBytes = end - begin - tableBytes;
+  memcpy(spaceBytes, buffer->bytes() + begin + tableBytes, haveBytes);
+
+  auto table = reinterpret_cast<const _::WireValue<uint32_t>*>(buffer->bytes() + begin);
+  const word* body = space.begin();
+  auto reader = kj::heap<Reader>(options, table, body, kj::Own<Buffer>(), kj::mv(space));
+  begin = end;
+
+  return input.read(spaceBytes + haveBytes, totalWords * sizeof(word) - haveBytes)
+      .then(kj::mvCapture(reader, [this](kj::Own<Reader>&& reader) -> kj::Own<MessageReader> {
+    ++readCount;
+    return kj::mv(reader);
+  }));
+}
+
+// =======================================================================================
+
+namespace {
+
 struct WriteArrays {
   // Holds arrays that must remain valid until a write completes.
 
@@ -183,26 +602,40 @@ struct WriteArrays {
   kj::Array<kj::ArrayPtr<const byte>> pieces;
 };
 
-}  // namespace
+inline size_t segmentTableSize(kj::ArrayPtr<const kj::ArrayPtr<const word>> segments) {
+  return (segments.size() + 2) & ~size_t(1);
+}
 
-kj::Promise<void> writeMessage(kj::AsyncOutputStream& output,
-                               kj::ArrayPtr<const kj::ArrayPtr<const word>> segments) {
+void fillSegmentTable(kj::ArrayPtr<const kj::ArrayPtr<const word>> segments,
+                      kj::ArrayPtr<_::WireValue<uint32_t>> table) {
   KJ_REQUIRE(segments.size() > 0, "Tried to serialize uninitialized message.");
 
-  WriteArrays arrays;
-  arrays.table = kj::heapArray<_::WireValue<uint32_t>>((segments.size() + 2) & ~size_t(1));
-
   // We write the segment count - 1 because this makes the first word zero for single-segment
   // messages, improving compression.  We don't bother doing this with segment sizes because
   // one-word segments are rare anyway.
-  arrays.table[0].set(segments.size() - 1);
+  table[0].set(segments.size() - 1);
   for (uint i = 0; i < segments.size(); i++) {
-    arrays.table[i + 1].set(segments[i].size());
+    table[i + 1].set(segments[i].size());
   }
   if (segments.size() % 2 == 0) {
     // Set padding byte.
-    arrays.table[segments.size() + 1].set(0);
+    table[segments.size() + 1].set(0);
   }
+}
+
+kj::Array<_::WireValue<uint32_t>> makeSegmentTable(
+    kj::ArrayPtr<const kj::ArrayPtr<const word>> segments) {
+  auto table = kj::heapArray<_::WireValue<uint32_t>>(segmentTableSize(segments));
+  fillSegmentTable(segments, table);
+  return table;
+}
+
+}  // namespace
+
+kj::Promise<void> writeMessage(kj::AsyncOutputStream& output,
+                               kj::ArrayPtr<const kj::ArrayPtr<const word>> segments) {
+  WriteArrays arrays;
+  arrays.table = makeSegmentTable(segments);
 
   arrays.pieces = kj::heapArray<kj::ArrayPtr<const byte>>(segments.size() + 1);
   arrays.pieces[0] = arrays.table.asBytes();
@@ -217,4 +650,283 @@ kj::Promise<void> writeMessage(kj::AsyncOutputStream& output,
   return promise.then(kj::mvCapture(arrays, [](WriteArrays&&) {}));
 }
 
+kj::Promise<void> writeMessages(
+    kj::AsyncOutputStream& output,
+    kj::ArrayPtr<const kj::ArrayPtr<const kj::ArrayPtr<const word>>> messages) {
+  if (messages.size() == 0) {
+    return kj::READY_NOW;
+  }
+
+  size_t tableWords = 0;
+  size_t pieceCount = 0;
+  for (auto& segments: messages) {
+    tableWords += segmentTableSize(segments);
+    pieceCount += segments.size() + 1;
+  }
+
+  // All of the segment tables share one allocation.  The stream takes care of splitting the pieces
+  // across multiple system calls if there are more than the OS accepts at once.
+  WriteArrays arrays;
+  arrays.table = kj::heapArray<_::WireValue<uint32_t>>(tableWords);
+  arrays.pieces = kj::heapArray<kj::ArrayPtr<const byte>>(pieceCount);
+
+  size_t tablePos = 0;
+  size_t piecePos = 0;
+  for (auto& segments: messages) {
+    auto table = arrays.table.slice(tablePos, tablePos + segmentTableSize(segments));
+    tablePos += table.size();
+    fillSegmentTable(segments, table);
+
+    arrays.pieces[piecePos++] = table.asBytes();
+    for (auto& segment: segments) {
+      arrays.pieces[piecePos++] = segment.asBytes();
+    }
+  }
+
+  auto promise = output.write(arrays.pieces);
+
+  // Make sure the arrays aren't freed until the write completes.
+  return promise.then(kj::mvCapture(arrays, [](WriteArrays&&) {}));
+}
+
+kj::Promise<void> writeMessages(kj::AsyncOutputStream& output,
+                                kj::ArrayPtr<MessageBuilder*> builders) {
+  auto messages = kj::heapArray<kj::ArrayPtr<const kj::ArrayPtr<const word>>>(builders.size());
+  for (uint i = 0; i < builders.size(); i++) {
+    messages[i] = builders[i]->getSegmentsForOutput();
+  }
+  auto promise = writeMessages(output, messages);
+  return promise.attach(kj::mv(messages));
+}
+
+// -------------------------------------------------------------------
+
+struct MessageWriteQueue::Batch {
+  kj::Vector<kj::ArrayPtr<const kj::ArrayPtr<const word>>> messages;
+  kj::Own<kj::PromiseFulfiller<void>> fulfiller;
+  kj::ForkedPromise<void> done;
+
+  Batch(kj::PromiseFulfillerPair<void> paf = kj::newPromiseAndFulfiller<void>())
+      : fulfiller(kj::mv(paf.fulfiller)), done(paf.promise.fork()) {}
+};
+
+MessageWriteQueue::MessageWriteQueue(kj::AsyncOutputStream& output): output(output) {}
+MessageWriteQueue::MessageWriteQueue(
+    kj::AsyncOutputStream& output, kj::Timer& timer, WriteBatchOptions options)
+    : output(output), timer(timer), options(options) {}
+MessageWriteQueue::~MessageWriteQueue() noexcept(false) {}
+
+size_t MessageWriteQueue::getQueuedCount() {
+  return queued.get() == nullptr ? 0 : queued->messages.size();
+}
+
+kj::Promise<void> MessageWriteQueue::write(
+    kj::ArrayPtr<const kj::ArrayPtr<const word>> segments) {
+  KJ_IF_MAYBE(e, error) {
+    return kj::cp(*e);
+  }
+
+  KJ_REQUIRE(segments.size() > 0, "Tried to serialize uninitialized message.");
+
+  if (queued.get() == nullptr) {
+    queued = kj::heap<Batch>();
+  }
+  queued->messages.add(segments);
+  auto result = queued->done.addBranch();
+
+  queuedBytes += (segments.size() / 2 + 1) * sizeof(word);
+  for (auto& segment: segments) {
+    queuedBytes += segment.size() * sizeof(word);
+  }
+
+  if (!writing) {
+    // Wait for the rest of this turn's messages (or longer, if so configured) before starting the
+    // write.
+    writing = true;
+
+    kj::Promise<void> delay = nullptr;
+    KJ_IF_MAYBE(t, timer) {
+      delay = options.maxDelay > 0 * kj::SECONDS ? t->afterDelay(options.maxDelay)
+                                                  : kj::evalLater([]() {});
+    } else {
+      delay = kj::evalLater([]() {});
+    }
+
+    auto paf = kj::newPromiseAndFulfiller<void>();
+    flushNow = kj::mv(paf.fulfiller);
+    writeLoop = delay.exclusiveJoin(kj::mv(paf.promise)).then([this]() {
+      flushNow = nullptr;
+      return writeQueued();
+    }).eagerlyEvaluate(nullptr);
+  }
+
+  if (queuedBytes >= options.maxBatchBytes) {
+    KJ_IF_MAYBE(f, flushNow) {
+      f->get()->fulfill();
+    }
+  }
+
+  return kj::mv(result);
+}
+
+kj::Promise<void> MessageWriteQueue::whenDrained() {
+  KJ_IF_MAYBE(e, error) {
+    return kj::cp(*e);
+  }
+
+  // Batches are written in order, so the last one finishing means they all have.
+  if (queued.get() != nullptr) {
+    return queued->done.addBranch();
+  } else if (inFlight.get() != nullptr) {
+    return inFlight->done.addBranch();
+  } else {
+    return kj::READY_NOW;
+  }
+}
+
+kj::Promise<void> MessageWriteQueue::writeQueued() {
+  if (queued.get() == nullptr) {
+    writing = false;
+    return kj::READY_NOW;
+  }
+
+  inFlight = kj::mv(queued);
+  queuedBytes = 0;
+  ++batchCount;
+  // The stream may throw rather than return a broken promise (e.g. on EPIPE), so make sure that
+  // fails the batch like any other error.
+  return kj::evalNow([this]() {
+    return writeMessages(output, inFlight->messages.asPtr());
+  }).then([this]() {
+    inFlight->fulfiller->fulfill();
+    inFlight = nullptr;
+    return writeQueued();
+  }, [this](kj::Exception&& exception) -> kj::Promise<void> {
+    inFlight->fulfiller->reject(kj::cp(exception));
+    inFlight = nullptr;
+    if (queued.get() != nullptr) {
+      queued->fulfiller->reject(kj::cp(exception));
+      queued = nullptr;
+    }
+    error = kj::mv(exception);
+    writing = false;
+    return kj::READY_NOW;
+  });
+}
+
+// =======================================================================================
+
+AsyncPackedInputStream::AsyncPackedInputStream(kj::AsyncInputStream& inner, size_t bufferSize)
+    : inner(inner), buffer(kj::heapArray<byte>(bufferSize)) {}
+
+kj::Promise<size_t> AsyncPackedInputStream::tryRead(
+    void* buffer, size_t minBytes, size_t maxBytes) {
+  return tryReadInternal(reinterpret_cast<byte*>(buffer), minBytes, maxBytes, 0);
+}
+
+kj::Promise<size_t> AsyncPackedInputStream::tryReadInternal(
+    byte* dst, size_t minBytes, size_t maxBytes, size_t alreadyRead) {
+  // Unpack whatever we already have buffered, and only go back to the underlying stream if that
+  // wasn't enough.
+  size_t n = unpacker.unpack(available, kj::arrayPtr(dst, maxBytes));
+  alreadyRead += n;
+  if (n >= minBytes) {
+    return alreadyRead;
+  }
+
+  dst += n;
+  minBytes -= n;
+  maxBytes -= n;
+
+  return inner.tryRead(buffer.begin(), 1, buffer.size())
+      .then([this,dst,minBytes,maxBytes,alreadyRead](size_t amount) -> kj::Promise<size_t> {
+    if (amount == 0) {
+      KJ_REQUIRE(unpacker.isBetweenWords(), "Premature end of packed input.") {
+        break;
+      }
+      return alreadyRead;
+    }
+
+    available = buffer.slice(0, amount);
+    return tryReadInternal(dst, minBytes, maxBytes, alreadyRead);
+  });
+}
+
+namespace {
+
+class PackedMessageWriter {
+  // Packs a message a chunk at a time, writing each chunk before packing the next.
+
+public:
+  explicit PackedMessageWriter(kj::ArrayPtr<const kj::ArrayPtr<const word>> segments)
+      : table(makeSegmentTable(segments)), segments(segments) {
+    size_t totalWords = table.size() / 2;
+    for (auto& segment: segments) {
+      totalWords += segment.size();
+    }
+
+    // Packing never expands a word to more than 10 bytes (tag, eight data bytes, and run count).
+    buffer = kj::heapArray<byte>(kj::min(totalWords, CHUNK_WORDS) * 10 + 16);
+  }
+
+  kj::Promise<void> writeNext(kj::AsyncOutputStream& output) {
+    kj::ArrayOutputStream packed(buffer);
+
+    {
+      _::PackedOutputStream packer(packed);
+      size_t budget = CHUNK_WORDS;
+      while (budget > 0 && nextPiece <= segments.size()) {
+        auto piece = getPiece(nextPiece);
+        size_t n = kj::min(budget, piece.size() - pieceOffset);
+        packer.write(piece.begin() + pieceOffset, n * sizeof(word));
+        pieceOffset += n;
+        budget -= n;
+        if (pieceOffset == piece.size()) {
+          ++nextPiece;
+          pieceOffset = 0;
+        }
+      }
+    }
+
+    auto bytes = packed.getArray();
+    auto promise = output.write(bytes.begin(), bytes.size());
+    if (nextPiece > segments.size()) {
+      return kj::mv(promise);
+    } else {
+      return promise.then([this,&output]() { return writeNext(output); });
+    }
+  }
+
+private:
+  static constexpr size_t CHUNK_WORDS = 8192;
+
+  kj::Array<_::WireValue<uint32_t>> table;
+  kj::ArrayPtr<const kj::ArrayPtr<const word>> segments;
+  kj::Array<byte> buffer;
+
+  uint nextPiece = 0;
+  // 0 is the segment table; n > 0 is segments[n - 1].
+  size_t pieceOffset = 0;
+  // Words of `nextPiece` already packed.
+
+  kj::ArrayPtr<const word> getPiece(uint index) {
+    if (index == 0) {
+      return kj::arrayPtr(reinterpret_cast<const word*>(table.begin()), table.size() / 2);
+    } else {
+      return segments[index - 1];
+    }
+  }
+};
+
+constexpr size_t PackedMessageWriter::CHUNK_WORDS;
+
+}  // namespace
+
+kj::Promise<void> writePackedMessage(kj::AsyncOutputStream& output,
+                                     kj::ArrayPtr<const kj::ArrayPtr<const word>> segments) {
+  auto writer = kj::heap<PackedMessageWriter>(segments);
+  auto promise = writer->writeNext(output);
+  return promise.attach(kj::mv(writer));
+}
+
 }  // namespace capnp
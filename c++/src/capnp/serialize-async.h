@@ -27,7 +27,10 @@
 #endif
 
 #include <kj/async-io.h>
+#include <kj/time.h>
 #include "message.h"
+#include "serialize-packed.h"
+#include <kj/vector.h>
 
 namespace capnp {
 
@@ -45,6 +48,154 @@ kj::Promise<kj::Maybe<kj::Own<MessageReader>>> tryReadMessage(
     kj::ArrayPtr<word> scratchSpace = nullptr);
 // Like `readMessage` but returns null on EOF.
 
+class LazyMessageReader: public MessageReader {
+  // A MessageReader returned by readMessageLazily(), which initially holds only the segment table
+  // and the first segment of the message.  Later segments are fetched on demand with
+  // loadSegments() or loadAll(), and space for them is allocated only then.  Accessing a segment
+  // that hasn't been loaded fails as if the message were invalid.
+  //
+  // This suits code such as routers which look at a small header in the first segment to decide
+  // what to do with a possibly very large message:  the rest can be passed along with forward()
+  // or dropped with discardRemaining() without ever being buffered.
+  //
+  // The input stream is left in the middle of the message until all segments have been consumed
+  // by one of loadAll(), discardRemaining(), or forward(), so one of those must complete before
+  // the next message is read from the same stream.  The stream must remain valid until then.  Only
+  // one of these methods may be in progress at a time.
+
+public:
+  LazyMessageReader(kj::AsyncInputStream& input, ReaderOptions options,
+                    kj::ArrayPtr<word> scratchSpace);
+  // Use readMessageLazily() instead.
+
+  KJ_DISALLOW_COPY(LazyMessageReader);
+  ~LazyMessageReader() noexcept(false);
+
+  inline uint getSegmentCount() const { return firstWord[0].get() + 1; }
+  inline uint getLoadedSegmentCount() const { return loadedCount; }
+  size_t getTotalWords() const;
+  // Segment count and total size as given by the segment table.
+
+  inline bool isFinished() const { return finished; }
+  // True if the whole message has been consumed from the input stream.
+
+  kj::Promise<void> loadSegments(uint count) KJ_WARN_UNUSED_RESULT;
+  // Make sure that the first `count` segments (or all segments, if there are fewer) are loaded.
+  // Fails if the segments were already discarded.  ReaderOptions::traversalLimitInWords bounds the
+  // total size of the loaded segments, but not of the message as a whole, since segments that are
+  // only forwarded or discarded are never held in memory.
+
+  kj::Promise<void> loadAll() KJ_WARN_UNUSED_RESULT;
+  // Load all remaining segments, after which the reader behaves like one from readMessage().
+
+  kj::Promise<void> discardRemaining() KJ_WARN_UNUSED_RESULT;
+  // Consume the rest of the message from the input stream without storing it.  Segments not yet
+  // loaded become permanently unavailable.
+
+  kj::Promise<void> forward(kj::AsyncOutputStream& output) KJ_WARN_UNUSED_RESULT;
+  // Write the whole message, in the standard format, to `output`.  Segments already loaded are
+  // written from memory; the rest are copied from the input stream to `output` through a small
+  // fixed-size buffer and do not become available to this reader.  `output` must remain valid
+  // until the returned promise resolves.
+
+  // implements MessageReader ----------------------------------------
+  kj::ArrayPtr<const word> getSegment(uint id) override;
+
+private:
+  kj::AsyncInputStream& input;
+  _::WireValue<uint32_t> firstWord[2];
+  kj::Array<_::WireValue<uint32_t>> moreSizes;
+  kj::Array<const word*> segmentStarts;
+  // Start of each loaded segment, except the first, which is `segment0Start`.  Allocated only
+  // for multi-segment messages.
+
+  const word* segment0Start = nullptr;
+  uint loadedCount = 0;
+  bool finished = false;
+
+  kj::ArrayPtr<word> scratchSpace;
+  // Portion of the caller's scratch space not yet used.
+
+  kj::Vector<kj::Array<word>> ownedSpace;
+  // Only for segments which didn't fit in scratchSpace.
+
+  friend kj::Promise<kj::Own<LazyMessageReader>> readMessageLazily(
+      kj::AsyncInputStream& input, ReaderOptions options, kj::ArrayPtr<word> scratchSpace);
+  friend kj::Promise<kj::Maybe<kj::Own<LazyMessageReader>>> tryReadMessageLazily(
+      kj::AsyncInputStream& input, ReaderOptions options, kj::ArrayPtr<word> scratchSpace);
+
+  kj::Promise<bool> readHeader();
+  inline uint32_t getSegmentSize(uint id) const {
+    return id == 0 ? firstWord[1].get() : moreSizes[id - 1].get();
+  }
+  inline const word*& segmentStart(uint id) {
+    return id == 0 ? segment0Start : segmentStarts[id];
+  }
+  size_t sumSegmentSizes(uint begin, uint end) const;
+};
+
+kj::Promise<kj::Own<LazyMessageReader>> readMessageLazily(
+    kj::AsyncInputStream& input, ReaderOptions options = ReaderOptions(),
+    kj::ArrayPtr<word> scratchSpace = nullptr);
+kj::Promise<kj::Maybe<kj::Own<LazyMessageReader>>> tryReadMessageLazily(
+    kj::AsyncInputStream& input, ReaderOptions options = ReaderOptions(),
+    kj::ArrayPtr<word> scratchSpace = nullptr);
+// Like readMessage() / tryReadMessage(), but resolves as soon as the first segment has been read.
+// See LazyMessageReader.
+//
+// `scratchSpace`, if provided, is used for segments in the order they are loaded, for as long as
+// they fit.  It must remain valid until the returned MessageReader is destroyed.
+
+class BufferedMessageStream {
+  // Reads a sequence of messages from a stream through a large buffer.  Each read asks the stream
+  // for as much as the buffer will hold, so a burst of small messages arrives in one system call
+  // instead of two per message, and every complete message in the buffer is parsed without
+  // reading again.
+  //
+  // Messages that fit in the buffer are not copied:  the returned MessageReader points into the
+  // buffer and holds a reference to it.  While any such reader is alive, the buffer is never
+  // overwritten; the stream moves on to a fresh buffer when it runs out of room instead.  So
+  // holding on to one small message keeps its whole buffer alive -- copy it into a message of its
+  // own if you intend to keep it for long.  Messages too big for the buffer are read into space
+  // of their own.
+
+public:
+  static constexpr size_t DEFAULT_BUFFER_WORDS = 8192;
+
+  explicit BufferedMessageStream(kj::AsyncInputStream& input,
+                                 ReaderOptions options = ReaderOptions(),
+                                 size_t bufferWords = DEFAULT_BUFFER_WORDS);
+  KJ_DISALLOW_COPY(BufferedMessageStream);
+  ~BufferedMessageStream() noexcept(false);
+
+  kj::Promise<kj::Own<MessageReader>> readMessage() KJ_WARN_UNUSED_RESULT;
+  kj::Promise<kj::Maybe<kj::Own<MessageReader>>> tryReadMessage() KJ_WARN_UNUSED_RESULT;
+  // Like the free functions of the same name.  Only one read may be in progress at a time.  The
+  // returned readers may outlive the BufferedMessageStream.
+
+  inline uint64_t getReadCount() const { return readCount; }
+  // Number of reads made from the input stream so far.
+
+private:
+  struct Buffer;
+  class Reader;
+
+  kj::AsyncInputStream& input;
+  ReaderOptions options;
+  size_t bufferWords;
+
+  kj::Own<Buffer> buffer;
+  size_t begin = 0;
+  size_t end = 0;
+  // Byte offsets into `buffer` of the data received but not yet returned.  `begin` is always at a
+  // message boundary, and therefore word-aligned.
+
+  uint64_t readCount = 0;
+
+  kj::Promise<bool> fill(size_t minBytes);
+  kj::Promise<kj::Own<MessageReader>> readLargeMessage(size_t tableBytes, size_t totalWords);
+};
+
 kj::Promise<void> writeMessage(kj::AsyncOutputStream& output,
                                kj::ArrayPtr<const kj::ArrayPtr<const word>> segments)
     KJ_WARN_UNUSED_RESULT;
@@ -52,6 +203,145 @@ kj::Promise<void> writeMessage(kj::AsyncOutputStream& output, MessageBuilder& bu
     KJ_WARN_UNUSED_RESULT;
 // Write asynchronously.  The parameters must remain valid until the returned promise resolves.
 
+kj::Promise<void> writeMessages(
+    kj::AsyncOutputStream& output,
+    kj::ArrayPtr<const kj::ArrayPtr<const kj::ArrayPtr<const word>>> messages)
+    KJ_WARN_UNUSED_RESULT;
+kj::Promise<void> writeMessages(kj::AsyncOutputStream& output,
+                                kj::ArrayPtr<MessageBuilder*> builders)
+    KJ_WARN_UNUSED_RESULT;
+// Write several messages back-to-back with a single vectored write.  The result is the same as
+// calling writeMessage() for each in turn, but all of the segment tables are allocated together
+// and handed to the stream along with the segments as one list of pieces, so a file descriptor
+// stream issues as few writev() calls as IOV_MAX allows rather than at least one per message.
+// The parameters must remain valid until the returned promise resolves.
+
+struct WriteBatchOptions {
+  // Controls how long MessageWriteQueue holds on to messages in the hope of writing more of them at
+  // once.
+
+  size_t maxBatchBytes = 1u << 20;
+  // Once at least this many bytes of messages are waiting, they are written without waiting out
+  // the rest of `maxDelay`.  (They still wait for a write already in progress.)
+
+  kj::Duration maxDelay = 0 * kj::SECONDS;
+  // How long to hold the first message of a batch before writing it.  Zero, the default, means
+  // until the end of the event loop turn in which it was queued, which costs no latency.  A
+  // nonzero delay trades latency for fewer, larger writes, and requires a kj::Timer.
+};
+
+class MessageWriteQueue {
+  // Queues outgoing messages and writes them in batches.  While one batch is being written,
+  // newly-queued messages accumulate; when the write completes, everything accumulated goes out
+  // in a single writeMessages().  Messages queued during the same event loop turn are also
+  // batched together, so a publisher fanning out many small messages makes a handful of system
+  // calls rather than one per message.  See WriteBatchOptions to hold messages longer.
+  //
+  // Messages are written in the order in which they are queued.
+
+public:
+  explicit MessageWriteQueue(kj::AsyncOutputStream& output);
+  MessageWriteQueue(kj::AsyncOutputStream& output, kj::Timer& timer, WriteBatchOptions options);
+  KJ_DISALLOW_COPY(MessageWriteQueue);
+  ~MessageWriteQueue() noexcept(false);
+
+  kj::Promise<void> write(kj::ArrayPtr<const kj::ArrayPtr<const word>> segments)
+      KJ_WARN_UNUSED_RESULT;
+  kj::Promise<void> write(MessageBuilder& builder) KJ_WARN_UNUSED_RESULT;
+  // Queue a message.  The returned promise resolves once the batch containing it has been
+  // written.  The segments must remain valid until then.  Dropping the returned promise does not
+  // un-queue the message.
+  //
+  // If a write fails, the messages in that batch and all subsequent messages fail with the same
+  // exception.
+
+  size_t getQueuedCount();
+  // Number of messages waiting for the current write to complete.
+
+  kj::Promise<void> whenDrained();
+  // Resolves when every message queued so far has been written, or rejects if any write failed.
+
+  inline uint64_t getBatchCount() const { return batchCount; }
+  // Number of writes made to the output stream so far.  Each is a single writeMessages() call,
+  // i.e. one system call unless the batch has more pieces than IOV_MAX.
+
+private:
+  struct Batch;
+
+  kj::AsyncOutputStream& output;
+  kj::Maybe<kj::Timer&> timer;
+  WriteBatchOptions options;
+
+  size_t queuedBytes = 0;
+  // Total size of the messages in `queued`.
+
+  kj::Maybe<kj::Own<kj::PromiseFulfiller<void>>> flushNow;
+  // While waiting to write the first batch after an idle period, fulfill this to write
+  // immediately.
+
+  uint64_t batchCount = 0;
+
+  kj::Own<Batch> queued;
+  // Messages not yet handed to the stream, or null if there are none.
+
+  kj::Own<Batch> inFlight;
+  // The batch currently being written, or null if the queue is idle.
+
+  bool writing = false;
+  kj::Maybe<kj::Promise<void>> writeLoop;
+  kj::Maybe<kj::Exception> error;
+
+  kj::Promise<void> writeQueued();
+};
+
+// =======================================================================================
+// Packed format
+
+class AsyncPackedInputStream final: public kj::AsyncInputStream {
+  // Wraps an AsyncInputStream carrying packed data (see serialize-packed.h) and presents the
+  // unpacked bytes.  Input is decoded as it arrives, directly into the caller's buffer; with
+  // readPackedMessage() that means straight into the message's segment space, with no staging
+  // copy of either the packed or the unpacked message.
+  //
+  // The stream reads ahead into an internal buffer, so it may consume bytes belonging to the next
+  // message.  Use a single AsyncPackedInputStream for all messages read from a given connection.
+
+public:
+  explicit AsyncPackedInputStream(kj::AsyncInputStream& inner, size_t bufferSize = 8192);
+  KJ_DISALLOW_COPY(AsyncPackedInputStream);
+
+  // implements AsyncInputStream -------------------------------------
+  kj::Promise<size_t> tryRead(void* buffer, size_t minBytes, size_t maxBytes) override;
+
+private:
+  kj::AsyncInputStream& inner;
+  _::PackedUnpacker unpacker;
+  kj::Array<byte> buffer;
+  kj::ArrayPtr<const byte> available;
+  // Portion of `buffer` which has been read from `inner` but not yet unpacked.
+
+  kj::Promise<size_t> tryReadInternal(byte* dst, size_t minBytes, size_t maxBytes,
+                                      size_t alreadyRead);
+};
+
+kj::Promise<kj::Own<MessageReader>> readPackedMessage(
+    AsyncPackedInputStream& input, ReaderOptions options = ReaderOptions(),
+    kj::ArrayPtr<word> scratchSpace = nullptr);
+kj::Promise<kj::Maybe<kj::Own<MessageReader>>> tryReadPackedMessage(
+    AsyncPackedInputStream& input, ReaderOptions options = ReaderOptions(),
+    kj::ArrayPtr<word> scratchSpace = nullptr);
+// Read a packed message asynchronously.  Same as readMessage() / tryReadMessage(), but decoding
+// the packed format.
+
+kj::Promise<void> writePackedMessage(kj::AsyncOutputStream& output,
+                                     kj::ArrayPtr<const kj::ArrayPtr<const word>> segments)
+    KJ_WARN_UNUSED_RESULT;
+kj::Promise<void> writePackedMessage(kj::AsyncOutputStream& output, MessageBuilder& builder)
+    KJ_WARN_UNUSED_RESULT;
+// Write a packed message asynchronously.  The message is packed a bounded chunk at a time, each
+// chunk being written before the next is packed, so memory use doesn't grow with message size.
+// The parameters must remain valid until the returned promise resolves.
+
 // =======================================================================================
 // inline implementation details
 
@@ -59,6 +349,25 @@ inline kj::Promise<void> writeMessage(kj::AsyncOutputStream& output, MessageBuil
   return writeMessage(output, builder.getSegmentsForOutput());
 }
 
+inline kj::Promise<void> MessageWriteQueue::write(MessageBuilder& builder) {
+  return write(builder.getSegmentsForOutput());
+}
+
+inline kj::Promise<kj::Own<MessageReader>> readPackedMessage(
+    AsyncPackedInputStream& input, ReaderOptions options, kj::ArrayPtr<word> scratchSpace) {
+  return readMessage(input, options, scratchSpace);
+}
+
+inline kj::Promise<kj::Maybe<kj::Own<MessageReader>>> tryReadPackedMessage(
+    AsyncPackedInputStream& input, ReaderOptions options, kj::ArrayPtr<word> scratchSpace) {
+  return tryReadMessage(input, options, scratchSpace);
+}
+
+inline kj::Promise<void> writePackedMessage(
+    kj::AsyncOutputStream& output, MessageBuilder& builder) {
+  return writePackedMessage(output, builder.getSegmentsForOutput());
+}
+
 }  // namespace capnp
 
 #endif  // CAPNP_SERIALIZE_ASYNC_H_
@@ -0,0 +1,312 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "serialize-log.h"
+#include <kj/debug.h>
+#include <kj/compat/gtest.h>
+#include <kj/miniposix.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include "test-util.h"
+
+#if !_WIN32  // TODO(someday): Find a temp directory on Windows.
+
+namespace capnp {
+namespace _ {  // private
+namespace {
+
+kj::AutoCloseFd makeTempFile() {
+#if __ANDROID__
+  char filename[] = "capnproto-serialize-log-test-XXXXXX";
+#else
+  char filename[] = "/tmp/capnproto-serialize-log-test-XXXXXX";
+#endif
+  kj::AutoCloseFd result(mkstemp(filename));
+  KJ_ASSERT(result.get() >= 0);
+  // Unlink the file so that it will be deleted on close.
+  KJ_SYSCALL(unlink(filename));
+  return result;
+}
+
+off_t fileSize(int fd) {
+  struct stat stats;
+  KJ_SYSCALL(fstat(fd, &stats));
+  return stats.st_size;
+}
+
+void appendTestRecords(RecordLogWriter& writer, uint begin, uint end) {
+  for (uint i = begin; i < end; i++) {
+    MallocMessageBuilder builder(i % 5 == 0 ? 1 : SUGGESTED_FIRST_SEGMENT_WORDS,
+                                 AllocationStrategy::FIXED_SIZE);
+    auto root = builder.initRoot<TestAllTypes>();
+    if (i % 7 == 0) {
+      initTestMessage(root);
+    }
+    root.setUInt32Field(i);
+    writer.append(builder);
+  }
+}
+
+uint recordValue(const RecordLogReader& reader, size_t index) {
+  return reader.getMessage(index)->getRoot<TestAllTypes>().getUInt32Field();
+}
+
+void checkRecords(const RecordLogReader& reader, uint count) {
+  ASSERT_EQ(count, reader.size());
+  for (uint i = 0; i < count; i++) {
+    auto message = reader.getMessage(i);
+    auto root = message->getRoot<TestAllTypes>();
+    EXPECT_EQ(i, root.getUInt32Field());
+    if (i % 7 == 0) {
+      EXPECT_EQ("foo", root.getTextField());
+      EXPECT_EQ(3u, root.getStructList().size());
+    }
+  }
+}
+
+TEST(SerializeLog, Crc32c) {
+  kj::StringPtr check = "123456789";
+
+  for (bool hardware: {true, false}) {
+    bool previous = setCrc32cHardwareEnabled(hardware);
+    KJ_DEFER(setCrc32cHardwareEnabled(previous));
+
+    EXPECT_EQ(0u, crc32c(nullptr));
+    EXPECT_EQ(0xe3069283u, crc32c(check.asBytes()));
+    EXPECT_EQ(0xe3069283u,
+              crc32c(check.asBytes().slice(4, 9), crc32c(check.asBytes().slice(0, 4))));
+
+    // 32 bytes of zeros, from RFC 3720.
+    byte zeros[32] = {};
+    EXPECT_EQ(0x8a9136aau, crc32c(kj::arrayPtr(zeros, sizeof(zeros))));
+  }
+
+  // The hardware and portable paths must agree at every alignment and length.
+  byte buffer[300];
+  for (uint i = 0; i < sizeof(buffer); i++) {
+    buffer[i] = i * 37 + 11;
+  }
+  for (uint offset = 0; offset < 9; offset++) {
+    for (uint size: {0u, 1u, 7u, 8u, 9u, 64u, 255u, 291u}) {
+      auto piece = kj::arrayPtr(buffer + offset, size);
+      uint32_t fast = crc32c(piece);
+      bool previous = setCrc32cHardwareEnabled(false);
+      uint32_t slow = crc32c(piece);
+      setCrc32cHardwareEnabled(previous);
+      KJ_EXPECT(fast == slow, offset, size);
+    }
+  }
+}
+
+TEST(SerializeLog, RoundTripWithFooter) {
+  auto fd = makeTempFile();
+
+  RecordLogOptions options;
+  options.syncInterval = 16;
+  options.batchSizeBytes = 4096;
+  {
+    RecordLogWriter writer(fd, options);
+    appendTestRecords(writer, 0, 300);
+    EXPECT_EQ(300u, writer.size());
+    writer.finish();
+    EXPECT_ANY_THROW(appendTestRecords(writer, 300, 301));
+  }
+
+  RecordLogReader reader(fd);
+  EXPECT_TRUE(reader.hasFooter());
+  EXPECT_EQ(0u, reader.getDiscardedWords());
+  checkRecords(reader, 300);
+  EXPECT_ANY_THROW(reader.getRecord(300));
+}
+
+TEST(SerializeLog, ScanWithoutFooter) {
+  auto fd = makeTempFile();
+
+  {
+    RecordLogWriter writer(fd);
+    appendTestRecords(writer, 0, 100);
+    // Destructor flushes but doesn't write a footer.
+  }
+
+  RecordLogReader reader(fd);
+  EXPECT_FALSE(reader.hasFooter());
+  EXPECT_EQ(0u, reader.getDiscardedWords());
+  checkRecords(reader, 100);
+}
+
+TEST(SerializeLog, EmptyLog) {
+  auto fd = makeTempFile();
+
+  {
+    RecordLogReader reader(fd);
+    EXPECT_EQ(0u, reader.size());
+  }
+
+  {
+    RecordLogWriter writer(fd);
+    writer.finish();
+  }
+
+  RecordLogReader reader(fd);
+  EXPECT_TRUE(reader.hasFooter());
+  EXPECT_EQ(0u, reader.size());
+}
+
+TEST(SerializeLog, ReopenAndAppend) {
+  auto fd = makeTempFile();
+
+  {
+    RecordLogWriter writer(fd);
+    appendTestRecords(writer, 0, 10);
+    writer.finish();
+  }
+
+  {
+    // Reopening removes the footer and continues where the log left off.
+    RecordLogWriter writer(fd);
+    EXPECT_EQ(10u, writer.size());
+    appendTestRecords(writer, 10, 25);
+    writer.finish();
+  }
+
+  RecordLogReader reader(fd);
+  EXPECT_TRUE(reader.hasFooter());
+  checkRecords(reader, 25);
+}
+
+TEST(SerializeLog, TornWrite) {
+  auto fd = makeTempFile();
+
+  {
+    RecordLogWriter writer(fd);
+    appendTestRecords(writer, 0, 10);
+  }
+
+  // Simulate a crash in the middle of writing the last record.
+  KJ_SYSCALL(ftruncate(fd, fileSize(fd) - 13));
+
+  {
+    RecordLogReader reader(fd);
+    EXPECT_FALSE(reader.hasFooter());
+    EXPECT_GT(reader.getDiscardedWords(), 0u);
+    checkRecords(reader, 9);
+  }
+
+  {
+    // The writer cuts off the torn record before appending.
+    RecordLogWriter writer(fd);
+    EXPECT_EQ(9u, writer.size());
+    appendTestRecords(writer, 9, 12);
+  }
+
+  RecordLogReader reader(fd);
+  EXPECT_EQ(0u, reader.getDiscardedWords());
+  checkRecords(reader, 12);
+}
+
+TEST(SerializeLog, CorruptRecord) {
+  auto fd = makeTempFile();
+
+  RecordLogOptions options;
+  options.syncInterval = 4;
+  {
+    RecordLogWriter writer(fd, options);
+    appendTestRecords(writer, 0, 20);
+    writer.finish();
+  }
+
+  // Find record 5 in the file and flip a bit in the middle of it.
+  off_t corruptOffset;
+  {
+    RecordLogReader reader(fd);
+    auto record0 = reader.getRecord(0);
+    auto record5 = reader.getRecord(5);
+    // Record 0's content follows the file header, a sync marker, and its own tag.
+    corruptOffset = (record5.begin() - record0.begin() + 4) * sizeof(word) +
+        record5.asBytes().size() / 2;
+  }
+  byte b;
+  KJ_SYSCALL(pread(fd, &b, 1, corruptOffset));
+  b ^= 0x10;
+  KJ_SYSCALL(pwrite(fd, &b, 1, corruptOffset));
+
+  {
+    // With the footer, the index is intact, but the checksum catches the damage on access.
+    RecordLogReader reader(fd);
+    EXPECT_TRUE(reader.hasFooter());
+    EXPECT_EQ(20u, reader.size());
+    EXPECT_EQ(4u, recordValue(reader, 4));
+    EXPECT_ANY_THROW(reader.getRecord(5));
+    EXPECT_EQ(6u, recordValue(reader, 6));
+  }
+
+  // Chop off the footer so that the reader has to scan.  It loses records 5 through 7, resuming
+  // at the sync marker before record 8.
+  {
+    RecordLogReader reader(fd);
+    auto record19 = reader.getRecord(19);
+    auto record0 = reader.getRecord(0);
+    KJ_SYSCALL(ftruncate(fd, (record19.end() - record0.begin() + 4) * sizeof(word)));
+  }
+
+  RecordLogReader reader(fd);
+  EXPECT_FALSE(reader.hasFooter());
+  EXPECT_GT(reader.getDiscardedWords(), 0u);
+  ASSERT_EQ(17u, reader.size());
+  EXPECT_EQ(4u, recordValue(reader, 4));
+  EXPECT_EQ(8u, recordValue(reader, 5));
+  EXPECT_EQ(19u, recordValue(reader, 16));
+}
+
+TEST(SerializeLog, AppendAllZeroCopy) {
+  auto fd = makeTempFile();
+
+  kj::Vector<kj::Own<MallocMessageBuilder>> builders;
+  kj::Vector<kj::ArrayPtr<const kj::ArrayPtr<const word>>> messages;
+  for (uint i = 0; i < 50; i++) {
+    auto builder = kj::heap<MallocMessageBuilder>(i % 5 == 0 ? 1 : SUGGESTED_FIRST_SEGMENT_WORDS,
+                                                  AllocationStrategy::FIXED_SIZE);
+    auto root = builder->initRoot<TestAllTypes>();
+    if (i % 7 == 0) {
+      initTestMessage(root);
+    }
+    root.setUInt32Field(i);
+    messages.add(builder->getSegmentsForOutput());
+    builders.add(kj::mv(builder));
+  }
+
+  {
+    RecordLogWriter writer(fd);
+    writer.appendAll(messages.asPtr().slice(0, 20));
+    appendTestRecords(writer, 20, 30);
+    writer.appendAll(messages.asPtr().slice(30, 50));
+    writer.finish();
+  }
+
+  RecordLogReader reader(fd);
+  checkRecords(reader, 50);
+}
+
+}  // namespace
+}  // namespace _ (private)
+}  // namespace capnp
+
+#endif  // !_WIN32
@@ -0,0 +1,581 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "serialize-log.h"
+#include "serialize-mmap.h"
+#include <kj/debug.h>
+#include <kj/io.h>
+#include <kj/miniposix.h>
+#include <string.h>
+#include <errno.h>
+
+#if _WIN32
+#include <io.h>
+#endif
+
+#if !defined(CAPNP_NO_SIMD) && (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) ? (__clang_major__ > 3 || (__clang_major__ == 3 && __clang_minor__ >= 8)) \
+                        : (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)))
+// As with the packing kernels in serialize-packed.c++, the SSE4.2 code is compiled with a
+// function-level target attribute and selected at runtime.
+#define CAPNP_CRC32C_SSE42 1
+#define CAPNP_TARGET_SSE42 __attribute__((target("sse4.2")))
+#include <nmmintrin.h>
+#else
+#define CAPNP_CRC32C_SSE42 0
+#endif
+
+#if !defined(CAPNP_NO_SIMD) && defined(__ARM_FEATURE_CRC32)
+#define CAPNP_CRC32C_ARM 1
+#include <arm_acle.h>
+#else
+#define CAPNP_CRC32C_ARM 0
+#endif
+
+namespace capnp {
+
+namespace _ {  // private
+
+namespace {
+
+// =======================================================================================
+// CRC32C
+
+struct Crc32cTables {
+  // Tables for the "slicing-by-8" algorithm, which processes eight bytes per iteration.  table[0]
+  // is the classic byte-at-a-time table.
+
+  uint32_t table[8][256];
+
+  Crc32cTables() {
+    for (uint i = 0; i < 256; i++) {
+      uint32_t crc = i;
+      for (uint j = 0; j < 8; j++) {
+        crc = (crc >> 1) ^ (0x82f63b78u & (0u - (crc & 1)));
+      }
+      table[0][i] = crc;
+    }
+    for (uint i = 0; i < 256; i++) {
+      for (uint k = 1; k < 8; k++) {
+        table[k][i] = (table[k - 1][i] >> 8) ^ table[0][table[k - 1][i] & 0xff];
+      }
+    }
+  }
+};
+
+const Crc32cTables& getCrc32cTables() {
+  static const Crc32cTables tables;
+  return tables;
+}
+
+uint32_t crc32cPortable(const byte* data, size_t size, uint32_t crc) {
+  auto& t = getCrc32cTables().table;
+
+  while (size > 0 && reinterpret_cast<uintptr_t>(data) % 8 != 0) {
+    crc = t[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    --size;
+  }
+
+  while (size >= 8) {
+    // Assemble the first four bytes explicitly so that this works regardless of host byte order.
+    uint32_t low = crc ^ (static_cast<uint32_t>(data[0]) |
+                          static_cast<uint32_t>(data[1]) << 8 |
+                          static_cast<uint32_t>(data[2]) << 16 |
+                          static_cast<uint32_t>(data[3]) << 24);
+    crc = t[7][low & 0xff] ^ t[6][(low >> 8) & 0xff] ^ t[5][(low >> 16) & 0xff] ^ t[4][low >> 24] ^
+          t[3][data[4]] ^ t[2][data[5]] ^ t[1][data[6]] ^ t[0][data[7]];
+    data += 8;
+    size -= 8;
+  }
+
+  while (size > 0) {
+    crc = t[0][(crc ^ *data++) & 0xff] ^ (crc >> 8);
+    --size;
+  }
+
+  return crc;
+}
+
+bool crc32cHardwareDisabled = false;
+
+#if CAPNP_CRC32C_SSE42
+
+CAPNP_TARGET_SSE42
+uint32_t crc32cSse42(const byte* data, size_t size, uint32_t crc) {
+  while (size > 0 && reinterpret_cast<uintptr_t>(data) % 8 != 0) {
+    crc = _mm_crc32_u8(crc, *data++);
+    --size;
+  }
+
+#if __x86_64__
+  uint64_t crc64 = crc;
+  while (size >= 8) {
+    uint64_t chunk;
+    memcpy(&chunk, data, sizeof(chunk));
+    crc64 = _mm_crc32_u64(crc64, chunk);
+    data += 8;
+    size -= 8;
+  }
+  crc = crc64;
+#else
+  while (size >= 4) {
+    uint32_t chunk;
+    memcpy(&chunk, data, sizeof(chunk));
+    crc = _mm_crc32_u32(crc, chunk);
+    data += 4;
+    size -= 4;
+  }
+#endif
+
+  while (size > 0) {
+    crc = _mm_crc32_u8(crc, *data++);
+    --size;
+  }
+
+  return crc;
+}
+
+bool useSse42() {
+  static const bool supported = __builtin_cpu_supports("sse4.2");
+  return supported && !crc32cHardwareDisabled;
+}
+
+#elif CAPNP_CRC32C_ARM
+
+uint32_t crc32cArm(const byte* data, size_t size, uint32_t crc) {
+  while (size > 0 && reinterpret_cast<uintptr_t>(data) % 8 != 0) {
+    crc = __crc32cb(crc, *data++);
+    --size;
+  }
+  while (size >= 8) {
+    uint64_t chunk;
+    memcpy(&chunk, data, sizeof(chunk));
+    crc = __crc32cd(crc, chunk);
+    data += 8;
+    size -= 8;
+  }
+  while (size > 0) {
+    crc = __crc32cb(crc, *data++);
+    --size;
+  }
+  return crc;
+}
+
+#endif
+
+}  // namespace
+
+uint32_t crc32c(kj::ArrayPtr<const byte> data, uint32_t crc) {
+  crc = ~crc;
+#if CAPNP_CRC32C_SSE42
+  if (useSse42()) {
+    return ~crc32cSse42(data.begin(), data.size(), crc);
+  }
+#elif CAPNP_CRC32C_ARM
+  if (!crc32cHardwareDisabled) {
+    return ~crc32cArm(data.begin(), data.size(), crc);
+  }
+#endif
+  return ~crc32cPortable(data.begin(), data.size(), crc);
+}
+
+bool setCrc32cHardwareEnabled(bool enabled) {
+  bool previous = !crc32cHardwareDisabled;
+  crc32cHardwareDisabled = !enabled;
+  return previous;
+}
+
+}  // namespace _ (private)
+
+// =======================================================================================
+
+namespace {
+
+constexpr uint64_t FILE_MAGIC = 0x3130676f6c6e7063ull;    // "cpnlog01"
+constexpr uint64_t FOOTER_MAGIC = 0x7869676f6c6e7063ull;  // "cpnlogix"
+constexpr uint64_t SYNC_MAGIC = 0x8a3d1f6c2b9e4705ull;
+// Arbitrary; chosen to be unlikely to appear in message data.
+
+constexpr uint32_t SYNC_TAG = 0xffffffffu;
+constexpr uint32_t SYNC_TAG_CHECK = 0x434e5953u;  // "SYNC"
+constexpr uint32_t FOOTER_TAG = 0xfffffffeu;
+// Reserved values for the `size` half of a tag word.  Record sizes must be less than these.
+
+inline uint64_t getWord(kj::ArrayPtr<const word> words, size_t pos) {
+  return reinterpret_cast<const _::WireValue<uint64_t>*>(words.begin())[pos].get();
+}
+
+inline void setWord(word& w, uint64_t value) {
+  reinterpret_cast<_::WireValue<uint64_t>&>(w).set(value);
+}
+
+inline uint32_t getTagSize(kj::ArrayPtr<const word> words, size_t pos) {
+  return reinterpret_cast<const _::WireValue<uint32_t>*>(words.begin() + pos)[0].get();
+}
+
+inline uint32_t getTagCrc(kj::ArrayPtr<const word> words, size_t pos) {
+  return reinterpret_cast<const _::WireValue<uint32_t>*>(words.begin() + pos)[1].get();
+}
+
+inline void setTag(word& w, uint32_t size, uint32_t crc) {
+  auto tag = reinterpret_cast<_::WireValue<uint32_t>*>(&w);
+  tag[0].set(size);
+  tag[1].set(crc);
+}
+
+bool isSyncMarker(kj::ArrayPtr<const word> words, size_t pos) {
+  return pos + 2 <= words.size() &&
+         getTagSize(words, pos) == SYNC_TAG &&
+         getTagCrc(words, pos) == SYNC_TAG_CHECK &&
+         getWord(words, pos + 1) == SYNC_MAGIC;
+}
+
+kj::Maybe<size_t> checkRecord(kj::ArrayPtr<const word> words, size_t pos, size_t limit,
+                              bool verifyChecksum) {
+  // Returns the size of the message in the record at `pos`, or null if there isn't a well-formed
+  // record there which ends before `limit`.
+
+  uint32_t size = getTagSize(words, pos);
+  if (size == 0 || size >= FOOTER_TAG || size > limit - pos - 1) {
+    return nullptr;
+  }
+
+  auto message = words.slice(pos + 1, pos + 1 + size);
+  if (expectedSizeInWordsFromPrefix(message) != size) {
+    return nullptr;
+  }
+  if (verifyChecksum && _::crc32c(message.asBytes()) != getTagCrc(words, pos)) {
+    return nullptr;
+  }
+
+  return size_t(size);
+}
+
+void truncateFile(int fd, uint64_t size) {
+#if _WIN32
+  errno_t error = _chsize_s(fd, size);
+  if (error != 0) {
+    KJ_FAIL_SYSCALL("_chsize_s", error);
+  }
+#else
+  KJ_SYSCALL(ftruncate(fd, size));
+#endif
+}
+
+}  // namespace
+
+// =======================================================================================
+
+RecordLogReader::RecordLogReader(int fd, ReaderOptions options, bool verifyChecksums)
+    : mapping(_::mmapWholeFile(fd, true)), options(options), verifyOnAccess(verifyChecksums) {
+  if (mapping.size() == 0) {
+    // Empty log (or a log whose header was never completely written).
+    recordsEnd = 0;
+    return;
+  }
+
+  KJ_REQUIRE(getWord(mapping, 0) == FILE_MAGIC, "not a record log");
+
+  if (!loadFooter()) {
+    scan();
+  }
+}
+
+bool RecordLogReader::loadFooter() {
+  // Footer layout: tag(FOOTER_TAG, crc of body), body = (count, offsets[count]),
+  // then the offset of the tag and FOOTER_MAGIC.
+
+  size_t end = mapping.size();
+  if (end < 5 || getWord(mapping, end - 1) != FOOTER_MAGIC) {
+    return false;
+  }
+
+  uint64_t footerPos = getWord(mapping, end - 2);
+  if (footerPos < 1 || footerPos > end - 4 || getTagSize(mapping, footerPos) != FOOTER_TAG) {
+    return false;
+  }
+
+  uint64_t count = getWord(mapping, footerPos + 1);
+  if (count != end - 4 - footerPos) {
+    return false;
+  }
+
+  auto body = mapping.slice(footerPos + 1, end - 2);
+  if (_::crc32c(body.asBytes()) != getTagCrc(mapping, footerPos)) {
+    return false;
+  }
+
+  auto result = kj::heapArray<uint64_t>(count);
+  uint64_t prev = 0;
+  for (size_t i = 0; i < count; i++) {
+    uint64_t offset = getWord(body, i + 1);
+    if (offset <= prev || offset >= footerPos) {
+      return false;
+    }
+    result[i] = prev = offset;
+  }
+
+  offsets = kj::mv(result);
+  recordsEnd = footerPos;
+  footerFound = true;
+  return true;
+}
+
+void RecordLogReader::scan() {
+  kj::Vector<uint64_t> found;
+  size_t end = mapping.size();
+  size_t pos = 1;
+
+  while (pos < end) {
+    if (isSyncMarker(mapping, pos)) {
+      pos += 2;
+      continue;
+    }
+
+    KJ_IF_MAYBE(size, checkRecord(mapping, pos, end, true)) {
+      found.add(pos);
+      pos += 1 + *size;
+      continue;
+    }
+
+    // Corrupt record, or the beginning of a torn write.  Resume at the next sync marker, if any.
+    size_t next = pos + 1;
+    while (next < end && !isSyncMarker(mapping, next)) {
+      ++next;
+    }
+    if (next == end) {
+      // Nothing intact after this point.
+      discardedWords += end - pos;
+      break;
+    }
+    discardedWords += next - pos;
+    pos = next;
+  }
+
+  offsets = found.releaseAsArray();
+  recordsEnd = pos;
+
+  // Records were verified during the scan.
+  verifyOnAccess = false;
+}
+
+kj::ArrayPtr<const word> RecordLogReader::getRecord(size_t index) const {
+  KJ_REQUIRE(index < size(), "record index out of range", index, size());
+
+  size_t pos = offsets[index];
+  size_t limit = index + 1 < size() ? offsets[index + 1] : recordsEnd;
+  KJ_IF_MAYBE(size, checkRecord(mapping, pos, limit, verifyOnAccess)) {
+    return mapping.slice(pos + 1, pos + 1 + *size);
+  } else {
+    KJ_FAIL_REQUIRE("record log entry is corrupt", index) {
+      return nullptr;
+    }
+  }
+}
+
+kj::Own<FlatArrayMessageReader> RecordLogReader::getMessage(size_t index) const {
+  return kj::heap<FlatArrayMessageReader>(getRecord(index), options);
+}
+
+// =======================================================================================
+
+class RecordLogWriter::RecordCollector final: public kj::OutputStream {
+  // Receives the output of `writeMessage()` for one record, checksums it, and queues it on the
+  // writer.  Segment data is queued by reference unless `copy` is true; everything else (i.e. the
+  // segment table, which writeMessage() builds in a temporary buffer) is always copied.
+
+public:
+  RecordCollector(RecordLogWriter& writer, kj::ArrayPtr<const kj::ArrayPtr<const word>> segments,
+                  bool copy)
+      : writer(writer), segments(segments), copy(copy) {}
+
+  inline uint32_t getCrc() const { return crc; }
+
+  void write(const void* buffer, size_t size) override {
+    add(kj::arrayPtr(reinterpret_cast<const byte*>(buffer), size));
+  }
+
+  void write(kj::ArrayPtr<const kj::ArrayPtr<const byte>> pieces) override {
+    for (auto& piece: pieces) {
+      add(piece);
+    }
+  }
+
+private:
+  RecordLogWriter& writer;
+  kj::ArrayPtr<const kj::ArrayPtr<const word>> segments;
+  size_t nextSegment = 0;
+  bool copy;
+  uint32_t crc = 0;
+
+  void add(kj::ArrayPtr<const byte> piece) {
+    crc = _::crc32c(piece, crc);
+
+    if (!copy && nextSegment < segments.size() &&
+        piece.begin() == segments[nextSegment].asBytes().begin()) {
+      ++nextSegment;
+      writer.addPiece(piece);
+    } else {
+      KJ_ASSERT(piece.size() % sizeof(word) == 0);
+      auto space = writer.allocate(piece.size() / sizeof(word));
+      memcpy(space.asBytes().begin(), piece.begin(), piece.size());
+      writer.addPiece(space.asBytes());
+    }
+  }
+};
+
+RecordLogWriter::RecordLogWriter(int fd, RecordLogOptions options)
+    : fd(fd), options(options), recordsSinceSync(options.syncInterval) {
+  RecordLogReader existing(fd, ReaderOptions(), false);
+
+  endOffset = existing.recordsEnd;
+  truncateFile(fd, endOffset * sizeof(word));
+  KJ_SYSCALL(lseek(fd, endOffset * sizeof(word), SEEK_SET));
+
+  if (endOffset == 0) {
+    auto header = allocate(1);
+    setWord(header[0], FILE_MAGIC);
+    addPiece(header.asBytes());
+    endOffset = 1;
+  } else {
+    offsets.addAll(existing.offsets);
+  }
+}
+
+RecordLogWriter::~RecordLogWriter() noexcept(false) {
+  unwindDetector.catchExceptionsIfUnwinding([&]() {
+    flush();
+  });
+}
+
+kj::ArrayPtr<word> RecordLogWriter::allocate(size_t words) {
+  if (chunks.empty() || chunkUsed + words > chunks.back().size()) {
+    chunks.add(kj::heapArray<word>(kj::max(words, options.batchSizeBytes / sizeof(word))));
+    chunkUsed = 0;
+  }
+
+  auto result = chunks.back().slice(chunkUsed, chunkUsed + words);
+  chunkUsed += words;
+  return result;
+}
+
+void RecordLogWriter::addPiece(kj::ArrayPtr<const byte> piece) {
+  bufferedBytes += piece.size();
+  if (!pieces.empty() && pieces.back().end() == piece.begin()) {
+    // Contiguous with the previous piece, which is common when copying.  Merge them to save iovecs.
+    auto& last = pieces.back();
+    last = kj::arrayPtr(last.begin(), piece.end());
+  } else {
+    pieces.add(piece);
+  }
+}
+
+void RecordLogWriter::addSyncMarkerIfNeeded() {
+  if (recordsSinceSync >= options.syncInterval) {
+    auto marker = allocate(2);
+    setTag(marker[0], SYNC_TAG, SYNC_TAG_CHECK);
+    setWord(marker[1], SYNC_MAGIC);
+    addPiece(marker.asBytes());
+    endOffset += 2;
+    recordsSinceSync = 0;
+  }
+}
+
+void RecordLogWriter::addRecord(kj::ArrayPtr<const kj::ArrayPtr<const word>> segments,
+                                bool copy) {
+  KJ_REQUIRE(!finished, "can't append to a record log after finish()");
+
+  size_t size = computeSerializedSizeInWords(segments);
+  KJ_REQUIRE(size < FOOTER_TAG, "message is too large for a record log", size);
+
+  addSyncMarkerIfNeeded();
+
+  auto tag = allocate(1);
+  addPiece(tag.asBytes());
+
+  RecordCollector collector(*this, segments, copy);
+  writeMessage(collector, segments);
+  setTag(tag[0], size, collector.getCrc());
+
+  offsets.add(endOffset);
+  endOffset += 1 + size;
+  ++recordsSinceSync;
+}
+
+void RecordLogWriter::append(kj::ArrayPtr<const kj::ArrayPtr<const word>> segments) {
+  addRecord(segments, true);
+  if (bufferedBytes >= options.batchSizeBytes) {
+    flush();
+  }
+}
+
+void RecordLogWriter::appendAll(
+    kj::ArrayPtr<const kj::ArrayPtr<const kj::ArrayPtr<const word>>> messages) {
+  for (auto& segments: messages) {
+    addRecord(segments, false);
+  }
+  // We must write before returning since we're holding pointers into the caller's segments.
+  flush();
+}
+
+void RecordLogWriter::flush() {
+  if (!pieces.empty()) {
+    kj::FdOutputStream(fd).write(pieces.asPtr());
+    pieces.clear();
+  }
+  bufferedBytes = 0;
+
+  // Keep one chunk around for the next batch.
+  if (chunks.size() > 1) {
+    chunks.truncate(1);
+  }
+  chunkUsed = 0;
+}
+
+void RecordLogWriter::sync() {
+  flush();
+#if _WIN32
+  KJ_SYSCALL(_commit(fd));
+#else
+  KJ_SYSCALL(fsync(fd));
+#endif
+}
+
+void RecordLogWriter::finish() {
+  KJ_REQUIRE(!finished, "finish() called twice");
+
+  size_t count = offsets.size();
+  auto footer = allocate(count + 4);
+  setWord(footer[1], count);
+  for (size_t i = 0; i < count; i++) {
+    setWord(footer[i + 2], offsets[i]);
+  }
+  setTag(footer[0], FOOTER_TAG, _::crc32c(footer.slice(1, count + 2).asBytes()));
+  setWord(footer[count + 2], endOffset);
+  setWord(footer[count + 3], FOOTER_MAGIC);
+  addPiece(footer.asBytes());
+  endOffset += count + 4;
+
+  flush();
+  finished = true;
+}
+
+}  // namespace capnp
@@ -0,0 +1,205 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef CAPNP_SERIALIZE_LOG_H_
+#define CAPNP_SERIALIZE_LOG_H_
+
+#if defined(__GNUC__) && !defined(CAPNP_HEADER_WARNINGS)
+#pragma GCC system_header
+#endif
+
+#include "serialize.h"
+#include <kj/vector.h>
+
+namespace capnp {
+
+// =======================================================================================
+// Record logs
+//
+// A record log is an append-only file of messages, suitable for durable storage of a stream of
+// messages.  Compared to simply concatenating the output of `writeMessage()`, a record log adds:
+// - A CRC32C checksum on every record, so that corruption and torn writes are detected.
+// - Periodic sync markers, so that a reader can skip over a corrupted record and resume at the
+//   next marker rather than losing the rest of the file.
+// - An optional index footer, written by `RecordLogWriter::finish()`, which lets a reader open the
+//   file and jump to any record by number without scanning it.
+//
+// The format is word-aligned throughout, so records are read in-place from a memory mapping:
+//
+//     file    = fileHeader (record | syncMarker)* footer?
+//     record  = tag(size: UInt32, crc: UInt32) message
+//
+// where `message` is exactly what `writeMessage()` produces, `size` is its length in words, and
+// `crc` is the CRC32C of its bytes.  Sync markers and the footer are distinguished by reserved
+// `size` values.  All integers are little-endian.
+
+struct RecordLogOptions {
+  uint syncInterval = 256;
+  // A sync marker is written before the first record of each writer session, and then after every
+  // `syncInterval` records.  After corruption, the reader resumes at the next sync marker, so this
+  // bounds how many records a single bad record can take out with it.
+
+  size_t batchSizeBytes = 65536;
+  // `append()` copies records into a batch buffer which is written out with a single gathered
+  // write once it exceeds this size (or on `flush()`).
+};
+
+class RecordLogReader {
+  // Reads a record log via mmap().  Records are never copied.
+  //
+  // If the log ends with a valid index footer, opening is O(1).  Otherwise, the log is scanned and
+  // every record's checksum is verified; records that fail are dropped, and any torn write at the
+  // end of the file is ignored.
+  //
+  // Once constructed, the object is immutable, so it can be shared between threads.
+
+public:
+  explicit RecordLogReader(int fd, ReaderOptions options = ReaderOptions(),
+                           bool verifyChecksums = true);
+  // Map and index the log open on `fd`.  Does not take ownership of `fd`.  If `verifyChecksums` is
+  // true, records loaded via the footer have their checksum checked each time they are accessed;
+  // records found by scanning are always checked once, up front.
+
+  KJ_DISALLOW_COPY(RecordLogReader);
+
+  inline size_t size() const { return offsets.size(); }
+  // Number of (intact) records in the log.
+
+  kj::ArrayPtr<const word> getRecord(size_t index) const;
+  // Get the words of the message in the given record, suitable for `FlatArrayMessageReader`.
+  // The returned array points into the mapping.  Throws if the record's checksum doesn't match.
+
+  kj::Own<FlatArrayMessageReader> getMessage(size_t index) const;
+  // Construct a reader for the message in the given record.
+
+  inline bool hasFooter() const { return footerFound; }
+  // Whether the index was loaded from a footer, as opposed to built by scanning.
+
+  inline size_t getDiscardedWords() const { return discardedWords; }
+  // Number of words that were skipped during the scan because they were corrupt or torn.  Zero
+  // for a log that was opened via its footer or that had no damage.
+
+private:
+  kj::Array<const word> mapping;
+  kj::Array<uint64_t> offsets;
+  // Word offset of each record's tag.
+  size_t recordsEnd;
+  // End of the last record (i.e. start of the footer or torn tail), in words.
+  size_t discardedWords = 0;
+  ReaderOptions options;
+  bool footerFound = false;
+  bool verifyOnAccess;
+
+  bool loadFooter();
+  void scan();
+
+  friend class RecordLogWriter;
+};
+
+class RecordLogWriter {
+  // Appends messages to a record log.
+  //
+  // Records are buffered and written with one gathered write (writev()) per batch.  Nothing is
+  // guaranteed to have reached the file until `flush()`, and nothing is durable until `sync()`.
+
+public:
+  explicit RecordLogWriter(int fd, RecordLogOptions options = RecordLogOptions());
+  // Start writing to `fd`, which must be open for both reading and writing.  Does not take
+  // ownership of `fd`.  If the file is empty, a new log is started.  Otherwise the existing log
+  // is opened with `RecordLogReader`; any footer or torn tail is truncated away and new records
+  // are appended after the last intact record.
+
+  KJ_DISALLOW_COPY(RecordLogWriter);
+  ~RecordLogWriter() noexcept(false);
+  // Flushes any buffered records.  Does not write a footer.
+
+  void append(MessageBuilder& builder);
+  void append(kj::ArrayPtr<const kj::ArrayPtr<const word>> segments);
+  // Append one message.  The content is copied into the batch buffer, so the builder may be
+  // modified or destroyed as soon as this returns.
+
+  void appendAll(kj::ArrayPtr<const kj::ArrayPtr<const kj::ArrayPtr<const word>>> messages);
+  // Append several messages at once and flush.  Message content is not copied: the segments are
+  // passed directly to writev() along with the framing, which is the fastest option for large
+  // messages.
+
+  void flush();
+  // Write out any buffered records.
+
+  void sync();
+  // Flush and then fsync() the file.
+
+  void finish();
+  // Flush, then write the index footer.  No more records may be appended afterwards (but a new
+  // writer can be opened on the same file, which will remove the footer).
+
+  inline size_t size() const { return offsets.size(); }
+  // Total number of records in the log, including any from before this writer was opened.
+
+private:
+  class RecordCollector;
+
+  int fd;
+  RecordLogOptions options;
+
+  kj::Vector<uint64_t> offsets;
+  // Word offset of every record's tag, for the footer.
+  uint64_t endOffset;
+  // Offset of the end of the log in words, including buffered data.
+  uint recordsSinceSync;
+  bool finished = false;
+
+  kj::Vector<kj::ArrayPtr<const byte>> pieces;
+  // Data waiting to be written by the next flush.
+
+  kj::Vector<kj::Array<word>> chunks;
+  size_t chunkUsed = 0;
+  size_t bufferedBytes = 0;
+  // Framing, and copies of records added with `append()`, are allocated from `chunks`.  Everything
+  // but the first chunk is released on flush.
+
+  kj::UnwindDetector unwindDetector;
+
+  kj::ArrayPtr<word> allocate(size_t words);
+  void addPiece(kj::ArrayPtr<const byte> piece);
+  void addSyncMarkerIfNeeded();
+  void addRecord(kj::ArrayPtr<const kj::ArrayPtr<const word>> segments, bool copy);
+};
+
+namespace _ {  // private
+
+uint32_t crc32c(kj::ArrayPtr<const byte> data, uint32_t crc = 0);
+// Computes the CRC32C (Castagnoli) checksum of `data`, continuing from the checksum `crc` of
+// any preceding data.  Uses the SSE4.2 or ARMv8 CRC instructions when available.
+
+bool setCrc32cHardwareEnabled(bool enabled);
+// Allows tests and benchmarks to force the portable implementation.  Returns the previous
+// setting.  Not thread-safe.
+
+}  // namespace _ (private)
+
+inline void RecordLogWriter::append(MessageBuilder& builder) {
+  append(builder.getSegmentsForOutput());
+}
+
+}  // namespace capnp
+
+#endif  // CAPNP_SERIALIZE_LOG_H_
@@ -0,0 +1,162 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "serialize-mmap.h"
+#include <kj/debug.h>
+#include <kj/thread.h>
+#include <kj/vector.h>
+#include <kj/compat/gtest.h>
+#include <kj/miniposix.h>
+#include <stdlib.h>
+#include <sys/stat.h>
+#include "test-util.h"
+
+#if !_WIN32  // TODO(someday): Find a temp directory on Windows.
+
+namespace capnp {
+namespace _ {  // private
+namespace {
+
+kj::AutoCloseFd makeTempFile() {
+#if __ANDROID__
+  char filename[] = "capnproto-serialize-mmap-test-XXXXXX";
+#else
+  char filename[] = "/tmp/capnproto-serialize-mmap-test-XXXXXX";
+#endif
+  kj::AutoCloseFd result(mkstemp(filename));
+  KJ_ASSERT(result.get() >= 0);
+  // Unlink the file so that it will be deleted on close.
+  KJ_SYSCALL(unlink(filename));
+  return result;
+}
+
+void writeTestFile(int fd, uint count) {
+  for (uint i = 0; i < count; i++) {
+    // Use a tiny first segment on every third message so that some messages have many segments.
+    MallocMessageBuilder builder(i % 3 == 0 ? 1 : SUGGESTED_FIRST_SEGMENT_WORDS,
+                                 AllocationStrategy::FIXED_SIZE);
+    auto root = builder.initRoot<TestAllTypes>();
+    if (i % 2 == 0) {
+      initTestMessage(root);
+    }
+    root.setUInt32Field(i);
+    writeMessageToFd(fd, builder);
+  }
+}
+
+void checkRecord(MmapMessageFile& file, uint i) {
+  auto reader = file.getMessage(i);
+  auto root = reader->getRoot<TestAllTypes>();
+  EXPECT_EQ(i, root.getUInt32Field());
+  if (i % 2 == 0) {
+    EXPECT_EQ("foo", root.getTextField());
+    EXPECT_EQ(3u, root.getStructList().size());
+  }
+}
+
+TEST(SerializeMmap, RandomAccess) {
+  auto fd = makeTempFile();
+  writeTestFile(fd, 50);
+
+  MmapMessageFile file(fd);
+  ASSERT_EQ(50u, file.size());
+
+  for (uint i: {37u, 0u, 49u, 12u, 13u, 3u}) {
+    checkRecord(file, i);
+  }
+
+  // Records can also be read without the heap-allocated reader.
+  FlatArrayMessageReader reader(file.getRecord(7));
+  EXPECT_EQ(7u, reader.getRoot<TestAllTypes>().getUInt32Field());
+  EXPECT_EQ(file.getRecord(7).end(), reader.getEnd());
+
+  EXPECT_ANY_THROW(file.getRecord(50));
+}
+
+TEST(SerializeMmap, EmptyFile) {
+  auto fd = makeTempFile();
+  MmapMessageFile file(fd);
+  EXPECT_EQ(0u, file.size());
+}
+
+TEST(SerializeMmap, SidecarIndex) {
+  auto fd = makeTempFile();
+  auto indexFd = makeTempFile();
+  writeTestFile(fd, 20);
+
+  {
+    MmapMessageFile file(fd);
+    file.writeIndexToFd(indexFd);
+  }
+
+  lseek(indexFd, 0, SEEK_SET);
+  MmapMessageFile file(fd, indexFd);
+  ASSERT_EQ(20u, file.size());
+  for (uint i = 0; i < file.size(); i++) {
+    checkRecord(file, i);
+  }
+
+  // An index for a different file is rejected.
+  writeTestFile(fd, 1);
+  lseek(indexFd, 0, SEEK_SET);
+  EXPECT_ANY_THROW(MmapMessageFile file(fd, indexFd));
+}
+
+TEST(SerializeMmap, TruncatedFile) {
+  auto fd = makeTempFile();
+  writeTestFile(fd, 3);
+
+  struct stat stats;
+  KJ_SYSCALL(fstat(fd, &stats));
+  KJ_SYSCALL(ftruncate(fd, stats.st_size - sizeof(word)));
+
+  EXPECT_ANY_THROW(MmapMessageFile file(fd));
+}
+
+TEST(SerializeMmap, ConcurrentIteration) {
+  auto fd = makeTempFile();
+  writeTestFile(fd, 64);
+  MmapMessageFile file(fd);
+
+  constexpr uint THREAD_COUNT = 4;
+  uint64_t sums[THREAD_COUNT] = {};
+  {
+    kj::Vector<kj::Own<kj::Thread>> threads;
+    for (uint t = 0; t < THREAD_COUNT; t++) {
+      threads.add(kj::heap<kj::Thread>([&file,&sums,t]() {
+        for (uint i = t; i < file.size(); i += THREAD_COUNT) {
+          FlatArrayMessageReader reader(file.getRecord(i));
+          sums[t] += reader.getRoot<TestAllTypes>().getUInt32Field();
+        }
+      }));
+    }
+  }
+
+  uint64_t total = 0;
+  for (auto sum: sums) total += sum;
+  EXPECT_EQ(64u * 63u / 2u, total);
+}
+
+}  // namespace
+}  // namespace _ (private)
+}  // namespace capnp
+
+#endif  // !_WIN32
@@ -0,0 +1,178 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#include "serialize-mmap.h"
+#include <kj/debug.h>
+#include <kj/io.h>
+#include <kj/vector.h>
+#include <kj/miniposix.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <errno.h>
+
+#if _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#endif
+
+namespace capnp {
+
+namespace _ {  // private
+
+namespace {
+
+class MmapDisposer: public kj::ArrayDisposer {
+protected:
+  void disposeImpl(void* firstElement, size_t elementSize, size_t elementCount,
+                   size_t capacity, void (*destroyElement)(void*)) const {
+#if _WIN32
+    KJ_ASSERT(UnmapViewOfFile(firstElement));
+#else
+    munmap(firstElement, elementSize * elementCount);
+#endif
+  }
+};
+
+constexpr MmapDisposer mmapDisposer = MmapDisposer();
+
+}  // namespace
+
+kj::Array<const word> mmapWholeFile(int fd, bool ignorePartialWord) {
+  struct stat stats;
+  KJ_SYSCALL(fstat(fd, &stats));
+  KJ_REQUIRE(S_ISREG(stats.st_mode), "can only mmap() regular files");
+  KJ_REQUIRE(ignorePartialWord || stats.st_size % sizeof(word) == 0,
+             "file size is not a multiple of the word size; not a Cap'n Proto message file",
+             stats.st_size);
+
+  if (static_cast<size_t>(stats.st_size) < sizeof(word)) {
+    // mmap()ing zero bytes will fail.
+    return nullptr;
+  }
+
+  // Map only the whole words, so that the disposer, which only knows the array's size, unmaps
+  // exactly what we mapped.  Any partial word at the end is ignored.
+  size_t wordCount = stats.st_size / sizeof(word);
+  size_t byteCount = wordCount * sizeof(word);
+
+#if _WIN32
+  HANDLE handle = reinterpret_cast<HANDLE>(_get_osfhandle(fd));
+  KJ_ASSERT(handle != INVALID_HANDLE_VALUE);
+  HANDLE mappingHandle = CreateFileMapping(
+      handle, NULL, PAGE_READONLY, 0, byteCount, NULL);
+  KJ_ASSERT(mappingHandle != INVALID_HANDLE_VALUE);
+  KJ_DEFER(KJ_ASSERT(CloseHandle(mappingHandle)));
+  const void* mapping = MapViewOfFile(mappingHandle, FILE_MAP_READ, 0, 0, byteCount);
+#else  // _WIN32
+  const void* mapping = mmap(NULL, byteCount, PROT_READ, MAP_SHARED, fd, 0);
+  if (mapping == MAP_FAILED) {
+    KJ_FAIL_SYSCALL("mmap", errno);
+  }
+#endif  // !_WIN32
+
+  return kj::Array<const word>(reinterpret_cast<const word*>(mapping), wordCount, mmapDisposer);
+}
+
+}  // namespace _ (private)
+
+// =======================================================================================
+
+namespace {
+
+constexpr uint64_t INDEX_MAGIC = 0x7864692d6e706163ull;  // "capn-idx" in little-endian.
+
+}  // namespace
+
+MmapMessageFile::MmapMessageFile(int fd, ReaderOptions options)
+    : mapping(_::mmapWholeFile(fd)), options(options) {
+  kj::Vector<size_t> index;
+
+  size_t pos = 0;
+  while (pos < mapping.size()) {
+    auto remaining = mapping.slice(pos, mapping.size());
+    size_t expected = expectedSizeInWordsFromPrefix(remaining);
+    KJ_REQUIRE(expected <= remaining.size(), "message file ends with a truncated message",
+               index.size(), pos) {
+      break;
+    }
+    index.add(pos);
+    pos += expected;
+  }
+  index.add(pos);
+
+  offsets = index.releaseAsArray();
+}
+
+MmapMessageFile::MmapMessageFile(int fd, int indexFd, ReaderOptions options)
+    : mapping(_::mmapWholeFile(fd)), options(options) {
+  kj::FdInputStream input(indexFd);
+
+  _::WireValue<uint64_t> header[3];
+  input.read(header, sizeof(header));
+  KJ_REQUIRE(header[0].get() == INDEX_MAGIC, "not a message file index");
+  KJ_REQUIRE(header[1].get() == mapping.size(),
+             "message file index does not match file size", header[1].get(), mapping.size());
+
+  uint64_t count = header[2].get();
+  KJ_REQUIRE(count <= mapping.size(), "message file index is corrupt", count);
+
+  auto wireOffsets = kj::heapArray<_::WireValue<uint64_t>>(count + 1);
+  input.read(wireOffsets.begin(), wireOffsets.size() * sizeof(wireOffsets[0]));
+
+  offsets = kj::heapArray<size_t>(count + 1);
+  for (size_t i = 0; i <= count; i++) {
+    uint64_t offset = wireOffsets[i].get();
+    KJ_REQUIRE(i == 0 ? offset == 0 : offset > offsets[i - 1],
+               "message file index is corrupt", i, offset);
+    offsets[i] = offset;
+  }
+  KJ_REQUIRE(offsets[count] <= mapping.size(), "message file index is corrupt", offsets[count]);
+}
+
+kj::ArrayPtr<const word> MmapMessageFile::getRecord(size_t index) const {
+  KJ_REQUIRE(index < size(), "message index out of range", index, size());
+  return mapping.slice(offsets[index], offsets[index + 1]);
+}
+
+kj::Own<FlatArrayMessageReader> MmapMessageFile::getMessage(size_t index) const {
+  return kj::heap<FlatArrayMessageReader>(getRecord(index), options);
+}
+
+void MmapMessageFile::writeIndex(kj::OutputStream& output) const {
+  // Format: magic, file size in words, message count, then `count + 1` word offsets (the last
+  // one being the end of the last message).  All values are little-endian 64-bit.
+  auto table = kj::heapArray<_::WireValue<uint64_t>>(offsets.size() + 3);
+  table[0].set(INDEX_MAGIC);
+  table[1].set(mapping.size());
+  table[2].set(size());
+  for (size_t i = 0; i < offsets.size(); i++) {
+    table[i + 3].set(offsets[i]);
+  }
+  output.write(table.begin(), table.size() * sizeof(table[0]));
+}
+
+void MmapMessageFile::writeIndexToFd(int fd) const {
+  kj::FdOutputStream output(fd);
+  writeIndex(output);
+}
+
+}  // namespace capnp
@@ -0,0 +1,98 @@
+// Copyright (c) 2013-2014 Sandstorm Development Group, Inc. and contributors
+// Licensed under the MIT License:
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in
+// all copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+// THE SOFTWARE.
+
+#ifndef CAPNP_SERIALIZE_MMAP_H_
+#define CAPNP_SERIALIZE_MMAP_H_
+
+#if defined(__GNUC__) && !defined(CAPNP_HEADER_WARNINGS)
+#pragma GCC system_header
+#endif
+
+#include "serialize.h"
+
+namespace capnp {
+
+namespace _ {  // private
+
+kj::Array<const word> mmapWholeFile(int fd, bool ignorePartialWord = false);
+// Maps the whole (regular) file read-only.  The mapping is released when the array is destroyed
+// and remains valid after `fd` is closed.  Returns an empty array if the file is empty.  Throws
+// if the file's size is not a multiple of the word size, unless `ignorePartialWord` is true, in
+// which case any trailing partial word (e.g. left by an interrupted append) is left out of the
+// returned array.
+
+}  // namespace _ (private)
+
+class MmapMessageFile {
+  // Provides random access to a file containing a sequence of messages written back-to-back with
+  // `writeMessage()` / `writeMessageToFd()`.  The file is mapped into memory and messages are
+  // read in-place with `FlatArrayMessageReader`, so no message content is ever copied.
+  //
+  // An index of message offsets is built when the file is opened, by walking each message's
+  // segment table (see `expectedSizeInWordsFromPrefix()`).  This touches only the first page or so
+  // of each message, but for very large files it can still be worth saving the index to a sidecar
+  // file with `writeIndex()` and passing it back in on the next open.
+  //
+  // Once constructed, the object is immutable, so any number of threads may call `getMessage()`
+  // or `getRecord()` concurrently, e.g. to split iteration over `size()` records between workers.
+  // Each thread should use its own MessageReader.
+
+public:
+  explicit MmapMessageFile(int fd, ReaderOptions options = ReaderOptions());
+  // Map the file and build the index by scanning it.  Does not take ownership of `fd`; the
+  // descriptor may be closed as soon as the constructor returns.
+
+  MmapMessageFile(int fd, int indexFd, ReaderOptions options = ReaderOptions());
+  // Map the file and load its index from `indexFd`, which must contain the output of a previous
+  // call to `writeIndex()` on the same file contents.  The loaded index is sanity-checked against
+  // the size of the file, but a stale index for a file of identical size cannot be detected; in
+  // that case `getMessage()` will throw or return garbage, but will never read out of bounds.
+
+  KJ_DISALLOW_COPY(MmapMessageFile);
+
+  inline size_t size() const { return offsets.size() - 1; }
+  // Number of messages in the file.
+
+  kj::ArrayPtr<const word> getRecord(size_t index) const;
+  // Get the raw words of the message at the given index, suitable for passing to
+  // `FlatArrayMessageReader`.  The returned array points into the mapping and remains valid as
+  // long as this object does.
+
+  kj::Own<FlatArrayMessageReader> getMessage(size_t index) const;
+  // Construct a reader for the message at the given index.  The reader uses the ReaderOptions
+  // passed to the constructor and must not outlive this object.  If you want to avoid the heap
+  // allocation, construct a `FlatArrayMessageReader` on `getRecord(index)` yourself.
+
+  void writeIndex(kj::OutputStream& output) const;
+  void writeIndexToFd(int fd) const;
+  // Write the offset index so that it can later be passed to the two-fd constructor.
+
+private:
+  kj::Array<const word> mapping;
+  kj::Array<size_t> offsets;
+  // Word offset of each message within `mapping`, plus a final entry marking the end of the last
+  // message.
+  ReaderOptions options;
+};
+
+}  // namespace capnp
+
+#endif  // CAPNP_SERIALIZE_MMAP_H_
@@ -159,6 +159,42 @@ void expectPacksTo(kj::ArrayPtr<const byte> unpacked, kj::ArrayPtr<const byte> p
     }
   }
 
+  // -----------------------------------------------------------------
+  // incremental unpack
+
+  for (size_t inBlock: {size_t(1), size_t(3), packed.size()}) {
+    for (size_t outBlock: {size_t(1), size_t(5), size_t(8), unpacked.size()}) {
+      if (inBlock == 0 || outBlock == 0) continue;
+
+      PackedUnpacker unpacker;
+      memset(roundTrip.begin(), 0xaa, roundTrip.size());
+      size_t inPos = 0;
+      size_t outPos = 0;
+      kj::ArrayPtr<const byte> input;
+
+      for (;;) {
+        if (input.size() == 0 && inPos < packed.size()) {
+          size_t n = kj::min(inBlock, packed.size() - inPos);
+          input = packed.slice(inPos, inPos + n);
+          inPos += n;
+        }
+        size_t n = kj::min(outBlock, unpacked.size() - outPos);
+        size_t inputBefore = input.size();
+        size_t written = unpacker.unpack(input, roundTrip.slice(outPos, outPos + n));
+        outPos += written;
+        if (written == 0 && input.size() == inputBefore && inPos == packed.size()) break;
+      }
+
+      EXPECT_EQ(unpacked.size(), outPos);
+      EXPECT_EQ(0u, input.size());
+      EXPECT_TRUE(unpacker.isBetweenWords());
+      if (memcmp(roundTrip.begin(), unpacked.begin(), unpacked.size()) != 0) {
+        KJ_FAIL_ASSERT("Tried to unpack `packed` incrementally, expected `unpacked`, got "
+                       "`roundTrip`", packed, inBlock, outBlock, unpacked, roundTrip);
+      }
+    }
+  }
+
   pipe.clear();
 
   // -----------------------------------------------------------------
@@ -190,7 +226,31 @@ void expectPacksTo(kj::ArrayPtr<const byte> unpacked, kj::ArrayPtr<const byte> p
 #define expectPacksTo(...)
 #endif
 
+class ScopedPackedSimd {
+  // Forces the vectorized packing kernels on or off for the duration of a scope.
+
+public:
+  explicit ScopedPackedSimd(bool enabled): previous(setPackedSimdEnabled(enabled)) {}
+  ~ScopedPackedSimd() { setPackedSimdEnabled(previous); }
+  KJ_DISALLOW_COPY(ScopedPackedSimd);
+
+private:
+  bool previous;
+};
+
+void expectSimplePacking();
+
 TEST(Packed, SimplePacking) {
+  {
+    ScopedPackedSimd simd(false);
+    expectSimplePacking();
+  }
+  if (isPackedSimdActive()) {
+    expectSimplePacking();
+  }
+}
+
+void expectSimplePacking() {
   expectPacksTo({}, {});
   expectPacksTo({0,0,0,0,0,0,0,0}, {0,0});
   expectPacksTo({0,0,12,0,0,34,0,0}, {0x24,12,34});
@@ -211,6 +271,65 @@ TEST(Packed, SimplePacking) {
       {0xed,8,100,6,1,1,2, 0,2, 0xd4,1,2,3,1});
 }
 
+kj::Array<word> makePackingTestData(uint wordCount) {
+  // Pseudo-random words with a mix of all-zero runs, all-non-zero runs, and sparse words, so that
+  // every branch of the packing loop gets exercised.
+
+  auto result = kj::heapArray<word>(wordCount);
+  byte* bytes = reinterpret_cast<byte*>(result.begin());
+  uint32_t state = 12345;
+  auto next = [&]() { state = state * 1103515245 + 12345; return state >> 16; };
+
+  uint i = 0;
+  while (i < wordCount) {
+    uint runLength = kj::min<uint>(next() % 300 + 1, wordCount - i);
+    uint density = next() % 10;  // 0 = all zero, 9 = all non-zero
+    for (uint j = 0; j < runLength * sizeof(word); j++) {
+      byte value = next() % 255 + 1;
+      bytes[i * sizeof(word) + j] = next() % 9 < density ? value : 0;
+    }
+    i += runLength;
+  }
+
+  return result;
+}
+
+TEST(Packed, SimdMatchesScalar) {
+  auto data = makePackingTestData(20000);
+  auto bytes = kj::arrayPtr(reinterpret_cast<const byte*>(data.begin()), data.size() * sizeof(word));
+
+  TestPipe scalarPipe;
+  {
+    ScopedPackedSimd simd(false);
+    kj::BufferedOutputStreamWrapper bufferedOut(scalarPipe);
+    PackedOutputStream packedOut(bufferedOut);
+    packedOut.write(bytes.begin(), bytes.size());
+  }
+
+  TestPipe simdPipe;
+  {
+    kj::BufferedOutputStreamWrapper bufferedOut(simdPipe);
+    PackedOutputStream packedOut(bufferedOut);
+    packedOut.write(bytes.begin(), bytes.size());
+  }
+
+  ASSERT_TRUE(scalarPipe.getData() == simdPipe.getData());
+  EXPECT_EQ(data.size(), computeUnpackedSizeInWords(simdPipe.getArray()));
+
+  for (bool enabled: {false, true}) {
+    ScopedPackedSimd simd(enabled);
+    for (size_t blockSize: {size_t(kj::maxValue), size_t(7), size_t(1024)}) {
+      simdPipe.resetRead(blockSize);
+      auto roundTrip = kj::heapArray<byte>(bytes.size());
+      PackedInputStream packedIn(simdPipe);
+      packedIn.InputStream::read(roundTrip.begin(), roundTrip.size());
+      EXPECT_TRUE(simdPipe.allRead());
+      KJ_EXPECT(memcmp(roundTrip.begin(), bytes.begin(), bytes.size()) == 0,
+                enabled, blockSize);
+    }
+  }
+}
+
 // =======================================================================================
 
 class TestMessageBuilder: public MallocMessageBuilder {
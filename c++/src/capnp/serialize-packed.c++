@@ -24,14 +24,196 @@
 #include "layout.h"
 #include <vector>
 
+#if !defined(CAPNP_NO_SIMD) && (defined(__x86_64__) || defined(__i386__)) && \
+    (defined(__clang__) ? (__clang_major__ > 3 || (__clang_major__ == 3 && __clang_minor__ >= 8)) \
+                        : (__GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 9)))
+// We compile the SSSE3 kernels with a function-level target attribute and pick them at runtime
+// based on CPUID, so that the library still runs on CPUs that lack SSSE3.  Older compilers
+// refuse to expand the intrinsics outside of a translation unit built with -mssse3.
+#define CAPNP_PACKED_SSSE3 1
+#define CAPNP_TARGET_SSSE3 __attribute__((target("ssse3")))
+#include <tmmintrin.h>
+#else
+#define CAPNP_PACKED_SSSE3 0
+#endif
+
 namespace capnp {
 
 namespace _ {  // private
 
-PackedInputStream::PackedInputStream(kj::BufferedInputStream& inner): inner(inner) {}
-PackedInputStream::~PackedInputStream() noexcept(false) {}
+namespace {
 
-size_t PackedInputStream::tryRead(void* dst, size_t minBytes, size_t maxBytes) {
+// =======================================================================================
+// Per-word kernels
+//
+// The packing and unpacking loops below are templated on a "kernel" which knows how to encode
+// or decode a single word in the fast path, i.e. when the caller has already ensured that there
+// are at least 10 bytes of room in the output (when packing) or 10 bytes of input available
+// (when unpacking).  The kernel may therefore read or write up to 8 bytes past the tag byte
+// without bounds checks.
+
+struct ScalarKernel {
+  static inline uint8_t* packWord(const uint8_t* __restrict__ in, uint8_t* __restrict__ out,
+                                  uint8_t& tag) {
+    // Writes the non-zero bytes of the word at `in` to `out`, sets `tag` to the bitmask of
+    // non-zero bytes, and returns the new output position.
+
+#define HANDLE_BYTE(n) \
+    uint8_t bit##n = in[n] != 0; \
+    *out = in[n]; \
+    out += bit##n; /* out only advances if the byte was non-zero */
+
+    HANDLE_BYTE(0);
+    HANDLE_BYTE(1);
+    HANDLE_BYTE(2);
+    HANDLE_BYTE(3);
+    HANDLE_BYTE(4);
+    HANDLE_BYTE(5);
+    HANDLE_BYTE(6);
+    HANDLE_BYTE(7);
+#undef HANDLE_BYTE
+
+    tag = (bit0 << 0) | (bit1 << 1) | (bit2 << 2) | (bit3 << 3)
+        | (bit4 << 4) | (bit5 << 5) | (bit6 << 6) | (bit7 << 7);
+    return out;
+  }
+
+  static inline const uint8_t* unpackWord(const uint8_t* __restrict__ in,
+                                          uint8_t* __restrict__ out, uint8_t tag) {
+    // Expands the bytes at `in` into the word at `out` according to `tag`, returning the new
+    // input position.
+
+#define HANDLE_BYTE(n) \
+    { \
+       bool isNonzero = (tag & (1u << n)) != 0; \
+       *out++ = *in & (-(int8_t)isNonzero); \
+       in += isNonzero; \
+    }
+
+    HANDLE_BYTE(0);
+    HANDLE_BYTE(1);
+    HANDLE_BYTE(2);
+    HANDLE_BYTE(3);
+    HANDLE_BYTE(4);
+    HANDLE_BYTE(5);
+    HANDLE_BYTE(6);
+    HANDLE_BYTE(7);
+#undef HANDLE_BYTE
+
+    return in;
+  }
+
+  static inline bool hasMultipleZeros(const uint8_t* in) {
+    // Returns true if the word at `in` contains at least two zero bytes, which is the point
+    // where packing it becomes a net win.
+
+    uint c = in[0] == 0;
+    c += in[1] == 0;
+    c += in[2] == 0;
+    c += in[3] == 0;
+    c += in[4] == 0;
+    c += in[5] == 0;
+    c += in[6] == 0;
+    c += in[7] == 0;
+    return c >= 2;
+  }
+};
+
+#if CAPNP_PACKED_SSSE3
+
+struct ShuffleTables {
+  // PSHUFB control vectors for every possible tag, so that a word can be compacted or expanded
+  // with a single shuffle instead of eight dependent byte moves.
+
+  uint8_t pack[256][8];
+  // Moves the non-zero bytes (as indicated by the tag) to the front of the word.
+
+  uint8_t unpack[256][8];
+  // Scatters the leading bytes of the input back to the positions indicated by the tag, filling
+  // the rest with zeros (a control byte with the high bit set produces zero).
+
+  uint8_t count[256];
+  // Number of bits set in the tag, i.e. the number of bytes the packed word occupies.  A table
+  // lookup avoids depending on POPCNT, which some SSSE3-capable CPUs lack.
+
+  ShuffleTables() {
+    for (uint tag = 0; tag < 256; tag++) {
+      uint n = 0;
+      for (uint i = 0; i < 8; i++) {
+        if (tag & (1u << i)) {
+          pack[tag][n] = i;
+          unpack[tag][i] = n++;
+        } else {
+          unpack[tag][i] = 0x80;
+        }
+      }
+      count[tag] = n;
+      for (uint i = n; i < 8; i++) {
+        pack[tag][i] = 0x80;
+      }
+    }
+  }
+};
+
+const ShuffleTables& getShuffleTables() {
+  static const ShuffleTables tables;
+  return tables;
+}
+
+struct Ssse3Kernel {
+  const ShuffleTables& tables;
+
+  explicit Ssse3Kernel(const ShuffleTables& tables): tables(tables) {}
+
+  CAPNP_TARGET_SSSE3 inline uint8_t* packWord(
+      const uint8_t* __restrict__ in, uint8_t* __restrict__ out, uint8_t& tag) const {
+    __m128i value = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(in));
+    uint zeros = _mm_movemask_epi8(_mm_cmpeq_epi8(value, _mm_setzero_si128()));
+    tag = ~zeros;
+    __m128i control = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(tables.pack[tag]));
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(out), _mm_shuffle_epi8(value, control));
+    return out + tables.count[tag];
+  }
+
+  CAPNP_TARGET_SSSE3 inline const uint8_t* unpackWord(
+      const uint8_t* __restrict__ in, uint8_t* __restrict__ out, uint8_t tag) const {
+    __m128i bytes = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(in));
+    __m128i control = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(tables.unpack[tag]));
+    _mm_storel_epi64(reinterpret_cast<__m128i*>(out), _mm_shuffle_epi8(bytes, control));
+    return in + tables.count[tag];
+  }
+
+  CAPNP_TARGET_SSSE3 inline bool hasMultipleZeros(const uint8_t* in) const {
+    __m128i value = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(in));
+    uint zeros = _mm_movemask_epi8(_mm_cmpeq_epi8(value, _mm_setzero_si128())) & 0xffu;
+    return (zeros & (zeros - 1)) != 0;
+  }
+};
+
+bool packedSimdDisabled = false;
+
+bool useSsse3() {
+  static const bool supported = __builtin_cpu_supports("ssse3");
+  return supported && !packedSimdDisabled;
+}
+
+#endif  // CAPNP_PACKED_SSSE3
+
+// =======================================================================================
+
+template <typename Kernel>
+KJ_ALWAYS_INLINE(size_t unpackWords(
+    kj::BufferedInputStream& inner, const Kernel& kernel,
+    void* dst, size_t minBytes, size_t maxBytes));
+template <typename Kernel>
+KJ_ALWAYS_INLINE(void packWords(
+    kj::BufferedOutputStream& inner, const Kernel& kernel, const void* src, size_t size));
+// Inlined so that each instantiation is compiled with the target options of the function
+// calling it; the SSSE3 wrappers below depend on this.
+
+template <typename Kernel>
+size_t unpackWords(kj::BufferedInputStream& inner, const Kernel& kernel,
+                   void* dst, size_t minBytes, size_t maxBytes) {
   if (maxBytes == 0) {
     return 0;
   }
@@ -99,23 +281,8 @@ size_t PackedInputStream::tryRead(void* dst, size_t minBytes, size_t maxBytes) {
       }
     } else {
       tag = *in++;
-
-#define HANDLE_BYTE(n) \
-      { \
-         bool isNonzero = (tag & (1u << n)) != 0; \
-         *out++ = *in & (-(int8_t)isNonzero); \
-         in += isNonzero; \
-      }
-
-      HANDLE_BYTE(0);
-      HANDLE_BYTE(1);
-      HANDLE_BYTE(2);
-      HANDLE_BYTE(3);
-      HANDLE_BYTE(4);
-      HANDLE_BYTE(5);
-      HANDLE_BYTE(6);
-      HANDLE_BYTE(7);
-#undef HANDLE_BYTE
+      in = kernel.unpackWord(in, out, tag);
+      out += sizeof(word);
     }
 
     if (tag == 0) {
@@ -180,6 +347,149 @@ size_t PackedInputStream::tryRead(void* dst, size_t minBytes, size_t maxBytes) {
 #undef REFRESH_BUFFER
 }
 
+template <typename Kernel>
+void packWords(kj::BufferedOutputStream& inner, const Kernel& kernel,
+               const void* src, size_t size) {
+  kj::ArrayPtr<byte> buffer = inner.getWriteBuffer();
+  byte slowBuffer[20];
+
+  uint8_t* __restrict__ out = reinterpret_cast<uint8_t*>(buffer.begin());
+
+  const uint8_t* __restrict__ in = reinterpret_cast<const uint8_t*>(src);
+  const uint8_t* const inEnd = reinterpret_cast<const uint8_t*>(src) + size;
+
+  while (in < inEnd) {
+    if (reinterpret_cast<uint8_t*>(buffer.end()) - out < 10) {
+      // Oops, we're out of space.  We need at least 10 bytes for the fast path, since we don't
+      // bounds-check on every byte.
+
+      // Write what we have so far.
+      inner.write(buffer.begin(), out - reinterpret_cast<uint8_t*>(buffer.begin()));
+
+      // Use a slow buffer into which we'll encode 10 to 20 bytes.  This should get us past the
+      // output stream's buffer boundary.
+      buffer = kj::arrayPtr(slowBuffer, sizeof(slowBuffer));
+      out = reinterpret_cast<uint8_t*>(buffer.begin());
+    }
+
+    uint8_t* tagPos = out++;
+    uint8_t tag;
+    out = kernel.packWord(in, out, tag);
+    in += sizeof(word);
+    *tagPos = tag;
+
+    if (tag == 0) {
+      // An all-zero word is followed by a count of consecutive zero words (not including the
+      // first one).
+
+      // We can check a whole word at a time.
+      const uint64_t* inWord = reinterpret_cast<const uint64_t*>(in);
+
+      // The count must fit it 1 byte, so limit to 255 words.
+      const uint64_t* limit = reinterpret_cast<const uint64_t*>(inEnd);
+      if (limit - inWord > 255) {
+        limit = inWord + 255;
+      }
+
+      while (inWord < limit && *inWord == 0) {
+        ++inWord;
+      }
+
+      // Write the count.
+      *out++ = inWord - reinterpret_cast<const uint64_t*>(in);
+
+      // Advance input.
+      in = reinterpret_cast<const uint8_t*>(inWord);
+
+    } else if (tag == 0xffu) {
+      // An all-nonzero word is followed by a count of consecutive uncompressed words, followed
+      // by the uncompressed words themselves.
+
+      // Count the number of consecutive words in the input which have no more than a single
+      // zero-byte.  We look for at least two zeros because that's the point where our compression
+      // scheme becomes a net win.
+      // TODO(perf):  Maybe look for three zeros?  Compressing a two-zero word is a loss if the
+      //   following word has no zeros.
+      const uint8_t* runStart = in;
+
+      const uint8_t* limit = inEnd;
+      if ((size_t)(limit - in) > 255 * sizeof(word)) {
+        limit = in + 255 * sizeof(word);
+      }
+
+      while (in < limit && !kernel.hasMultipleZeros(in)) {
+        in += sizeof(word);
+      }
+
+      // Write the count.
+      uint count = in - runStart;
+      *out++ = count / sizeof(word);
+
+      if (count <= reinterpret_cast<uint8_t*>(buffer.end()) - out) {
+        // There's enough space to memcpy.
+        memcpy(out, runStart, count);
+        out += count;
+      } else {
+        // Input overruns the output buffer.  We'll give it to the output stream in one chunk
+        // and let it decide what to do.
+        inner.write(buffer.begin(), reinterpret_cast<byte*>(out) - buffer.begin());
+        inner.write(runStart, in - runStart);
+        buffer = inner.getWriteBuffer();
+        out = reinterpret_cast<uint8_t*>(buffer.begin());
+      }
+    }
+  }
+
+  // Write whatever is left.
+  inner.write(buffer.begin(), reinterpret_cast<byte*>(out) - buffer.begin());
+}
+
+#if CAPNP_PACKED_SSSE3
+CAPNP_TARGET_SSSE3 size_t unpackWordsSsse3(
+    kj::BufferedInputStream& inner, void* dst, size_t minBytes, size_t maxBytes) {
+  return unpackWords(inner, Ssse3Kernel(getShuffleTables()), dst, minBytes, maxBytes);
+}
+
+CAPNP_TARGET_SSSE3 void packWordsSsse3(
+    kj::BufferedOutputStream& inner, const void* src, size_t size) {
+  packWords(inner, Ssse3Kernel(getShuffleTables()), src, size);
+}
+#endif  // CAPNP_PACKED_SSSE3
+
+}  // namespace
+
+bool setPackedSimdEnabled(bool enabled) {
+#if CAPNP_PACKED_SSSE3
+  bool previous = !packedSimdDisabled;
+  packedSimdDisabled = !enabled;
+  return previous;
+#else
+  return false;
+#endif
+}
+
+bool isPackedSimdActive() {
+#if CAPNP_PACKED_SSSE3
+  return useSsse3();
+#else
+  return false;
+#endif
+}
+
+// -------------------------------------------------------------------
+
+PackedInputStream::PackedInputStream(kj::BufferedInputStream& inner): inner(inner) {}
+PackedInputStream::~PackedInputStream() noexcept(false) {}
+
+size_t PackedInputStream::tryRead(void* dst, size_t minBytes, size_t maxBytes) {
+#if CAPNP_PACKED_SSSE3
+  if (useSsse3()) {
+    return unpackWordsSsse3(inner, dst, minBytes, maxBytes);
+  }
+#endif
+  return unpackWords(inner, ScalarKernel(), dst, minBytes, maxBytes);
+}
+
 void PackedInputStream::skip(size_t bytes) {
   // We can't just read into buffers because buffers must end on block boundaries.
 
@@ -303,129 +613,124 @@ PackedOutputStream::PackedOutputStream(kj::BufferedOutputStream& inner)
 PackedOutputStream::~PackedOutputStream() noexcept(false) {}
 
 void PackedOutputStream::write(const void* src, size_t size) {
-  kj::ArrayPtr<byte> buffer = inner.getWriteBuffer();
-  byte slowBuffer[20];
-
-  uint8_t* __restrict__ out = reinterpret_cast<uint8_t*>(buffer.begin());
-
-  const uint8_t* __restrict__ in = reinterpret_cast<const uint8_t*>(src);
-  const uint8_t* const inEnd = reinterpret_cast<const uint8_t*>(src) + size;
-
-  while (in < inEnd) {
-    if (reinterpret_cast<uint8_t*>(buffer.end()) - out < 10) {
-      // Oops, we're out of space.  We need at least 10 bytes for the fast path, since we don't
-      // bounds-check on every byte.
-
-      // Write what we have so far.
-      inner.write(buffer.begin(), out - reinterpret_cast<uint8_t*>(buffer.begin()));
-
-      // Use a slow buffer into which we'll encode 10 to 20 bytes.  This should get us past the
-      // output stream's buffer boundary.
-      buffer = kj::arrayPtr(slowBuffer, sizeof(slowBuffer));
-      out = reinterpret_cast<uint8_t*>(buffer.begin());
-    }
-
-    uint8_t* tagPos = out++;
-
-#define HANDLE_BYTE(n) \
-    uint8_t bit##n = *in != 0; \
-    *out = *in; \
-    out += bit##n; /* out only advances if the byte was non-zero */ \
-    ++in
-
-    HANDLE_BYTE(0);
-    HANDLE_BYTE(1);
-    HANDLE_BYTE(2);
-    HANDLE_BYTE(3);
-    HANDLE_BYTE(4);
-    HANDLE_BYTE(5);
-    HANDLE_BYTE(6);
-    HANDLE_BYTE(7);
-#undef HANDLE_BYTE
-
-    uint8_t tag = (bit0 << 0) | (bit1 << 1) | (bit2 << 2) | (bit3 << 3)
-                | (bit4 << 4) | (bit5 << 5) | (bit6 << 6) | (bit7 << 7);
-    *tagPos = tag;
-
-    if (tag == 0) {
-      // An all-zero word is followed by a count of consecutive zero words (not including the
-      // first one).
+#if CAPNP_PACKED_SSSE3
+  if (useSsse3()) {
+    packWordsSsse3(inner, src, size);
+    return;
+  }
+#endif
+  packWords(inner, ScalarKernel(), src, size);
+}
 
-      // We can check a whole word at a time.
-      const uint64_t* inWord = reinterpret_cast<const uint64_t*>(in);
+// -------------------------------------------------------------------
 
-      // The count must fit it 1 byte, so limit to 255 words.
-      const uint64_t* limit = reinterpret_cast<const uint64_t*>(inEnd);
-      if (limit - inWord > 255) {
-        limit = inWord + 255;
-      }
+template <typename Kernel>
+inline size_t PackedUnpacker::unpackImpl(const Kernel& kernel, kj::ArrayPtr<const byte>& input,
+                                  kj::ArrayPtr<byte> output) {
+  const uint8_t* in = reinterpret_cast<const uint8_t*>(input.begin());
+  const uint8_t* const inEnd = reinterpret_cast<const uint8_t*>(input.end());
+  uint8_t* out = reinterpret_cast<uint8_t*>(output.begin());
+  uint8_t* const outEnd = reinterpret_cast<uint8_t*>(output.end());
 
-      while (inWord < limit && *inWord == 0) {
-        ++inWord;
+  for (;;) {
+    switch (state) {
+      case State::TAG:
+        if (in == inEnd || out == outEnd) goto done;
+
+        if (inEnd - in >= 10 && outEnd - out >= 8) {
+          // Fast path:  The tag, up to eight data bytes, and the run length if any are all
+          // available, and the whole word fits in the output.
+          tag = *in++;
+          in = kernel.unpackWord(in, out, tag);
+          out += sizeof(word);
+        } else {
+          tag = *in++;
+          wordPos = 0;
+          state = State::WORD_IN;
+          continue;
+        }
+        break;
+
+      case State::WORD_IN:
+        for (; wordPos < 8; wordPos++) {
+          if (tag & (1u << wordPos)) {
+            if (in == inEnd) goto done;
+            current[wordPos] = *in++;
+          } else {
+            current[wordPos] = 0;
+          }
+        }
+        wordPos = 0;
+        state = State::WORD_OUT;
+        // fallthrough
+
+      case State::WORD_OUT: {
+        size_t n = kj::min(size_t(8 - wordPos), size_t(outEnd - out));
+        memcpy(out, current + wordPos, n);
+        out += n;
+        wordPos += n;
+        if (wordPos < 8) goto done;
+        break;
       }
 
-      // Write the count.
-      *out++ = inWord - reinterpret_cast<const uint64_t*>(in);
-
-      // Advance input.
-      in = reinterpret_cast<const uint8_t*>(inWord);
-
-    } else if (tag == 0xffu) {
-      // An all-nonzero word is followed by a count of consecutive uncompressed words, followed
-      // by the uncompressed words themselves.
+      case State::ZERO_COUNT:
+        if (in == inEnd) goto done;
+        runRemaining = *in++ * sizeof(word);
+        state = State::ZERO_RUN;
+        continue;
 
-      // Count the number of consecutive words in the input which have no more than a single
-      // zero-byte.  We look for at least two zeros because that's the point where our compression
-      // scheme becomes a net win.
-      // TODO(perf):  Maybe look for three zeros?  Compressing a two-zero word is a loss if the
-      //   following word has no zeros.
-      const uint8_t* runStart = in;
+      case State::RAW_COUNT:
+        if (in == inEnd) goto done;
+        runRemaining = *in++ * sizeof(word);
+        state = State::RAW_RUN;
+        continue;
 
-      const uint8_t* limit = inEnd;
-      if ((size_t)(limit - in) > 255 * sizeof(word)) {
-        limit = in + 255 * sizeof(word);
+      case State::ZERO_RUN: {
+        size_t n = kj::min(runRemaining, size_t(outEnd - out));
+        memset(out, 0, n);
+        out += n;
+        runRemaining -= n;
+        if (runRemaining > 0) goto done;
+        state = State::TAG;
+        continue;
       }
 
-      while (in < limit) {
-        // Check eight input bytes for zeros.
-        uint c = *in++ == 0;
-        c += *in++ == 0;
-        c += *in++ == 0;
-        c += *in++ == 0;
-        c += *in++ == 0;
-        c += *in++ == 0;
-        c += *in++ == 0;
-        c += *in++ == 0;
-
-        if (c >= 2) {
-          // Un-read the word with multiple zeros, since we'll want to compress that one.
-          in -= 8;
-          break;
-        }
+      case State::RAW_RUN: {
+        size_t n = kj::min(runRemaining, kj::min(size_t(outEnd - out), size_t(inEnd - in)));
+        memcpy(out, in, n);
+        out += n;
+        in += n;
+        runRemaining -= n;
+        if (runRemaining > 0) goto done;
+        state = State::TAG;
+        continue;
       }
+    }
 
-      // Write the count.
-      uint count = in - runStart;
-      *out++ = count / sizeof(word);
+    // We just finished a word.  Tags 0 and 0xff are followed by a run.
+    state = tag == 0 ? State::ZERO_COUNT : tag == 0xffu ? State::RAW_COUNT : State::TAG;
+  }
 
-      if (count <= reinterpret_cast<uint8_t*>(buffer.end()) - out) {
-        // There's enough space to memcpy.
-        memcpy(out, runStart, count);
-        out += count;
-      } else {
-        // Input overruns the output buffer.  We'll give it to the output stream in one chunk
-        // and let it decide what to do.
-        inner.write(buffer.begin(), reinterpret_cast<byte*>(out) - buffer.begin());
-        inner.write(runStart, in - runStart);
-        buffer = inner.getWriteBuffer();
-        out = reinterpret_cast<uint8_t*>(buffer.begin());
-      }
-    }
+done:
+  input = kj::arrayPtr(reinterpret_cast<const byte*>(in), reinterpret_cast<const byte*>(inEnd));
+  return out - reinterpret_cast<uint8_t*>(output.begin());
+}
+
+size_t PackedUnpacker::unpack(kj::ArrayPtr<const byte>& input, kj::ArrayPtr<byte> output) {
+#if CAPNP_PACKED_SSSE3
+  if (useSsse3()) {
+    return unpackSsse3(input, output);
   }
+#endif
+  return unpackImpl(ScalarKernel(), input, output);
+}
 
-  // Write whatever is left.
-  inner.write(buffer.begin(), reinterpret_cast<byte*>(out) - buffer.begin());
+#if CAPNP_PACKED_SSSE3
+CAPNP_TARGET_SSSE3 size_t PackedUnpacker::unpackSsse3(
+    kj::ArrayPtr<const byte>& input, kj::ArrayPtr<byte> output) {
+  return unpackImpl(Ssse3Kernel(getShuffleTables()), input, output);
 }
+#endif
 
 }  // namespace _ (private)
 
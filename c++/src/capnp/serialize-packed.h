@@ -62,6 +62,54 @@ private:
   kj::BufferedOutputStream& inner;
 };
 
+class PackedUnpacker {
+  // Incrementally decodes a packed byte stream.  Unlike PackedInputStream, this never waits for
+  // input: it decodes whatever it is given and remembers where it left off, even in the middle of
+  // a word or a run.  This makes it suitable for event-loop code which receives packed data in
+  // arbitrary chunks (see AsyncPackedInputStream in serialize-async.h).
+
+public:
+  size_t unpack(kj::ArrayPtr<const byte>& input, kj::ArrayPtr<byte> output);
+  // Decode from `input` into `output` until the input is exhausted or the output is full.
+  // Advances `input` past the bytes consumed and returns the number of bytes written.  The output
+  // may stop in the middle of a word, in which case the next call picks up from there.
+
+  inline bool isBetweenWords() const { return state == State::TAG; }
+  // True if everything consumed so far decodes to whole words with no run in progress, i.e. it
+  // would be clean for the input to end here.
+
+private:
+  enum class State: uint8_t {
+    TAG,         // Expecting a tag byte.
+    WORD_IN,     // Collecting the non-zero bytes of a word into `current`.
+    WORD_OUT,    // Emitting `current` to the output.
+    ZERO_COUNT,  // Expecting the length of a zero run.
+    RAW_COUNT,   // Expecting the length of an uncompressed run.
+    ZERO_RUN,    // Emitting `runRemaining` zero bytes.
+    RAW_RUN      // Copying `runRemaining` bytes straight from input to output.
+  };
+
+  State state = State::TAG;
+  uint8_t tag = 0;
+  uint8_t wordPos = 0;
+  byte current[8];
+  size_t runRemaining = 0;
+
+  template <typename Kernel>
+  KJ_ALWAYS_INLINE(size_t unpackImpl(const Kernel& kernel, kj::ArrayPtr<const byte>& input,
+                                     kj::ArrayPtr<byte> output));
+  size_t unpackSsse3(kj::ArrayPtr<const byte>& input, kj::ArrayPtr<byte> output);
+};
+
+bool setPackedSimdEnabled(bool enabled);
+// On x86, PackedInputStream and PackedOutputStream use SSSE3 shuffles to expand and compact
+// words when the CPU supports it, falling back to portable scalar code otherwise.  The two
+// produce byte-identical output.  This allows tests and benchmarks to force the scalar code.
+// Returns the previous setting.  Not thread-safe; do not call while packing is in progress.
+
+bool isPackedSimdActive();
+// Returns true if the vectorized packing code is both supported by this CPU and enabled.
+
 }  // namespace _ (private)
 
 class PackedMessageReader: private _::PackedInputStream, public InputStreamMessageReader {
@@ -195,6 +195,118 @@ TEST(Serialize, FlatArrayEvenSegmentCount) {
   }
 }
 
+TEST(Serialize, FlatArrayBuilder) {
+  TestMessageBuilder builder(7);
+  initTestMessage(builder.initRoot<TestAllTypes>());
+
+  kj::Array<word> serialized = messageToFlatArray(builder);
+  auto array = kj::heapArray<word>(serialized.size() + 5);
+  memset(array.asBytes().begin(), 0xab, array.asBytes().size());
+  memcpy(array.asBytes().begin(), serialized.asBytes().begin(), serialized.asBytes().size());
+
+  {
+    FlatArrayMessageBuilder inPlace(array);
+    EXPECT_EQ(array.end() - 5, inPlace.getEnd());
+    auto root = inPlace.getRoot<TestAllTypes>();
+    checkTestMessage(root);
+
+    // Scalar changes happen directly in the array, without allocating.
+    root.setUInt32Field(12345);
+    root.getStructField().setInt8Field(-7);
+    EXPECT_EQ(7u, inPlace.getSegmentsForOutput().size());
+    {
+      FlatArrayMessageReader reader(array);
+      EXPECT_EQ(12345u, reader.getRoot<TestAllTypes>().getUInt32Field());
+      EXPECT_EQ(-7, reader.getRoot<TestAllTypes>().getStructField().getInt8Field());
+    }
+
+    // Bigger objects go into new segments, reached through far pointers.
+    root.setTextField("this text is much too long to fit where \"foo\" was");
+    root.initInt64List(100).set(99, 42);
+    auto segments = inPlace.getSegmentsForOutput();
+    EXPECT_GT(segments.size(), 7u);
+
+    auto copy = messageToFlatArray(segments);
+    FlatArrayMessageReader reader(copy);
+    auto readRoot = reader.getRoot<TestAllTypes>();
+    EXPECT_EQ(12345u, readRoot.getUInt32Field());
+    EXPECT_EQ("this text is much too long to fit where \"foo\" was", readRoot.getTextField());
+    EXPECT_EQ(42, readRoot.getInt64List()[99]);
+    EXPECT_EQ(3u, readRoot.getStructList().size());
+  }
+
+  // Nothing past the end of the message was touched.
+  for (auto& b: array.slice(serialized.size(), array.size()).asBytes()) {
+    EXPECT_EQ(0xab, b);
+  }
+}
+
+TEST(Serialize, FlatArrayBuilderIgnoresSmallTraversalLimit) {
+  // Validation must accept any well-formed message, even one larger than the traversal limit.
+  MallocMessageBuilder builder;
+  initTestMessage(builder.initRoot<TestAllTypes>());
+  kj::Array<word> serialized = messageToFlatArray(builder);
+
+  ReaderOptions options;
+  options.traversalLimitInWords = 16;
+  {
+    FlatArrayMessageReader reader(serialized, options);
+    EXPECT_ANY_THROW(checkTestMessage(reader.getRoot<TestAllTypes>()));
+  }
+
+  FlatArrayMessageBuilder inPlace(serialized, options);
+  checkTestMessage(inPlace.getRoot<TestAllTypes>());
+}
+
+TEST(Serialize, FlatArrayBuilderEmptyMiddleSegment) {
+  // Three segments of 1, 0 and 3 words.  The root pointer is a far pointer into the last one.
+  WireValue<uint32_t> data[12];
+  uint32_t words[12] = {
+    2, 1, 0, 3,                    // segment table
+    (0 << 3) | 2, 2,               // far pointer to segment 2, offset 0
+    0, (1 << 16) | 1,              // landing pad:  struct with one data word and one pointer
+    0x7b01, 0,                     // boolField = true, int8Field = 123
+    0, 0                           // null textField
+  };
+  for (uint i = 0; i < 12; i++) data[i].set(words[i]);
+  auto array = kj::arrayPtr(reinterpret_cast<word*>(data), 6);
+
+  {
+    FlatArrayMessageReader reader(array);
+    EXPECT_EQ(123, reader.getRoot<TestAllTypes>().getInt8Field());
+  }
+
+  FlatArrayMessageBuilder inPlace(array);
+  EXPECT_EQ(3u, inPlace.getSegmentsForOutput().size());
+  auto root = inPlace.getRoot<TestAllTypes>();
+  EXPECT_TRUE(root.getBoolField());
+  EXPECT_EQ(123, root.getInt8Field());
+
+  // New space goes in a new segment, which must not take the ID of an existing one.
+  root.setTextField("foo");
+  EXPECT_EQ(4u, inPlace.getSegmentsForOutput().size());
+
+  kj::Array<word> serialized = messageToFlatArray(inPlace);
+  FlatArrayMessageReader reader(serialized);
+  EXPECT_EQ(123, reader.getRoot<TestAllTypes>().getInt8Field());
+  EXPECT_EQ("foo", reader.getRoot<TestAllTypes>().getTextField());
+}
+
+TEST(Serialize, FlatArrayBuilderRejectsInvalid) {
+  MallocMessageBuilder builder;
+  initTestMessage(builder.initRoot<TestAllTypes>());
+  kj::Array<word> serialized = messageToFlatArray(builder);
+
+  // Point the root struct far outside the segment.
+  auto rootPointer = reinterpret_cast<WireValue<uint32_t>*>(serialized.begin() + 1);
+  rootPointer[0].set(0x100000 << 2);
+
+  EXPECT_ANY_THROW(FlatArrayMessageBuilder inPlace(serialized));
+
+  // An empty array has no root pointer to modify.
+  EXPECT_ANY_THROW(FlatArrayMessageBuilder inPlace(nullptr));
+}
+
 class TestInputStream: public kj::InputStream {
 public:
   TestInputStream(kj::ArrayPtr<const word> data, bool lazy)
@@ -211,6 +323,8 @@ public:
     return amount;
   }
 
+  size_t remaining() { return end - pos; }
+
 private:
   const char* pos;
   const char* end;
@@ -302,6 +416,61 @@ TEST(Serialize, InputStreamEvenSegmentCountLazy) {
   checkTestMessage(reader.getRoot<TestAllTypes>());
 }
 
+TEST(Serialize, InputStreamReadsSegmentsOnDemand) {
+  TestMessageBuilder builder(7);
+  initTestMessage(builder.initRoot<TestAllTypes>());
+  auto segments = builder.getSegmentsForOutput();
+
+  kj::Array<word> serialized = messageToFlatArray(builder);
+  size_t segmentsStart = serialized.size() - computeSerializedSizeInWords(segments) + 4;
+
+  {
+    // Scratch space that only fits the first segment.  The stream only ever returns the minimum
+    // requested, so we can see exactly which segments have been asked for.
+    auto scratch = kj::heapArray<word>(segments[0].size());
+    TestInputStream stream(serialized.asPtr(), true);
+    InputStreamMessageReader reader(stream, ReaderOptions(), scratch);
+    size_t afterSegment0 = (segmentsStart + segments[0].size()) * sizeof(word);
+    EXPECT_EQ(serialized.asBytes().size() - afterSegment0, stream.remaining());
+
+    EXPECT_EQ(scratch.begin(), reader.getSegment(0).begin());
+    EXPECT_EQ(segments[2].size(), reader.getSegment(2).size());
+    EXPECT_EQ(serialized.asBytes().size() - afterSegment0 -
+              (segments[1].size() + segments[2].size()) * sizeof(word),
+              stream.remaining());
+
+    checkTestMessage(reader.getRoot<TestAllTypes>());
+    EXPECT_EQ(0u, stream.remaining());
+  }
+
+  {
+    // When the stream has more data available, the first read picks up as much of the rest of the
+    // message as fits in the scratch space...
+    auto scratch = kj::heapArray<word>(segments[0].size() + segments[1].size() + 1);
+    TestInputStream stream(serialized.asPtr(), false);
+    InputStreamMessageReader reader(stream, ReaderOptions(), scratch);
+    size_t readAhead = (segmentsStart + scratch.size()) * sizeof(word);
+    EXPECT_EQ(serialized.asBytes().size() - readAhead, stream.remaining());
+    EXPECT_EQ(scratch.begin() + segments[0].size(), reader.getSegment(1).begin());
+
+    // ...and once segments must be allocated, a small remainder of the message is allocated and
+    // read along with them.
+    EXPECT_EQ(segments[2].size(), reader.getSegment(2).size());
+    EXPECT_EQ(0u, stream.remaining());
+    checkTestMessage(reader.getRoot<TestAllTypes>());
+  }
+
+  {
+    // Segments that are never touched are skipped on destruction.
+    TestInputStream stream(serialized.asPtr(), true);
+    {
+      InputStreamMessageReader reader(stream, ReaderOptions());
+      EXPECT_LT(0u, stream.remaining());
+    }
+    EXPECT_EQ(0u, stream.remaining());
+  }
+}
+
 TEST(Serialize, InputStreamToBuilder) {
   TestMessageBuilder builder(1);
   initTestMessage(builder.initRoot<TestAllTypes>());
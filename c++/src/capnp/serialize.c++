@@ -115,6 +115,74 @@ kj::ArrayPtr<const word> initMessageBuilderFromFlatArrayCopy(
   return kj::arrayPtr(reader.getEnd(), array.end());
 }
 
+// -------------------------------------------------------------------
+
+struct FlatArrayMessageBuilder::ParsedArray {
+  kj::Array<SegmentInit> segments;
+  word* end;
+};
+
+FlatArrayMessageBuilder::ParsedArray FlatArrayMessageBuilder::parse(
+    kj::ArrayPtr<word> array, ReaderOptions options, bool validate) {
+  // A message whose pointers don't overlap never traverses more words than it contains, so allow
+  // at least that many.  Otherwise the default limit would reject any valid message larger than
+  // it, which a builder -- unlike a reader -- has no reason to do.  Overlapping pointers are still
+  // cut off, so validation costs at most a constant number of passes over the array.
+  options.traversalLimitInWords = kj::max(options.traversalLimitInWords, array.size());
+
+  FlatArrayMessageReader reader(array, options);
+
+  if (validate) {
+    // Traversing the message bounds-checks every pointer, which is what makes it safe for the
+    // builder to follow them.
+    reader.getRoot<AnyPointer>().targetSize();
+  }
+
+  // Take the segment count from the segment table, which the reader has checked.  We can't just
+  // stop at the first empty segment, since an empty segment may be followed by others.
+  uint segmentCount = array.size() == 0 ? 0 :
+      reinterpret_cast<const _::WireValue<uint32_t>*>(array.begin())->get() + 1;
+
+  kj::Vector<SegmentInit> segments(segmentCount);
+  for (uint i = 0; i < segmentCount; i++) {
+    auto segment = reader.getSegment(i);
+
+    // The reader's segments are slices of `array`, which we know to be writable.
+    word* start = array.begin() + (segment.begin() - array.begin());
+    segments.add(SegmentInit { kj::arrayPtr(start, segment.size()), segment.size() });
+  }
+
+  KJ_REQUIRE(segments.size() > 0 && segments[0].space.size() > 0,
+             "Message has no root pointer.");
+
+  return ParsedArray { segments.releaseAsArray(),
+                       array.begin() + (reader.getEnd() - array.begin()) };
+}
+
+FlatArrayMessageBuilder::FlatArrayMessageBuilder(
+    kj::ArrayPtr<word> array, ReaderOptions options, bool validate)
+    : FlatArrayMessageBuilder(parse(array, options, validate)) {}
+
+FlatArrayMessageBuilder::FlatArrayMessageBuilder(ParsedArray&& parsed)
+    : MessageBuilder(parsed.segments), end(parsed.end),
+      nextSize(SUGGESTED_FIRST_SEGMENT_WORDS) {}
+
+FlatArrayMessageBuilder::~FlatArrayMessageBuilder() noexcept(false) {}
+
+kj::ArrayPtr<word> FlatArrayMessageBuilder::allocateSegment(uint minimumSize) {
+  // New segments grow like MallocMessageBuilder's under GROW_HEURISTICALLY.
+  uint size = kj::max(minimumSize, nextSize);
+  auto segment = kj::heapArray<word>(size);
+  memset(segment.asBytes().begin(), 0, segment.asBytes().size());
+  nextSize += size;
+
+  kj::ArrayPtr<word> result = segment;
+  newSegments.add(kj::mv(segment));
+  return result;
+}
+
+// -------------------------------------------------------------------
+
 kj::Array<word> messageToFlatArray(kj::ArrayPtr<const kj::ArrayPtr<const word>> segments) {
   kj::Array<word> result = kj::heapArray<word>(computeSerializedSizeInWords(segments));
 
@@ -163,7 +231,8 @@ size_t computeSerializedSizeInWords(kj::ArrayPtr<const kj::ArrayPtr<const word>>
 
 InputStreamMessageReader::InputStreamMessageReader(
     kj::InputStream& inputStream, ReaderOptions options, kj::ArrayPtr<word> scratchSpace)
-    : MessageReader(options), inputStream(inputStream), readPos(nullptr) {
+    : MessageReader(options), inputStream(inputStream), segmentsRead(0),
+      scratchSpace(scratchSpace), bufferedBytes(0) {
   _::WireValue<uint32_t> firstWord[2];
 
   inputStream.read(firstWord, sizeof(firstWord));
@@ -201,64 +270,101 @@ InputStreamMessageReader::InputStreamMessageReader(
     break;
   }
 
-  if (scratchSpace.size() < totalWords) {
-    // TODO(perf):  Consider allocating each segment as a separate chunk to reduce memory
-    //   fragmentation.
-    ownedSpace = kj::heapArray<word>(totalWords);
-    scratchSpace = ownedSpace;
-  }
-
-  segment0 = scratchSpace.slice(0, segment0Size);
+  segment0 = kj::arrayPtr(static_cast<const word*>(nullptr), segment0Size);
 
   if (segmentCount > 1) {
     moreSegments = kj::heapArray<kj::ArrayPtr<const word>>(segmentCount - 1);
-    size_t offset = segment0Size;
-
     for (uint i = 0; i < segmentCount - 1; i++) {
-      uint segmentSize = moreSizes[i].get();
-      moreSegments[i] = scratchSpace.slice(offset, offset + segmentSize);
-      offset += segmentSize;
+      moreSegments[i] = kj::arrayPtr(static_cast<const word*>(nullptr), moreSizes[i].get());
     }
   }
 
-  if (segmentCount == 1) {
-    inputStream.read(scratchSpace.begin(), totalWords * sizeof(word));
-  } else if (segmentCount > 1) {
-    readPos = scratchSpace.asBytes().begin();
-    readPos += inputStream.read(readPos, segment0Size * sizeof(word), totalWords * sizeof(word));
-  }
+  readSegments(1);
 }
 
 InputStreamMessageReader::~InputStreamMessageReader() noexcept(false) {
-  if (readPos != nullptr) {
+  if (segmentsRead <= moreSegments.size()) {
     unwindDetector.catchExceptionsIfUnwinding([&]() {
-      // Note that lazy reads only happen when we have multiple segments, so moreSegments.back() is
-      // valid.
-      const byte* allEnd = reinterpret_cast<const byte*>(moreSegments.back().end());
-      inputStream.skip(allEnd - readPos);
+      size_t remainingWords = 0;
+      for (uint i = segmentsRead - 1; i < moreSegments.size(); i++) {
+        remainingWords += moreSegments[i].size();
+      }
+      inputStream.skip(remainingWords * sizeof(word) - bufferedBytes);
     });
   }
 }
 
+namespace {
+
+constexpr size_t READ_AHEAD_WORDS = 8192;
+// When InputStreamMessageReader has to allocate space for segments, it also allocates for the rest
+// of the message, and reads ahead into it, if the rest is no bigger than this or than the
+// allocation itself.
+
+}  // namespace
+
+void InputStreamMessageReader::readSegments(uint end) {
+  uint begin = segmentsRead;
+  if (begin >= end) return;
+
+  size_t words = 0;
+  for (uint i = begin; i < end; i++) {
+    words += (i == 0 ? segment0 : moreSegments[i - 1]).size();
+  }
+  size_t restWords = 0;
+  for (uint i = end; i <= moreSegments.size(); i++) {
+    restWords += moreSegments[i - 1].size();
+  }
+
+  // All the segments we're about to read are contiguous in the stream, so give them contiguous
+  // space and read them at once.  As long as there's room after them, also read as much of the
+  // rest of the message as the stream already has available, saving reads later.
+  kj::ArrayPtr<word> space;
+  bool inScratch = words <= scratchSpace.size();
+  if (inScratch) {
+    space = scratchSpace;
+  } else {
+    size_t extra = restWords <= kj::max(words, READ_AHEAD_WORDS) ? restWords : 0;
+    auto owned = kj::heapArray<word>(words + extra);
+    // Whatever we read ahead belongs at the start of these segments.
+    memcpy(owned.begin(), scratchSpace.begin(), bufferedBytes);
+    space = owned;
+    ownedSpace.add(kj::mv(owned));
+  }
+
+  size_t wanted = words * sizeof(word);
+  size_t room = kj::min(space.size(), words + restWords) * sizeof(word);
+  if (bufferedBytes < wanted) {
+    byte* pos = space.asBytes().begin() + bufferedBytes;
+    bufferedBytes += inputStream.read(pos, wanted - bufferedBytes, room - bufferedBytes);
+  }
+  bufferedBytes -= wanted;
+
+  if (inScratch || space.size() > words) {
+    // Later segments go right after these, where any read-ahead data already is.
+    scratchSpace = space.slice(words, space.size());
+  }
+  // Otherwise `space` had no room to read ahead, so bufferedBytes is now zero and the remaining
+  // scratch space can still be used for later segments.
+
+  const word* pos = space.begin();
+  for (uint i = begin; i < end; i++) {
+    kj::ArrayPtr<const word>& segment = i == 0 ? segment0 : moreSegments[i - 1];
+    segment = kj::arrayPtr(pos, segment.size());
+    pos += segment.size();
+  }
+
+  segmentsRead = end;
+}
+
 kj::ArrayPtr<const word> InputStreamMessageReader::getSegment(uint id) {
   if (id > moreSegments.size()) {
     return nullptr;
   }
 
-  kj::ArrayPtr<const word> segment = id == 0 ? segment0 : moreSegments[id - 1];
-
-  if (readPos != nullptr) {
-    // May need to lazily read more data.
-    const byte* segmentEnd = reinterpret_cast<const byte*>(segment.end());
-    if (readPos < segmentEnd) {
-      // Note that lazy reads only happen when we have multiple segments, so moreSegments.back() is
-      // valid.
-      const byte* allEnd = reinterpret_cast<const byte*>(moreSegments.back().end());
-      readPos += inputStream.read(readPos, segmentEnd - readPos, allEnd - readPos);
-    }
-  }
+  readSegments(id + 1);
 
-  return segment;
+  return id == 0 ? segment0 : moreSegments[id - 1];
 }
 
 void readMessageCopy(kj::InputStream& input, MessageBuilder& target,
@@ -47,6 +47,7 @@
 
 #include "message.h"
 #include <kj/io.h>
+#include <kj/vector.h>
 
 namespace capnp {
 
@@ -84,9 +85,53 @@ kj::ArrayPtr<const word> initMessageBuilderFromFlatArrayCopy(
 // message. This is useful when reading multiple messages that have been concatenated. See also
 // FlatArrayMessageReader::getEnd().
 //
-// (Note that it's also possible to initialize a `MessageBuilder` directly without a copy using one
-// of `MessageBuilder`'s constructors. However, this approach skips the validation step and is not
-// safe to use on untrusted input. Therefore, we do not provide a convenience method for it.)
+// (To modify a message without copying it at all, see FlatArrayMessageBuilder, below.)
+
+class FlatArrayMessageBuilder: public MessageBuilder {
+  // Modifies a serialized message in place, without copying it.  The message's segments become the
+  // builder's first segments, so setting a field writes straight into the array.  Objects which
+  // need new space -- e.g. a longer text value, or a newly-initialized struct -- go into fresh
+  // heap-allocated segments, so nothing is ever written outside the message's part of the array.
+  // Far pointers between the original and the new segments work as usual, and
+  // getSegmentsForOutput() returns the original segments (still pointing into the array) followed
+  // by any new ones.
+  //
+  // As with any builder, replacing an object leaves its old space zeroed but still occupying room
+  // in the message; a message which is patched repeatedly will grow.
+  //
+  // The array must remain valid, and must not be read or written by anything else, until the
+  // builder is destroyed.
+
+public:
+  explicit FlatArrayMessageBuilder(kj::ArrayPtr<word> array,
+                                   ReaderOptions options = ReaderOptions(),
+                                   bool validate = true);
+  // Parses the segment table at the start of `array`.  If `validate` is true, the constructor then
+  // traverses the whole message as a MessageReader would, throwing if any pointer is
+  // out-of-bounds, so that a malicious message can't trick the builder into accessing memory
+  // outside the array.  The traversal limit used is the larger of `options.traversalLimitInWords`
+  // and the size of `array`, so a valid message is never rejected for being large.  This is much
+  // cheaper than copying, but it's still a pass over the whole message; if the data comes from a
+  // source you trust (e.g. a file only your program writes), you may pass false to skip it.
+
+  KJ_DISALLOW_COPY(FlatArrayMessageBuilder);
+  ~FlatArrayMessageBuilder() noexcept(false);
+
+  word* getEnd() const { return end; }
+  // Get a pointer just past the end of the message within the array.  See
+  // FlatArrayMessageReader::getEnd().
+
+  kj::ArrayPtr<word> allocateSegment(uint minimumSize) override;
+
+private:
+  struct ParsedArray;
+  FlatArrayMessageBuilder(ParsedArray&& parsed);
+  static ParsedArray parse(kj::ArrayPtr<word> array, ReaderOptions options, bool validate);
+
+  word* end;
+  uint nextSize;
+  kj::Vector<kj::Array<word>> newSegments;
+};
 
 kj::Array<word> messageToFlatArray(MessageBuilder& builder);
 // Constructs a flat array containing the entire content of the given message.
@@ -127,6 +172,13 @@ size_t expectedSizeInWordsFromPrefix(kj::ArrayPtr<const word> messagePrefix);
 class InputStreamMessageReader: public MessageReader {
   // A MessageReader that reads from an abstract kj::InputStream. See also StreamFdMessageReader
   // for a subclass specific to file descriptors.
+  //
+  // Only the segment table and the first segment are read by the constructor.  Later segments are
+  // read, and space for them allocated, when they are first accessed; reading segment N also reads
+  // any earlier segments not yet read, since the stream is sequential.  Segments that are never
+  // reached are skipped over when the reader is destroyed, without being allocated.  Whenever
+  // there is already space for them, e.g. in `scratchSpace`, each read also picks up as much of
+  // the rest of the message as the stream has available.
 
 public:
   InputStreamMessageReader(kj::InputStream& inputStream,
@@ -139,16 +191,29 @@ public:
 
 private:
   kj::InputStream& inputStream;
-  byte* readPos;
+  uint segmentsRead;
 
   // Optimize for single-segment case.
   kj::ArrayPtr<const word> segment0;
   kj::Array<kj::ArrayPtr<const word>> moreSegments;
+  // Segments at index segmentsRead and beyond have not been read yet, so only their sizes are
+  // meaningful.
 
-  kj::Array<word> ownedSpace;
-  // Only if scratchSpace wasn't big enough.
+  kj::ArrayPtr<word> scratchSpace;
+  // Space not yet used:  the rest of the caller's scratch space, or of an allocation which had
+  // room for the rest of the message.
+
+  size_t bufferedBytes;
+  // Bytes of the segments not yet read which were nevertheless read ahead into the start of
+  // scratchSpace.
+
+  kj::Vector<kj::Array<word>> ownedSpace;
+  // Only for segments which didn't fit in scratchSpace.
 
   kj::UnwindDetector unwindDetector;
+
+  void readSegments(uint end);
+  // Read all segments with index less than `end` that haven't been read yet.
 };
 
 void readMessageCopy(kj::InputStream& input, MessageBuilder& target,